@@ -0,0 +1,345 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "animation.h"
+#include "backlight.h"
+#include "keyboard_tester.h"
+
+/**
+ * First quarter of the sine wave, 127 * sin(i * pi / 128).
+ */
+static const uint8_t sin_quarter[65] PROGMEM = {
+  0, 3, 6, 9, 12, 16, 19, 22, 25, 28, 31, 34, 37, 40, 43, 46,
+  49, 51, 54, 57, 60, 63, 65, 68, 71, 73, 76, 78, 81, 83, 85, 88,
+  90, 92, 94, 96, 98, 100, 102, 104, 106, 107, 109, 111, 112, 113, 115, 116,
+  117, 118, 120, 121, 122, 122, 123, 124, 125, 125, 126, 126, 126, 127, 127, 127,
+  127,
+};
+
+/**
+ * Cubic ease in-out sampled every 4 steps, the last entry is the end
+ * point used for interpolation.
+ */
+static const uint8_t ease_table[65] PROGMEM = {
+  0, 0, 0, 0, 0, 0, 1, 1, 2, 3, 4, 5, 7, 9, 11, 13,
+  16, 19, 23, 27, 31, 36, 41, 47, 54, 61, 68, 77, 85, 95, 105, 116,
+  128, 139, 150, 160, 170, 178, 187, 194, 201, 208, 214, 219, 224, 228, 232, 236,
+  239, 242, 244, 246, 248, 250, 251, 252, 253, 254, 254, 255, 255, 255, 255, 255,
+  255,
+};
+
+/**
+ * Phase increment per frame of each effect.
+ */
+static const fix8_t effect_speed[ANIMATION_EFFECTS] PROGMEM = {
+  [ANIMATION_NONE] = 0,
+  /* Breathing runs on the driver auto breath mode, no frames */
+  [ANIMATION_BREATHING] = 0,
+  /* One hue cycle every 4s */
+  [ANIMATION_RAINBOW] = ANIMATION_CYCLE(4),
+  /* Ring speed of 256 position units per second */
+  [ANIMATION_RIPPLE] = ANIMATION_CYCLE(1),
+  /* One sweep every 3s */
+  [ANIMATION_GRADIENT] = ANIMATION_CYCLE(3),
+};
+
+_Static_assert((ANIMATION_RIPPLE_WIDTH & (ANIMATION_RIPPLE_WIDTH - 1)) == 0 &&
+	       ANIMATION_RIPPLE_WIDTH <= 128, "Invalid ripple width");
+
+/**
+ * Hardware breathing, about one breath every 2s.
+ */
+static const struct ABMEffect breathing = {
+  .rise = ABM_RAMP_840MS,
+  .hold_on = ABM_HOLD_0MS,
+  .fall = ABM_RAMP_840MS,
+  .hold_off = ABM_HOLD_210MS,
+  .loop_begin = ABM_LOOP_BEGIN_RISE,
+  .loop_end = ABM_LOOP_END_OFF,
+  .loops = ABM_LOOPS_FOREVER,
+};
+
+struct ripple {
+  uint8_t x;
+  uint8_t y;
+  /** Ring radius in position units, zero when the ripple is not running */
+  fix8_t radius;
+};
+
+static struct Backlight *board;
+static uint8_t effect;
+static volatile bool frame_due;
+/** Effect time, the integer part wraps around every cycle */
+static fix8_t phase;
+static struct LedColor primary = {128, 128, 128};
+static struct LedColor secondary = {0, 0, 128};
+static struct ripple ripples[ANIMATION_RIPPLES];
+
+/** Off-screen frame, in the order of the LED position table */
+static struct LedColor frame[BACKLIGHT_LEDS];
+
+uint8_t
+sin8(uint8_t theta)
+{
+  uint8_t idx = theta & 0x3f;
+  uint8_t value;
+
+  /* Mirror the quarter wave for the descending quarters */
+  if (theta & 0x40)
+    idx = 64 - idx;
+  value = pgm_read_byte(&sin_quarter[idx]);
+  return (theta & 0x80) ? 128 - value : 128 + value;
+}
+
+uint8_t
+ease8(uint8_t t)
+{
+  uint8_t lo = pgm_read_byte(&ease_table[t >> 2]);
+  uint8_t hi = pgm_read_byte(&ease_table[(t >> 2) + 1]);
+
+  /* Linear interpolation between the table samples */
+  return lo + (((hi - lo) * (t & 0x3)) >> 2);
+}
+
+/**
+ * Blend two colours, t = 0 gives a, t = 255 gives b.
+ */
+static inline struct LedColor
+blend(struct LedColor a, struct LedColor b, uint8_t t)
+{
+  struct LedColor c;
+
+  c.r = scale8(a.r, 255 - t) + scale8(b.r, t);
+  c.g = scale8(a.g, 255 - t) + scale8(b.g, t);
+  c.b = scale8(a.b, 255 - t) + scale8(b.b, t);
+  return c;
+}
+
+static inline struct LedColor
+dim(struct LedColor a, uint8_t level)
+{
+  struct LedColor c = {scale8(a.r, level), scale8(a.g, level),
+		       scale8(a.b, level)};
+  return c;
+}
+
+static void
+render_rainbow(void)
+{
+  struct backlight_led led;
+  uint8_t hue;
+
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++) {
+    backlight_led_get(i, &led);
+    hue = led.x + (phase >> 8);
+    frame[i] = backlight_hsv(hue, 255, 255);
+  }
+}
+
+static void
+render_ripple(void)
+{
+  fix8_t speed = pgm_read_word(&effect_speed[ANIMATION_RIPPLE]);
+  struct backlight_led led;
+  struct ripple *rp;
+  uint8_t dx, dy, ring, delta;
+  uint16_t dist, level;
+
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++) {
+    backlight_led_get(i, &led);
+    level = 0;
+    for (rp = ripples; rp < &ripples[ANIMATION_RIPPLES]; rp++) {
+      if (rp->radius == 0)
+	continue;
+      dx = (led.x > rp->x) ? led.x - rp->x : rp->x - led.x;
+      dy = (led.y > rp->y) ? led.y - rp->y : rp->y - led.y;
+      /* Octagonal distance approximation, max + min / 2 */
+      dist = (dx > dy) ? dx + (dy >> 1) : dy + (dx >> 1);
+      ring = rp->radius >> 8;
+      delta = (dist > ring) ? dist - ring : ring - dist;
+      if (dist < ring + ANIMATION_RIPPLE_WIDTH &&
+	  dist + ANIMATION_RIPPLE_WIDTH > ring)
+	/* Cosine shaped ring cross section */
+	level += sin8(64 + delta * (128 / ANIMATION_RIPPLE_WIDTH));
+    }
+    frame[i] = dim(primary, (level > 255) ? 255 : level);
+  }
+
+  /* Grow the rings, they end at the edge of the position space */
+  for (rp = ripples; rp < &ripples[ANIMATION_RIPPLES]; rp++) {
+    if (rp->radius == 0)
+      continue;
+    if (rp->radius > FIX8(255) - speed)
+      rp->radius = 0;
+    else
+      rp->radius += speed;
+  }
+}
+
+static void
+render_gradient(void)
+{
+  struct backlight_led led;
+
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++) {
+    backlight_led_get(i, &led);
+    frame[i] = blend(primary, secondary,
+		     ease8(sin8(led.x + (phase >> 8))));
+  }
+}
+
+/**
+ * Send the frame to the drivers, only the changed PWM bytes
+ * are written.
+ */
+static void
+commit_frame(void)
+{
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++)
+    backlight_led_set(board, i, frame[i]);
+  backlight_board_flush(board);
+}
+
+/**
+ * Hand all the LEDs to an auto breath mode channel, the driver
+ * runs the effect without any further bus traffic.
+ */
+static void
+breathing_start(void)
+{
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++) {
+    backlight_led_set(board, i, primary);
+    backlight_led_abm_set(board, i, ABM_CHANNEL_1);
+  }
+  backlight_board_abm_config(board, ABM_CHANNEL_1, &breathing);
+  backlight_board_abm_start(board);
+}
+
+/**
+ * Return the LEDs to PWM control.
+ */
+static void
+breathing_stop(void)
+{
+  backlight_board_abm_stop(board);
+  for (uint8_t i = 0; i < BACKLIGHT_LEDS; i++)
+    backlight_led_abm_set(board, i, ABM_PWM);
+  backlight_board_flush(board);
+}
+
+void
+animation_start(struct Backlight *bl, enum animation_effect next)
+{
+  if (effect == ANIMATION_BREATHING)
+    breathing_stop();
+
+  board = bl;
+  phase = 0;
+  for (uint8_t i = 0; i < ANIMATION_RIPPLES; i++)
+    ripples[i].radius = 0;
+  effect = next;
+  if (next == ANIMATION_BREATHING)
+    breathing_start();
+  /* Render the first frame as soon as possible */
+  frame_due = (pgm_read_word(&effect_speed[next]) != 0);
+}
+
+void
+animation_stop()
+{
+  if (effect == ANIMATION_BREATHING)
+    breathing_stop();
+  effect = ANIMATION_NONE;
+  frame_due = false;
+}
+
+enum animation_effect
+animation_current()
+{
+  return effect;
+}
+
+void
+animation_colors(struct LedColor first, struct LedColor second)
+{
+  primary = first;
+  secondary = second;
+}
+
+void
+animation_ripple(uint8_t x, uint8_t y)
+{
+  struct ripple *rp, *oldest = &ripples[0];
+
+  /* Reuse a free slot or the largest ring */
+  for (rp = ripples; rp < &ripples[ANIMATION_RIPPLES]; rp++) {
+    if (rp->radius == 0) {
+      oldest = rp;
+      break;
+    }
+    if (rp->radius > oldest->radius)
+      oldest = rp;
+  }
+  oldest->x = x;
+  oldest->y = y;
+  oldest->radius = FIX8(1);
+}
+
+bool
+animation_tick()
+{
+  /* Effects without a phase do not need frames */
+  if (pgm_read_word(&effect_speed[effect]) == 0)
+    return false;
+  frame_due = true;
+  return true;
+}
+
+void
+animation_render()
+{
+  if (!frame_due)
+    return;
+  frame_due = false;
+
+  switch (effect) {
+  case ANIMATION_RAINBOW:
+    render_rainbow();
+    break;
+  case ANIMATION_RIPPLE:
+    render_ripple();
+    break;
+  case ANIMATION_GRADIENT:
+    render_gradient();
+    break;
+  default:
+    return;
+  }
+  phase += pgm_read_word(&effect_speed[effect]);
+  commit_frame();
+}
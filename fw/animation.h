@@ -0,0 +1,147 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight animation engine.
+ * Effects are rendered at a fixed frame rate into an off-screen frame
+ * with one colour per LED, the frame is then sent to the driver with a
+ * single flush. The frame timer only marks frames as due, rendering
+ * happens in the main loop.
+ * Effect kernels use 8.8 fixed point phases and lookup tables in
+ * program memory, there is no floating point and no division.
+ * Effects the driver can run on its own, like breathing, are
+ * offloaded and need no frames.
+ */
+
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backlight.h"
+
+/**
+ * Frames rendered per second.
+ */
+#define ANIMATION_FPS 30
+
+/**
+ * Frame period in ms.
+ */
+#define ANIMATION_FRAME_MS (1000 / ANIMATION_FPS)
+
+/**
+ * Number of ripples that can run at the same time.
+ */
+#define ANIMATION_RIPPLES 4
+
+/**
+ * Width of a ripple ring, in LED position units.
+ * Must be a power of 2 up to 128.
+ */
+#define ANIMATION_RIPPLE_WIDTH 64
+
+/**
+ * 8.8 fixed point value.
+ */
+typedef uint16_t fix8_t;
+
+#define FIX8(v) ((fix8_t)((v) * 256))
+
+/**
+ * Phase increment per frame for an effect cycle of the given seconds,
+ * a cycle is 256 phase units.
+ */
+#define ANIMATION_CYCLE(sec) ((fix8_t)(65536UL / ((sec) * ANIMATION_FPS)))
+
+enum animation_effect {
+  ANIMATION_NONE,
+  /** All LEDs fade in and out, run by the driver auto breath mode */
+  ANIMATION_BREATHING,
+  /** Hue wheel scrolling along the x axis */
+  ANIMATION_RAINBOW,
+  /** Rings spreading from the key presses */
+  ANIMATION_RIPPLE,
+  /** Two colour gradient swept along the x axis */
+  ANIMATION_GRADIENT,
+  ANIMATION_EFFECTS,
+};
+
+/**
+ * Start an effect on the board backlight, replacing the current one.
+ */
+void animation_start(struct Backlight *bl, enum animation_effect effect);
+
+/**
+ * Stop the current effect, the LEDs keep the last frame.
+ */
+void animation_stop(void);
+
+/**
+ * Current effect.
+ */
+enum animation_effect animation_current(void);
+
+/**
+ * Set the colours used by the effects.
+ */
+void animation_colors(struct LedColor primary, struct LedColor secondary);
+
+/**
+ * Spawn a ripple at the given LED position.
+ */
+void animation_ripple(uint8_t x, uint8_t y);
+
+/**
+ * Mark the next frame as due, called by the frame timer.
+ *
+ * \return true if an effect is running and the timer must be rearmed.
+ */
+bool animation_tick(void);
+
+/**
+ * Render and send a frame if one is due, from the main loop.
+ */
+void animation_render(void);
+
+/**
+ * Offset sine, sin8(0) = 128, the period is 256.
+ */
+uint8_t sin8(uint8_t theta);
+
+/**
+ * Cubic ease in-out, maps 0..255 to 0..255.
+ */
+uint8_t ease8(uint8_t t);
+
+/**
+ * Scale a value by s/256, with scale8(v, 255) == v.
+ */
+static inline uint8_t
+scale8(uint8_t v, uint8_t s)
+{
+  return ((uint16_t)v * s + v) >> 8;
+}
+
+#endif /* _ANIMATION_H_ */
@@ -20,16 +20,21 @@
   this software.
 */
 
+#define TRACE_FILE TRACE_FILE_BACKLIGHT
+
 #include <assert.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include <avr/io.h>
-
-#include <LUFA/Drivers/Peripheral/TWI.h>
+#include <util/atomic.h>
 
 #include "backlight.h"
 #include "error.h"
+#include "gamma.h"
 #include "keyboard_tester.h"
+#include "sched.h"
+#include "twi.h"
 
 struct LedColor bright_white = {255, 255, 255};
 struct LedColor white = {128, 128, 128};
@@ -44,383 +49,469 @@ struct LedColor custom1 = {5, 50, 175};
 struct LedColor custom2 = {90, 50, 85};
 struct LedColor black = {0, 0, 0};
 
-static int is3733_unlock_cmd(uint8_t addr);
-static int is3733_set_cmd_page(uint8_t addr, uint8_t page);
-static int is3733_read_cmd(
-  uint8_t *value, uint8_t addr, uint8_t page, uint8_t offset);
-static int is3733_read_cmd_buf(
-  uint8_t *value, size_t size, uint8_t addr, uint8_t page, uint8_t offset);
-static int is3733_write_cmd(
-  uint8_t value, uint8_t addr, uint8_t page, uint8_t offset);
-static int is3733_write_cmd_buf(
-  const uint8_t *value, size_t size, uint8_t addr,
-  uint8_t page, uint8_t offset);
-static int is3733_read_reg(uint8_t *value, uint8_t addr, uint8_t offset);
-static int is3733_write_reg(uint8_t value, uint8_t addr, uint8_t offset);
-
-static int
-is3733_read_cmd(uint8_t *value, uint8_t addr, uint8_t page, uint8_t offset)
-{
-  int rc = ERR_I2C;
-
-  /* DEBUG("[%s] addr:%hhx pg:%hhx off:%hhx\r\n", __func__, */
-  /* addr, page, offset); */
-
-  /* Set the requested page */
-  if (is3733_set_cmd_page(addr, page) != ERR_OK)
-    return rc;
+/**
+ * Scale a PWM level by a calibration factor out of 255.
+ */
+#define BACKLIGHT_CAL(v, scale) ((uint8_t)(((v) * (scale) + (v)) >> 8))
 
-  /* Unlock command register for writing */
-  if (is3733_unlock_cmd(addr) != ERR_OK)
-    return rc;
+#define PWM_LUT_LEVEL(v, scale) BACKLIGHT_CAL(v, scale),
+#define PWM_LUT_PROFILE(r, g, b) {			\
+    { GAMMA_TABLE(PWM_LUT_LEVEL, b) },			\
+    { GAMMA_TABLE(PWM_LUT_LEVEL, g) },			\
+    { GAMMA_TABLE(PWM_LUT_LEVEL, r) },			\
+  },
 
-  /* Select the given offset in the page */
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) ==
-      TWI_ERROR_NoError) {
-    if (!TWI_SendByte(offset)) {
-      /* DEBUG("[%s] Can not select register offset %hhx:%hhx:%hhx\r\n", __func__, */
-      /* addr, page, offset); */
-      goto fail;
-    }
-    TWI_StopTransmission();
-  }
+/*
+ * Linear colour to PWM level of each channel for each white balance
+ * profile, with the gamma correction and the channel scale folded in
+ * at compile time. Channels are in PWM page order, blue first.
+ */
+static const uint8_t pwm_lut[BACKLIGHT_WB_COUNT][3][256] PROGMEM = {
+  BACKLIGHT_WB_PROFILES(PWM_LUT_PROFILE)
+};
 
-  /* Start the read transmission at the selected page::offset */
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_READ, 10) == TWI_ERROR_NoError) {
-    if (!TWI_ReceiveByte(value, true)) {
-      /* DEBUG("[%s] Can not read cmd register %hhx:%hhx:%hhx\r\n", __func__, */
-      /* 	    addr, page, offset); */
-      goto fail;
-    }
-    rc = ERR_OK;
-  }
+/* White balance profile of each LED of the map */
+static const uint8_t backlight_led_wb[BACKLIGHT_LEDS] PROGMEM =
+  BACKLIGHT_LED_WB;
 
-  /* DEBUG("[%s] %hhx:%hhx:%hhx -> %hhx\r\n", __func__, */
-  /* 	addr, page, offset, *value); */
+#define BACKLIGHT_LED_ENTRY(chip, key, row, col, x, y)	\
+  {chip, key, BACKLIGHT_PWM_INDEX(row, col), x, y},
 
- fail:
-  TWI_StopTransmission();
-  return rc;
-}
+const struct backlight_led backlight_leds[BACKLIGHT_LEDS] PROGMEM = {
+  BACKLIGHT_LED_MAP(BACKLIGHT_LED_ENTRY)
+};
 
-static int
-is3733_read_cmd_buf(uint8_t *value, size_t size, uint8_t addr,
-		    uint8_t page, uint8_t offset)
-{
-  int rc = ERR_I2C;
+/** LED of each matrix key */
+static const uint8_t backlight_key_leds[] PROGMEM = BACKLIGHT_KEY_MAP;
 
-  /* DEBUG("[%s] %hhx:%hhx:%hhx -> buf@%p\r\n", __func__, */
-  /* 	addr, page, offset, value); */
+/**
+ * Burst sources for the ABM page, a run of LEDs on the same
+ * channel is written from the line of the channel.
+ */
+static const uint8_t abm_fill[4][16] = {
+  {ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM,
+   ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM, ABM_PWM},
+  {ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1,
+   ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1,
+   ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1,
+   ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1, ABM_CHANNEL_1},
+  {ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2,
+   ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2,
+   ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2,
+   ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2, ABM_CHANNEL_2},
+  {ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3,
+   ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3,
+   ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3,
+   ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3, ABM_CHANNEL_3},
+};
 
-  /* Set the requested page */
-  if (is3733_set_cmd_page(addr, page) != ERR_OK)
-    return rc;
+/**
+ * Open-short detection readback, shared by the drivers that are
+ * checked one at a time.
+ */
+static uint8_t osd_data[LCO_END - LCO_OPEN];
+/** Driver that owns osd_data, NULL if the buffer is free */
+static struct IS3733_State *osd_owner;
 
-  /* Unlock command register for writing the offset. */
-  if (is3733_unlock_cmd(addr) != ERR_OK)
-    return rc;
+/**
+ * Cursor value of a page flush with nothing left to write.
+ */
+#define BACKLIGHT_FLUSH_DONE 0xFF
 
-  for (int i = 0; i < size; i++) {
-    /* Select the offset in the page */
-    if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) == TWI_ERROR_NoError) {
-      if (!TWI_SendByte(offset + i)) {
-	/* DEBUG("[%s] Can not select register offset %hhx:%hhx:%hhx\r\n", __func__, */
-	/*       addr, page, offset + i); */
-	goto fail;
-      }
-      TWI_StopTransmission();
-    }
+static int is3733_read_cmd_buf(
+  uint8_t *value, uint8_t size, struct IS3733_State *state,
+  uint8_t page, uint8_t offset, twi_callback_t done);
+static int is3733_verify_cmd_buf(
+  const uint8_t *value, uint8_t size, struct IS3733_State *state,
+  uint8_t page, uint8_t offset, twi_callback_t done);
+static int is3733_write_cmd(
+  uint8_t value, struct IS3733_State *state, uint8_t page, uint8_t offset);
+static int is3733_write_cmd_buf(
+  const uint8_t *value, uint8_t size, struct IS3733_State *state,
+  uint8_t page, uint8_t offset);
 
-     /* Start read of size bites starting at offset. */
-    if (TWI_StartTransmission(addr | TWI_ADDRESS_READ, 10) == TWI_ERROR_NoError) {
-      if (!TWI_ReceiveByte(&value[i], true)) {
-	/* DEBUG("[%s] Can not read cmd register byte %hhx:%hhx:%hhx\r\n", */
-	/*       __func__, addr, page, offset + i); */
-	goto fail;
-      }
-      TWI_StopTransmission();
-    }
-  }
-  return ERR_OK;
+/*
+ * The transport only queues transactions on the TWI engine, the
+ * return value tells whether the transaction was queued. Bus errors
+ * are counted in the device statistics.
+ * The engine selects the page on the device when needed.
+ */
 
- fail:
-  TWI_StopTransmission();
-  return rc;
+static int
+is3733_read_cmd_buf(uint8_t *value, uint8_t size, struct IS3733_State *state,
+		    uint8_t page, uint8_t offset, twi_callback_t done)
+{
+  struct twi_txn txn = {
+    .dev = &state->is_dev,
+    .page = page,
+    .offset = offset,
+    .flags = TWI_TXN_READ,
+    .len = size,
+    .buf = value,
+    .done = done,
+    .arg = state,
+  };
+
+  return twi_submit(&txn);
 }
 
+/**
+ * Queue a burst read that compares the device registers with the
+ * given buffer, the number of differences is reported to the
+ * completion callback in the transaction mismatch field.
+ */
 static int
-is3733_write_cmd(uint8_t value, uint8_t addr, uint8_t page, uint8_t offset)
+is3733_verify_cmd_buf(const uint8_t *value, uint8_t size,
+		      struct IS3733_State *state, uint8_t page, uint8_t offset,
+		      twi_callback_t done)
 {
-  int rc = ERR_I2C;
-
-  /* DEBUG("[%s] %hhx:%hhx:%hhx <- %hhx\r\n", __func__, */
-  /* 	addr, page, offset, value); */
-
-  /* Select the requested page */
-  if (is3733_set_cmd_page(addr, page) != ERR_OK)
-    return rc;
-
-  /* Unlock the command register for writing */
-  if (is3733_unlock_cmd(addr) != ERR_OK)
-    return rc;
-
-  /* Write the data at the requested page::offset */
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) == TWI_ERROR_NoError) {
-    if (!TWI_SendByte(offset)) {
-      /* DEBUG("[%s] Can not send offset byte\r\n", __func__); */
-      goto fail;
-    }
-    if (!TWI_SendByte(value)) {
-      /* DEBUG("[%s] Can not send value byte\r\n", __func__); */
-      goto fail;
-    }
-    rc = ERR_OK;
-  }
-
- fail:
-  TWI_StopTransmission();
-  return rc;
+  struct twi_txn txn = {
+    .dev = &state->is_dev,
+    .page = page,
+    .offset = offset,
+    .flags = TWI_TXN_READ | TWI_TXN_VERIFY,
+    .len = size,
+    .buf = (uint8_t *)value,
+    .done = done,
+    .arg = state,
+  };
+
+  return twi_submit(&txn);
 }
 
 static int
-is3733_write_cmd_buf(const uint8_t *value, size_t size, uint8_t addr,
-		      uint8_t page, uint8_t offset)
+is3733_write_cmd(uint8_t value, struct IS3733_State *state, uint8_t page,
+		 uint8_t offset)
 {
-  int rc = ERR_I2C;
-
-  /* DEBUG("[%s] %hhx:%hhx:%hhx <- buf@%p\r\n", __func__, */
-  /* 	addr, page, offset, value); */
-
-  /* Select the requested page */
-  if (is3733_set_cmd_page(addr, page) != ERR_OK)
-    return rc;
-
-  /* Unlock command register for writing again */
-  if (is3733_unlock_cmd(addr) != ERR_OK)
-    return rc;
-
-  /* Select offset in the page and write bytes */
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) == TWI_ERROR_NoError) {
-    if (!TWI_SendByte(offset)) {
-      /* DEBUG("[%s] Can not select register offset %hhx:%hhx:%hhx\r\n", */
-      /* 	    __func__, addr, page, offset); */
-      goto fail;
-    }
-
-    for (int i = 0; i < size; i++) {
-      if (!TWI_SendByte(value[i])) {
-	/* DEBUG("[%s] Can not write cmd register byte %hhx:%hhx:%hhx[%d]\r\n", */
-	/*       __func__, addr, page, offset, i); */
-	goto fail;
-      }
-    }
-    rc = ERR_OK;
-  }
-
- fail:
-  TWI_StopTransmission();
-  return rc;
+  struct twi_txn txn = {
+    .dev = &state->is_dev,
+    .page = page,
+    .offset = offset,
+    .flags = TWI_TXN_INLINE,
+    .len = 1,
+    .value = value,
+  };
+
+  return twi_submit(&txn);
 }
 
+/**
+ * Queue a burst write, the buffer must stay valid until the
+ * transaction completes. It normally points into the driver
+ * state shadow, so newer values are sent if it changes meanwhile.
+ */
 static int
-is3733_read_reg(uint8_t *value, uint8_t addr, uint8_t offset)
+is3733_write_cmd_buf(const uint8_t *value, uint8_t size,
+		     struct IS3733_State *state, uint8_t page, uint8_t offset)
 {
-  int rc = ERR_I2C;
+  struct twi_txn txn = {
+    .dev = &state->is_dev,
+    .page = page,
+    .offset = offset,
+    .len = size,
+    .buf = (uint8_t *)value,
+  };
+
+  return twi_submit(&txn);
+}
 
-  /* DEBUG("[%s] %hhx:%hhx\r\n", __func__, addr, offset); */
+/**
+ * Register offset of the first SW line of a LED in the PWM and ABM
+ * pages, the LED channels are 0x10 bytes apart. Neighbouring LEDs
+ * on the same line are at consecutive offsets.
+ */
+static inline uint8_t
+is3733_led_offset(const struct IS3733_State *state, uint8_t idx)
+{
+  return pgm_read_byte(&backlight_leds[state->is_first + idx].pwm);
+}
 
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) ==
-      TWI_ERROR_NoError) {
-    if (!TWI_SendByte(offset)) {
-      /* DEBUG("[%s] Can not select register offset %hhx:%hhx\r\n", __func__, */
-      /* 	    addr, offset); */
-      goto fail;
-    }
-    TWI_StopTransmission();
-  }
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_READ, 10) ==
-      TWI_ERROR_NoError) {
-    if (!TWI_ReceiveByte(value, true)) {
-      /* DEBUG("[%s] Can not read register %hhx:%hhx\r\n", __func__, */
-      /* 	    addr, offset); */
-      goto fail;
-    }
-    rc = ERR_OK;
+/**
+ * Find the mirror index of a LED of the chip.
+ * \return The LED index or BACKLIGHT_LEDS if the LED is not populated.
+ */
+static uint8_t
+is3733_led_find(const struct IS3733_State *state, uint8_t row, uint8_t col)
+{
+  uint8_t idx, offset = BACKLIGHT_PWM_INDEX(row, col);
+
+  for (idx = 0; idx < state->is_leds; idx++) {
+    if (is3733_led_offset(state, idx) == offset)
+      return idx;
   }
+  return BACKLIGHT_LEDS;
+}
 
-  /* DEBUG("[%s] %hhx:%hhx -> %hhx\r\n", __func__, addr, offset, *value); */
+static inline uint8_t
+is3733_abm_get(const struct IS3733_State *state, uint8_t idx)
+{
+  return (state->is_abm[idx / 4] >> ((idx % 4) * 2)) & 0x3;
+}
 
- fail:
-  TWI_StopTransmission();
-  return rc;
+static inline bool
+is3733_dirty(const uint8_t *dirty, uint8_t idx)
+{
+  return dirty[idx / 8] & (1 << (idx % 8));
 }
 
+/**
+ * Write the next run of dirty PWM bytes, starting the search at
+ * *cursor, channel * is_leds + LED.
+ * Dirty bytes of neighbouring LEDs close enough to each other are
+ * coalesced in a single auto-increment burst, the dirty bits are
+ * cleared when the burst is queued. The cursor moves past the burst,
+ * it becomes BACKLIGHT_FLUSH_DONE when there is nothing left to write.
+ * If the queue is full the cursor does not move and the bytes stay
+ * dirty.
+ */
 static int
-is3733_write_reg(uint8_t value, uint8_t addr, uint8_t offset)
+is3733_flush_pwm_span(struct IS3733_State *state, uint8_t *cursor)
 {
-  int rc = ERR_I2C;
-
-  /* DEBUG("[%s] %hhx:%hhx <- %hhx\r\n", __func__, addr, offset, value); */
-
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) ==
-      TWI_ERROR_NoError) {
-    if (!TWI_SendByte(offset)) {
-      /* DEBUG("[%s] Can not send offset byte\r\n", __func__); */
-      goto fail;
+  int rc;
+  uint8_t n = state->is_leds;
+  uint8_t *dirty;
+  uint8_t pos, ch, idx, start, end, clean, offset;
+
+  for (pos = *cursor; pos < 3 * n;) {
+    ch = pos / n;
+    idx = pos - ch * n;
+    dirty = state->pwm_dirty[ch];
+    /* Skip clean bytes, a whole byte of the bitmap at a time if possible */
+    if (dirty[idx / 8] == 0) {
+      idx = (idx | 7) + 1;
+      pos = ch * n + ((idx < n) ? idx : n);
+      continue;
     }
-    if (!TWI_SendByte(value)) {
-      /* DEBUG("[%s] Can not send value byte\r\n", __func__); */
-      goto fail;
+    if (!is3733_dirty(dirty, idx)) {
+      pos++;
+      continue;
     }
-    rc = ERR_OK;
+
+    /*
+     * Extend the span along the SW line until the gap of clean
+     * bytes gets too large.
+     */
+    start = idx;
+    end = idx;
+    clean = 0;
+    offset = is3733_led_offset(state, start);
+    for (idx++; idx < n && clean <= BACKLIGHT_FLUSH_GAP; idx++) {
+      if (is3733_led_offset(state, idx) != offset + idx - start)
+	break;
+      if (is3733_dirty(dirty, idx)) {
+	end = idx;
+	clean = 0;
+      }
+      else {
+	clean++;
+      }
+    }
+
+    rc = is3733_write_cmd_buf(&state->is_pwm[ch][start], end - start + 1,
+			      state, CRP_LED_PWM, offset + ch * 0x10);
+    if (rc != ERR_OK)
+      return rc;
+    *cursor = ch * n + end + 1;
+    for (; start <= end; start++)
+      dirty[start / 8] &= ~(1 << (start % 8));
+    return ERR_OK;
   }
 
- fail:
-  TWI_StopTransmission();
-  return rc;
+  *cursor = BACKLIGHT_FLUSH_DONE;
+  return ERR_OK;
 }
 
 /**
- * Select a page in the command register.
- * This automatically unlocks the command register for writing.
- * After the page is selected, it is possible to send the byte
- * offset in the page along with the data.
+ * Write the next run of LEDs with a dirty ABM selection, starting
+ * the search at the *cursor LED.
+ * A run is made of neighbouring LEDs on the same channel, each of
+ * the 3 SW lines is written with a burst from abm_fill.
  */
 static int
-is3733_set_cmd_page(uint8_t addr, uint8_t page)
+is3733_flush_abm_span(struct IS3733_State *state, uint8_t *cursor)
 {
-  int rc = ERR_I2C;
+  int rc;
+  uint8_t n = state->is_leds;
+  uint8_t idx, start, end, clean, offset, abm, ch;
 
-  if (is3733_unlock_cmd(addr) != ERR_OK)
-    return rc;
+  for (idx = *cursor; idx < n;) {
+    if (state->abm_dirty[idx / 8] == 0) {
+      idx = (idx | 7) + 1;
+      continue;
+    }
+    if (!is3733_dirty(state->abm_dirty, idx)) {
+      idx++;
+      continue;
+    }
 
-  if (TWI_StartTransmission(addr | TWI_ADDRESS_WRITE, 10) ==
-      TWI_ERROR_NoError) {
-    if (!TWI_SendByte(BCR_COMMAND)) {
-      /* DEBUG("[%s] Can not select command register.\r\n", __func__); */
-      goto fail;
+    start = idx;
+    end = idx;
+    clean = 0;
+    offset = is3733_led_offset(state, start);
+    abm = is3733_abm_get(state, start);
+    for (idx++; idx < n && clean <= BACKLIGHT_FLUSH_GAP &&
+	   idx - start < sizeof(abm_fill[0]); idx++) {
+      if (is3733_led_offset(state, idx) != offset + idx - start ||
+	  is3733_abm_get(state, idx) != abm)
+	break;
+      if (is3733_dirty(state->abm_dirty, idx)) {
+	end = idx;
+	clean = 0;
+      }
+      else {
+	clean++;
+      }
     }
-    if (!TWI_SendByte(page)) {
-      /* DEBUG("[%s] Can not send page address.\r\n", __func__); */
-      goto fail;
+
+    /* The three channel lines go together */
+    if (twi_queue_free() < 3)
+      return ERR_BUSY;
+    for (ch = 0; ch < 3; ch++) {
+      rc = is3733_write_cmd_buf(abm_fill[abm], end - start + 1, state,
+				CRP_AUTO_BREATH_MODE, offset + ch * 0x10);
+      if (rc != ERR_OK)
+	return rc;
     }
-    rc = ERR_OK;
+    *cursor = end + 1;
+    for (; start <= end; start++)
+      state->abm_dirty[start / 8] &= ~(1 << (start % 8));
+    return ERR_OK;
   }
 
- fail:
-  TWI_StopTransmission();
-  return rc;
+  *cursor = BACKLIGHT_FLUSH_DONE;
+  return ERR_OK;
 }
 
 /**
- * Unlock next write to command register.
+ * Write the next run of dirty bytes of the PWM or ABM page.
  */
 static int
-is3733_unlock_cmd(uint8_t addr)
+is3733_flush_span(struct IS3733_State *state, uint8_t page, uint8_t *cursor)
 {
-  return is3733_write_reg(WRITE_LOCK_ENABLE_MAGIC, addr, BCR_WRITE_LOCK);
+  if (page == CRP_LED_PWM)
+    return is3733_flush_pwm_span(state, cursor);
+  return is3733_flush_abm_span(state, cursor);
 }
 
-void
-backlight_init(struct IS3733_State *state, uint8_t addr)
+uint8_t
+backlight_key_led(uint8_t key)
 {
-  /*
-   * Set port E mode to general purpose I/O
-   * output pin: 2 -- no pullup
-   */
-  PORTE = 0;
-  DDRE = (1 << DDE2);
-  // enable led driver pulling SDB (port PE2) to HIGH
-  PORTE |= (1 << PE2);
+  if (key >= sizeof(backlight_key_leds))
+    return BACKLIGHT_LEDS;
+  return pgm_read_byte(&backlight_key_leds[key]);
+}
 
-  /* Initialize TWI at 500kHz */
-  TWI_Init(TWI_BIT_PRESCALE_1, TWI_BITLENGTH_FROM_FREQ(1, 500000));
+void
+backlight_init(struct IS3733_State *state, uint8_t chip, uint8_t sync)
+{
+  struct backlight_led led;
+  uint8_t idx, line, col, ch;
 
   memset(state, 0, sizeof(*state));
-  state->bus_addr = addr;
+  twi_device_init(&state->is_dev, I2C_BACKLIGHT_BUSADDR_N(chip));
+  state->is_sync = sync;
+
+  /* Pick the LEDs of the chip from the map and enable them */
+  for (idx = 0; idx < BACKLIGHT_LEDS; idx++) {
+    backlight_led_get(idx, &led);
+    if (led.chip != chip)
+      continue;
+    if (state->is_leds == 0)
+      state->is_first = idx;
+    else if (state->is_first + state->is_leds != idx)
+      DEBUG("[%s] LED map is not grouped by chip\r\n", __func__);
+    state->is_leds++;
+    line = led.pwm / 0x10;
+    col = led.pwm % 0x10;
+    for (ch = 0; ch < 3; ch++)
+      state->is_onoff[(line + ch) * 2 + col / 8] |= (1 << (col % 8));
+  }
+}
+
+/**
+ * Completion of the reset register read, the device is back
+ * to the default page.
+ */
+static void
+backlight_reset_done(const struct twi_txn *txn, int rc)
+{
+  txn->dev->page = TWI_PAGE_NONE;
 }
 
 void
 backlight_reset(struct IS3733_State *state)
 {
-  uint8_t tmp, rc;
-  uint8_t addr = state->bus_addr;
+  int rc;
+  uint8_t sync = state->is_sync;
 
-  // clear state of all LEDs
-  memset(state, 0, sizeof(*state));
-  state->bus_addr = addr;
+  /*
+   * Clear state of all LEDs, the device, the LED map and the on/off
+   * registers are kept.
+   */
+  memset(state->is_func, 0, sizeof(state->is_func));
+  memset(state->is_pwm, 0, sizeof(state->is_pwm));
+  memset(state->is_abm, 0, sizeof(state->is_abm));
+  memset(state->abm_dirty, 0, sizeof(state->abm_dirty));
+  state->is_intr_mask = 0;
+  state->is_brightness = 0;
+  state->is_pwm_sum = 0;
+  state->is_pwm_excess = 0;
 
-  DEBUG("[%s] Reset backlight driver @%hhx\r\n", __func__, addr);
+  DEBUG("[%s] Reset backlight driver @%hhx\r\n", __func__, state->is_dev.addr);
 
   // read reset register
-  rc = is3733_read_cmd(&tmp, state->bus_addr, CRP_FUNCTION, LFO_RESET);
-  state->is_command.c_func[LFO_RESET] = tmp;
+  rc = is3733_read_cmd_buf(&state->is_func[LFO_RESET], 1, state,
+			   CRP_FUNCTION, LFO_RESET, backlight_reset_done);
   if (rc != ERR_OK) {
     DEBUG("Can not reset backlight\r\n");
     return;
   }
 
-  // clear software shutdown
-  rc = is3733_write_cmd(LED_FN_CONF_SSD, state->bus_addr, CRP_FUNCTION,
+  // clear software shutdown and set the SYNC role
+  rc = is3733_write_cmd(LED_FN_CONF_SSD | sync, state, CRP_FUNCTION,
 			LFO_CONF);
   if (rc != ERR_OK) {
     DEBUG("Can not clear software shutdown\r\n");
     return;
   }
-  state->is_command.c_func[LFO_CONF] = LED_FN_CONF_SSD;
+  state->is_func[LFO_CONF] = LED_FN_CONF_SSD | sync;
 
   // clear global current control register
-  rc = is3733_write_cmd(0x00, state->bus_addr, CRP_FUNCTION,
+  rc = is3733_write_cmd(0x00, state, CRP_FUNCTION,
 			LFO_GLOBAL_CURRENT_CTRL);
   if (rc != ERR_OK) {
     DEBUG("Can not reset Global Current Control\r\n");
     return;
   }
-  state->is_command.c_func[LFO_GLOBAL_CURRENT_CTRL] = 0x0;
+  state->is_func[LFO_GLOBAL_CURRENT_CTRL] = 0x0;
 
   /*
    * Enable LED pull-up and pull-down resistors.
    */
-  rc = is3733_write_cmd(0x7, state->bus_addr, CRP_FUNCTION,
+  rc = is3733_write_cmd(0x7, state, CRP_FUNCTION,
 			LFO_SW_PULLUP);
   if (rc += ERR_OK) {
     DEBUG("Can not configure SW Pullup\r\n");
     return;
   }
-  rc = is3733_write_cmd(0x0, state->bus_addr, CRP_FUNCTION,
+  rc = is3733_write_cmd(0x0, state, CRP_FUNCTION,
 			LFO_CS_PULLDOWN);
   if (rc += ERR_OK) {
     DEBUG("Can not configure CS Pulldown\r\n");
     return;
   }
 
-  /*
-   * Enable leds in our matrix.
-   * The left keypad is attached to the CS4-CS6 and SW1-SW6
-   * portion of the grid.
-   * The right keypad is attached to the CS1-CS3 and SW1-SW6
-   * portion of the grid.
-   */
-  state->is_command.c_onoff[LCO_ONOFF + 0x00] = 0x3f;
-  state->is_command.c_onoff[LCO_ONOFF + 0x02] = 0x3f;
-  state->is_command.c_onoff[LCO_ONOFF + 0x04] = 0x3f;
-  state->is_command.c_onoff[LCO_ONOFF + 0x06] = 0x3f;
-  state->is_command.c_onoff[LCO_ONOFF + 0x08] = 0x3f;
-  state->is_command.c_onoff[LCO_ONOFF + 0x0A] = 0x3f;
-  rc = is3733_write_cmd_buf(&state->is_command.c_onoff[LCO_ONOFF], 0x0B,
-  			    state->bus_addr, CRP_LED_CTRL, LCO_ONOFF);
+  /* Enable the LEDs in the map */
+  rc = is3733_write_cmd_buf(state->is_onoff, sizeof(state->is_onoff),
+			    state, CRP_LED_CTRL, LCO_ONOFF);
   if (rc != ERR_OK) {
     DEBUG("Can not configure LED on\r\n");
     return;
   }
 
-  /* Make sure we clear the PWM page. */
-  rc = is3733_write_cmd_buf(&state->is_command.c_pwm[0], 0xC0, state->bus_addr,
-			    CRP_LED_PWM, 0);
-  if (rc != ERR_OK) {
-    DEBUG("Can not reset LED PWM\r\n");
-    return;
-  }
+  /* Make sure we clear the PWM of the LEDs with the next flush. */
+  memset(state->pwm_dirty, 0xff, sizeof(state->pwm_dirty));
+  state->is_pwm_pending = true;
 }
 
 void
@@ -429,125 +520,310 @@ backlight_disable(struct IS3733_State *state)
 
 }
 
-int
-backlight_brightness(struct IS3733_State *state, uint8_t value) {
+void
+backlight_stats(struct IS3733_State *state)
+{
+  DEBUG("[%s] @%hhx I2C transactions: %u avoided: %u errors: %u\r\n",
+	__func__, state->is_dev.addr, state->is_dev.tx, state->is_dev.avoided,
+	state->is_dev.errors);
+}
 
+/**
+ * Global current the power budget allows while the PWM shadow
+ * is written, capped to the requested brightness.
+ */
+static uint8_t
+backlight_power_target(const struct IS3733_State *state)
+{
+  uint32_t limit, sum = (uint32_t)state->is_pwm_sum + state->is_pwm_excess;
+
+  if (sum == 0)
+    return state->is_brightness;
+  limit = BACKLIGHT_POWER_K / sum;
+  return (limit < state->is_brightness) ? limit : state->is_brightness;
+}
+
+static int
+backlight_write_gcc(struct IS3733_State *state, uint8_t value)
+{
   int rc;
 
-  rc = is3733_write_cmd(value, state->bus_addr, CRP_FUNCTION,
+  rc = is3733_write_cmd(value, state, CRP_FUNCTION,
 			LFO_GLOBAL_CURRENT_CTRL);
   if (rc != ERR_OK) {
-    DEBUG("Can not set backlight brightness to %hhx\r\n", value);
+    DEBUG("Can not set backlight global current to %hhx\r\n", value);
     return rc;
   }
-  state->is_command.c_func[LFO_GLOBAL_CURRENT_CTRL] = value;
+  state->is_func[LFO_GLOBAL_CURRENT_CTRL] = value;
+  state->is_gcc_step = sched_now();
 
   return rc;
 }
 
+/**
+ * Power governor, cut the global current before the PWM shadow
+ * is written if it goes over the budget.
+ * The open-short detection owns the global current while it runs.
+ */
+static int
+backlight_govern_down(struct IS3733_State *state)
+{
+  uint8_t target;
+
+  if (state->is_func[LFO_CONF] & LED_FN_CONF_OSD)
+    return ERR_OK;
+  target = backlight_power_target(state);
+  if (target >= state->is_func[LFO_GLOBAL_CURRENT_CTRL])
+    return ERR_OK;
+  return backlight_write_gcc(state, target);
+}
+
+/**
+ * Power governor, raise the global current in steps of
+ * BACKLIGHT_GCC_SLEW towards the budget once the PWM shadow
+ * is on the device.
+ */
+static int
+backlight_govern_up(struct IS3733_State *state)
+{
+  uint8_t gcc = state->is_func[LFO_GLOBAL_CURRENT_CTRL];
+  uint8_t target;
+
+  if (state->is_pwm_pending || (state->is_func[LFO_CONF] & LED_FN_CONF_OSD))
+    return ERR_OK;
+  target = backlight_power_target(state);
+  if (target <= gcc ||
+      (uint8_t)(sched_now() - state->is_gcc_step) < BACKLIGHT_GCC_STEP_MS)
+    return ERR_OK;
+  if (target - gcc > BACKLIGHT_GCC_SLEW)
+    target = gcc + BACKLIGHT_GCC_SLEW;
+  return backlight_write_gcc(state, target);
+}
+
 int
-backlight_set(struct IS3733_State *state, uint16_t row, uint16_t col, struct LedColor lc)
+backlight_brightness(struct IS3733_State *state, uint8_t value) {
+
+  state->is_brightness = value;
+  /* Dimming is immediate, the power governor ramps up */
+  return backlight_govern_down(state);
+}
+
+/**
+ * Update a PWM shadow byte, marking it dirty if it changed.
+ */
+static inline void
+backlight_set_pwm(struct IS3733_State *state, uint8_t ch, uint8_t idx,
+		  uint8_t value)
 {
-  int rc = ERR_BACKLIGHT;
-  uint8_t col_offset, col_index;
-  uint8_t led_status;
-  int index;
+  uint32_t old;
 
-  if (row > 3) {
-    return rc;
-  }
-  if (col > 15) {
-    return rc;
+  if (state->is_pwm[ch][idx] == value)
+    return;
+  if (value < state->is_pwm[ch][idx]) {
+    old = state->is_pwm_excess + (state->is_pwm[ch][idx] - value);
+    state->is_pwm_excess = (old > 0xffff) ? 0xffff : old;
   }
-  col_offset = (col > 7) ? 1 : 0;
-  col_index = (col > 7) ? col - 8 : col;
-  row = row * 3;
+  state->is_pwm_sum += value - state->is_pwm[ch][idx];
+  state->is_pwm[ch][idx] = value;
+  state->pwm_dirty[ch][idx / 8] |= (1 << (idx % 8));
+  state->is_pwm_pending = true;
+}
+
+/**
+ * Set the colour of a LED of the chip by mirror index.
+ */
+static void
+backlight_set_led(struct IS3733_State *state, uint8_t idx, struct LedColor lc)
+{
+  const uint8_t (*lut)[256] = pwm_lut[0];
+
+  /* Folds away with a single profile */
+  if (BACKLIGHT_WB_COUNT > 1)
+    lut = pwm_lut[pgm_read_byte(&backlight_led_wb[state->is_first + idx])];
+
+  backlight_set_pwm(state, 0, idx, pgm_read_byte(&lut[0][lc.b]));
+  backlight_set_pwm(state, 1, idx, pgm_read_byte(&lut[1][lc.g]));
+  backlight_set_pwm(state, 2, idx, pgm_read_byte(&lut[2][lc.r]));
+}
 
-  /* Check status for all LED channels */
-  led_status = state->is_command.c_onoff[LCO_ONOFF + row * 2 + col_offset];
-  if ((led_status & (1 << col_index)) == 0) {
+int
+backlight_flush(struct IS3733_State *state)
+{
+  int rc;
+  uint8_t cursor;
+
+  rc = backlight_govern_down(state);
+  if (rc != ERR_OK)
     return rc;
+
+  for (cursor = 0; cursor != BACKLIGHT_FLUSH_DONE;) {
+    rc = is3733_flush_span(state, CRP_LED_PWM, &cursor);
+    if (rc != ERR_OK) {
+      DEBUG("[%s] Can not flush LED PWM\r\n", __func__);
+      return rc;
+    }
   }
-  led_status = state->is_command.c_onoff[LCO_ONOFF + (row + 1) * 2 + col_offset];
-  if ((led_status & (1 << col_index)) == 0) {
-    return rc;
+  state->is_pwm_pending = false;
+  state->is_pwm_excess = 0;
+
+  for (cursor = 0; cursor != BACKLIGHT_FLUSH_DONE;) {
+    rc = is3733_flush_span(state, CRP_AUTO_BREATH_MODE, &cursor);
+    if (rc != ERR_OK) {
+      DEBUG("[%s] Can not flush LED ABM\r\n", __func__);
+      return rc;
+    }
   }
 
-  led_status = state->is_command.c_onoff[LCO_ONOFF + (row + 2) * 2 + col_offset];
-  if ((led_status & (1 << col_index)) == 0) {
-    return rc;
-  }
+  return ERR_OK;
+}
 
-  /* Update PWM for each channel */
-  index = row * 0x10 + col;
-  state->is_command.c_pwm[index] = lc.b;
-  DEBUG("[%s] B(%hx, %hx) @ PWM[%x] <- %hhx\r\n", __func__, row, col,
-  	index, lc.b);
-  rc = is3733_write_cmd(lc.b, state->bus_addr, CRP_LED_PWM, index);
-  if (rc != ERR_OK) {
-    return rc;
-  }
+struct LedColor
+backlight_hsv(uint8_t hue, uint8_t sat, uint8_t val)
+{
+  struct LedColor c;
+  uint8_t region, rest, p, q, t;
 
-  index = (row + 1) * 0x10 + col;
-  state->is_command.c_pwm[index] = lc.g;
-  DEBUG("[%s] G(%hx, %hx) @ PWM[%x] <- %hhx\r\n", __func__, row, col,
-  	index, lc.g);
-  rc = is3733_write_cmd(lc.g, state->bus_addr, CRP_LED_PWM, index);
-  if (rc != ERR_OK) {
-    return rc;
+  if (sat == 0) {
+    c.r = c.g = c.b = val;
+    return c;
   }
 
-  index = (row + 2) * 0x10 + col;
-  state->is_command.c_pwm[index] = lc.r;
-  DEBUG("[%s] R(%hx, %hx) @ PWM[%x] <- %hhx\r\n", __func__, row, col,
-  	index, lc.r);
-  rc = is3733_write_cmd(lc.r, state->bus_addr, CRP_LED_PWM, index);
-  if (rc != ERR_OK) {
-    return rc;
+  /* Six regions of 43 hue steps, rest is the position in the region */
+  region = hue / 43;
+  rest = (hue - region * 43) * 6;
+
+  p = (val * (uint8_t)(255 - sat)) >> 8;
+  q = (val * (uint8_t)(255 - ((sat * rest) >> 8))) >> 8;
+  t = (val * (uint8_t)(255 - ((sat * (uint8_t)(255 - rest)) >> 8))) >> 8;
+
+  switch (region) {
+  case 0:
+    c.r = val; c.g = t; c.b = p;
+    break;
+  case 1:
+    c.r = q; c.g = val; c.b = p;
+    break;
+  case 2:
+    c.r = p; c.g = val; c.b = t;
+    break;
+  case 3:
+    c.r = p; c.g = q; c.b = val;
+    break;
+  case 4:
+    c.r = t; c.g = p; c.b = val;
+    break;
+  default:
+    c.r = val; c.g = p; c.b = q;
+    break;
   }
+  return c;
+}
 
+int
+backlight_set(struct IS3733_State *state, uint16_t row, uint16_t col, struct LedColor lc)
+{
+  uint8_t idx;
+
+  if (row > 3 || col > 15)
+    return ERR_BACKLIGHT;
+
+  /* Only the LEDs in the map are enabled */
+  idx = is3733_led_find(state, row, col);
+  if (idx == BACKLIGHT_LEDS)
+    return ERR_BACKLIGHT;
+
+  backlight_set_led(state, idx, lc);
   return ERR_OK;
 }
 
+/**
+ * Update the ABM selection of a LED, marking it dirty if it changed.
+ */
+static inline void
+backlight_set_abm(struct IS3733_State *state, uint8_t idx, uint8_t abm)
+{
+  uint8_t shift = (idx % 4) * 2;
+
+  if (is3733_abm_get(state, idx) == abm)
+    return;
+  state->is_abm[idx / 4] &= ~(0x3 << shift);
+  state->is_abm[idx / 4] |= (abm << shift);
+  state->abm_dirty[idx / 8] |= (1 << (idx % 8));
+}
+
 int
 backlight_abm_set(struct IS3733_State *state, uint16_t row, uint16_t col,
 		  enum ABMChannel abm)
 {
+  uint8_t idx;
+
+  if (row > 3 || col > 15)
+    return ERR_BACKLIGHT;
+
+  idx = is3733_led_find(state, row, col);
+  if (idx == BACKLIGHT_LEDS)
+    return ERR_BACKLIGHT;
+
+  backlight_set_abm(state, idx, abm);
+  return ERR_OK;
+}
+
+int
+backlight_abm_config(struct IS3733_State *state, enum ABMChannel abm,
+		     const struct ABMEffect *effect)
+{
+  uint8_t offset;
+  uint8_t *conf;
   int rc;
-  int index;
 
-  /* Convert from matrix row to base LED row */
-  row = row * 3;
+  /* Larger counts would wrap, possibly to ABM_LOOPS_FOREVER */
+  if (abm == ABM_PWM || effect->loops > ABM_LOOPS_MAX)
+    return ERR_BACKLIGHT;
 
-  /* Set ABM channel for each LED */
-  index = row * 0x10 + col;
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_AUTO_BREATH_MODE,
-			index);
-  DEBUG("[%s] B(%hx, %hx) @ ABM[%x] <- %hhx\r\n", __func__, row, col,
-  	index, abm);
-  if (rc != ERR_OK) {
-    return rc;
-  }
+  /* The 4 registers of each channel are consecutive */
+  offset = LFO_ABM1_C1 + (abm - ABM_CHANNEL_1) * 4;
+  conf = &state->is_func[offset];
+  conf[0] = (effect->rise << 5) | (effect->hold_on << 1);
+  conf[1] = (effect->fall << 5) | (effect->hold_off << 1);
+  conf[2] = (effect->loop_end << 4) | (effect->loop_begin << 2) |
+    ((effect->loops >> 8) & 0x3);
+  conf[3] = effect->loops & 0xff;
 
-  index = (row + 1) * 0x10 + col;
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_AUTO_BREATH_MODE,
-			index);
-  DEBUG("[%s] G(%hx, %hx) @ ABM[%x] <- %hhx\r\n", __func__, row, col,
-  	index, abm);
-  if (rc != ERR_OK) {
+  rc = is3733_write_cmd_buf(conf, 4, state, CRP_FUNCTION, offset);
+  if (rc != ERR_OK)
+    DEBUG("[%s] Can not configure ABM%hhu\r\n", __func__, abm);
+  return rc;
+}
+
+int
+backlight_abm_start(struct IS3733_State *state)
+{
+  uint8_t conf = state->is_func[LFO_CONF] | LED_FN_CONF_B_EN;
+  int rc;
+
+  rc = backlight_flush(state);
+  if (rc != ERR_OK)
     return rc;
-  }
 
-  index = (row + 2) * 0x10 + col;
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_AUTO_BREATH_MODE,
-			index);
-  DEBUG("[%s] R(%hx, %hx) @ ABMd[%x] <- %hhx\r\n", __func__, row, col,
-  	index, abm);
-  if (rc != ERR_OK) {
+  rc = is3733_write_cmd(conf, state, CRP_FUNCTION, LFO_CONF);
+  if (rc != ERR_OK)
     return rc;
-  }
+  state->is_func[LFO_CONF] = conf;
 
-  return ERR_OK;
+  /* Latch the new timings, the channels restart */
+  return is3733_write_cmd(0x00, state, CRP_FUNCTION, LFO_TIME_UPDATE);
+}
+
+int
+backlight_abm_stop(struct IS3733_State *state)
+{
+  uint8_t conf = state->is_func[LFO_CONF] & ~LED_FN_CONF_B_EN;
+  int rc;
+
+  rc = is3733_write_cmd(conf, state, CRP_FUNCTION, LFO_CONF);
+  if (rc == ERR_OK)
+    state->is_func[LFO_CONF] = conf;
+  return rc;
 }
 
 
@@ -563,12 +839,24 @@ int
 backlight_check_trigger(struct IS3733_State *state)
 {
   int rc = ERR_I2C;
-  uint8_t conf = state->is_command.c_func[LFO_CONF];
+  uint8_t conf = state->is_func[LFO_CONF];
 
   DEBUG("[%s] Trigger open-short detection\r\n", __func__);
 
-  /* Set global current control for open short detect (datasheet) */
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_FUNCTION,
+  /* Flag the faults in the interrupt status */
+  rc = is3733_write_cmd(BL_INTR_OPEN | BL_INTR_SHORT, state, TWI_PAGE_NONE,
+			BCR_INTR_MASK);
+  if (rc != ERR_OK) {
+    DEBUG("[%s] Can not set the interrupt mask\r\n", __func__);
+    return rc;
+  }
+  state->is_intr_mask = BL_INTR_OPEN | BL_INTR_SHORT;
+
+  /*
+   * Set global current control for open short detect (datasheet),
+   * the mirror keeps the current to restore.
+   */
+  rc = is3733_write_cmd(0x01, state, CRP_FUNCTION,
 			LFO_GLOBAL_CURRENT_CTRL);
   if (rc != ERR_OK) {
     DEBUG("[%s] Can not set GCC=0x01\r\n", __func__);
@@ -578,209 +866,447 @@ backlight_check_trigger(struct IS3733_State *state)
   /* Clear OSD bit */
   conf &= ~(uint8_t)(LED_FN_CONF_OSD);
 
-  rc = is3733_write_cmd(conf, state->bus_addr, CRP_FUNCTION, LFO_CONF);
+  rc = is3733_write_cmd(conf, state, CRP_FUNCTION, LFO_CONF);
   if (rc != ERR_OK) {
     DEBUG("[%s] Can not clear backlight open-short-detect bit %hhx\r\n",
 	  __func__, conf);
     return rc;
   }
-  state->is_command.c_func[LFO_CONF] = conf;
+  state->is_func[LFO_CONF] = conf;
 
   /* Set OSD bit */
   conf |= (uint8_t)(LED_FN_CONF_OSD);
 
-  rc = is3733_write_cmd(conf, state->bus_addr, CRP_FUNCTION, LFO_CONF);
+  rc = is3733_write_cmd(conf, state, CRP_FUNCTION, LFO_CONF);
   if (rc != ERR_OK) {
     DEBUG("[%s] Can not set backlight open-short-detect bit %hhx\r\n",
 	  __func__, conf);
     return rc;
   }
-  state->is_command.c_func[LFO_CONF] = conf;
+  state->is_func[LFO_CONF] = conf;
 
   return ERR_OK;
 }
 
+/**
+ * Completion of the open-short detection readbacks.
+ */
+static void
+backlight_check_done(const struct twi_txn *txn, int rc)
+{
+  struct IS3733_State *state = txn->arg;
+
+  state->is_check = (rc == ERR_OK) ? IS3733_CHECK_READY : IS3733_CHECK_FAILED;
+}
+
+int
+backlight_check_status(struct IS3733_State *state)
+{
+  int rc;
+
+  state->is_check = IS3733_CHECK_PENDING;
+  rc = is3733_read_cmd_buf(&state->is_intr_status, 1, state, TWI_PAGE_NONE,
+			   BCR_INTR_STATUS, backlight_check_done);
+  if (rc != ERR_OK)
+    state->is_check = IS3733_CHECK_IDLE;
+  return rc;
+}
+
 int
 backlight_check(struct IS3733_State *state)
 {
   int rc = ERR_I2C;
 
-  DEBUG("[%s] Check open-short detection result\r\n", __func__);
+  /* The readback buffer is shared, one driver at a time */
+  if (osd_owner != NULL && osd_owner != state)
+    return ERR_BUSY;
 
-  rc = is3733_read_cmd_buf(&state->is_command.c_onoff[LCO_OPEN],
-  			   LCO_END - LCO_OPEN,
-  			   state->bus_addr,
-  			   CRP_LED_CTRL, LCO_OPEN);
+  osd_owner = state;
+  state->is_check = IS3733_CHECK_PENDING;
+  rc = is3733_read_cmd_buf(osd_data, sizeof(osd_data), state,
+  			   CRP_LED_CTRL, LCO_OPEN, backlight_check_done);
   if (rc != ERR_OK) {
+    osd_owner = NULL;
+    state->is_check = IS3733_CHECK_IDLE;
     DEBUG("Can not read backlight open-short-detect page\r\n");
     return rc;
   }
 
-  DEBUG("Led OPEN region dump:\r\n");
-  for (int idx = LCO_OPEN; idx < LCO_SHORT; idx += 4) {
-    DEBUG("[%hhx] %hhx %hhx %hhx %hhx\r\n",
-	  idx,
-	  state->is_command.c_onoff[idx],
-	  state->is_command.c_onoff[idx + 1],
-	  state->is_command.c_onoff[idx + 2],
-	  state->is_command.c_onoff[idx + 3]);
-  }
+  return ERR_OK;
+}
 
-  DEBUG("Led SHORT region dump:\r\n");
-  for (int idx = LCO_SHORT; idx < LCO_END; idx += 4) {
-    DEBUG("[%hhx] %hhx %hhx %hhx %hhx\r\n",
-	  idx,
-	  state->is_command.c_onoff[idx],
-	  state->is_command.c_onoff[idx + 1],
-	  state->is_command.c_onoff[idx + 2],
-	  state->is_command.c_onoff[idx + 3]);
+uint8_t
+backlight_check_faults(const struct IS3733_State *state, uint8_t idx)
+{
+  uint8_t offset, ch, byte, bit, faults = 0;
+
+  if (osd_owner != state)
+    return 0;
+
+  /* One bit per LED channel, in the layout of the on/off registers */
+  offset = is3733_led_offset(state, idx);
+  for (ch = 0; ch < 3; ch++) {
+    byte = (offset / 0x10 + ch) * 2 + (offset % 0x10) / 8;
+    bit = 1 << (offset % 8);
+    if (osd_data[byte] & bit)
+      faults |= (BL_FAULT_OPEN_B << ch);
+    if (osd_data[LCO_SHORT - LCO_OPEN + byte] & bit)
+      faults |= (BL_FAULT_SHORT_B << ch);
   }
+  return faults;
+}
 
-  return ERR_OK;
+int
+backlight_check_restore(struct IS3733_State *state)
+{
+  uint8_t conf = state->is_func[LFO_CONF] & ~LED_FN_CONF_OSD;
+  int rc;
+
+  if (osd_owner == state)
+    osd_owner = NULL;
+  state->is_check = IS3733_CHECK_IDLE;
+
+  rc = is3733_write_cmd(conf, state, CRP_FUNCTION, LFO_CONF);
+  if (rc != ERR_OK)
+    return rc;
+  state->is_func[LFO_CONF] = conf;
+
+  return is3733_write_cmd(state->is_func[LFO_GLOBAL_CURRENT_CTRL], state,
+			  CRP_FUNCTION, LFO_GLOBAL_CURRENT_CTRL);
+}
+
+/**
+ * Completion of a PWM run verification.
+ */
+static void
+backlight_verify_done(const struct twi_txn *txn, int rc)
+{
+  struct IS3733_State *state = txn->arg;
+
+  state->is_verify_mismatch += txn->mismatch;
+  if (rc != ERR_OK)
+    state->is_verify = IS3733_CHECK_FAILED;
+  state->is_verify_queued--;
+}
+
+/**
+ * Queue the verification of the next runs of neighbouring LEDs
+ * in the PWM shadow, until the queue fills up. The rest is queued
+ * by backlight_poll.
+ */
+static void
+backlight_verify_runs(struct IS3733_State *state)
+{
+  uint8_t n = state->is_leds;
+  uint8_t ch, idx, len, offset;
+  int rc;
+
+  while (state->is_verify_next < 3 * n) {
+    ch = state->is_verify_next / n;
+    idx = state->is_verify_next - ch * n;
+    offset = is3733_led_offset(state, idx);
+    for (len = 1; idx + len < n; len++) {
+      if (is3733_led_offset(state, idx + len) != offset + len)
+	break;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      state->is_verify_queued++;
+    }
+    rc = is3733_verify_cmd_buf(&state->is_pwm[ch][idx], len, state,
+			       CRP_LED_PWM, offset + ch * 0x10,
+			       backlight_verify_done);
+    if (rc != ERR_OK) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	state->is_verify_queued--;
+      }
+      return;
+    }
+    state->is_verify_next += len;
+  }
 }
 
 int
-backlight_set_all(struct IS3733_State *state, int lr, struct LedColor lc) {
+backlight_verify(struct IS3733_State *state)
+{
   int rc;
 
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_FUNCTION, LFO_CONF);
+  if (state->is_verify != IS3733_CHECK_IDLE || state->is_verify_queued)
+    return ERR_BUSY;
+
+  /* Queued writes complete first, so the device must match the mirror */
+  rc = backlight_flush(state);
   if (rc != ERR_OK)
     return rc;
 
-  if (lr == 0) {
-    backlight_set(state, 0, 3, lc);
-    backlight_set(state, 0, 5, lc);
-    backlight_set(state, 1, 3, lc);
-    backlight_set(state, 1, 4, lc);
-    backlight_set(state, 1, 5, lc);
+  state->is_verify_mismatch = 0;
+  state->is_verify_next = 0;
+  state->is_verify = IS3733_CHECK_PENDING;
+  backlight_verify_runs(state);
+  return ERR_OK;
+}
+
+void
+backlight_poll(struct IS3733_State *state)
+{
+  backlight_govern_up(state);
+
+  switch (state->is_verify) {
+  case IS3733_CHECK_PENDING:
+    backlight_verify_runs(state);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (state->is_verify == IS3733_CHECK_PENDING &&
+	  state->is_verify_next == 3 * state->is_leds &&
+	  state->is_verify_queued == 0)
+	state->is_verify = IS3733_CHECK_READY;
+    }
+    break;
+  case IS3733_CHECK_READY:
+    if (state->is_verify_mismatch)
+      DEBUG("Backlight PWM page mismatch: %hhu bytes\r\n",
+	    state->is_verify_mismatch);
+    state->is_verify = IS3733_CHECK_IDLE;
+    break;
+  case IS3733_CHECK_FAILED:
+    DEBUG("Can not verify backlight PWM page\r\n");
+    state->is_verify = IS3733_CHECK_IDLE;
+    break;
+  }
+}
+
+void
+backlight_board_init(struct Backlight *bl)
+{
+  uint8_t chip, sync;
+
+  /*
+   * Set port E mode to general purpose I/O
+   * output pin: 2 -- no pullup
+   */
+  PORTE = 0;
+  DDRE = (1 << DDE2);
+  // enable led drivers pulling the shared SDB (port PE2) to HIGH
+  PORTE |= (1 << PE2);
+
+  twi_init();
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    if (BACKLIGHT_DRIVERS == 1)
+      sync = 0;
+    else
+      sync = (chip == 0) ? LED_FN_CONF_SYNC_MASTER : LED_FN_CONF_SYNC_SLAVE;
+    backlight_init(&bl->chip[chip], chip, sync);
   }
-  else {
-    backlight_set(state, 0, 0, lc);
-    backlight_set(state, 0, 2, lc);
-    backlight_set(state, 1, 0, lc);
-    backlight_set(state, 1, 1, lc);
-    backlight_set(state, 1, 2, lc);
+}
+
+void
+backlight_board_reset(struct Backlight *bl)
+{
+  uint8_t chip;
+
+  /* The slaves are set up before the master starts the SYNC clock */
+  for (chip = BACKLIGHT_DRIVERS; chip > 0; chip--)
+    backlight_reset(&bl->chip[chip - 1]);
+}
+
+void
+backlight_board_poll(struct Backlight *bl)
+{
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++)
+    backlight_poll(&bl->chip[chip]);
+}
+
+void
+backlight_board_stats(struct Backlight *bl)
+{
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++)
+    backlight_stats(&bl->chip[chip]);
+}
+
+int
+backlight_board_brightness(struct Backlight *bl, uint8_t value)
+{
+  int rc, err = ERR_OK;
+
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    rc = backlight_brightness(&bl->chip[chip], value);
+    if (rc != ERR_OK)
+      err = rc;
   }
+  return err;
+}
+
+/**
+ * Flush a page of all the drivers, one burst of each chip in turn.
+ */
+static int
+backlight_board_flush_page(struct Backlight *bl, uint8_t page)
+{
+  uint8_t cursor[BACKLIGHT_DRIVERS] = {0};
+  uint8_t chip;
+  bool pending;
+  int rc;
+
+  do {
+    pending = false;
+    for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+      if (cursor[chip] == BACKLIGHT_FLUSH_DONE)
+	continue;
+      rc = is3733_flush_span(&bl->chip[chip], page, &cursor[chip]);
+      if (rc != ERR_OK)
+	return rc;
+      if (cursor[chip] != BACKLIGHT_FLUSH_DONE)
+	pending = true;
+    }
+  } while (pending);
 
   return ERR_OK;
 }
 
 int
-backlight_set_pattern(struct IS3733_State *state) {
-
+backlight_board_flush(struct Backlight *bl)
+{
   int rc;
+  uint8_t chip;
 
-  //backlight_abm_set(state, 1, 3, ABM_PWM);
-  /* backlight_abm_set(state, 1, 4, ABM_DISABLE); */
-  /* backlight_abm_set(state, 1, 5, ABM_DISABLE); */
-  rc = is3733_write_cmd(0x01, state->bus_addr, CRP_FUNCTION, LFO_CONF);
-  if (rc != ERR_OK)
+  /* The current is cut before the brighter frame is written */
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    rc = backlight_govern_down(&bl->chip[chip]);
+    if (rc != ERR_OK)
+      return rc;
+  }
+
+  rc = backlight_board_flush_page(bl, CRP_LED_PWM);
+  if (rc != ERR_OK) {
+    DEBUG("[%s] Can not flush LED PWM\r\n", __func__);
     return rc;
+  }
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    bl->chip[chip].is_pwm_pending = false;
+    bl->chip[chip].is_pwm_excess = 0;
+  }
 
-  backlight_brightness(state, 255);
-  backlight_set(state, 0, 3, white);
-  backlight_set(state, 0, 5, custom2);
-  backlight_set(state, 1, 3, red);
-  backlight_set(state, 1, 4, green);
-  backlight_set(state, 1, 5, blue);
+  rc = backlight_board_flush_page(bl, CRP_AUTO_BREATH_MODE);
+  if (rc != ERR_OK)
+    DEBUG("[%s] Can not flush LED ABM\r\n", __func__);
+  return rc;
+}
+
+int
+backlight_board_verify(struct Backlight *bl)
+{
+  int rc, err;
+
+  /* Flush first, so the readbacks queue behind the whole frame */
+  err = backlight_board_flush(bl);
+  if (err != ERR_OK)
+    return err;
+
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    rc = backlight_verify(&bl->chip[chip]);
+    if (rc != ERR_OK)
+      err = rc;
+  }
+  return err;
+}
+
+int
+backlight_led_set(struct Backlight *bl, uint8_t idx, struct LedColor lc)
+{
+  struct IS3733_State *state;
+
+  if (idx >= BACKLIGHT_LEDS)
+    return ERR_BACKLIGHT;
+  state = &bl->chip[pgm_read_byte(&backlight_leds[idx].chip)];
+  backlight_set_led(state, idx - state->is_first, lc);
+  return ERR_OK;
+}
 
-  backlight_set(state, 0, 0, custom);
-  backlight_set(state, 0, 2, red);
-  backlight_set(state, 1, 0, red);
-  backlight_set(state, 1, 1, green);
-  backlight_set(state, 1, 2, blue);
+int
+backlight_led_abm_set(struct Backlight *bl, uint8_t idx, enum ABMChannel abm)
+{
+  struct IS3733_State *state;
 
+  if (idx >= BACKLIGHT_LEDS)
+    return ERR_BACKLIGHT;
+  state = &bl->chip[pgm_read_byte(&backlight_leds[idx].chip)];
+  backlight_set_abm(state, idx - state->is_first, abm);
   return ERR_OK;
 }
 
-#if 0
 int
-backlight_set_animation(struct IS3733_State *state) {
+backlight_board_abm_config(struct Backlight *bl, enum ABMChannel abm,
+			   const struct ABMEffect *effect)
+{
+  int rc, err = ERR_OK;
+
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    rc = backlight_abm_config(&bl->chip[chip], abm, effect);
+    if (rc != ERR_OK)
+      err = rc;
+  }
+  return err;
+}
 
+int
+backlight_board_abm_start(struct Backlight *bl)
+{
   int rc;
+  uint8_t chip;
 
-  /* Clear B_EN */
-  rc = is3733_write_cmd(state->is_command.c_func[LFO_CONF] & ~(0x02),
-			state->bus_addr, CRP_FUNCTION, LFO_CONF);
+  rc = backlight_board_flush(bl);
   if (rc != ERR_OK)
     return rc;
 
-  backlight_brightness(state, 255);
-  backlight_set(state, 0, 3, white);
-  backlight_set(state, 0, 5, white);
-  backlight_set(state, 1, 3, red);
-  backlight_set(state, 1, 4, green);
-  backlight_set(state, 1, 5, blue);
+  /* Nothing left to flush, each chip only latches the timings */
+  for (chip = BACKLIGHT_DRIVERS; chip > 0; chip--) {
+    rc = backlight_abm_start(&bl->chip[chip - 1]);
+    if (rc != ERR_OK)
+      return rc;
+  }
+  return ERR_OK;
+}
 
-  /* Select auto breath mode index for each of the second row LEDs */
-  backlight_abm_set(state, 1, 3, ABM_CHANNEL_1);
-  backlight_abm_set(state, 1, 4, ABM_CHANNEL_2);
-  backlight_abm_set(state, 1, 5, ABM_CHANNEL_3);
+int
+backlight_board_abm_stop(struct Backlight *bl)
+{
+  int rc, err = ERR_OK;
 
-  /* Configure ABM1
-   * Loop 2 times start=off end=off 1.68s rise 3.36s hold
-   */
-  rc = is3733_write_cmd((0x03 << 5) | (0x05 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM1_C1);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd((0x03 << 5) | (0x05 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM1_C2);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x00, state->bus_addr, CRP_FUNCTION, LFO_ABM1_C3);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x02, state->bus_addr, CRP_FUNCTION, LFO_ABM1_C4);
-  if (rc != ERR_OK)
-    return rc;
+  for (uint8_t chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    rc = backlight_abm_stop(&bl->chip[chip]);
+    if (rc != ERR_OK)
+      err = rc;
+  }
+  return err;
+}
 
-  /* Configure ABM2
-   * Loop 2 times start=on end=off 3.36s rise 1.68s hold
-   */
-  rc = is3733_write_cmd((0x04 << 5) | (0x04 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM2_C1);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd((0x04 << 5) | (0x04 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM2_C2);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x01 << 4, state->bus_addr, CRP_FUNCTION, LFO_ABM2_C3);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x02, state->bus_addr, CRP_FUNCTION, LFO_ABM2_C4);
-  if (rc != ERR_OK)
-    return rc;
+/*
+ * Colours of the test pattern, repeated along the LED map.
+ */
+static struct LedColor *const pattern[] = {
+  &custom, &red, &white, &custom2, &red,
+  &green, &blue, &red, &green, &blue,
+};
 
-  /* Configure ABM3
-   * Loop 4 times start=off end=on 0.84s rise 1.68s hold
-   */
-  rc = is3733_write_cmd((0x02 << 5) | (0x04 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM3_C1);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd((0x02 << 5) | (0x04 << 1), state->bus_addr,
-			CRP_FUNCTION, LFO_ABM3_C2);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x01 << 4, state->bus_addr, CRP_FUNCTION, LFO_ABM3_C3);
-  if (rc != ERR_OK)
-    return rc;
-  rc = is3733_write_cmd(0x01 << 6, state->bus_addr, CRP_FUNCTION, LFO_ABM3_C4);
-  if (rc != ERR_OK)
-    return rc;
+int
+backlight_set_pattern(struct Backlight *bl) {
 
-  /* Set B_EN */
-  rc = is3733_write_cmd(state->is_command.c_func[LFO_CONF] | (1 << 1),
-			state->bus_addr, CRP_FUNCTION, LFO_CONF);
-  if (rc != ERR_OK)
-    return rc;
+  struct IS3733_State *state;
+  uint8_t chip, led, colors = sizeof(pattern) / sizeof(pattern[0]);
+  int rc;
 
-  /* Reset time update register */
-  rc = is3733_write_cmd(0x00, state->bus_addr, CRP_FUNCTION, LFO_TIME_UPDATE);
-  if (rc != ERR_OK)
-    return rc;
-  return ERR_OK;
+  for (chip = BACKLIGHT_DRIVERS; chip > 0; chip--) {
+    state = &bl->chip[chip - 1];
+    rc = is3733_write_cmd(LED_FN_CONF_SSD | state->is_sync, state,
+			  CRP_FUNCTION, LFO_CONF);
+    if (rc != ERR_OK)
+      return rc;
+    state->is_func[LFO_CONF] = LED_FN_CONF_SSD | state->is_sync;
+  }
+
+  backlight_board_brightness(bl, 255);
+  for (led = 0; led < BACKLIGHT_LEDS; led++)
+    backlight_led_set(bl, led, *pattern[led % colors]);
+
+  return backlight_board_flush(bl);
 }
-#endif
@@ -25,6 +25,20 @@
 
 #include <stdint.h>
 
+#include <avr/pgmspace.h>
+
+#include "twi.h"
+
+/*
+ * The LED map of the board, BACKLIGHT_LEDMAP names the header of
+ * another board in the build flags.
+ */
+#ifdef BACKLIGHT_LEDMAP
+#include BACKLIGHT_LEDMAP
+#else
+#include "ledmap.h"
+#endif
+
 /**
  * Backlight Driver I2C BUS address (base)
  * b1010 000x
@@ -35,6 +49,63 @@
  */
 #define I2C_BACKLIGHT_BUSADDR 0xA0
 
+/**
+ * Bus address of the n-th driver on the bus, with ADDR2 tied to GND
+ * the ADDR1 pin selects GND, SCL, SDA or VCC for drivers 0-3.
+ */
+#define I2C_BACKLIGHT_BUSADDR_N(n) (I2C_BACKLIGHT_BUSADDR + ((n) << 1))
+
+/**
+ * Number of drivers on the bus, one covers half of a full-size
+ * keyboard. With more than one driver the first is the SYNC master
+ * and the others follow its PWM clock.
+ */
+#ifndef BACKLIGHT_DRIVERS
+#define BACKLIGHT_DRIVERS 1
+#endif
+
+_Static_assert(BACKLIGHT_DRIVERS >= 1 && BACKLIGHT_DRIVERS <= 4,
+	       "Invalid number of backlight drivers");
+
+/**
+ * Average current budget of the LEDs in mA, shared evenly by the
+ * drivers. The board declares 100mA to the USB host, the rest is
+ * left to the microcontroller.
+ */
+#ifndef BACKLIGHT_POWER_BUDGET_MA
+#define BACKLIGHT_POWER_BUDGET_MA 60
+#endif
+
+/**
+ * Current setting resistor on the R_EXT pin in kOhm, the CS outputs
+ * source 840 / R_EXT mA at full global current.
+ */
+#define BACKLIGHT_REXT_KOHM 33
+
+/**
+ * SW lines scanned by the drivers, a LED is lit for one scan slot.
+ */
+#define BACKLIGHT_SCAN_LINES 12
+
+/**
+ * The average current of a driver is
+ * 840 / R_EXT * GCC / 256 * sum(PWM) / 256 / BACKLIGHT_SCAN_LINES,
+ * so the global current that meets the budget is
+ * BACKLIGHT_POWER_K / sum(PWM).
+ */
+#define BACKLIGHT_POWER_K						\
+  ((uint32_t)((uint64_t)BACKLIGHT_POWER_BUDGET_MA * 1000 * 65536 *	\
+	      BACKLIGHT_SCAN_LINES * BACKLIGHT_REXT_KOHM /		\
+	      (840000ULL * BACKLIGHT_DRIVERS)))
+
+/**
+ * Global current increase per step when the budget allows more
+ * current, and interval between steps in ms. The current is cut at
+ * once when a frame goes over the budget.
+ */
+#define BACKLIGHT_GCC_SLEW 16
+#define BACKLIGHT_GCC_STEP_MS 8
+
 /**
  * Magic value to write in BCR_WRITE_LOCK register
  * to enable the next write to the command register.
@@ -47,6 +118,47 @@ struct LedColor {
   uint8_t b;
 };
 
+/**
+ * White balance of each colour channel, the PWM of the channel is
+ * scaled by BACKLIGHT_WB_x / 255 on top of the gamma correction.
+ * Override from the build flags to calibrate a board.
+ */
+#ifndef BACKLIGHT_WB_R
+#define BACKLIGHT_WB_R 255
+#endif
+#ifndef BACKLIGHT_WB_G
+#define BACKLIGHT_WB_G 255
+#endif
+#ifndef BACKLIGHT_WB_B
+#define BACKLIGHT_WB_B 255
+#endif
+
+/**
+ * White balance profiles, one X(r, g, b) entry with the channel
+ * scales of each profile, the first one is the board default.
+ * Each profile has its own PWM lookup tables, 768 bytes of flash,
+ * so that LEDs with different calibrations cost no multiplication.
+ */
+#ifndef BACKLIGHT_WB_PROFILES
+#define BACKLIGHT_WB_PROFILES(X)					\
+	X(BACKLIGHT_WB_R, BACKLIGHT_WB_G, BACKLIGHT_WB_B)
+#endif
+
+/**
+ * White balance profile of each LED, an initializer indexed like
+ * the LED map. LEDs that are not listed use the first profile.
+ */
+#ifndef BACKLIGHT_LED_WB
+#define BACKLIGHT_LED_WB { 0 }
+#endif
+
+#define BACKLIGHT_WB_PROFILE_COUNT(r, g, b) + 1
+
+/**
+ * Number of white balance profiles.
+ */
+#define BACKLIGHT_WB_COUNT (0 BACKLIGHT_WB_PROFILES(BACKLIGHT_WB_PROFILE_COUNT))
+
 extern struct LedColor bright_white;
 extern struct LedColor white;
 extern struct LedColor red;
@@ -60,27 +172,138 @@ extern struct LedColor custom1;
 extern struct LedColor custom2;
 extern struct LedColor black;
 
-struct CommandRegisterState {
-  /** LED control register onoff section */
-  uint8_t c_onoff[0x48];
-  /** Pulse Width modulation register state */
-  uint8_t c_pwm[0xc0];
-  /** Auto Breadth Mode register state */
-  uint8_t c_abm[0xc0];
-  /** Function register state */
-  uint8_t c_func[0x12];
+/**
+ * LED map entry for LEDs that are not under a key of the scanned
+ * matrix.
+ */
+#define BACKLIGHT_NO_KEY 0xFF
+
+#define BACKLIGHT_LED_COUNT(chip, key, row, col, x, y) + 1
+#define BACKLIGHT_LED_ON_CHIP0(chip, key, row, col, x, y) + ((chip) == 0)
+#define BACKLIGHT_LED_ON_CHIP1(chip, key, row, col, x, y) + ((chip) == 1)
+#define BACKLIGHT_LED_ON_CHIP2(chip, key, row, col, x, y) + ((chip) == 2)
+#define BACKLIGHT_LED_ON_CHIP3(chip, key, row, col, x, y) + ((chip) == 3)
+#define BACKLIGHT_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/**
+ * Number of LEDs on the board.
+ */
+#define BACKLIGHT_LEDS (0 BACKLIGHT_LED_MAP(BACKLIGHT_LED_COUNT))
+
+/**
+ * Number of LEDs on the n-th driver.
+ */
+#define BACKLIGHT_CHIP_LEDS(n) (0 BACKLIGHT_LED_MAP(BACKLIGHT_LED_ON_CHIP##n))
+
+/**
+ * Size of the per-driver LED mirror, the most populated driver.
+ */
+#define BACKLIGHT_CHIP_LEDS_MAX						\
+  BACKLIGHT_MAX(BACKLIGHT_MAX(BACKLIGHT_CHIP_LEDS(0),			\
+			      BACKLIGHT_CHIP_LEDS(1)),			\
+		BACKLIGHT_MAX(BACKLIGHT_CHIP_LEDS(2),			\
+			      BACKLIGHT_CHIP_LEDS(3)))
+
+/* A driver has 12 SW lines of 16 CS columns, 64 RGB LEDs */
+_Static_assert(BACKLIGHT_CHIP_LEDS_MAX <= 64, "Too many LEDs on a driver");
+_Static_assert(BACKLIGHT_LEDS == BACKLIGHT_CHIP_LEDS(0) + BACKLIGHT_CHIP_LEDS(1) +
+	       BACKLIGHT_CHIP_LEDS(2) + BACKLIGHT_CHIP_LEDS(3),
+	       "LED map refers to a missing driver");
+_Static_assert((BACKLIGHT_CHIP_LEDS(1) == 0 || BACKLIGHT_DRIVERS > 1) &&
+	       (BACKLIGHT_CHIP_LEDS(2) == 0 || BACKLIGHT_DRIVERS > 2) &&
+	       (BACKLIGHT_CHIP_LEDS(3) == 0 || BACKLIGHT_DRIVERS > 3),
+	       "LED map refers to a missing driver");
+
+/**
+ * Size of the function register page.
+ */
+#define IS3733_FUNC_SIZE 0x12
+
+/**
+ * Size of the on/off section of the LED control page.
+ */
+#define IS3733_ONOFF_SIZE 0x18
+
+/**
+ * Shadow bytes that differ by at most this many clean bytes are
+ * flushed in the same burst, it is cheaper to rewrite them than
+ * to start another transaction.
+ */
+#define BACKLIGHT_FLUSH_GAP 2
+
+/**
+ * Progress of the asynchronous readbacks.
+ */
+enum IS3733_Check {
+  IS3733_CHECK_IDLE,
+  IS3733_CHECK_PENDING,
+  IS3733_CHECK_READY,
+  IS3733_CHECK_FAILED,
 };
 
 /**
  * Driver state of the is3733 chip.
+ * Only the LEDs of the chip in the LED map are mirrored, in map
+ * order. The PWM shadow holds one line per colour channel, in the
+ * order of the driver SW lines (blue, green, red), so that runs of
+ * neighbouring LEDs are contiguous both in the shadow and in the
+ * device register map.
  */
 struct IS3733_State {
-  /** I2C bus address of the device */
-  uint8_t bus_addr;
-  /** Command register state */
-  struct CommandRegisterState is_command;
+  /** I2C bus device, address and transport statistics */
+  struct twi_device is_dev;
+  /** Index of the first LED of the chip in the LED map */
+  uint8_t is_first;
+  /** Number of LEDs of the chip in the LED map */
+  uint8_t is_leds;
+  /** LED on/off registers, built from the LED map */
+  uint8_t is_onoff[IS3733_ONOFF_SIZE];
+  /** Function register state */
+  uint8_t is_func[IS3733_FUNC_SIZE];
+  /** Global current requested, the power governor may set less */
+  uint8_t is_brightness;
+  /** Low byte of the time of the last global current step, in ms */
+  uint8_t is_gcc_step;
+  /** Sum of the PWM shadow, updated as the bytes change */
+  uint16_t is_pwm_sum;
+  /**
+   * Decreases of the PWM shadow since the last flush, a partly
+   * written frame never draws more than is_pwm_sum + is_pwm_excess.
+   */
+  uint16_t is_pwm_excess;
+  /** The PWM shadow has changes not yet written to the device */
+  bool is_pwm_pending;
+  /** PWM shadow of each channel of the LEDs */
+  uint8_t is_pwm[3][BACKLIGHT_CHIP_LEDS_MAX];
+  /** PWM shadow bytes not yet written to the device, one bit per byte */
+  uint8_t pwm_dirty[3][(BACKLIGHT_CHIP_LEDS_MAX + 7) / 8];
+  /** ABM channel of the LEDs, 2 bits each */
+  uint8_t is_abm[(BACKLIGHT_CHIP_LEDS_MAX + 3) / 4];
+  /** ABM selections not yet written to the device, one bit per LED */
+  uint8_t abm_dirty[(BACKLIGHT_CHIP_LEDS_MAX + 7) / 8];
   /** Interrupt mask register */
   uint8_t is_intr_mask;
+  /** Interrupt status register, read back by backlight_check_status */
+  uint8_t is_intr_status;
+  /** SYNC role bits kept in every configuration register write */
+  uint8_t is_sync;
+  /** Open-short detection readback progress, see enum IS3733_Check */
+  volatile uint8_t is_check;
+  /** PWM page verification progress, see enum IS3733_Check */
+  volatile uint8_t is_verify;
+  /** Next PWM shadow byte to verify, channel * is_leds + LED */
+  uint8_t is_verify_next;
+  /** Verification reads queued and not completed yet */
+  volatile uint8_t is_verify_queued;
+  /** PWM bytes that differ from the mirror in the last verification */
+  volatile uint8_t is_verify_mismatch;
+};
+
+/**
+ * Backlight of the whole board, one driver state per chip.
+ */
+struct Backlight {
+  struct IS3733_State chip[BACKLIGHT_DRIVERS];
 };
 
 /**
@@ -99,6 +322,20 @@ enum BacklightConfigureRegister {
 	BCR_INTR_STATUS = 0xF1,
 };
 
+/**
+ * Bits of the BCR_INTR_MASK and BCR_INTR_STATUS registers.
+ */
+enum BacklightInterrupt {
+	/** Open detected */
+	BL_INTR_OPEN = 1,
+	/** Short detected */
+	BL_INTR_SHORT = (1 << 1),
+	/** Auto breath mode loops completed, mask register only */
+	BL_INTR_ABM = (1 << 2),
+	/** Clear the interrupt 8ms after it fires, mask register only */
+	BL_INTR_AUTO_CLEAR = (1 << 3),
+};
+
 /**
  * Data values for the BCR_COMMAND register configuration.
  * Each value selects a different page to which the following
@@ -178,31 +415,280 @@ enum ABMChannel {
 };
 
 /**
- * Initialize the backlight driver.
+ * Auto breath mode rise (T1) and fall (T3) times.
+ */
+enum ABMRamp {
+	ABM_RAMP_210MS = 0x0,
+	ABM_RAMP_420MS = 0x1,
+	ABM_RAMP_840MS = 0x2,
+	ABM_RAMP_1680MS = 0x3,
+	ABM_RAMP_3360MS = 0x4,
+	ABM_RAMP_6720MS = 0x5,
+	ABM_RAMP_13440MS = 0x6,
+	ABM_RAMP_26880MS = 0x7,
+};
+
+/**
+ * Auto breath mode hold on (T2) and hold off (T4) times.
  */
-void backlight_init(struct IS3733_State *state, uint8_t addr);
+enum ABMHold {
+	ABM_HOLD_0MS = 0x0,
+	ABM_HOLD_210MS = 0x1,
+	ABM_HOLD_420MS = 0x2,
+	ABM_HOLD_840MS = 0x3,
+	ABM_HOLD_1680MS = 0x4,
+	ABM_HOLD_3360MS = 0x5,
+	ABM_HOLD_6720MS = 0x6,
+	ABM_HOLD_13440MS = 0x7,
+	ABM_HOLD_26880MS = 0x8,
+};
+
+/**
+ * Auto breath mode loop begin phase.
+ */
+enum ABMLoopBegin {
+	ABM_LOOP_BEGIN_RISE = 0x0,
+	ABM_LOOP_BEGIN_HOLD_ON = 0x1,
+	ABM_LOOP_BEGIN_FALL = 0x2,
+	ABM_LOOP_BEGIN_HOLD_OFF = 0x3,
+};
+
+/**
+ * Auto breath mode state at the end of the loops.
+ */
+enum ABMLoopEnd {
+	ABM_LOOP_END_OFF = 0x0,
+	ABM_LOOP_END_ON = 0x1,
+};
+
+/**
+ * Number of loops for endless breathing.
+ */
+#define ABM_LOOPS_FOREVER 0
+
+/**
+ * Largest number of loops, the loop counter is 10 bits wide.
+ */
+#define ABM_LOOPS_MAX 0x3FF
+
+/**
+ * Breathing effect run by an auto breath mode channel.
+ * The peak brightness of each LED is its PWM value.
+ */
+struct ABMEffect {
+	/** Rise time, enum ABMRamp */
+	uint8_t rise;
+	/** Hold on time, enum ABMHold */
+	uint8_t hold_on;
+	/** Fall time, enum ABMRamp */
+	uint8_t fall;
+	/** Hold off time, enum ABMHold */
+	uint8_t hold_off;
+	/** First phase of each loop, enum ABMLoopBegin */
+	uint8_t loop_begin;
+	/** Final state, enum ABMLoopEnd */
+	uint8_t loop_end;
+	/** Number of loops, up to ABM_LOOPS_MAX, or ABM_LOOPS_FOREVER */
+	uint16_t loops;
+};
+
+/**
+ * PWM register of the blue channel of the LED at a key row and CS
+ * column of the driver, the green and red channels follow at
+ * BACKLIGHT_PWM_G and BACKLIGHT_PWM_R.
+ */
+#define BACKLIGHT_PWM_INDEX(row, col) ((row) * 0x30 + (col))
+#define BACKLIGHT_PWM_G 0x10
+#define BACKLIGHT_PWM_R 0x20
+
+/**
+ * Topology of a LED on the board, generated from the LED map.
+ */
+struct backlight_led {
+  /** Driver chip, index in struct Backlight */
+  uint8_t chip;
+  /** Matrix key index on top of the LED, or BACKLIGHT_NO_KEY */
+  uint8_t key;
+  /** PWM register of the blue channel, see BACKLIGHT_PWM_INDEX */
+  uint8_t pwm;
+  /** Horizontal position, the board spans 0-255 */
+  uint8_t x;
+  /** Vertical position, the board spans 0-255 */
+  uint8_t y;
+};
+
+extern const struct backlight_led backlight_leds[BACKLIGHT_LEDS] PROGMEM;
+
+/**
+ * Fetch an entry of the LED topology table.
+ */
+static inline void
+backlight_led_get(uint8_t idx, struct backlight_led *led)
+{
+  memcpy_P(led, &backlight_leds[idx], sizeof(*led));
+}
+
+/**
+ * Find the LED under a matrix key.
+ * \return The index in the LED topology table or BACKLIGHT_LEDS if
+ * the key has no LED.
+ */
+uint8_t backlight_key_led(uint8_t key);
+
+/**
+ * Initialize the state of the n-th backlight driver, at bus address
+ * I2C_BACKLIGHT_BUSADDR_N(chip), with its LEDs from the LED map.
+ * The sync argument is the SYNC role of the chip,
+ * LED_FN_CONF_SYNC_MASTER, LED_FN_CONF_SYNC_SLAVE or 0.
+ */
+void backlight_init(struct IS3733_State *state, uint8_t chip, uint8_t sync);
 
 void backlight_reset(struct IS3733_State *state);
 void backlight_disable(struct IS3733_State *state);
 
-/* Rows and columns here are 0-based */
+/**
+ * Read back the PWM page and compare it with the mirror to detect
+ * bus corruption. Pending changes are flushed first, the result
+ * is reported by backlight_poll.
+ */
+int backlight_verify(struct IS3733_State *state);
+
+/**
+ * Complete the asynchronous backlight operations, from the main loop.
+ */
+void backlight_poll(struct IS3733_State *state);
+
+/**
+ * Dump the I2C transport statistics.
+ */
+void backlight_stats(struct IS3733_State *state);
+
+/**
+ * Write the pending PWM and ABM shadow changes to the device.
+ */
+int backlight_flush(struct IS3733_State *state);
+
+/**
+ * Convert a hue, saturation, value colour to RGB.
+ * The hue wheel spans 0-255, red is at 0.
+ */
+struct LedColor backlight_hsv(uint8_t hue, uint8_t sat, uint8_t val);
+
+/*
+ * Rows and columns here are 0-based.
+ * backlight_set only updates the PWM shadow, changes are sent
+ * to the device by backlight_flush.
+ * Colours are linear, the gamma correction and white balance are
+ * applied on the way to the shadow.
+ */
 int backlight_set(struct IS3733_State *state, uint16_t row, uint16_t col, struct LedColor lc);
-int backlight_set_all(struct IS3733_State *state, int half, struct LedColor lc);
+
+/**
+ * Auto breath mode.
+ * Select the channel driving a LED, like backlight_set this only
+ * updates the shadow until the next backlight_flush.
+ */
 int backlight_abm_set(struct IS3733_State *state, uint16_t row, uint16_t col, enum ABMChannel abm);
+
+/**
+ * Program the effect of an auto breath mode channel.
+ * \return ERR_BACKLIGHT for the PWM channel or more than
+ * ABM_LOOPS_MAX loops.
+ */
+int backlight_abm_config(struct IS3733_State *state, enum ABMChannel abm,
+			 const struct ABMEffect *effect);
+
+/**
+ * Flush the pending changes and start the auto breath mode channels.
+ */
+int backlight_abm_start(struct IS3733_State *state);
+
+/**
+ * Stop all auto breath mode channels, the LEDs keep the PWM value.
+ */
+int backlight_abm_stop(struct IS3733_State *state);
 int backlight_off(struct IS3733_State *state, uint16_t row, uint16_t col);
+
+/**
+ * Set the global current, as a ceiling for the power governor.
+ * The governor keeps the current within BACKLIGHT_POWER_BUDGET_MA
+ * for the frame being flushed, using the running sum of the PWM
+ * shadow. The current is cut before a brighter frame is written and
+ * raised back in steps by backlight_poll.
+ */
 int backlight_brightness(struct IS3733_State *state, uint8_t value);
 
+/**
+ * Faults of a LED found by the open-short detection, one bit per
+ * colour channel.
+ */
+enum BacklightFault {
+	BL_FAULT_OPEN_B = 1,
+	BL_FAULT_OPEN_G = (1 << 1),
+	BL_FAULT_OPEN_R = (1 << 2),
+	BL_FAULT_SHORT_B = (1 << 3),
+	BL_FAULT_SHORT_G = (1 << 4),
+	BL_FAULT_SHORT_R = (1 << 5),
+};
+
 /**
  * Check backlight Led open and short.
+ * The detection cycle is started by backlight_check_trigger, which
+ * drops the global current to the test level. The interrupt status
+ * flags a fault as soon as one is found, backlight_check_status
+ * reads it back. backlight_check reads back the open and short
+ * registers in a buffer shared by the drivers, it is decoded by
+ * backlight_check_faults, by LED index within the chip, and
+ * released by backlight_check_restore,
+ * which also restores the global current.
+ * The reads complete asynchronously, the progress is in is_check.
  */
 int backlight_check_trigger(struct IS3733_State *state);
+int backlight_check_status(struct IS3733_State *state);
 int backlight_check(struct IS3733_State *state);
+uint8_t backlight_check_faults(const struct IS3733_State *state, uint8_t idx);
+int backlight_check_restore(struct IS3733_State *state);
+
+/**
+ * Board operations, applied to every driver on the bus.
+ * Enable the drivers and assign the bus addresses and SYNC roles.
+ */
+void backlight_board_init(struct Backlight *bl);
+void backlight_board_reset(struct Backlight *bl);
+void backlight_board_poll(struct Backlight *bl);
+void backlight_board_stats(struct Backlight *bl);
+int backlight_board_brightness(struct Backlight *bl, uint8_t value);
+int backlight_board_verify(struct Backlight *bl);
+
+/**
+ * Write the pending changes of all drivers. The bursts of the chips
+ * are interleaved on the bus, so that all the chips pick up the
+ * frame at about the same time even when the transaction queue
+ * can not hold the whole frame.
+ */
+int backlight_board_flush(struct Backlight *bl);
+
+/*
+ * LEDs by index in the LED position table, the changes are sent
+ * by backlight_board_flush.
+ */
+int backlight_led_set(struct Backlight *bl, uint8_t led, struct LedColor lc);
+int backlight_led_abm_set(struct Backlight *bl, uint8_t led,
+			  enum ABMChannel abm);
+
+/**
+ * Auto breath mode on all drivers, the channels of the SYNC slaves
+ * follow the master clock.
+ */
+int backlight_board_abm_config(struct Backlight *bl, enum ABMChannel abm,
+			       const struct ABMEffect *effect);
+int backlight_board_abm_start(struct Backlight *bl);
+int backlight_board_abm_stop(struct Backlight *bl);
 
 /**
  * Top level operations
  */
-int backlight_set_pattern(struct IS3733_State *state);
-int backlight_set_animation(struct IS3733_State *state);
+int backlight_set_pattern(struct Backlight *bl);
 
 
 #endif /* _BACKLIGHT_H_ */
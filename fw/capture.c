@@ -0,0 +1,230 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#define TRACE_FILE TRACE_FILE_CAPTURE
+
+#include <stdbool.h>
+
+#include <avr/cpufunc.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "capture.h"
+#include "error.h"
+#include "keyboard_tester.h"
+#include "matrix.h"
+#include "time.h"
+
+#define CAPTURE_RECORDS_MASK (CAPTURE_RECORDS - 1)
+
+/**
+ * TIMER 0 compare value for the sampling rate with clk/8 prescaler
+ */
+#define CAPTURE_TIMER0_TOP (CLOCK_HZ / 8 / CAPTURE_SAMPLE_HZ - 1)
+
+_Static_assert(CAPTURE_TIMER0_TOP <= 0xff, "Capture sample rate too low");
+
+/**
+ * A row state transition.
+ */
+struct captureRecord {
+	/** Samples elapsed since the previous record */
+	uint16_t elapsed;
+	/** Row state after the transition */
+	uint8_t rows;
+};
+
+/*
+ * Volatile, like the indexes, so that the compiler keeps the record
+ * stores before the head update and the loads after the head check.
+ */
+static volatile struct captureRecord records[CAPTURE_RECORDS];
+/* Free running indexes, only the sampler writes head */
+static volatile uint8_t head;
+/* Free running indexes, only the frame builder writes tail */
+static volatile uint8_t tail;
+
+static volatile bool active;
+static uint8_t captureColumn;
+static uint8_t captureMask;
+/* Row state of the last record */
+static uint8_t lastRows;
+/* Row state of the last sample */
+static uint8_t sampleRows;
+static uint16_t elapsed;
+static volatile uint16_t dropped;
+
+/* Frames to emit around the data */
+static bool startPending;
+static bool stopPending;
+
+ISR(TIMER0_COMPA_vect)
+{
+	uint8_t rows = matrixReadRows() & captureMask;
+	uint8_t previous = sampleRows;
+	uint8_t h;
+
+	sampleRows = rows;
+	if (elapsed != UINT16_MAX)
+		elapsed++;
+	if (rows == lastRows && elapsed != UINT16_MAX) {
+		/* Back to the recorded state after a dropped transition */
+		if (rows != previous)
+			dropped++;
+		return;
+	}
+
+	h = head;
+	if ((uint8_t)(h - tail) == CAPTURE_RECORDS) {
+		/*
+		 * Count each missed transition once, the interval since
+		 * the last record keeps accumulating so that the next
+		 * record is still timed from a state the host has seen.
+		 */
+		if (rows != previous)
+			dropped++;
+		return;
+	}
+	records[h & CAPTURE_RECORDS_MASK].elapsed = elapsed;
+	records[h & CAPTURE_RECORDS_MASK].rows = rows;
+	head = h + 1;
+	lastRows = rows;
+	elapsed = 0;
+}
+
+int
+captureStart(uint8_t col, uint8_t row_mask)
+{
+	if (col >= KEYBOARD_COLUMNS || active)
+		return ERR_CAPTURE;
+	/* The host must see the end of the last capture first */
+	if (stopPending || head != tail)
+		return ERR_CAPTURE;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		/* From now on the matrix scan is suspended */
+		active = true;
+		captureColumn = col;
+		captureMask = row_mask;
+		head = 0;
+		tail = 0;
+		dropped = 0;
+		elapsed = 0;
+
+		matrixSelectColumn(col);
+		// latch delay for column signal propagation to row pins.
+		_NOP();
+		lastRows = matrixReadRows() & captureMask;
+		sampleRows = lastRows;
+		startPending = true;
+		stopPending = false;
+
+		/* enable clock to timer 0 */
+		PRR0 &= ~(1 << PRTIM0);
+		TCCR0A = (1 << WGM01); // CTC mode
+		TCCR0B = 0;
+		TCNT0 = 0;
+		OCR0A = CAPTURE_TIMER0_TOP;
+		TIFR0 = (1 << OCF0A); // clear pending compare match
+		TIMSK0 = (1 << OCIE0A); // unmask OC0A interrupt
+		/* Start the timer, clk/8 prescaler */
+		TCCR0B = (1 << CS01);
+	}
+
+	DEBUG("Capture column %hhu rows %hhx\r\n", col, row_mask);
+	return ERR_OK;
+}
+
+void
+captureStop()
+{
+	if (!active)
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TIMSK0 = 0;
+		TCCR0B = 0;
+		matrixClearColumns();
+		stopPending = true;
+		active = false;
+	}
+	PRR0 |= (1 << PRTIM0);
+}
+
+bool
+captureActive()
+{
+	return active;
+}
+
+uint8_t
+captureFetchFrame(uint8_t *buf, uint8_t size)
+{
+	uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+	uint8_t len = 0;
+	uint8_t t = tail;
+	uint16_t count;
+
+	if (size < CAPTURE_HEADER_SIZE + 5)
+		return 0;
+
+	buf[0] = CAPTURE_SYNC0;
+	buf[1] = CAPTURE_SYNC1;
+	if (startPending) {
+		buf[2] = CAPTURE_FRAME_START;
+		payload[len++] = CAPTURE_SAMPLE_HZ & 0xff;
+		payload[len++] = CAPTURE_SAMPLE_HZ >> 8;
+		payload[len++] = captureColumn;
+		payload[len++] = captureMask;
+		payload[len++] = lastRows;
+		startPending = false;
+	}
+	else if (t != head) {
+		buf[2] = CAPTURE_FRAME_DATA;
+		while (t != head &&
+		       CAPTURE_HEADER_SIZE + len + CAPTURE_RECORD_SIZE <= size) {
+			volatile struct captureRecord *rec =
+				&records[t & CAPTURE_RECORDS_MASK];
+			payload[len++] = rec->elapsed & 0xff;
+			payload[len++] = rec->elapsed >> 8;
+			payload[len++] = rec->rows;
+			t++;
+		}
+		tail = t;
+	}
+	else if (stopPending) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			count = dropped;
+		}
+		buf[2] = CAPTURE_FRAME_STOP;
+		payload[len++] = count & 0xff;
+		payload[len++] = count >> 8;
+		stopPending = false;
+	}
+	else {
+		return 0;
+	}
+	buf[3] = len;
+
+	return CAPTURE_HEADER_SIZE + len;
+}
@@ -0,0 +1,108 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Switch bounce capture.
+ * While capturing, the matrix scan is suspended and one column is kept
+ * selected while TIMER 0 samples its rows at CAPTURE_SAMPLE_HZ.
+ * Only transitions are recorded, as the number of samples elapsed since
+ * the previous transition and the new row state, these are streamed to
+ * the host in binary frames:
+ *
+ * | 0xA5 | 0x5A | type | payload length | payload |
+ *
+ * CAPTURE_FRAME_START payload: sample rate in Hz (u16), column (u8),
+ * row mask (u8), initial row state (u8).
+ * CAPTURE_FRAME_DATA payload: records of samples elapsed (u16) and
+ * new row state (u8). The elapsed count saturates at 0xFFFF, in which
+ * case the record may repeat the previous row state. Transitions that
+ * find the buffer full are dropped, the next record still counts the
+ * samples since the previous one, so the time base is kept.
+ * CAPTURE_FRAME_STOP payload: number of transitions dropped (u16).
+ * Multi-byte values are little endian.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Sampling rate of the captured column.
+ */
+#define CAPTURE_SAMPLE_HZ 20000
+
+/**
+ * Number of transition records buffered, must be a power of 2.
+ */
+#define CAPTURE_RECORDS 64
+
+/**
+ * Frame synchronization bytes.
+ */
+#define CAPTURE_SYNC0 0xA5
+#define CAPTURE_SYNC1 0x5A
+
+/**
+ * Size of the frame header.
+ */
+#define CAPTURE_HEADER_SIZE 4
+
+/**
+ * Size of a transition record in a data frame.
+ */
+#define CAPTURE_RECORD_SIZE 3
+
+enum CaptureFrameType {
+	CAPTURE_FRAME_START = 0x01,
+	CAPTURE_FRAME_DATA = 0x02,
+	CAPTURE_FRAME_STOP = 0x03,
+};
+
+/**
+ * Start sampling the rows in row_mask of the given column.
+ *
+ * \return ERR_CAPTURE for an invalid column, while a capture is
+ * running or while the frames of the last one are still pending.
+ */
+int captureStart(uint8_t col, uint8_t row_mask);
+
+/**
+ * Stop sampling, pending records are still streamed.
+ */
+void captureStop(void);
+
+/**
+ * Check whether the sampler owns the matrix.
+ */
+bool captureActive(void);
+
+/**
+ * Fill buf with the next frame to stream to the host.
+ *
+ * \return The frame size, 0 if there is nothing to send.
+ */
+uint8_t captureFetchFrame(uint8_t *buf, uint8_t size);
+
+#endif /* _CAPTURE_H_ */
@@ -0,0 +1,184 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#define TRACE_FILE TRACE_FILE_DEBOUNCE
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "debounce.h"
+#include "keyboard_tester.h"
+#include "matrix.h"
+
+/**
+ * Default debounce window expressed in scans.
+ */
+#define DEBOUNCE_DEFAULT_WINDOW						\
+	((DEBOUNCE_WINDOW_MS / KEYBOARD_SCAN_INTERVAL_MS) > DEBOUNCE_WINDOW_MAX ? \
+	 DEBOUNCE_WINDOW_MAX : (DEBOUNCE_WINDOW_MS / KEYBOARD_SCAN_INTERVAL_MS))
+
+/**
+ * Number of bit-slices in the vertical counters and windows.
+ */
+#define DEBOUNCE_SLICES 3
+
+/**
+ * Debounce state of a column.
+ * Bit N of each field refers to row N.
+ */
+struct debounceState {
+	/** Debounced state */
+	uint8_t state;
+	/** Scans since the raw state started to differ from the debounced one */
+	uint8_t count[DEBOUNCE_SLICES];
+};
+
+/**
+ * Bit-sliced debounce windows of a column.
+ * Bit N of slice I is bit I of the window of row N.
+ */
+struct debounceWindow {
+	/** Window applied to released keys */
+	uint8_t press[DEBOUNCE_SLICES];
+	/** Window applied to pressed keys */
+	uint8_t release[DEBOUNCE_SLICES];
+};
+
+static struct debounceState debounceState[KEYBOARD_COLUMNS];
+/** Windows in use by the current mode */
+static struct debounceWindow activeWindow[KEYBOARD_COLUMNS];
+/** Windows configured for the DEBOUNCE_PER_KEY mode */
+static struct debounceWindow keyWindow[KEYBOARD_COLUMNS];
+/** Mode selected by debounceSetMode() */
+static enum DebounceMode activeMode;
+
+/**
+ * Set the window of the keys selected by mask in a bit-sliced window.
+ */
+static void
+debounceSliceWindow(uint8_t *slices, uint8_t mask, uint8_t window)
+{
+	for (uint8_t i = 0; i < DEBOUNCE_SLICES; i++) {
+		if (window & (1 << i))
+			slices[i] |= mask;
+		else
+			slices[i] &= ~mask;
+	}
+}
+
+void
+debounceReset()
+{
+	memset(debounceState, 0, sizeof(debounceState));
+	for (uint8_t col = 0; col < KEYBOARD_COLUMNS; col++) {
+		debounceSliceWindow(keyWindow[col].press, 0xff,
+				    DEBOUNCE_DEFAULT_WINDOW);
+		debounceSliceWindow(keyWindow[col].release, 0xff,
+				    DEBOUNCE_DEFAULT_WINDOW);
+	}
+	debounceSetMode(DEBOUNCE_DEFAULT_MODE);
+}
+
+void
+debounceSetMode(enum DebounceMode mode)
+{
+	for (uint8_t col = 0; col < KEYBOARD_COLUMNS; col++) {
+		memset(debounceState[col].count, 0,
+		       sizeof(debounceState[col].count));
+		switch (mode) {
+		case DEBOUNCE_EAGER:
+			debounceSliceWindow(activeWindow[col].press, 0xff, 0);
+			debounceSliceWindow(activeWindow[col].release, 0xff,
+					    DEBOUNCE_DEFAULT_WINDOW);
+			break;
+		case DEBOUNCE_DEFERRED:
+			debounceSliceWindow(activeWindow[col].press, 0xff,
+					    DEBOUNCE_DEFAULT_WINDOW);
+			debounceSliceWindow(activeWindow[col].release, 0xff,
+					    DEBOUNCE_DEFAULT_WINDOW);
+			break;
+		case DEBOUNCE_PER_KEY:
+			activeWindow[col] = keyWindow[col];
+			break;
+		default:
+			DEBUG("Error: invalid debounce mode %d\r\n", mode);
+			return;
+		}
+	}
+	activeMode = mode;
+}
+
+void
+debounceSetWindow(uint8_t row, uint8_t col, uint8_t press, uint8_t release)
+{
+	if (row >= KEYBOARD_ROWS || col >= KEYBOARD_COLUMNS)
+		return;
+	if (press > DEBOUNCE_WINDOW_MAX)
+		press = DEBOUNCE_WINDOW_MAX;
+	if (release > DEBOUNCE_WINDOW_MAX)
+		release = DEBOUNCE_WINDOW_MAX;
+
+	debounceSliceWindow(keyWindow[col].press, (1 << row), press);
+	debounceSliceWindow(keyWindow[col].release, (1 << row), release);
+	if (activeMode == DEBOUNCE_PER_KEY)
+		activeWindow[col] = keyWindow[col];
+}
+
+uint8_t
+debounceColumn(uint8_t col, uint8_t raw)
+{
+	struct debounceState *ds = &debounceState[col];
+	struct debounceWindow *dw = &activeWindow[col];
+	uint8_t diff = raw ^ ds->state;
+	uint8_t w0, w1, w2, expired, carry;
+
+	/* Nothing changed and no debounce in progress */
+	if ((diff | ds->count[0] | ds->count[1] | ds->count[2]) == 0)
+		return ds->state;
+
+	/* Pick the press window for released keys and vice versa */
+	w0 = (dw->press[0] & ~ds->state) | (dw->release[0] & ds->state);
+	w1 = (dw->press[1] & ~ds->state) | (dw->release[1] & ds->state);
+	w2 = (dw->press[2] & ~ds->state) | (dw->release[2] & ds->state);
+
+	/* Keys that differed for long enough switch state */
+	expired = diff & ~((ds->count[0] ^ w0) | (ds->count[1] ^ w1) |
+			   (ds->count[2] ^ w2));
+	ds->state ^= expired;
+
+	/*
+	 * Increment the counters of keys that are still bouncing,
+	 * clear the others.
+	 */
+	diff &= ~expired;
+	carry = diff;
+	ds->count[0] ^= carry;
+	carry &= ~ds->count[0];
+	ds->count[1] ^= carry;
+	carry &= ~ds->count[1];
+	ds->count[2] ^= carry;
+	ds->count[0] &= diff;
+	ds->count[1] &= diff;
+	ds->count[2] &= diff;
+
+	return ds->state;
+}
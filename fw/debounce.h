@@ -0,0 +1,91 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Keyboard matrix debounce.
+ * Each column is debounced as a whole: the state of the rows is kept
+ * in a packed row word and every key has a 3-bit vertical counter,
+ * stored as three bit-slices, so that all the keys in a column are
+ * debounced with a handful of bitwise operations.
+ */
+
+#ifndef _DEBOUNCE_H_
+#define _DEBOUNCE_H_
+
+#include <stdint.h>
+
+/**
+ * Debounce window in ms used by the non per-key modes.
+ */
+#define DEBOUNCE_WINDOW_MS 5
+
+/**
+ * Maximum debounce window, in scans, that fits the vertical counters.
+ */
+#define DEBOUNCE_WINDOW_MAX 7
+
+/**
+ * Debounce mode selected at reset.
+ */
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_EAGER
+
+/**
+ * Debounce algorithms.
+ * A key changes state once it has been sampled in the new state
+ * for (window + 1) consecutive scans, the window for each key
+ * depends on the mode and on the current state of the key.
+ */
+enum DebounceMode {
+	/** Report presses on the first sample, defer releases */
+	DEBOUNCE_EAGER = 0,
+	/** Defer both presses and releases */
+	DEBOUNCE_DEFERRED = 1,
+	/** Use the windows configured with debounceSetWindow() */
+	DEBOUNCE_PER_KEY = 2,
+};
+
+/**
+ * Reset the debounce state of all keys and select the default mode.
+ */
+void debounceReset(void);
+
+/**
+ * Select the debounce algorithm.
+ * This resets any debounce in progress.
+ */
+void debounceSetMode(enum DebounceMode mode);
+
+/**
+ * Configure the press and release windows, in scans, of a key for
+ * the DEBOUNCE_PER_KEY mode, immediately if the mode is selected.
+ */
+void debounceSetWindow(uint8_t row, uint8_t col, uint8_t press,
+		       uint8_t release);
+
+/**
+ * Feed a raw packed row word sampled from the given column and
+ * return the debounced row word.
+ */
+uint8_t debounceColumn(uint8_t col, uint8_t raw);
+
+#endif /* _DEBOUNCE_H_ */
@@ -28,6 +28,10 @@
 
 #include <avr/pgmspace.h>
 #include "descriptors.h"
+#include "keyboard_tester.h"
+
+_Static_assert(USB_DPRAM_USED <= USB_DPRAM_SIZE,
+	       "Endpoints do not fit in the USB DPRAM");
 
 /* Manufacturer string descriptor, unicode string */
 const USB_Descriptor_String_t PROGMEM ManufacturerString =
@@ -64,10 +68,44 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 	.NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
 };
 
+/**
+ * N-key rollover keyboard report, used when the host selects the
+ * report protocol. Hosts using the boot protocol ignore this and
+ * expect the standard boot keyboard report.
+ * The modifier byte is followed by one bit for each key in the matrix,
+ * see USB_NKROReport_Data_t.
+ */
 const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
 {
-	// USB class driver standard Keyboard report, with 6 max simultaneous key presses
-	HID_DESCRIPTOR_KEYBOARD(6)
+	HID_RI_USAGE_PAGE(8, 0x01), // Generic Desktop
+	HID_RI_USAGE(8, 0x06), // Keyboard
+	HID_RI_COLLECTION(8, 0x01), // Application
+		// Modifier keys
+		HID_RI_USAGE_PAGE(8, 0x07), // Key Codes
+		HID_RI_USAGE_MINIMUM(8, 0xE0), // Keyboard Left Control
+		HID_RI_USAGE_MAXIMUM(8, 0xE7), // Keyboard Right GUI
+		HID_RI_LOGICAL_MINIMUM(8, 0x00),
+		HID_RI_LOGICAL_MAXIMUM(8, 0x01),
+		HID_RI_REPORT_SIZE(8, 0x01),
+		HID_RI_REPORT_COUNT(8, 0x08),
+		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+		// Keyboard LEDs
+		HID_RI_USAGE_PAGE(8, 0x08), // LEDs
+		HID_RI_USAGE_MINIMUM(8, 0x01), // Num Lock
+		HID_RI_USAGE_MAXIMUM(8, 0x05), // Kana
+		HID_RI_REPORT_COUNT(8, 0x05),
+		HID_RI_OUTPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
+		HID_RI_REPORT_COUNT(8, 0x01),
+		HID_RI_REPORT_SIZE(8, 0x03),
+		HID_RI_OUTPUT(8, HID_IOF_CONSTANT),
+		// Key bitmap
+		HID_RI_USAGE_PAGE(8, 0x07), // Key Codes
+		HID_RI_USAGE_MINIMUM(8, KEYBOARD_USAGE_BASE),
+		HID_RI_USAGE_MAXIMUM(8, KEYBOARD_USAGE_BASE + KEYBOARD_NKRO_BITS - 1),
+		HID_RI_REPORT_SIZE(8, 0x01),
+		HID_RI_REPORT_COUNT(8, KEYBOARD_NKRO_BITS),
+		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+	HID_RI_END_COLLECTION(0),
 };
 
 /**
@@ -173,7 +211,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigDescriptor =
 			ENDPOINT_ATTR_NO_SYNC | // endpoint not synchronized
 			ENDPOINT_USAGE_DATA), // used for data transfers
 		.EndpointSize = HID_REPORT_EPSIZE, // Endpoint bank size, maximum size of data packet that can be received
-		.PollingIntervalMS = 0x05 // polling interval for INTERRUPT/ISOSYNCHRONOUS endpoints
+		.PollingIntervalMS = KEYBOARD_SCAN_INTERVAL_MS // polling interval for INTERRUPT/ISOSYNCHRONOUS endpoints
 	}
 };
 
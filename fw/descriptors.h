@@ -30,6 +30,8 @@
 
 #include <LUFA/Drivers/USB/USB.h>
 
+#include "matrix.h"
+
 /** Endpoint address of the CDC device-to-host notification IN endpoint. */
 #define CDC_NOTIFICATION_EPADDR        (ENDPOINT_DIR_IN | 2)
 
@@ -42,14 +44,42 @@
 /** Endpoint address of the HID Report input endpoint */
 #define HID_REPORT_IN_EPADDR           (ENDPOINT_DIR_IN | 5)
 
-/** Size in bytes of the HID Report IN endpoint */
-#define HID_REPORT_EPSIZE              8
+/**
+ * Size in bytes of the HID Report IN endpoint.
+ * This must fit both the boot protocol and the NKRO reports.
+ */
+#define HID_REPORT_EPSIZE              ((1 + sizeof(KeystateBitset)) <= 8 ? 8 : \
+					(1 + sizeof(KeystateBitset)) <= 16 ? 16 : \
+					(1 + sizeof(KeystateBitset)) <= 32 ? 32 : 64)
 
 /** Size in bytes of the CDC device-to-host notification IN endpoint. */
 #define CDC_NOTIFICATION_EPSIZE        8
 
 /** Size in bytes of the CDC data IN and OUT endpoints. */
-#define CDC_TXRX_EPSIZE                16
+#define CDC_TXRX_EPSIZE                64
+
+/**
+ * Number of banks of the CDC data endpoints, the device fills one
+ * bank while the host reads the other.
+ */
+#define CDC_TXRX_BANKS                 2
+
+/** Number of banks of the HID Report IN endpoint. */
+#define HID_REPORT_BANKS               2
+
+/**
+ * Endpoint DPRAM used by the configuration, the atmega32u4 has
+ * USB_DPRAM_SIZE bytes shared by all the endpoints:
+ * control 64, notification 8, CDC data IN and OUT 2 x 64 each,
+ * HID report 2 x 8..64, at most 456 bytes.
+ */
+#define USB_DPRAM_USED (FIXED_CONTROL_ENDPOINT_SIZE +			\
+			CDC_NOTIFICATION_EPSIZE +			\
+			CDC_TXRX_EPSIZE * CDC_TXRX_BANKS * 2 +		\
+			HID_REPORT_EPSIZE * HID_REPORT_BANKS)
+
+/** Endpoint DPRAM size of the atmega32u4. */
+#define USB_DPRAM_SIZE                 832
 
 /** Device configuration descriptor structure.
  * This specifies the device configuration descriptor structure that is returned
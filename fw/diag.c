@@ -0,0 +1,272 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#define TRACE_FILE TRACE_FILE_DIAG
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backlight.h"
+#include "capture.h"
+#include "diag.h"
+#include "error.h"
+#include "keyboard_tester.h"
+#include "sched.h"
+#include "twi.h"
+
+enum diag_state {
+  DIAG_IDLE,
+  /** Start the detection cycle of the current driver */
+  DIAG_TRIGGER,
+  /** Poll the interrupt status until a fault or the timeout */
+  DIAG_STATUS,
+  /** Read back the open and short registers */
+  DIAG_READ,
+  /** Decode the registers in fault records */
+  DIAG_DECODE,
+  /** Restore the global current of the driver */
+  DIAG_RESTORE,
+};
+
+/**
+ * Transactions queued by backlight_check_trigger.
+ */
+#define DIAG_TRIGGER_TXNS 4
+
+/**
+ * Transactions queued by backlight_check_restore.
+ */
+#define DIAG_RESTORE_TXNS 2
+
+static void diag_tick(void *arg);
+
+static struct Backlight *board;
+static struct sched_timer tick = SCHED_TIMER_INIT(diag_tick, NULL);
+static uint8_t state = DIAG_IDLE;
+static uint8_t chip;
+/** ms spent in the detection cycle of the current driver */
+static uint8_t detect_ms;
+/** Seconds to the next periodic check */
+static uint16_t wait_s;
+static uint16_t period_s;
+static uint32_t started;
+
+/* Result of the last board check */
+static uint16_t duration;
+static uint8_t tested;
+static uint8_t faulty;
+static uint8_t flags;
+static uint8_t records[DIAG_FAULTS_MAX][DIAG_RECORD_SIZE];
+static bool report_pending;
+
+static void
+diag_record(uint8_t idx, uint8_t faults)
+{
+  struct backlight_led led;
+
+  if (faulty >= DIAG_FAULTS_MAX) {
+    flags |= DIAG_REPORT_TRUNCATED;
+    return;
+  }
+  backlight_led_get(idx, &led);
+  records[faulty][0] = idx;
+  records[faulty][1] = led.key;
+  records[faulty][2] = faults;
+  faulty++;
+}
+
+static void
+diag_decode(struct IS3733_State *cs)
+{
+  uint8_t idx, faults;
+
+  for (idx = 0; idx < cs->is_leds; idx++) {
+    faults = backlight_check_faults(cs, idx);
+    if (faults) {
+      DEBUG("[%s] LED %hhu faults %hhx\r\n", __func__, cs->is_first + idx,
+	    faults);
+      diag_record(cs->is_first + idx, faults);
+    }
+  }
+  tested += cs->is_leds;
+}
+
+static void
+diag_done(void)
+{
+  duration = sched_now() - started;
+  report_pending = true;
+  state = DIAG_IDLE;
+
+  DEBUG("[%s] %hhu LEDs %hhu faulty in %ums\r\n", __func__, tested, faulty,
+	duration);
+
+  if (period_s) {
+    wait_s = period_s;
+    sched_add(&tick, 1000, 1000);
+  } else {
+    sched_cancel(&tick);
+  }
+}
+
+static void
+diag_begin(void)
+{
+  chip = 0;
+  tested = 0;
+  faulty = 0;
+  flags = 0;
+  started = sched_now();
+  state = DIAG_TRIGGER;
+  sched_add(&tick, 1, 1);
+}
+
+/**
+ * Advance the check, every ms while a check is in progress and
+ * every second while waiting for the next periodic check.
+ */
+static void
+diag_tick(void *arg)
+{
+  struct IS3733_State *cs = &board->chip[chip];
+  int rc;
+
+  switch (state) {
+  case DIAG_IDLE:
+    if (--wait_s == 0)
+      diag_begin();
+    break;
+  case DIAG_TRIGGER:
+    /* Do not leave the driver half configured if the queue fills */
+    if (twi_queue_free() < DIAG_TRIGGER_TXNS)
+      break;
+    rc = backlight_check_trigger(cs);
+    if (rc != ERR_OK) {
+      flags |= DIAG_REPORT_BUS_ERROR;
+      state = DIAG_RESTORE;
+      break;
+    }
+    detect_ms = 0;
+    state = DIAG_STATUS;
+    break;
+  case DIAG_STATUS:
+    if (cs->is_check == IS3733_CHECK_PENDING)
+      break;
+    if ((cs->is_check == IS3733_CHECK_READY &&
+	 (cs->is_intr_status & (BL_INTR_OPEN | BL_INTR_SHORT))) ||
+	++detect_ms >= DIAG_DETECT_MS) {
+      state = DIAG_READ;
+      break;
+    }
+    backlight_check_status(cs);
+    break;
+  case DIAG_READ:
+    rc = backlight_check(cs);
+    if (rc == ERR_BUSY)
+      break;
+    if (rc != ERR_OK) {
+      flags |= DIAG_REPORT_BUS_ERROR;
+      state = DIAG_RESTORE;
+      break;
+    }
+    state = DIAG_DECODE;
+    break;
+  case DIAG_DECODE:
+    if (cs->is_check == IS3733_CHECK_PENDING)
+      break;
+    if (cs->is_check == IS3733_CHECK_READY)
+      diag_decode(cs);
+    else
+      flags |= DIAG_REPORT_BUS_ERROR;
+    state = DIAG_RESTORE;
+    break;
+  case DIAG_RESTORE:
+    if (twi_queue_free() < DIAG_RESTORE_TXNS)
+      break;
+    backlight_check_restore(cs);
+    if (++chip < BACKLIGHT_DRIVERS)
+      state = DIAG_TRIGGER;
+    else
+      diag_done();
+    break;
+  }
+}
+
+void
+diag_init(struct Backlight *bl)
+{
+  board = bl;
+}
+
+void
+diag_start(uint16_t period)
+{
+  period_s = period;
+  /* Do not leave a driver in the middle of its detection cycle */
+  if (state != DIAG_IDLE && state != DIAG_TRIGGER)
+    return;
+  diag_begin();
+}
+
+void
+diag_stop(void)
+{
+  period_s = 0;
+  if (state == DIAG_IDLE)
+    sched_cancel(&tick);
+}
+
+bool
+diag_busy(void)
+{
+  return state != DIAG_IDLE;
+}
+
+uint8_t
+diag_fetch_report(uint8_t *buf, uint8_t size)
+{
+  uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint8_t len = 0;
+  uint8_t i;
+
+  if (!report_pending || size < CAPTURE_HEADER_SIZE +
+      DIAG_REPORT_HEADER_SIZE + faulty * DIAG_RECORD_SIZE)
+    return 0;
+
+  buf[0] = CAPTURE_SYNC0;
+  buf[1] = CAPTURE_SYNC1;
+  buf[2] = DIAG_FRAME_REPORT;
+  payload[len++] = duration & 0xff;
+  payload[len++] = duration >> 8;
+  payload[len++] = tested;
+  payload[len++] = faulty;
+  payload[len++] = flags;
+  for (i = 0; i < faulty; i++) {
+    payload[len++] = records[i][0];
+    payload[len++] = records[i][1];
+    payload[len++] = records[i][2];
+  }
+  buf[3] = len;
+  report_pending = false;
+
+  return CAPTURE_HEADER_SIZE + len;
+}
@@ -0,0 +1,121 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight LED self-test.
+ * The open-short detection of the drivers runs in the background, one
+ * driver at a time, driven by a 1ms timer. The detection cycle is
+ * done when a fault is flagged in the interrupt status or after
+ * DIAG_DETECT_MS, the open and short registers are then decoded into
+ * per LED fault records and the global current is restored.
+ * The result of a full board check is streamed to the host as a
+ * binary report, in the same framing as the capture frames:
+ *
+ * | 0xA5 | 0x5A | DIAG_FRAME_REPORT | payload length | payload |
+ *
+ * Payload: check duration in ms (u16), LEDs tested (u8), faulty LEDs
+ * (u8), flags (u8, see enum diag_report_flags), followed by fault
+ * records of LED index (u8), matrix key (u8) and faults (u8, see
+ * enum BacklightFault). Multi-byte values are little endian.
+ */
+
+#ifndef _DIAG_H_
+#define _DIAG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backlight.h"
+#include "capture.h"
+
+/**
+ * Time allowed to the detection cycle of a driver, in ms.
+ */
+#define DIAG_DETECT_MS 5
+
+/**
+ * Number of fault records kept for the report.
+ */
+#define DIAG_FAULTS_MAX 16
+
+/**
+ * Size of a fault record in the report.
+ */
+#define DIAG_RECORD_SIZE 3
+
+/**
+ * Size of the report payload before the fault records.
+ */
+#define DIAG_REPORT_HEADER_SIZE 5
+
+/**
+ * Size of a report frame with all the fault records.
+ */
+#define DIAG_FRAME_SIZE (CAPTURE_HEADER_SIZE + DIAG_REPORT_HEADER_SIZE + \
+			 DIAG_FAULTS_MAX * DIAG_RECORD_SIZE)
+
+/**
+ * Frame type of the report, after the capture frame types.
+ */
+#define DIAG_FRAME_REPORT 0x10
+
+enum diag_report_flags {
+  /** More faults were found than DIAG_FAULTS_MAX */
+  DIAG_REPORT_TRUNCATED = 1,
+  /** A driver could not be tested */
+  DIAG_REPORT_BUS_ERROR = (1 << 1),
+};
+
+/**
+ * Attach the self-test to the backlight drivers.
+ */
+void diag_init(struct Backlight *bl);
+
+/**
+ * Start a full board check, repeated every period_s seconds if
+ * period_s is not 0. A check in progress is restarted, unless a
+ * driver is in the middle of its detection cycle, in which case only
+ * the period is updated.
+ */
+void diag_start(uint16_t period_s);
+
+/**
+ * Stop the periodic check, a check in progress is completed.
+ */
+void diag_stop(void);
+
+/**
+ * Check whether a board check is in progress.
+ */
+bool diag_busy(void);
+
+/**
+ * Fill buf with the report of the last board check, once.
+ * The report is held back until size bytes are enough for all the
+ * fault records.
+ *
+ * \return The frame size, 0 if there is nothing to send.
+ */
+uint8_t diag_fetch_report(uint8_t *buf, uint8_t size);
+
+#endif /* _DIAG_H_ */
@@ -30,6 +30,8 @@
 #define ERR_OK 0
 #define ERR_I2C -1
 #define ERR_BACKLIGHT -2
+#define ERR_CAPTURE -3
+#define ERR_BUSY -4
 
 
 #endif /* _ERROR_H_ */
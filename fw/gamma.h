@@ -0,0 +1,53 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Gamma correction curve for the LED PWM, 255 * (i / 255)^2.2
+ * for each 8-bit input level i.
+ * The table is an X-macro, X(level, s) with s passed through, so
+ * that the calibration of each colour channel can be folded in at
+ * compile time.
+ */
+
+#ifndef _GAMMA_H_
+#define _GAMMA_H_
+
+#define GAMMA_TABLE(X, s)						\
+	X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(0, s) X(1, s)	\
+	X(1, s) X(1, s) X(1, s) X(1, s) X(1, s) X(1, s) X(1, s) X(1, s) X(1, s) X(2, s) X(2, s) X(2, s) X(2, s) X(2, s) X(2, s) X(2, s)	\
+	X(3, s) X(3, s) X(3, s) X(3, s) X(3, s) X(4, s) X(4, s) X(4, s) X(4, s) X(5, s) X(5, s) X(5, s) X(5, s) X(6, s) X(6, s) X(6, s)	\
+	X(6, s) X(7, s) X(7, s) X(7, s) X(8, s) X(8, s) X(8, s) X(9, s) X(9, s) X(9, s) X(10, s) X(10, s) X(11, s) X(11, s) X(11, s) X(12, s)	\
+	X(12, s) X(13, s) X(13, s) X(13, s) X(14, s) X(14, s) X(15, s) X(15, s) X(16, s) X(16, s) X(17, s) X(17, s) X(18, s) X(18, s) X(19, s) X(19, s)	\
+	X(20, s) X(20, s) X(21, s) X(22, s) X(22, s) X(23, s) X(23, s) X(24, s) X(25, s) X(25, s) X(26, s) X(26, s) X(27, s) X(28, s) X(28, s) X(29, s)	\
+	X(30, s) X(30, s) X(31, s) X(32, s) X(33, s) X(33, s) X(34, s) X(35, s) X(35, s) X(36, s) X(37, s) X(38, s) X(39, s) X(39, s) X(40, s) X(41, s)	\
+	X(42, s) X(43, s) X(43, s) X(44, s) X(45, s) X(46, s) X(47, s) X(48, s) X(49, s) X(49, s) X(50, s) X(51, s) X(52, s) X(53, s) X(54, s) X(55, s)	\
+	X(56, s) X(57, s) X(58, s) X(59, s) X(60, s) X(61, s) X(62, s) X(63, s) X(64, s) X(65, s) X(66, s) X(67, s) X(68, s) X(69, s) X(70, s) X(71, s)	\
+	X(73, s) X(74, s) X(75, s) X(76, s) X(77, s) X(78, s) X(79, s) X(81, s) X(82, s) X(83, s) X(84, s) X(85, s) X(87, s) X(88, s) X(89, s) X(90, s)	\
+	X(91, s) X(93, s) X(94, s) X(95, s) X(97, s) X(98, s) X(99, s) X(100, s) X(102, s) X(103, s) X(105, s) X(106, s) X(107, s) X(109, s) X(110, s) X(111, s)	\
+	X(113, s) X(114, s) X(116, s) X(117, s) X(119, s) X(120, s) X(121, s) X(123, s) X(124, s) X(126, s) X(127, s) X(129, s) X(130, s) X(132, s) X(133, s) X(135, s)	\
+	X(137, s) X(138, s) X(140, s) X(141, s) X(143, s) X(145, s) X(146, s) X(148, s) X(149, s) X(151, s) X(153, s) X(154, s) X(156, s) X(158, s) X(159, s) X(161, s)	\
+	X(163, s) X(165, s) X(166, s) X(168, s) X(170, s) X(172, s) X(173, s) X(175, s) X(177, s) X(179, s) X(181, s) X(182, s) X(184, s) X(186, s) X(188, s) X(190, s)	\
+	X(192, s) X(194, s) X(196, s) X(197, s) X(199, s) X(201, s) X(203, s) X(205, s) X(207, s) X(209, s) X(211, s) X(213, s) X(215, s) X(217, s) X(219, s) X(221, s)	\
+	X(223, s) X(225, s) X(227, s) X(229, s) X(231, s) X(234, s) X(236, s) X(238, s) X(240, s) X(242, s) X(244, s) X(246, s) X(248, s) X(251, s) X(253, s) X(255, s)
+
+#endif /* _GAMMA_H_ */
@@ -21,27 +21,47 @@
   this software.
 */
 
+#define TRACE_FILE TRACE_FILE_KEYBOARD_TESTER
+
 #include <stdbool.h>
 
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <avr/power.h>
+#include <util/atomic.h>
 
 #include <LUFA/Drivers/Board/LEDs.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Platform/Platform.h>
 
 #include "backlight.h"
+#include "capture.h"
 #include "descriptors.h"
+#include "diag.h"
+#include "error.h"
 #include "keyboard_tester.h"
+#include "ledstream.h"
 #include "matrix.h"
+#include "sched.h"
 
 static void setupHardware(void);
 static void initKeyboardScan(void);
 static void deinitKeyboardScan(void);
 static void startKeyboardScan(void);
 static void stopKeyboardScan(void);
+static void processHostCommands(void);
+static void processHostByte(uint8_t byte);
+static void sendHostFrames(void);
+static uint8_t fetchHostFrame(uint8_t *buf, uint8_t size);
+static uint8_t hostRoom(void);
+static void hostWrite(const uint8_t *buf, uint8_t size);
+static void benchStart(uint8_t seconds);
+static uint8_t benchFetchFrame(uint8_t *buf, uint8_t size);
+#ifdef KEYBOARD_SCAN_SOF
+static void scanOnFrame(void);
+static void scanPhaseReport(void);
+#endif
 
 /**
  * Standard file stream for the CDC interface when set up,
@@ -52,6 +72,88 @@ FILE serialStream;
 bool hostConnected = false;
 bool debugConnected = false;
 
+#ifdef KEYBOARD_SCAN_SOF
+/**
+ * Timing of the matrix scan with respect to the USB Start Of Frame,
+ * all values are in TIMER 1 ticks.
+ */
+struct scanPhase {
+  /** Timestamp of the last Start Of Frame event */
+  uint16_t sof;
+  /** Time from the Start Of Frame event to the scan completion */
+  uint16_t last;
+  uint16_t min;
+  uint16_t max;
+  /** Time between consecutive Start Of Frame events */
+  uint16_t periodMin;
+  uint16_t periodMax;
+  /** Frames accumulated in the min/max statistics */
+  uint16_t frames;
+};
+
+static volatile struct scanPhase scanPhase;
+#endif
+
+/**
+ * Commands sent by the host on the CDC interface.
+ * Each command byte is followed by a fixed number of argument bytes.
+ */
+enum HostCommand {
+  /** Start bounce capture, arguments: column, row mask */
+  HOST_CMD_CAPTURE_START = 'c',
+  /** Stop bounce capture, no arguments */
+  HOST_CMD_CAPTURE_STOP = 's',
+  /**
+   * Run the backlight self-test, argument: period in seconds,
+   * 0 to run it once.
+   */
+  HOST_CMD_DIAG = 'd',
+  /** Backlight frame, followed by the frame data, see ledstream.h */
+  HOST_CMD_FRAME = 'f',
+  /** Send and reset the backlight frame statistics, no arguments */
+  HOST_CMD_FRAME_STATS = 'q',
+  /** Send the trace statistics, no arguments */
+  HOST_CMD_TRACE_STATS = 'l',
+  /**
+   * Run the CDC throughput benchmark, argument: duration in seconds,
+   * 0 to stop it.
+   */
+  HOST_CMD_BENCH = 'b',
+};
+
+/**
+ * Frame type of the benchmark data, after the trace frame types.
+ * Payload: sequence number (u16), followed by the pattern bytes,
+ * byte i of the payload is (sequence + i) & 0xff.
+ */
+#define HOST_FRAME_BENCH 0x14
+
+/**
+ * Frame type of the benchmark summary, sent once at the end.
+ * Payload: elapsed time in ms (u32), data frames sent (u32), payload
+ * bytes sent (u32).
+ */
+#define HOST_FRAME_BENCH_END 0x15
+
+/** Size of the benchmark summary payload */
+#define HOST_BENCH_END_SIZE 12
+
+/** CDC throughput benchmark state */
+static struct {
+  uint32_t start;
+  uint32_t end;
+  uint32_t frames;
+  uint32_t bytes;
+  bool active;
+} bench;
+
+/** Maximum size of a host command, including the command byte */
+#define HOST_CMD_MAX_SIZE 3
+
+/** Host command being received */
+static uint8_t hostCommand[HOST_CMD_MAX_SIZE];
+static uint8_t hostCommandLength;
+
 static char banner[] = "Welcome to the KeyboardTester board DEBUG serial\r\n";
 
 /** 
@@ -66,12 +168,12 @@ static USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface = {
     .DataINEndpoint = {
       .Address = CDC_TX_EPADDR,
       .Size = CDC_TXRX_EPSIZE,
-      .Banks = 1,
+      .Banks = CDC_TXRX_BANKS,
     },
     .DataOUTEndpoint = {
       .Address = CDC_RX_EPADDR,
       .Size = CDC_TXRX_EPSIZE,
-      .Banks = 1,
+      .Banks = CDC_TXRX_BANKS,
     },
     .NotificationEndpoint = {
       .Address = CDC_NOTIFICATION_EPADDR,
@@ -82,10 +184,12 @@ static USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface = {
 };
 
 /**
- * Buffer holding the previous HID Keyboard Report for internal
- * LUFA driver functionality purposes.
+ * Protocol of the last keyboard report sent on the HID IN endpoint.
+ * The matrix report path knows when the report changes, so there is
+ * no need for LUFA to keep a copy of the previous report to compare
+ * against.
  */
-static uint8_t prevHIDKeyboardReportBuffer[sizeof(USB_KeyboardReport_Data_t)];
+static bool keyboardReportNKRO;
 
 /**
  * LUFA HID Keyboard Class driver interface configuration and state information.
@@ -99,10 +203,10 @@ static USB_ClassInfo_HID_Device_t Keyboard_HID_Interface = {
     .ReportINEndpoint = {
       .Address = HID_REPORT_IN_EPADDR,
       .Size = HID_REPORT_EPSIZE,
-      .Banks = 1
+      .Banks = HID_REPORT_BANKS
     },
-    .PrevReportINBuffer = prevHIDKeyboardReportBuffer,
-    .PrevReportINBufferSize = sizeof(prevHIDKeyboardReportBuffer)
+    .PrevReportINBuffer = NULL,
+    .PrevReportINBufferSize = KEYBOARD_REPORT_MAX_SIZE
   },
 };
 
@@ -119,13 +223,6 @@ setupHardware()
   /* Disable clock division */
   clock_prescale_set(clock_div_1);
 
-  /* Set port F mode to general purpose I/O
-   * output pin: 0,1,4 -- no pullup
-   * input pin: 5,6
-   */
-  PORTF = 0;
-  DDRF = (1 << DDF0) | (1 << DDF1) | (1 << DDF4);
-
   LEDs_Init();
   /* Hardware Initialization */
   USB_Init(USB_DEVICE_OPT_FULLSPEED | USB_OPT_AUTO_PLL);
@@ -134,16 +231,77 @@ setupHardware()
   debugConnected = false;
 }
 
+#ifndef KEYBOARD_SCAN_SOF
 /* 
  * Register interrupt handler for OC1A interrupt, which will be
  * triggered by the timer.
  */
 ISR(TIMER1_COMPA_vect)
 {
-  if (hostConnected) {
+  if (hostConnected && !captureActive()) {
     matrixScan();
   }
 }
+#else
+/*
+ * Scan the matrix from the Start Of Frame event, so that a fresh
+ * report is ready before the next host poll.
+ * TIMER 1 runs free at clk/8 and timestamps the scan with respect
+ * to the frame.
+ */
+static void
+scanOnFrame()
+{
+  uint16_t sof = TCNT1;
+  uint16_t period = sof - scanPhase.sof;
+  uint16_t phase;
+
+  matrixScan();
+  phase = TCNT1 - sof;
+
+  scanPhase.sof = sof;
+  scanPhase.last = phase;
+  if (scanPhase.frames == 0) {
+    scanPhase.min = phase;
+    scanPhase.max = phase;
+    scanPhase.periodMin = period;
+    scanPhase.periodMax = period;
+  }
+  if (phase < scanPhase.min)
+    scanPhase.min = phase;
+  if (phase > scanPhase.max)
+    scanPhase.max = phase;
+  if (period < scanPhase.periodMin)
+    scanPhase.periodMin = period;
+  if (period > scanPhase.periodMax)
+    scanPhase.periodMax = period;
+  if (scanPhase.frames < SCAN_PHASE_REPORT_FRAMES)
+    scanPhase.frames++;
+}
+
+/*
+ * Dump the scan phase statistics and start a new measurement window.
+ */
+static void
+scanPhaseReport()
+{
+  struct scanPhase phase;
+
+  if (scanPhase.frames < SCAN_PHASE_REPORT_FRAMES)
+    return;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    phase = *(struct scanPhase *)&scanPhase;
+    scanPhase.frames = 0;
+  }
+
+  DEBUG("Scan phase us last:%u min:%u max:%u SOF period us min:%u max:%u\r\n",
+	phase.last / TIMER1_PHASE_TICKS_US, phase.min / TIMER1_PHASE_TICKS_US,
+	phase.max / TIMER1_PHASE_TICKS_US,
+	phase.periodMin / TIMER1_PHASE_TICKS_US,
+	phase.periodMax / TIMER1_PHASE_TICKS_US);
+}
+#endif
 
 /**
  * Initialize keyboard matrix scan timer
@@ -184,10 +342,17 @@ deinitKeyboardScan()
 /**
  * Setup timer interrupt to periodically scan the keyboard matrix
  * MUST run with interrupts disabled.
+ * When scanning on Start Of Frame, the timer is only used to
+ * measure the scan phase.
  */
 static void
 startKeyboardScan()
 {
+#ifdef KEYBOARD_SCAN_SOF
+  /* Normal mode, free running with clk/8 prescaler */
+  TCNT1 = 0;
+  TCCR1B |= (0 << CS12) | (1 << CS11) | (0 << CS10);
+#else
   /* 
    * select operation mode for timer 1
    * we use CTC (Clear Timer on Compare match) WGM (waveform generation mode),
@@ -209,6 +374,7 @@ startKeyboardScan()
   TCCR1B |= (1 << WGM12) | (0 << WGM13);
   /* Select clock source and start the timer, clk/64 prescaler */
   TCCR1B |= (0 << CS12) | (1 << CS11) | (1 << CS10);
+#endif
 }
 
 static void
@@ -220,6 +386,248 @@ stopKeyboardScan()
   TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));
 }
 
+/**
+ * Drain the CDC OUT endpoint, the bytes are handled as they are
+ * read from the endpoint bank without copying the packet.
+ */
+static void
+processHostCommands()
+{
+  uint8_t address = VirtualSerial_CDC_Interface.Config.DataOUTEndpoint.Address;
+
+  if (USB_DeviceState != DEVICE_STATE_Configured)
+    return;
+
+  Endpoint_SelectEndpoint(address);
+  if (!Endpoint_IsOUTReceived())
+    return;
+  while (Endpoint_BytesInEndpoint()) {
+    processHostByte(Endpoint_Read_8());
+    /* Commands may print on the debug port, which selects the IN endpoint */
+    Endpoint_SelectEndpoint(address);
+  }
+  Endpoint_ClearOUT();
+}
+
+/**
+ * Accumulate bytes from the host and run complete commands.
+ * Frame data is passed to the frame decoder, unknown command
+ * bytes are thrown away.
+ */
+static void
+processHostByte(uint8_t byte)
+{
+  uint8_t size;
+
+  if (ledstream_active()) {
+    ledstream_feed(byte);
+    return;
+  }
+  hostCommand[hostCommandLength++] = byte;
+
+  switch (hostCommand[0]) {
+  case HOST_CMD_CAPTURE_START:
+    size = 3;
+    break;
+  case HOST_CMD_CAPTURE_STOP:
+  case HOST_CMD_FRAME:
+  case HOST_CMD_FRAME_STATS:
+  case HOST_CMD_TRACE_STATS:
+    size = 1;
+    break;
+  case HOST_CMD_DIAG:
+  case HOST_CMD_BENCH:
+    size = 2;
+    break;
+  default:
+    hostCommandLength = 0;
+    return;
+  }
+  if (hostCommandLength < size)
+    return;
+  hostCommandLength = 0;
+
+  switch (hostCommand[0]) {
+  case HOST_CMD_CAPTURE_START:
+    if (captureStart(hostCommand[1], hostCommand[2]) != ERR_OK)
+      DEBUG("Error: can not start capture on column %hhu\r\n",
+	    hostCommand[1]);
+    break;
+  case HOST_CMD_CAPTURE_STOP:
+    captureStop();
+    break;
+  case HOST_CMD_DIAG:
+    diag_start(hostCommand[1]);
+    break;
+  case HOST_CMD_FRAME:
+    ledstream_begin();
+    break;
+  case HOST_CMD_FRAME_STATS:
+    ledstream_request_stats();
+    break;
+  case HOST_CMD_TRACE_STATS:
+    trace_request_stats();
+    break;
+  case HOST_CMD_BENCH:
+    benchStart(hostCommand[1]);
+    break;
+  }
+}
+
+/**
+ * Size of the binary frame buffer, as much as the free IN banks can
+ * take at once.
+ */
+#define HOST_FRAME_SIZE (CDC_TXRX_EPSIZE * CDC_TXRX_BANKS)
+
+_Static_assert(DIAG_FRAME_SIZE <= HOST_FRAME_SIZE,
+	       "Self-test report does not fit in the IN banks");
+
+/**
+ * Stream pending bounce capture frames, self-test reports, backlight
+ * frame statistics, trace records and benchmark data to the host.
+ * Each frame is sized to the room left in the IN banks, so that a
+ * host that does not read never stalls the main loop.
+ */
+static void
+sendHostFrames()
+{
+  static uint8_t frame[HOST_FRAME_SIZE];
+  uint8_t size;
+
+  if (!debugConnected)
+    return;
+  while ((size = fetchHostFrame(frame, hostRoom())) != 0)
+    hostWrite(frame, size);
+}
+
+/**
+ * Fill buf with the next frame for the host, in order of priority.
+ *
+ * \return The frame size, 0 if there is nothing to send or no frame
+ * fits in size bytes.
+ */
+static uint8_t
+fetchHostFrame(uint8_t *buf, uint8_t size)
+{
+  uint8_t len;
+
+  if ((len = captureFetchFrame(buf, size)) != 0)
+    return len;
+  if ((len = diag_fetch_report(buf, size)) != 0)
+    return len;
+  if ((len = ledstream_fetch_stats(buf, size)) != 0)
+    return len;
+  if ((len = trace_fetch_stats(buf, size)) != 0)
+    return len;
+  if ((len = trace_fetch_frame(buf, size)) != 0)
+    return len;
+  return benchFetchFrame(buf, size);
+}
+
+/**
+ * Room left in the free banks of the CDC IN endpoint, a block of
+ * this size is written without waiting for the host.
+ */
+static uint8_t
+hostRoom()
+{
+  int16_t room;
+
+  if (USB_DeviceState != DEVICE_STATE_Configured)
+    return 0;
+
+  Endpoint_SelectEndpoint(
+    VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+  room = (CDC_TXRX_BANKS - Endpoint_GetBusyBanks()) * CDC_TXRX_EPSIZE -
+    Endpoint_BytesInEndpoint();
+  if (room < 0)
+    return 0;
+  return (room > HOST_FRAME_SIZE) ? HOST_FRAME_SIZE : room;
+}
+
+/**
+ * Write a block that fits in hostRoom() to the CDC IN endpoint.
+ * The block is copied straight into the banks and every bank it
+ * fills is sent at once, a trailing partial packet is flushed by
+ * CDC_Device_USBTask.
+ */
+static void
+hostWrite(const uint8_t *buf, uint8_t size)
+{
+  Endpoint_SelectEndpoint(
+    VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+  Endpoint_Write_Stream_LE(buf, size, NULL);
+  if (!Endpoint_IsReadWriteAllowed())
+    Endpoint_ClearIN();
+}
+
+/**
+ * Start streaming the benchmark pattern for the given number of
+ * seconds, 0 ends a running benchmark with its summary.
+ */
+static void
+benchStart(uint8_t seconds)
+{
+  uint32_t now = sched_now();
+
+  if (seconds == 0) {
+    bench.end = now;
+    return;
+  }
+  bench.start = now;
+  bench.end = now + seconds * 1000UL;
+  bench.frames = 0;
+  bench.bytes = 0;
+  bench.active = true;
+}
+
+/**
+ * Fill buf with a benchmark frame of exactly size bytes, so that the
+ * IN banks are always sent as whole packets, or with the summary once
+ * the benchmark is over.
+ *
+ * \return The frame size, 0 if the benchmark is not running.
+ */
+static uint8_t
+benchFetchFrame(uint8_t *buf, uint8_t size)
+{
+  uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint8_t len = 0;
+  uint32_t summary[3];
+  uint32_t now;
+  uint16_t seq;
+
+  if (!bench.active || size < CAPTURE_HEADER_SIZE + HOST_BENCH_END_SIZE)
+    return 0;
+
+  buf[0] = CAPTURE_SYNC0;
+  buf[1] = CAPTURE_SYNC1;
+  now = sched_now();
+  if ((int32_t)(now - bench.end) >= 0) {
+    buf[2] = HOST_FRAME_BENCH_END;
+    summary[0] = now - bench.start;
+    summary[1] = bench.frames;
+    summary[2] = bench.bytes;
+    for (; len < HOST_BENCH_END_SIZE; len++)
+      payload[len] = summary[len / 4] >> (8 * (len % 4));
+    bench.active = false;
+  }
+  else {
+    seq = bench.frames;
+    buf[2] = HOST_FRAME_BENCH;
+    payload[len++] = seq & 0xff;
+    payload[len++] = seq >> 8;
+    for (; len < size - CAPTURE_HEADER_SIZE; len++)
+      payload[len] = seq + len;
+    bench.frames++;
+    bench.bytes += len;
+  }
+  buf[3] = len;
+
+  return CAPTURE_HEADER_SIZE + len;
+}
+
 int
 main(void)
 {
@@ -237,21 +645,28 @@ main(void)
   LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
 
   initKeyboardScan();
+  sched_init();
   startKeyboardScan();
-  init_backlight_timer();
+  init_backlight();
 
   /* enable interrupts */
   sei();
 
   while (true) {
     /*
-     * Must throw away unused bytes from the host,
+     * Must consume all bytes from the host,
      * or it will lock up while waiting for the device
      */
-    CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface);
+    processHostCommands();
+    sendHostFrames();
+    sched_run();
+    backlight_task();
     CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
     HID_Device_USBTask(&Keyboard_HID_Interface);
     USB_USBTask();
+#ifdef KEYBOARD_SCAN_SOF
+    scanPhaseReport();
+#endif
   }
 }
 
@@ -293,6 +708,10 @@ void EVENT_USB_Device_StartOfFrame(void)
    * hardware key repeats.
    */
   HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
+#ifdef KEYBOARD_SCAN_SOF
+  if (hostConnected && !captureActive())
+    scanOnFrame();
+#endif
 }
 
 /** Event handler for the library USB Control Request reception event. */
@@ -336,6 +755,10 @@ void EVENT_CDC_Device_ControLineStateChanged(
  * no report is to be sent.
  *
  * \return True to force sending of the report, false let the library decide.
+ * The report is forced only when it changed since the last one sent on the
+ * IN endpoint, reports requested on the control endpoint do not count as sent.
+ * The NKRO report is used when the host selected the report protocol,
+ * the boot keyboard report otherwise.
  */
 bool CALLBACK_HID_Device_CreateHIDReport(
     USB_ClassInfo_HID_Device_t * const HIDInterfaceInfo,
@@ -344,7 +767,8 @@ bool CALLBACK_HID_Device_CreateHIDReport(
     void *reportData,
     uint16_t * const reportSize)
 {
-  USB_KeyboardReport_Data_t *kbdReport = (USB_KeyboardReport_Data_t *)reportData;
+  bool nkro = HIDInterfaceInfo->State.UsingReportProtocol;
+  bool changed;
 
   if (reportType != HID_REPORT_ITEM_In) {
     *reportSize = 0;
@@ -353,10 +777,17 @@ bool CALLBACK_HID_Device_CreateHIDReport(
     return false;
   }
 
-  matrixFillKeyboardReport(kbdReport);
-  *reportSize = sizeof(USB_KeyboardReport_Data_t);
+  if (Endpoint_GetCurrentEndpoint() != HID_REPORT_IN_EPADDR) {
+    matrixFetchKeyboardReport(reportData, reportSize, nkro, false);
+    return false;
+  }
+
+  changed = matrixFetchKeyboardReport(reportData, reportSize, nkro, true);
+  /* Protocol switched by SET_PROTOCOL, the new report format must be sent */
+  changed |= (nkro != keyboardReportNKRO);
+  keyboardReportNKRO = nkro;
 
-  return false;
+  return changed;
 }
 
 /** HID class driver callback function that handles incoming reports from the host
@@ -34,6 +34,8 @@
 
 #include <stdio.h>
 
+#include "trace.h"
+
 /** 
  * LED mask for the library LED driver, to indicate that the
  * USB interface is not ready.
@@ -59,15 +61,33 @@
 #define LEDMASK_USB_ERROR        (LEDS_LED1 | LEDS_LED2)
 
 /**
- * Interval in ms between each keyboard matrix scan
+ * Interval in ms between each keyboard matrix scan.
+ * When KEYBOARD_SCAN_SOF is defined the matrix is scanned on every
+ * USB Start Of Frame and the host polls the keyboard every ms,
+ * otherwise TIMER 1 triggers the scan.
  */
+#ifdef KEYBOARD_SCAN_SOF
+#define KEYBOARD_SCAN_INTERVAL_MS 1
+#else
 #define KEYBOARD_SCAN_INTERVAL_MS 5
+#endif
 
 /**
  * Number of ticks for ms of TIMER 1 with clk/64 prescaler
  */
 #define TIMER1_TICKS 125
 
+/**
+ * Number of ticks for us of TIMER 1 with clk/8 prescaler,
+ * used to measure the scan phase when scanning on Start Of Frame.
+ */
+#define TIMER1_PHASE_TICKS_US 1
+
+/**
+ * Number of frames between each scan phase report.
+ */
+#define SCAN_PHASE_REPORT_FRAMES 1024
+
 void EVENT_USB_Device_Connect(void);
 void EVENT_USB_Device_Disconnect(void);
 void EVENT_USB_Device_ConfigurationChanged(void);
@@ -77,9 +97,17 @@ extern FILE serialStream;
 extern bool hostConnected;
 extern bool debugConnected;
 
+/**
+ * Debug messages, traced in binary unless TRACE_TEXT is defined,
+ * in which case they are printed on the debug serial.
+ */
+#ifdef TRACE_TEXT
 #define DEBUG(fmt, ...) do {						\
 		if (debugConnected)					\
 			fprintf(&serialStream, fmt, ## __VA_ARGS__);	\
 	} while (0)
+#else
+#define DEBUG(fmt, ...) TRACE(fmt, ## __VA_ARGS__)
+#endif
 
 #endif
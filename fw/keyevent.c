@@ -0,0 +1,78 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include "keyevent.h"
+
+#define KEYEVENT_QUEUE_MASK (KEYEVENT_QUEUE_SIZE - 1)
+
+/*
+ * Volatile, like the indexes, so that the compiler keeps the event
+ * store before the head update and the event load after the head check.
+ */
+static volatile keyevent_t queue[KEYEVENT_QUEUE_SIZE];
+/* Free running indexes, only the producer writes head */
+static volatile uint8_t head;
+/* Free running indexes, only the consumer writes tail */
+static volatile uint8_t tail;
+
+void
+keyeventReset()
+{
+	head = 0;
+	tail = 0;
+}
+
+bool
+keyeventPush(keyevent_t ev)
+{
+	uint8_t h = head;
+
+	if ((uint8_t)(h - tail) == KEYEVENT_QUEUE_SIZE)
+		return false;
+	queue[h & KEYEVENT_QUEUE_MASK] = ev;
+	/* Publish the event only after it is stored */
+	head = h + 1;
+	return true;
+}
+
+bool
+keyeventPeek(keyevent_t *ev)
+{
+	uint8_t t = tail;
+
+	if (t == head)
+		return false;
+	*ev = queue[t & KEYEVENT_QUEUE_MASK];
+	return true;
+}
+
+void
+keyeventPop()
+{
+	tail = tail + 1;
+}
+
+void
+keyeventFlush()
+{
+	tail = head;
+}
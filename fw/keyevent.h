@@ -0,0 +1,87 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Key event queue between the matrix scan and the HID report path.
+ * This is a single-producer single-consumer ring: the scan interrupt
+ * only moves the head and the USB task only moves the tail, both
+ * indexes fit in a byte so no locking is needed.
+ */
+
+#ifndef _KEYEVENT_H_
+#define _KEYEVENT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Number of events in the queue, must be a power of 2.
+ */
+#define KEYEVENT_QUEUE_SIZE 32
+
+/**
+ * Event flag set for key presses, clear for releases.
+ */
+#define KEYEVENT_PRESS 0x80
+
+/**
+ * Key index of an event.
+ */
+#define KEYEVENT_KEY(ev) ((ev) & ~KEYEVENT_PRESS)
+
+/**
+ * A key event, the key index with the KEYEVENT_PRESS flag.
+ */
+typedef uint8_t keyevent_t;
+
+/**
+ * Drop all queued events.
+ * MUST run with the producer stopped.
+ */
+void keyeventReset(void);
+
+/**
+ * Queue an event, producer side.
+ *
+ * \return False if the queue is full and the event was dropped.
+ */
+bool keyeventPush(keyevent_t ev);
+
+/**
+ * Fetch the oldest event without removing it, consumer side.
+ *
+ * \return False if the queue is empty.
+ */
+bool keyeventPeek(keyevent_t *ev);
+
+/**
+ * Remove the oldest event, consumer side.
+ */
+void keyeventPop(void);
+
+/**
+ * Drop all queued events, consumer side.
+ */
+void keyeventFlush(void);
+
+#endif /* _KEYEVENT_H_ */
@@ -0,0 +1,63 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight LED map of the board, one X(chip, key, row, col, x, y)
+ * entry for each populated RGB LED:
+ * - chip: driver on the bus, index in struct Backlight
+ * - key: matrix key index on top of the LED, or BACKLIGHT_NO_KEY
+ * - row, col: key row (SW1-3, SW4-6...) and CS column of the driver
+ * - x, y: position on the board, the board spans 0-255
+ *
+ * The driver state only mirrors the LEDs listed here. Entries are
+ * grouped by chip and sorted by row and column, so that neighbouring
+ * LEDs share a bus burst.
+ *
+ * Generated by tools/ledmap_gen.py, do not edit. Sources:
+ * - ../pcb/cherry_proto_circuit/key_matrix.sch
+ * - ../pcb/panel/panel.kicad_pcb
+ * - tools/ledmap_proto.txt
+ */
+
+#ifndef _LEDMAP_H_
+#define _LEDMAP_H_
+
+#define BACKLIGHT_LED_MAP(X)					\
+	X(0, BACKLIGHT_NO_KEY, 0, 0, 159, 0)			\
+	X(0, BACKLIGHT_NO_KEY, 0, 2, 255, 0)			\
+	X(0, 0, 0, 3, 0, 0)					\
+	X(0, 2, 0, 5, 96, 0)					\
+	X(0, BACKLIGHT_NO_KEY, 1, 0, 159, 255)			\
+	X(0, BACKLIGHT_NO_KEY, 1, 1, 207, 255)			\
+	X(0, BACKLIGHT_NO_KEY, 1, 2, 255, 255)			\
+	X(0, 3, 1, 3, 0, 255)					\
+	X(0, 4, 1, 4, 48, 255)					\
+	X(0, 5, 1, 5, 96, 255)
+
+/**
+ * LED map index of each matrix key, BACKLIGHT_LEDS for keys
+ * without a LED.
+ */
+#define BACKLIGHT_KEY_MAP { 2, BACKLIGHT_LEDS, 3, 7, 8, 9 }
+
+#endif /* _LEDMAP_H_ */
@@ -0,0 +1,268 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "animation.h"
+#include "backlight.h"
+#include "capture.h"
+#include "error.h"
+#include "keyboard_tester.h"
+#include "ledstream.h"
+#include "sched.h"
+
+enum ledstream_state {
+  LEDSTREAM_IDLE,
+  LEDSTREAM_SEQ,
+  LEDSTREAM_TYPE,
+  LEDSTREAM_LENGTH_LO,
+  LEDSTREAM_LENGTH_HI,
+  /* States past the length consume the frame body */
+  LEDSTREAM_COUNT,
+  LEDSTREAM_RUN_START,
+  LEDSTREAM_RUN_LENGTH,
+  LEDSTREAM_RED,
+  LEDSTREAM_GREEN,
+  LEDSTREAM_BLUE,
+  /** Malformed frame, the rest of the body is dropped */
+  LEDSTREAM_SKIP,
+  /** Frame decoded, the body must end here */
+  LEDSTREAM_END,
+};
+
+static struct Backlight *board;
+static uint8_t state = LEDSTREAM_IDLE;
+static uint8_t type;
+static uint8_t seq;
+/** Bytes left in the frame body */
+static uint16_t length;
+/** Runs left in a delta frame */
+static uint8_t runs;
+/** LED being decoded and LEDs left in the run */
+static uint8_t led;
+static uint8_t left;
+static struct LedColor color;
+
+/** Sequence number expected for the next frame */
+static uint8_t next_seq;
+/** A frame was decoded since the statistics were reset */
+static bool synced;
+static uint16_t frames;
+static uint16_t dropped;
+static uint16_t errors;
+static uint16_t deferred;
+static uint32_t first_ms;
+static uint32_t last_ms;
+static bool stats_pending;
+
+/**
+ * End of the frame body, a frame that was not decoded exactly
+ * is counted as malformed.
+ */
+static void
+ledstream_end(void)
+{
+  uint32_t now = sched_now();
+
+  if (state != LEDSTREAM_END) {
+    state = LEDSTREAM_IDLE;
+    errors++;
+    return;
+  }
+  state = LEDSTREAM_IDLE;
+  if (!synced) {
+    synced = true;
+    first_ms = now;
+  } else {
+    dropped += (uint8_t)(seq - next_seq);
+  }
+  next_seq = seq + 1;
+  last_ms = now;
+  frames++;
+
+  /* Whatever is left dirty goes out with the next frame */
+  if (backlight_board_flush(board) != ERR_OK)
+    deferred++;
+}
+
+static void
+ledstream_done(void)
+{
+  state = LEDSTREAM_END;
+}
+
+static void
+ledstream_error(void)
+{
+  state = LEDSTREAM_SKIP;
+}
+
+/**
+ * Start a run of LEDs, check that it fits the LED table.
+ */
+static void
+ledstream_run(uint8_t first, uint8_t count)
+{
+  if (count == 0 || first >= BACKLIGHT_LEDS ||
+      count > BACKLIGHT_LEDS - first) {
+    ledstream_error();
+    return;
+  }
+  led = first;
+  left = count;
+  state = LEDSTREAM_RED;
+}
+
+void
+ledstream_init(struct Backlight *bl)
+{
+  board = bl;
+}
+
+void
+ledstream_begin()
+{
+  if (animation_current() != ANIMATION_NONE)
+    animation_stop();
+  state = LEDSTREAM_SEQ;
+}
+
+bool
+ledstream_active()
+{
+  return state != LEDSTREAM_IDLE;
+}
+
+void
+ledstream_feed(uint8_t byte)
+{
+  switch (state) {
+  case LEDSTREAM_SEQ:
+    seq = byte;
+    state = LEDSTREAM_TYPE;
+    break;
+  case LEDSTREAM_TYPE:
+    type = byte;
+    state = LEDSTREAM_LENGTH_LO;
+    break;
+  case LEDSTREAM_LENGTH_LO:
+    length = byte;
+    state = LEDSTREAM_LENGTH_HI;
+    break;
+  case LEDSTREAM_LENGTH_HI:
+    length |= (uint16_t)byte << 8;
+    state = LEDSTREAM_COUNT;
+    /* A frame needs at least its count */
+    if (length == 0)
+      ledstream_end();
+    return;
+  case LEDSTREAM_COUNT:
+    if (type == LEDSTREAM_FULL) {
+      ledstream_run(0, byte);
+    } else if (type == LEDSTREAM_DELTA) {
+      runs = byte;
+      if (runs == 0)
+	ledstream_done();
+      else
+	state = LEDSTREAM_RUN_START;
+    } else {
+      ledstream_error();
+    }
+    break;
+  case LEDSTREAM_RUN_START:
+    led = byte;
+    state = LEDSTREAM_RUN_LENGTH;
+    break;
+  case LEDSTREAM_RUN_LENGTH:
+    ledstream_run(led, byte);
+    break;
+  case LEDSTREAM_RED:
+    color.r = byte;
+    state = LEDSTREAM_GREEN;
+    break;
+  case LEDSTREAM_GREEN:
+    color.g = byte;
+    state = LEDSTREAM_BLUE;
+    break;
+  case LEDSTREAM_BLUE:
+    color.b = byte;
+    backlight_led_set(board, led++, color);
+    if (--left != 0)
+      state = LEDSTREAM_RED;
+    else if (type == LEDSTREAM_DELTA && --runs != 0)
+      state = LEDSTREAM_RUN_START;
+    else
+      ledstream_done();
+    break;
+  case LEDSTREAM_END:
+    /* More bytes than the frame needs */
+    ledstream_error();
+    break;
+  }
+
+  if (state >= LEDSTREAM_COUNT && --length == 0)
+    ledstream_end();
+}
+
+void
+ledstream_request_stats()
+{
+  stats_pending = true;
+}
+
+uint8_t
+ledstream_fetch_stats(uint8_t *buf, uint8_t size)
+{
+  uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint32_t elapsed = last_ms - first_ms;
+  uint8_t len = 0;
+
+  if (!stats_pending || size < LEDSTREAM_STATS_SIZE)
+    return 0;
+
+  buf[0] = CAPTURE_SYNC0;
+  buf[1] = CAPTURE_SYNC1;
+  buf[2] = LEDSTREAM_FRAME_STATS;
+  payload[len++] = frames & 0xff;
+  payload[len++] = frames >> 8;
+  payload[len++] = dropped & 0xff;
+  payload[len++] = dropped >> 8;
+  payload[len++] = errors & 0xff;
+  payload[len++] = errors >> 8;
+  payload[len++] = deferred & 0xff;
+  payload[len++] = deferred >> 8;
+  for (uint8_t i = 0; i < 4; i++, elapsed >>= 8)
+    payload[len++] = elapsed & 0xff;
+  buf[3] = len;
+
+  stats_pending = false;
+  synced = false;
+  frames = 0;
+  dropped = 0;
+  errors = 0;
+  deferred = 0;
+  first_ms = 0;
+  last_ms = 0;
+
+  return CAPTURE_HEADER_SIZE + len;
+}
@@ -0,0 +1,111 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight frames streamed by the host.
+ * After the HOST_CMD_FRAME command byte the host sends a frame:
+ *
+ * | sequence | type | length | count | data |
+ *
+ * The length (u16, little endian) is the size of the frame body, the
+ * count and data that follow it. A malformed frame is dropped up to
+ * its length, so that the rest of the body is never taken for host
+ * commands; the LEDs it already set go out with the next frame.
+ * LEDSTREAM_FULL frames carry count colours for the LEDs from 0.
+ * LEDSTREAM_DELTA frames carry count runs of changed LEDs, each run
+ * is the first LED index (u8), the number of LEDs (u8) and their
+ * colours. Colours are red, green and blue bytes, LED indexes are
+ * in the order of the LED position table.
+ * Frames are decoded while the bytes are read from the endpoint, the
+ * colours go straight into the driver state, which is flushed once
+ * at the end of the frame. The sequence number increments by one
+ * for each frame, gaps are counted as dropped frames.
+ * The statistics are sent to the host on request in the capture
+ * framing:
+ *
+ * | 0xA5 | 0x5A | LEDSTREAM_FRAME_STATS | payload length | payload |
+ *
+ * Payload: frames decoded (u16), frames dropped (u16), malformed
+ * frames (u16), flushes deferred because the bus was busy (u16), ms
+ * from the first to the last frame (u32). Multi-byte values are
+ * little endian.
+ */
+
+#ifndef _LEDSTREAM_H_
+#define _LEDSTREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backlight.h"
+#include "capture.h"
+
+enum ledstream_type {
+  LEDSTREAM_FULL = 0,
+  LEDSTREAM_DELTA = 1,
+};
+
+/**
+ * Frame type of the statistics, after the capture frame types.
+ */
+#define LEDSTREAM_FRAME_STATS 0x11
+
+/**
+ * Size of the statistics frame.
+ */
+#define LEDSTREAM_STATS_SIZE (CAPTURE_HEADER_SIZE + 12)
+
+/**
+ * Attach the frame decoder to the backlight drivers.
+ */
+void ledstream_init(struct Backlight *bl);
+
+/**
+ * Start decoding a frame, the running effect is stopped.
+ */
+void ledstream_begin(void);
+
+/**
+ * Check whether a frame is being decoded.
+ */
+bool ledstream_active(void);
+
+/**
+ * Decode the next byte of the frame.
+ */
+void ledstream_feed(uint8_t byte);
+
+/**
+ * Ask for the statistics to be sent to the host, they are reset
+ * once sent.
+ */
+void ledstream_request_stats(void);
+
+/**
+ * Fill buf with the requested statistics frame, once.
+ *
+ * \return The frame size, 0 if there is nothing to send.
+ */
+uint8_t ledstream_fetch_stats(uint8_t *buf, uint8_t size);
+
+#endif /* _LEDSTREAM_H_ */
@@ -20,206 +20,442 @@
   this software.
 */
 
+#define TRACE_FILE TRACE_FILE_MATRIX
+
 #include <stdbool.h>
 
 #include <avr/cpufunc.h>
 #include <avr/io.h>
+#include <util/atomic.h>
 
 #include "keyboard_tester.h"
 #include "matrix.h"
+#include "animation.h"
 #include "backlight.h"
 #include "bitset.h"
+#include "debounce.h"
+#include "diag.h"
 #include "error.h"
-#include "time.h"
+#include "keyevent.h"
+#include "ledstream.h"
+#include "sched.h"
 
 bool ledChecked = false;
 
-static void matrixSelectColumn(int idx);
-static void matrixClearColumn(int idx);
-static bool matrixFetchRow(int idx);
+static inline uint8_t matrixFetchRows(void);
+static inline void matrixUpdateColumn(uint8_t col, uint8_t rows);
 static void matrixKeyPress(int row, int column);
-static void matrix_key_action(int row, int column);
+static void matrixKeyRelease(int row, int column);
+static void matrixBuildKeyboardReport(void);
+static bool matrixConsumeEvents(void);
+static void matrix_key_action(int idx);
+static void matrix_key_actions(void);
 
-typedef void (*timer_callback_t)(void);
+/**
+ * Current led selected, index in the LED topology table.
+ * BACKLIGHT_LEDS means no led selected.
+ */
+static uint8_t currentLed = BACKLIGHT_LEDS;
 
 /**
- * Current led selected.
- * 0 means no led selected.
+ * Backlight drivers state
  */
-struct ledSelection {
-	int row;
-	int col;
-	struct LedColor color;
-	struct IS3733_State *state;
-	int half;
-};
+static struct Backlight backlight;
+
+static void rotate_selected_led(struct Backlight *bl);
+static void next_animation(struct Backlight *bl);
+static void ripple_key_led(int idx);
+static void ripple_selected_led(void);
+static void animation_frame(void *arg);
 
+/** Animation frame rate timer */
+static struct sched_timer frameTimer = SCHED_TIMER_INIT(animation_frame, NULL);
+
+/* Packed row words must fit the debounce and column state */
+_Static_assert(KEYBOARD_ROWS <= 8, "Too many matrix rows");
+/* Key indexes must fit the key events */
+_Static_assert(KEYBOARD_KEYS <= KEYEVENT_PRESS, "Too many matrix keys");
+
+static KeystateBitset lastKeystate;
+/*
+ * Keys released since the main loop last ran their actions.
+ * The scan only marks them, the actions drive the backlight state
+ * owned by the main loop.
+ */
+static KeystateBitset actionKeystate;
 /*
- * Current selected led. row=2 is no led selected.
+ * Packed row state for each column as seen by the last scan,
+ * bit N holds the state of row N.
  */
-struct ledSelection currentLed = {2, 0};
+static uint8_t columnState[KEYBOARD_COLUMNS];
 
-/**
- * Backlight driver state
+/*
+ * Set by the scan when the event queue overflows, the report path
+ * must then resync with lastKeystate.
  */
-static struct IS3733_State backlight_state;
-/** Callback invoked by the backlight timer */
-static timer_callback_t callback;
-
-static void backlight_timer_set(uint32_t nanosec, timer_callback_t cbk);
-static void backlight_do_check(void);
-static void rotate_selected_led(struct IS3733_State *state);
-static void breathe_selected_led(struct IS3733_State *state);
-static void breathe_all_led(struct IS3733_State *state);
-static void breathe_step(void);
-static void breathe_all_step(void);
-static bool backlight_color_step(void);
-
-BITSET_DECLARE(KeystateBitset, KEYBOARD_ROWS * KEYBOARD_COLUMNS);
-
-static int columnBits[] = {PF0, PF1, PF4};
-static int rowBits[] = {PF5, PF6};
-static KeystateBitset lastKeystate;
+static volatile bool keyeventOverflow;
 
-static void
-matrixSelectColumn(int idx)
-{
-	int shift = columnBits[idx];
-	PORTF |= (1 << shift);
-}
+/*
+ * Key state seen by the host, updated as the report path consumes
+ * the key events, and the keyboard reports built from it.
+ */
+static KeystateBitset reportKeystate;
+static USB_KeyboardReport_Data_t keyboardReport;
+static USB_NKROReport_Data_t nkroReport;
 
-static void
-matrixClearColumn(int idx)
-{
-	int shift = columnBits[idx];
-	PORTF &= ~(1 << shift);
-}
+/*
+ * Whether the row pins of each port can be gathered with one mask
+ * and shift, as constants so that they can be used while expanding
+ * the row pin map.
+ */
+enum {
+	matrixRowAlignedB = MATRIX_ROW_ALIGNED(B),
+	matrixRowAlignedC = MATRIX_ROW_ALIGNED(C),
+	matrixRowAlignedD = MATRIX_ROW_ALIGNED(D),
+	matrixRowAlignedE = MATRIX_ROW_ALIGNED(E),
+	matrixRowAlignedF = MATRIX_ROW_ALIGNED(F),
+};
 
-static bool
-matrixFetchRow(int idx)
+/*
+ * Fetch the state of all rows of the currently selected column
+ * as a packed row word.
+ * Each port holding row pins is read once. The rows of an aligned
+ * port are moved in place with one mask and shift, so that the cost
+ * grows with the number of ports; rows of other ports are gathered
+ * one at a time. Everything else folds away.
+ */
+static inline uint8_t
+matrixFetchRows()
 {
-	int shift = rowBits[idx];
-	uint8_t row = (PINF & (1 << shift));
-
-	return (row != 0);
+	uint8_t pinB __attribute__((unused)) = MATRIX_ROW_MASK(B) ? PINB : 0;
+	uint8_t pinC __attribute__((unused)) = MATRIX_ROW_MASK(C) ? PINC : 0;
+	uint8_t pinD __attribute__((unused)) = MATRIX_ROW_MASK(D) ? PIND : 0;
+	uint8_t pinE __attribute__((unused)) = MATRIX_ROW_MASK(E) ? PINE : 0;
+	uint8_t pinF __attribute__((unused)) = MATRIX_ROW_MASK(F) ? PINF : 0;
+
+#define MATRIX_PORT_GATHER(P)						\
+	| (matrixRowAligned##P ?					\
+	   ((pin##P & MATRIX_ROW_MASK(P)) >>				\
+	    (MATRIX_ROW_SHIFT(P) > 0 ? MATRIX_ROW_SHIFT(P) : 0)) <<	\
+	   (MATRIX_ROW_SHIFT(P) < 0 ? -MATRIX_ROW_SHIFT(P) : 0) : 0)
+#define MATRIX_ROW_GATHER(idx, port, bit)				\
+	| (matrixRowAligned##port ? 0 :				\
+	   ((pin##port >> (bit)) & 0x01) << (idx))
+
+	return (0 MATRIX_PORT_GATHER(B) MATRIX_PORT_GATHER(C)
+		MATRIX_PORT_GATHER(D) MATRIX_PORT_GATHER(E)
+		MATRIX_PORT_GATHER(F) MATRIX_ROW_PINS(MATRIX_ROW_GATHER));
+
+#undef MATRIX_PORT_GATHER
+#undef MATRIX_ROW_GATHER
 }
 
 static void
 matrixKeyPress(int row, int column)
 {
-	if (BITSET_GET(lastKeystate, RC2IDX(row, column)) == 0)
-		DEBUG("Button [%d, %d] pressed\r\n", row, column);
+	DEBUG("Button [%d, %d] pressed\r\n", row, column);
 	BITSET_SET(lastKeystate, RC2IDX(row, column));
+	if (!keyeventPush(RC2IDX(row, column) | KEYEVENT_PRESS))
+		keyeventOverflow = true;
 }
 
 static void
 matrixKeyRelease(int row, int column)
 {
-	if (BITSET_GET(lastKeystate, RC2IDX(row, column)) == 1) {
-		DEBUG("Button [%d, %d] released\r\n", row, column);
-		matrix_key_action(row, column);
-	}
+	DEBUG("Button [%d, %d] released\r\n", row, column);
 	BITSET_CLEAR(lastKeystate, RC2IDX(row, column));
+	if (!keyeventPush(RC2IDX(row, column)))
+		keyeventOverflow = true;
+	BITSET_SET(actionKeystate, RC2IDX(row, column));
 }
 
 void
 matrixReset()
 {
 	BITSET_CLEAR_ALL(lastKeystate);
-	for (int col = 0; col < KEYBOARD_COLUMNS; col++)
-		matrixClearColumn(col);
+	memset(columnState, 0, sizeof(columnState));
+	BITSET_CLEAR_ALL(reportKeystate);
+	BITSET_CLEAR_ALL(actionKeystate);
+	memset(&keyboardReport, 0, sizeof(keyboardReport));
+	memset(&nkroReport, 0, sizeof(nkroReport));
+	keyeventReset();
+	keyeventOverflow = false;
+	debounceReset();
+
+	/*
+	 * Columns are outputs driven low, rows are inputs without pullup.
+	 */
+#define MATRIX_INIT_PORT(P) do {					\
+		if (MATRIX_ROW_MASK(P) | MATRIX_COLUMN_MASK(P)) {	\
+			PORT##P &= (uint8_t)~(MATRIX_ROW_MASK(P) |	\
+					      MATRIX_COLUMN_MASK(P));	\
+			DDR##P = (DDR##P & (uint8_t)~MATRIX_ROW_MASK(P)) | \
+				MATRIX_COLUMN_MASK(P);			\
+		}							\
+	} while (0)
+
+	MATRIX_INIT_PORT(B);
+	MATRIX_INIT_PORT(C);
+	MATRIX_INIT_PORT(D);
+	MATRIX_INIT_PORT(E);
+	MATRIX_INIT_PORT(F);
+
+#undef MATRIX_INIT_PORT
 }
 
 void
-matrixScan()
+matrixSelectColumn(uint8_t col)
 {
-	for (int col = 0; col < KEYBOARD_COLUMNS; col++) {
-		matrixSelectColumn(col);
-		// latch delay for column signal propagation to row pins.
-		_NOP();
-		for (int row = 0; row < KEYBOARD_ROWS; row++) {
-			if (matrixFetchRow(row))
-				matrixKeyPress(row, col);
-			else
-				matrixKeyRelease(row, col);
-		}
-		matrixClearColumn(col);
+#define MATRIX_SELECT_COLUMN(idx, port, bit)				\
+	case (idx):							\
+		PORT##port |= (1 << (bit));				\
+		break;
+
+	switch (col) {
+		MATRIX_COLUMN_PINS(MATRIX_SELECT_COLUMN)
 	}
+
+#undef MATRIX_SELECT_COLUMN
 }
 
-static uint8_t scanCodes[] = {
-	HID_KEYBOARD_SC_A,
-	HID_KEYBOARD_SC_B,
-	HID_KEYBOARD_SC_C,
-	HID_KEYBOARD_SC_D,
-	HID_KEYBOARD_SC_E,
-	HID_KEYBOARD_SC_F
-};
+void
+matrixClearColumns()
+{
+#define MATRIX_CLEAR_PORT(P) do {					\
+		if (MATRIX_COLUMN_MASK(P))				\
+			PORT##P &= (uint8_t)~MATRIX_COLUMN_MASK(P);	\
+	} while (0)
+
+	MATRIX_CLEAR_PORT(B);
+	MATRIX_CLEAR_PORT(C);
+	MATRIX_CLEAR_PORT(D);
+	MATRIX_CLEAR_PORT(E);
+	MATRIX_CLEAR_PORT(F);
+
+#undef MATRIX_CLEAR_PORT
+}
 
-bool
-matrixFillKeyboardReport(USB_KeyboardReport_Data_t *keyboardReport)
+uint8_t
+matrixReadRows()
+{
+	return matrixFetchRows();
+}
+
+/*
+ * Debounce the rows of a column and compare them with the
+ * previous state of the column, only the rows that changed
+ * generate a press or release, so an idle column does not touch
+ * the key state at all.
+ * Every press and release is queued for the report path.
+ */
+static inline void
+matrixUpdateColumn(uint8_t col, uint8_t rows)
+{
+	uint8_t changed;
+
+	rows = debounceColumn(col, rows);
+	changed = rows ^ columnState[col];
+	if (changed == 0)
+		return;
+	columnState[col] = rows;
+
+	for (uint8_t row = 0; changed != 0;
+	     row++, changed >>= 1, rows >>= 1) {
+		if ((changed & 0x01) == 0)
+			continue;
+		if (rows & 0x01)
+			matrixKeyPress(row, col);
+		else
+			matrixKeyRelease(row, col);
+	}
+}
+
+/*
+ * Scan the matrix one column at a time.
+ * The scan is unrolled over the column pin map, so that selecting
+ * a column is a single bit set on a constant port.
+ */
+void
+matrixScan()
+{
+	uint8_t rows;
+
+#define MATRIX_SCAN_COLUMN(idx, port, bit) do {				\
+		PORT##port |= (1 << (bit));				\
+		/* latch delay for column signal propagation to row pins. */ \
+		_NOP();							\
+		rows = matrixFetchRows();				\
+		PORT##port &= ~(1 << (bit));				\
+		matrixUpdateColumn((idx), rows);			\
+	} while (0);
+
+	MATRIX_COLUMN_PINS(MATRIX_SCAN_COLUMN)
+
+#undef MATRIX_SCAN_COLUMN
+}
+
+/*
+ * Rebuild the keyboard reports from the key state seen by the host.
+ * The NKRO bitmap is a copy of the key state, the boot report
+ * holds the first 6 pressed keys.
+ */
+static void
+matrixBuildKeyboardReport()
 {
 	int idx, value;
-	uint8_t scanCode;
 	uint8_t nextKeycode = 0;
 
-	BITSET_FOREACH(idx, value, lastKeystate) {
+	memcpy(nkroReport.KeyBitmap, reportKeystate._b,
+	       sizeof(nkroReport.KeyBitmap));
+
+	memset(&keyboardReport, 0, sizeof(keyboardReport));
+	BITSET_FOREACH(idx, value, reportKeystate) {
 		if (!value)
 			continue;
-		// scanCode = layoutFetchScanCode(IDX2R(idx), IDX2C(idx));
-		scanCode = scanCodes[idx];
 		if (nextKeycode == 6) {
-			DEBUG("Error: Key rollover - too many keys pressed %d\r\n",
+			DEBUG("Key rollover - boot report full %d\r\n",
 			      nextKeycode);
 			break;
 		}
-		keyboardReport->KeyCode[nextKeycode++] = scanCode;
+		keyboardReport.KeyCode[nextKeycode++] = KEYBOARD_USAGE_BASE + idx;
+	}
+}
+
+/*
+ * Apply queued key events to the key state seen by the host.
+ * Events are consumed in order until one would change a key that
+ * already changed in this report, so that every transition reaches
+ * the host, in the following report if needed.
+ *
+ * \return True if the key state changed.
+ */
+static bool
+matrixConsumeEvents()
+{
+	KeystateBitset touched;
+	keyevent_t ev;
+	uint8_t key;
+	bool changed = false;
+
+	if (keyeventOverflow) {
+		DEBUG("Error: key event queue overflow\r\n");
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			reportKeystate = lastKeystate;
+			keyeventFlush();
+			keyeventOverflow = false;
+		}
+		matrixBuildKeyboardReport();
+		return true;
+	}
+
+	BITSET_CLEAR_ALL(touched);
+	while (keyeventPeek(&ev)) {
+		key = KEYEVENT_KEY(ev);
+		if (BITSET_GET(touched, key))
+			break;
+		BITSET_SET(touched, key);
+		if (ev & KEYEVENT_PRESS)
+			BITSET_SET(reportKeystate, key);
+		else
+			BITSET_CLEAR(reportKeystate, key);
+		keyeventPop();
+		changed = true;
 	}
 
-	return true;
+	if (changed)
+		matrixBuildKeyboardReport();
+	return changed;
 }
 
+bool
+matrixFetchKeyboardReport(void *report, uint16_t *size, bool nkro,
+			  bool consume)
+{
+	bool changed = false;
+
+	if (consume)
+		changed = matrixConsumeEvents();
+
+	if (nkro) {
+		*(USB_NKROReport_Data_t *)report = nkroReport;
+		*size = sizeof(nkroReport);
+	}
+	else {
+		*(USB_KeyboardReport_Data_t *)report = keyboardReport;
+		*size = sizeof(keyboardReport);
+	}
+
+	return changed;
+}
+
+/*
+ * Run the actions of the keys released since the last call.
+ */
 static void
-matrix_key_action(int row, int column)
+matrix_key_actions()
 {
-	int idx = RC2IDX(row, column);
+	KeystateBitset pending;
+	int idx;
+	uint8_t released;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		pending = actionKeystate;
+		BITSET_CLEAR_ALL(actionKeystate);
+	}
+
+	BITSET_FOREACH(idx, released, pending) {
+		if (released && idx < KEYBOARD_KEYS)
+			matrix_key_action(idx);
+	}
+}
+
+static void
+matrix_key_action(int idx)
+{
+	if (animation_current() == ANIMATION_RIPPLE)
+		ripple_key_led(idx);
 
 	switch(idx) {
 	case 0:
 		if (!ledChecked) {
 			DEBUG("Trigger LED check\r\n");
 			ledChecked = false;
-			currentLed.row = 2;
+			currentLed = BACKLIGHT_LEDS;
 			/* Initialize backlight */
-			backlight_reset(&backlight_state);
+			backlight_board_reset(&backlight);
 
-			/* Start LED diagnostic */
-			backlight_check_trigger(&backlight_state);
-			backlight_timer_set(1000000, &backlight_do_check);
+			/* Start LED diagnostic, the report goes to the host */
+			diag_start(0);
+			ledChecked = true;
 		}
 		else {
-			breathe_all_led(&backlight_state);
+			next_animation(&backlight);
 		}
 		break;
 	case 1:
 		/* Missing key */
 	case 2:
-		if (ledChecked)
-			backlight_set_pattern(&backlight_state);
+		if (ledChecked) {
+			animation_stop();
+			backlight_set_pattern(&backlight);
+			backlight_board_verify(&backlight);
+			backlight_board_stats(&backlight);
+		}
 		break;
 	case 3:
 		if (ledChecked) {
-			rotate_selected_led(&backlight_state);
+			animation_stop();
+			rotate_selected_led(&backlight);
 		}
 		break;
 	case 4:
 		if (ledChecked) {
-			breathe_selected_led(&backlight_state);
+			ripple_selected_led();
 		}
 		break;
 	case 5:
 		if (ledChecked)
-			backlight_brightness(&backlight_state, 0);
+			backlight_board_brightness(&backlight, 0);
 		break;
 	default:
 		DEBUG("Error: invalid index");
@@ -227,204 +463,110 @@ matrix_key_action(int row, int column)
 }
 
 /**
- * Start breathe animation on selected led.
- * This will go through all possible colors in 0.10s intervals.
+ * Switch to the next animation effect, the last one is no effect.
  */
 static void
-breathe_selected_led(struct IS3733_State *state)
+next_animation(struct Backlight *bl)
 {
-	DEBUG("Breathe led [%d, %d]\r\n", currentLed.row, currentLed.col);
-	currentLed.state = state;
-	currentLed.color.r = 0;
-	currentLed.color.g = 0;
-	currentLed.color.b = 0;
-	backlight_set(state, currentLed.row, currentLed.col, currentLed.color);
-	backlight_timer_set(100000, &breathe_step);
+	uint8_t effect = animation_current() + 1;
+
+	if (effect == ANIMATION_EFFECTS)
+		effect = ANIMATION_NONE;
+	DEBUG("Animation effect %hhu\r\n", effect);
+
+	backlight_board_brightness(bl, 255);
+	animation_start(bl, effect);
+	if (effect != ANIMATION_NONE)
+		sched_add(&frameTimer, ANIMATION_FRAME_MS, ANIMATION_FRAME_MS);
+	else
+		backlight_board_stats(bl);
 }
 
+/**
+ * Start a ripple from the selected led, or from the centre of
+ * the board if no led is selected.
+ */
 static void
-breathe_all_led(struct IS3733_State *state)
+ripple_selected_led()
 {
-	backlight_brightness(state, 255);
-	currentLed.state = state;
-	currentLed.color.r = 0;
-	currentLed.color.g = 0;
-	currentLed.color.b = 0;
-	currentLed.half = 0;
-	backlight_set_all(state, 0, black);
-	backlight_set_all(state, 1, black);
-	backlight_timer_set(100000, &breathe_all_step);
-}
+	struct backlight_led led;
 
-static bool
-backlight_color_step()
-{
-	uint8_t or = currentLed.color.r;
-	uint8_t og = currentLed.color.g;
-	uint8_t ob = currentLed.color.b;
-
-	currentLed.color.r += 0x20;
-	/* If wrap around, increment green */
-	if (currentLed.color.r <= or) {
-		currentLed.color.g += 0x20;
-		/* If wrap around, increment blue */
-		if (currentLed.color.g <= og) {
-			currentLed.color.b += 0x20;
-		}
+	if (currentLed == BACKLIGHT_LEDS) {
+		animation_ripple(128, 128);
+		return;
 	}
-
-	DEBUG("Breathe step [%x, %x, %x]\r\n", currentLed.color.r,
-	      currentLed.color.g, currentLed.color.b);
-	if (ob <= currentLed.color.b)
-		return true;
-	return false;
+	backlight_led_get(currentLed, &led);
+	animation_ripple(led.x, led.y);
 }
 
+/**
+ * Start a ripple from the LED under a pressed key.
+ */
 static void
-breathe_step()
+ripple_key_led(int idx)
 {
-	bool repeat = backlight_color_step();
+	struct backlight_led led;
+	uint8_t i = backlight_key_led(idx);
 
-	backlight_set(currentLed.state, currentLed.row, currentLed.col,
-		      currentLed.color);
-	/* When the blue wraps around we finish */
-	if (repeat)
-		backlight_timer_set(100000, &breathe_step);
+	if (i == BACKLIGHT_LEDS)
+		return;
+	backlight_led_get(i, &led);
+	animation_ripple(led.x, led.y);
 }
 
+/**
+ * Animation frame timer, the frame is rendered by backlight_task.
+ */
 static void
-breathe_all_step()
+animation_frame(void *arg)
 {
-	bool repeat = backlight_color_step();
-
-	backlight_set_all(currentLed.state, currentLed.half, currentLed.color);
-	/* When the blue wraps around we finish */
-	if (repeat)
-		backlight_timer_set(100000, &breathe_all_step);
-	else if (currentLed.half == 0) {
-		currentLed.color.r = 0;
-		currentLed.color.g = 0;
-		currentLed.color.b = 0;
-		backlight_set_all(currentLed.state, 0, black);
-		currentLed.half = 1;
-		backlight_timer_set(100000, &breathe_all_step);
-	}
+	if (!animation_tick())
+		sched_cancel(&frameTimer);
 }
 
 /**
- * Rotate the currently selected LED.
- * Assume 10 keys in the keyboard.
+ * Rotate the currently selected LED through the LED topology table,
+ * with a step with no LED selected after the last one.
  */
 static void
-rotate_selected_led(struct IS3733_State *state)
+rotate_selected_led(struct Backlight *bl)
 {
-	DEBUG("Rotate led (%d, %d)\r\n", currentLed.row, currentLed.col);
-	backlight_brightness(state, 255);
+	DEBUG("Rotate led %hhu\r\n", currentLed);
+	backlight_board_brightness(bl, 255);
 
-	if (currentLed.row != 2) {
-		/* Switch off current led. */
-		backlight_set(state, currentLed.row, currentLed.col, black);
-	}
+	/* Switch off current led. */
+	if (currentLed != BACKLIGHT_LEDS)
+		backlight_led_set(bl, currentLed, black);
 
 	/* Rotate led. */
-	if (currentLed.row == 0) {
-		/* Skip missing key */
-		if (currentLed.col == 0 || currentLed.col == 3)
-			currentLed.col += 2;
-		else if (currentLed.col == 5) {
-			currentLed.row += 1;
-			currentLed.col = 0;
-		}
-		else
-			currentLed.col += 1;
-	}
-	else if (currentLed.row == 1) {
+	if (currentLed == BACKLIGHT_LEDS)
+		currentLed = 0;
+	else
+		currentLed++;
 
-		if (currentLed.col == 5) {
-			currentLed.row += 1;
-			currentLed.col = 0;
-		}
-		else
-			currentLed.col += 1;
-	}
-	else {
-		currentLed.row = 0;
-		currentLed.col = 0;
-	}
-
-	DEBUG("Rotate led next (%d, %d)\r\n", currentLed.row, currentLed.col);
+	DEBUG("Rotate led next %hhu\r\n", currentLed);
 	/* If we switched to something valid, light it up. */
-	if (currentLed.row != 2)
-		backlight_set(state, currentLed.row, currentLed.col, bright_white);
+	if (currentLed != BACKLIGHT_LEDS)
+		backlight_led_set(bl, currentLed, bright_white);
+	backlight_board_flush(bl);
 }
 
 /**
- * Initialize the backlight blinking and open-short detection.
- * We use timer 2 for this.
+ * Initialize the backlight subsystem.
  */
 void
-init_backlight_timer()
+init_backlight()
 {
-	/* Select operation mode for timer 3
-	 * We use CTC (Clear Timer on Compare match) WGM (waveform generation mode).
-	 * Outputs OC3{A,B,C} of the waveform function generator are disconnected.
-	 * We use the prescaler clock source with clk/64 division,
-	 * we use channel A for compare and trigger an interrupt on match
-	 */
-
-	/* enable clock to timer 3 */
-	PRR1 &= ~(1 << PRTIM3);
-
-	// reset to normal mode for all channels (A, B, C), WGM3[1:0] = 0
-	TCCR3A = 0;
-	/* WGM3[3:2] select CTC */
-	TCCR3B |= (1 << WGM32) | (0 << WGM33);
-
-	TIFR3 = 0; // clear timer 3 interrupt flag register
-	TIFR3 |= (1 << OCF3A); // enable OCF3A OC3A interrupt
-
-	TIMSK3 = 0; // clear interrupt mask for timer 3
-
-	/* Init the backlight subsystem */
-	backlight_init(&backlight_state, I2C_BACKLIGHT_BUSADDR);
+	backlight_board_init(&backlight);
+	diag_init(&backlight);
+	ledstream_init(&backlight);
 }
 
-static void
-backlight_do_check()
-{
-	DEBUG("LED check triggered\r\n");
-	backlight_check(&backlight_state);
-	ledChecked = true;
-}
-
-/**
- * Set the next backlight timer interval.
- */
-static void
-backlight_timer_set(uint32_t nanosec, timer_callback_t cbk)
+void
+backlight_task()
 {
-	uint8_t clksource = get_timer3_clocksource(nanosec);
-	uint16_t ticks = get_timer3_ticks(clksource, nanosec);
-
-	DEBUG("Set backlight timer to %ldns ticks=%hd clksrc=%hhx\r\n", nanosec, ticks, clksource);
-
-	/* set output compare registers */
-	OCR3A = ticks;
-
-	callback = cbk;
-
-	TIMSK3 |= (1 << OCIE3A); // unmask OC3A interrupt
-
-	/* Select clock source and start the timer, clk/64 prescaler */
-	TCCR3B |= clksource;
+	matrix_key_actions();
+	animation_render();
+	backlight_board_poll(&backlight);
 }
 
-ISR(TIMER3_COMPA_vect)
-{
-	/* Stop the timer */
-	TIMSK3 = 0;
-	TCCR3B = 0;
-
-	if (callback)
-		callback();
-}
@@ -26,16 +26,31 @@
 #include <LUFA/Drivers/USB/USB.h>
 
 #include "backlight.h"
+#include "bitset.h"
+#include "matrix_pins.h"
 
 /**
- * Number of keyboard columns
+ * Number of keys in the matrix
  */
-#define KEYBOARD_COLUMNS 3
+#define KEYBOARD_KEYS (KEYBOARD_ROWS * KEYBOARD_COLUMNS)
 
 /**
- * Number of keyboard rows
+ * HID usage reported for the key at index 0, the other keys
+ * are reported with consecutive usages in index order.
  */
-#define KEYBOARD_ROWS 2
+#define KEYBOARD_USAGE_BASE HID_KEYBOARD_SC_A
+
+/**
+ * Number of key bits in the N-key rollover report bitmap.
+ */
+#define KEYBOARD_NKRO_BITS (BITSET_SIZE(KEYBOARD_KEYS) * NBBY)
+
+/**
+ * Size in bytes of the largest keyboard report.
+ */
+#define KEYBOARD_REPORT_MAX_SIZE					\
+	(sizeof(USB_NKROReport_Data_t) > sizeof(USB_KeyboardReport_Data_t) ? \
+	 sizeof(USB_NKROReport_Data_t) : sizeof(USB_KeyboardReport_Data_t))
 
 /**
  * Row-column to index conversion macros
@@ -44,6 +59,18 @@
 #define IDX2R(index) (index / KEYBOARD_COLUMNS)
 #define IDX2C(index) (index % KEYBOARD_COLUMNS)
 
+BITSET_DECLARE(KeystateBitset, KEYBOARD_KEYS);
+
+/**
+ * N-key rollover keyboard report, sent when the host selects
+ * the report protocol.
+ * Bit N of the key bitmap is the state of the key at index N.
+ */
+typedef struct {
+	uint8_t Modifier;
+	uint8_t KeyBitmap[sizeof(KeystateBitset)];
+} ATTR_PACKED USB_NKROReport_Data_t;
+
 /**
  * Trigger a scan of the keyboard matrix
  */
@@ -55,14 +82,43 @@ void matrixScan(void);
 void matrixReset(void);
 
 /**
- * Fill the given keyboard report with the last keys reported by
- * the scan loop.
+ * Drive the given column, for sampling outside of the scan loop.
+ */
+void matrixSelectColumn(uint8_t col);
+
+/**
+ * Release all the columns.
+ */
+void matrixClearColumns(void);
+
+/**
+ * Sample the rows of the selected column as a packed row word.
+ */
+uint8_t matrixReadRows(void);
+
+/**
+ * Copy the keyboard report for the key state seen by the host.
+ * The report is an USB_NKROReport_Data_t if nkro is set, otherwise
+ * it is a boot protocol USB_KeyboardReport_Data_t, size is set to
+ * the size of the report.
+ * If consume is set, the key events queued by the scan loop are
+ * applied first, this must only be done for reports that are
+ * going to be sent.
+ *
+ * \return True if the report changed.
+ */
+bool matrixFetchKeyboardReport(void *HIDReport, uint16_t *size, bool nkro,
+			       bool consume);
+
+/**
+ * Init the keyboard matrix backlight.
  */
-bool matrixFillKeyboardReport(USB_KeyboardReport_Data_t *HIDReport);
+void init_backlight(void);
 
 /**
- * Init the keyboard matrix backlight timer.
+ * Run the backlight work deferred to the main loop, including the
+ * actions of the keys released since the last call.
  */
-void init_backlight_timer(void);
+void backlight_task(void);
 
 #endif /* _MATRIX_H_ */
@@ -0,0 +1,143 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Keyboard matrix pin map.
+ * Each entry is X(index, port, bit) where port is one of B, C, D, E, F.
+ * Columns are outputs driven high one at a time, rows are inputs
+ * sampled for each column; there can be at most 8 rows.
+ * The scan routine is unrolled from these lists at compile time, so the
+ * pin map must only be changed here, or in the header that
+ * MATRIX_PINMAP names in the build flags for another board.
+ * Note that PD0/PD1 are the TWI bus and PE2 is the backlight driver
+ * shutdown line.
+ */
+
+#ifndef _MATRIX_PINS_H_
+#define _MATRIX_PINS_H_
+
+#ifdef MATRIX_PINMAP
+#include MATRIX_PINMAP
+#else
+#define MATRIX_COLUMN_PINS(X)			\
+	X(0, F, 0)				\
+	X(1, F, 1)				\
+	X(2, F, 4)
+
+#define MATRIX_ROW_PINS(X)			\
+	X(0, F, 5)				\
+	X(1, F, 6)
+#endif
+
+/*
+ * Helpers to derive the matrix geometry and per-port pin masks
+ * from the pin map, all of these fold to constants.
+ */
+#define MATRIX_PORTID_B 0
+#define MATRIX_PORTID_C 1
+#define MATRIX_PORTID_D 2
+#define MATRIX_PORTID_E 3
+#define MATRIX_PORTID_F 4
+
+#define MATRIX_PIN_COUNT(idx, port, bit) + 1
+#define MATRIX_PIN_ON(P, port, bit)					\
+	((MATRIX_PORTID_##P == MATRIX_PORTID_##port) ? (1 << (bit)) : 0)
+#define MATRIX_PIN_ON_B(idx, port, bit) | MATRIX_PIN_ON(B, port, bit)
+#define MATRIX_PIN_ON_C(idx, port, bit) | MATRIX_PIN_ON(C, port, bit)
+#define MATRIX_PIN_ON_D(idx, port, bit) | MATRIX_PIN_ON(D, port, bit)
+#define MATRIX_PIN_ON_E(idx, port, bit) | MATRIX_PIN_ON(E, port, bit)
+#define MATRIX_PIN_ON_F(idx, port, bit) | MATRIX_PIN_ON(F, port, bit)
+
+/**
+ * Mask of the row and column pins on the given port
+ */
+#define MATRIX_ROW_MASK(P) (0 MATRIX_ROW_PINS(MATRIX_PIN_ON_##P))
+#define MATRIX_COLUMN_MASK(P) (0 MATRIX_COLUMN_PINS(MATRIX_PIN_ON_##P))
+
+/*
+ * Sums over the row pins of a port of 1, of the distance between
+ * the pin bit and the row index, and of its square.
+ */
+#define MATRIX_ROW_TERM(P, port, term)					\
+	+ ((MATRIX_PORTID_##P == MATRIX_PORTID_##port) ? (term) : 0)
+#define MATRIX_ROW_DIST(idx, bit) ((bit) - (idx))
+#define MATRIX_ROW_DIST2(idx, bit)					\
+	(MATRIX_ROW_DIST(idx, bit) * MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_COUNT_B(idx, port, bit) MATRIX_ROW_TERM(B, port, 1)
+#define MATRIX_ROW_COUNT_C(idx, port, bit) MATRIX_ROW_TERM(C, port, 1)
+#define MATRIX_ROW_COUNT_D(idx, port, bit) MATRIX_ROW_TERM(D, port, 1)
+#define MATRIX_ROW_COUNT_E(idx, port, bit) MATRIX_ROW_TERM(E, port, 1)
+#define MATRIX_ROW_COUNT_F(idx, port, bit) MATRIX_ROW_TERM(F, port, 1)
+#define MATRIX_ROW_SUM_B(idx, port, bit)				\
+	MATRIX_ROW_TERM(B, port, MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_SUM_C(idx, port, bit)				\
+	MATRIX_ROW_TERM(C, port, MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_SUM_D(idx, port, bit)				\
+	MATRIX_ROW_TERM(D, port, MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_SUM_E(idx, port, bit)				\
+	MATRIX_ROW_TERM(E, port, MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_SUM_F(idx, port, bit)				\
+	MATRIX_ROW_TERM(F, port, MATRIX_ROW_DIST(idx, bit))
+#define MATRIX_ROW_SUM2_B(idx, port, bit)				\
+	MATRIX_ROW_TERM(B, port, MATRIX_ROW_DIST2(idx, bit))
+#define MATRIX_ROW_SUM2_C(idx, port, bit)				\
+	MATRIX_ROW_TERM(C, port, MATRIX_ROW_DIST2(idx, bit))
+#define MATRIX_ROW_SUM2_D(idx, port, bit)				\
+	MATRIX_ROW_TERM(D, port, MATRIX_ROW_DIST2(idx, bit))
+#define MATRIX_ROW_SUM2_E(idx, port, bit)				\
+	MATRIX_ROW_TERM(E, port, MATRIX_ROW_DIST2(idx, bit))
+#define MATRIX_ROW_SUM2_F(idx, port, bit)				\
+	MATRIX_ROW_TERM(F, port, MATRIX_ROW_DIST2(idx, bit))
+
+#define MATRIX_ROW_COUNT(P) (0 MATRIX_ROW_PINS(MATRIX_ROW_COUNT_##P))
+#define MATRIX_ROW_SUM(P) (0 MATRIX_ROW_PINS(MATRIX_ROW_SUM_##P))
+#define MATRIX_ROW_SUM2(P) (0 MATRIX_ROW_PINS(MATRIX_ROW_SUM2_##P))
+
+/**
+ * True if all the row pins of the given port are at the same distance
+ * from their row index, so that the port value maps to the packed row
+ * word with a mask and a single shift. This holds when the distances
+ * have no variance.
+ */
+#define MATRIX_ROW_ALIGNED(P)						\
+	(MATRIX_ROW_COUNT(P) * MATRIX_ROW_SUM2(P) ==			\
+	 MATRIX_ROW_SUM(P) * MATRIX_ROW_SUM(P))
+
+/**
+ * Distance of the row pins of an aligned port from their row index,
+ * positive when the pins sit above the row bits.
+ */
+#define MATRIX_ROW_SHIFT(P)						\
+	(MATRIX_ROW_COUNT(P) ? MATRIX_ROW_SUM(P) / MATRIX_ROW_COUNT(P) : 0)
+
+/**
+ * Number of keyboard columns
+ */
+#define KEYBOARD_COLUMNS (0 MATRIX_COLUMN_PINS(MATRIX_PIN_COUNT))
+
+/**
+ * Number of keyboard rows
+ */
+#define KEYBOARD_ROWS (0 MATRIX_ROW_PINS(MATRIX_PIN_COUNT))
+
+#endif /* _MATRIX_PINS_H_ */
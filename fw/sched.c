@@ -0,0 +1,324 @@
+/*
+  Copyright 2018-2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "sched.h"
+#include "time.h"
+
+#define SCHED_SLOT_MASK (SCHED_SLOTS - 1)
+
+_Static_assert(SCHED_SLOTS <= 32, "Slot bitmap too small");
+_Static_assert((uint32_t)SCHED_SLOTS * SCHED_TICKS_PER_MS <= UINT16_MAX,
+	       "Wheel revolution must fit TIMER 3");
+
+/* Timers in each slot, a timer is in slot (expires % SCHED_SLOTS) */
+static struct sched_timer *wheel[SCHED_SLOTS];
+/* Non-empty slots */
+static uint32_t slot_map;
+/* Expired timers waiting for sched_run, in expiration order */
+static struct sched_timer *ready_head;
+static struct sched_timer *ready_tail;
+
+/* Time of the last wheel update */
+static volatile uint32_t now;
+/* TIMER 3 count at the last wheel update */
+static uint16_t base_count;
+/* ms from the last wheel update to the programmed compare match */
+static uint8_t wake_ms;
+
+static void
+slot_insert(struct sched_timer *timer)
+{
+	uint8_t slot = timer->expires & SCHED_SLOT_MASK;
+
+	timer->prev = NULL;
+	timer->next = wheel[slot];
+	if (timer->next)
+		timer->next->prev = timer;
+	wheel[slot] = timer;
+	slot_map |= (1UL << slot);
+	timer->state = SCHED_TIMER_ARMED;
+}
+
+static void
+slot_remove(struct sched_timer *timer)
+{
+	uint8_t slot = timer->expires & SCHED_SLOT_MASK;
+
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		wheel[slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	if (wheel[slot] == NULL)
+		slot_map &= ~(1UL << slot);
+}
+
+static void
+ready_append(struct sched_timer *timer)
+{
+	timer->next = NULL;
+	timer->prev = ready_tail;
+	if (ready_tail)
+		ready_tail->next = timer;
+	else
+		ready_head = timer;
+	ready_tail = timer;
+	timer->state = SCHED_TIMER_READY;
+}
+
+static void
+ready_remove(struct sched_timer *timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		ready_head = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	else
+		ready_tail = timer->prev;
+}
+
+/**
+ * Distance in ms to the next non-empty slot, a full revolution
+ * if the wheel is empty.
+ */
+static uint8_t
+next_slot_distance(void)
+{
+	uint32_t map = slot_map;
+	uint8_t slot = (now + 1) & SCHED_SLOT_MASK;
+	uint8_t dist;
+
+	if (map == 0)
+		return SCHED_SLOTS;
+	for (dist = 1; dist < SCHED_SLOTS; dist++) {
+		if (map & (1UL << slot))
+			break;
+		slot = (slot + 1) & SCHED_SLOT_MASK;
+	}
+	return dist;
+}
+
+/**
+ * Program the compare match for the given number of ms after the
+ * last wheel update.
+ * Must be called with interrupts disabled.
+ */
+static void
+program_wake(uint8_t ms)
+{
+	uint16_t compare = base_count + ms * SCHED_TICKS_PER_MS;
+
+	wake_ms = ms;
+	OCR3A = compare;
+	/*
+	 * If the deadline was already passed while we were programming
+	 * it, fire as soon as possible instead of after a counter wrap.
+	 */
+	if ((uint16_t)(compare - TCNT3) > ms * SCHED_TICKS_PER_MS)
+		OCR3A = TCNT3 + 2;
+}
+
+/**
+ * Whole ms elapsed since the last wheel update.
+ * Must be called with interrupts disabled.
+ */
+static uint8_t
+elapsed_ms(void)
+{
+	uint16_t ticks = TCNT3 - base_count;
+	uint8_t ms = 0;
+
+	/* Bounded by a wheel revolution, avoid the division */
+	while (ticks >= SCHED_TICKS_PER_MS && ms < SCHED_SLOTS) {
+		ticks -= SCHED_TICKS_PER_MS;
+		ms++;
+	}
+	return ms;
+}
+
+/**
+ * Put the timer in the wheel and move the compare match
+ * earlier if needed.
+ * Must be called with interrupts disabled.
+ */
+static void
+arm(struct sched_timer *timer)
+{
+	int32_t dist = timer->expires - now;
+
+	slot_insert(timer);
+	if (dist < 1)
+		dist = 1;
+	if (dist < wake_ms)
+		program_wake(dist);
+}
+
+/**
+ * Move the expiration of a periodic timer past the current time by
+ * whole periods. The slots up to the current time may have been
+ * walked already, a timer left there would wait a full revolution.
+ * Must be called with interrupts disabled.
+ */
+static void
+skip_missed(struct sched_timer *timer)
+{
+	uint32_t t = now + elapsed_ms();
+	int32_t late = t - timer->expires;
+
+	if (late >= 0)
+		timer->expires += (late / timer->period + 1) * timer->period;
+}
+
+void
+sched_init()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		/* enable clock to timer 3 */
+		PRR1 &= ~(1 << PRTIM3);
+
+		/* Normal mode, the counter runs freely */
+		TCCR3A = 0;
+		TCCR3B = 0;
+		TCNT3 = 0;
+
+		now = 0;
+		base_count = 0;
+		program_wake(SCHED_SLOTS);
+
+		TIFR3 = (1 << OCF3A); // clear pending compare match
+		TIMSK3 = (1 << OCIE3A); // unmask OC3A interrupt
+		/* Start the timer, clk/64 prescaler */
+		TCCR3B = PRESCALER_64(3);
+	}
+}
+
+void
+sched_add(struct sched_timer *timer, uint16_t delay, uint16_t period)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (timer->state == SCHED_TIMER_ARMED)
+			slot_remove(timer);
+		else if (timer->state == SCHED_TIMER_READY)
+			ready_remove(timer);
+
+		if (delay == 0)
+			delay = 1;
+		timer->expires = now + elapsed_ms() + delay;
+		timer->period = period;
+		arm(timer);
+	}
+}
+
+void
+sched_cancel(struct sched_timer *timer)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (timer->state == SCHED_TIMER_ARMED)
+			slot_remove(timer);
+		else if (timer->state == SCHED_TIMER_READY)
+			ready_remove(timer);
+		timer->state = SCHED_TIMER_IDLE;
+	}
+}
+
+bool
+sched_pending(struct sched_timer *timer)
+{
+	return timer->state != SCHED_TIMER_IDLE;
+}
+
+uint32_t
+sched_now()
+{
+	uint32_t t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = now + elapsed_ms();
+	}
+	return t;
+}
+
+void
+sched_run()
+{
+	struct sched_timer *timer;
+	sched_callback_t callback;
+	void *arg;
+
+	for (;;) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			timer = ready_head;
+			if (timer) {
+				ready_remove(timer);
+				callback = timer->callback;
+				arg = timer->arg;
+				if (timer->period) {
+					/* Keep the phase, late runs do not drift */
+					timer->expires += timer->period;
+					skip_missed(timer);
+					arm(timer);
+				}
+				else {
+					timer->state = SCHED_TIMER_IDLE;
+				}
+			}
+		}
+		if (timer == NULL)
+			break;
+		/* The callback may rearm or cancel its own timer */
+		callback(arg);
+	}
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+	struct sched_timer *timer, *next;
+	uint8_t slot;
+
+	/* Walk the slots passed since the last update */
+	for (uint8_t ms = 0; ms < wake_ms; ms++) {
+		now++;
+		slot = now & SCHED_SLOT_MASK;
+		if ((slot_map & (1UL << slot)) == 0)
+			continue;
+		for (timer = wheel[slot]; timer; timer = next) {
+			next = timer->next;
+			/* Timers for later revolutions stay in the slot */
+			if ((int32_t)(timer->expires - now) > 0)
+				continue;
+			slot_remove(timer);
+			ready_append(timer);
+		}
+	}
+	base_count += wake_ms * SCHED_TICKS_PER_MS;
+	program_wake(next_slot_distance());
+}
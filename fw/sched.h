@@ -0,0 +1,117 @@
+/*
+  Copyright 2018-2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Software timers.
+ * All the timers share TIMER 3, which runs freely with a 1ms
+ * resolution. Timers are kept in a hashed timing wheel, insertion and
+ * cancellation are O(1). The compare interrupt is programmed for the
+ * next wheel slot holding a timer, so there is no periodic tick when
+ * nothing is due.
+ * Expired timers are only queued by the interrupt, their callbacks
+ * run from the main loop in sched_run().
+ */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Number of wheel slots, one per millisecond, must be a power of 2.
+ */
+#define SCHED_SLOTS 32
+
+/**
+ * TIMER 3 ticks per millisecond with clk/64 prescaler.
+ */
+#define SCHED_TICKS_PER_MS (F_CPU / 64 / 1000)
+
+typedef void (*sched_callback_t)(void *arg);
+
+enum sched_timer_state {
+	SCHED_TIMER_IDLE,
+	/** In the timing wheel */
+	SCHED_TIMER_ARMED,
+	/** Expired, waiting for the main loop */
+	SCHED_TIMER_READY,
+};
+
+/**
+ * Timer, owned by the caller and linked in the scheduler lists.
+ */
+struct sched_timer {
+	struct sched_timer *next;
+	struct sched_timer *prev;
+	/** Expiration time in ms */
+	uint32_t expires;
+	/** Reload interval in ms, 0 for one-shot timers */
+	uint16_t period;
+	/** See enum sched_timer_state */
+	uint8_t state;
+	sched_callback_t callback;
+	void *arg;
+};
+
+/**
+ * Static initializer for a timer.
+ */
+#define SCHED_TIMER_INIT(cbk, data) {		\
+		.state = SCHED_TIMER_IDLE,	\
+		.callback = (cbk),		\
+		.arg = (data),			\
+	}
+
+/**
+ * Start TIMER 3 and the scheduler.
+ */
+void sched_init(void);
+
+/**
+ * Arm a timer to expire after delay ms, and then every period ms
+ * if period is not 0. A timer already armed is rescheduled.
+ */
+void sched_add(struct sched_timer *timer, uint16_t delay, uint16_t period);
+
+/**
+ * Cancel a timer, its callback will not run.
+ */
+void sched_cancel(struct sched_timer *timer);
+
+/**
+ * Check whether the timer is armed or waiting for its callback.
+ */
+bool sched_pending(struct sched_timer *timer);
+
+/**
+ * Current time in ms.
+ */
+uint32_t sched_now(void);
+
+/**
+ * Run the callbacks of the expired timers, from the main loop.
+ */
+void sched_run(void);
+
+#endif /* _SCHED_H_ */
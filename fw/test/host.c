@@ -0,0 +1,97 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <avr/io.h>
+
+#include "host.h"
+
+#define HOST_REG8_DEFINE(reg) volatile uint8_t reg;
+#define HOST_REG16_DEFINE(reg) volatile uint16_t reg;
+HOST_REGS8(HOST_REG8_DEFINE)
+HOST_REGS16(HOST_REG16_DEFINE)
+
+/* The test of keyboard_tester.c links the real ones */
+__attribute__((weak)) FILE serialStream;
+__attribute__((weak)) bool hostConnected;
+__attribute__((weak)) bool debugConnected;
+
+int host_failures;
+
+static uint32_t seed = 1;
+
+/**
+ * Time base of the trace records, tests that run the scheduler
+ * link sched.c instead.
+ */
+__attribute__((weak)) uint32_t
+sched_now(void)
+{
+  return 0;
+}
+
+/**
+ * Nothing is wired to the pins unless the test models it.
+ */
+__attribute__((weak)) uint8_t
+host_pin_read(uint8_t port)
+{
+  return 0;
+}
+
+uint16_t
+rnd(uint16_t n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % n;
+}
+
+void
+rnd_seed(uint32_t value)
+{
+  seed = value;
+}
+
+/* fw/time.h hides the libc one */
+double
+now_ns(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+int
+host_report(const char *name)
+{
+  if (host_failures) {
+    printf("%s: %d checks FAILED\n", name, host_failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Support for the host build of the firmware modules: the globals
+ * that the firmware expects from keyboard_tester.c and a minimal
+ * check harness. Each test is a standalone program that exits with
+ * a non-zero status if any check failed.
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+extern int host_failures;
+
+/**
+ * Record a failure with the given message if cond is false.
+ */
+#define CHECK(cond, fmt, ...) do {					\
+    if (!(cond)) {							\
+      host_failures++;							\
+      fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__,		\
+	      ## __VA_ARGS__);						\
+    }									\
+  } while (0)
+
+/**
+ * Pseudo random number below n, the same sequence on every run.
+ */
+uint16_t rnd(uint16_t n);
+
+/**
+ * Restart the rnd() sequence.
+ */
+void rnd_seed(uint32_t seed);
+
+/**
+ * Host time in ns, for the benchmarks.
+ */
+double now_ns(void);
+
+/**
+ * Print the test result.
+ *
+ * \return The exit status of the test.
+ */
+int host_report(const char *name);
+
+#endif /* _HOST_H_ */
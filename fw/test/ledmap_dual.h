@@ -0,0 +1,46 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * LED map of a board with two drivers for the host tests, the
+ * prototype wiring on each half of the board.
+ */
+
+#ifndef _LEDMAP_DUAL_H_
+#define _LEDMAP_DUAL_H_
+
+#define BACKLIGHT_LED_MAP(X)					\
+	X(0, BACKLIGHT_NO_KEY, 0, 0, 80, 0)			\
+	X(0, BACKLIGHT_NO_KEY, 0, 2, 127, 0)			\
+	X(0, 0, 0, 3, 0, 0)					\
+	X(0, 2, 0, 5, 48, 0)					\
+	X(0, BACKLIGHT_NO_KEY, 1, 0, 80, 255)			\
+	X(1, BACKLIGHT_NO_KEY, 0, 0, 208, 0)			\
+	X(1, BACKLIGHT_NO_KEY, 0, 2, 255, 0)			\
+	X(1, 3, 1, 3, 128, 255)					\
+	X(1, 4, 1, 4, 176, 255)					\
+	X(1, 5, 1, 5, 224, 255)
+
+#define BACKLIGHT_KEY_MAP { 2, BACKLIGHT_LEDS, 3, 7, 8, 9 }
+
+#endif /* _LEDMAP_DUAL_H_ */
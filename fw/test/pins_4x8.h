@@ -0,0 +1,48 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * 4x8 matrix pin map for the host tests, the rows on one port and
+ * the columns on another.
+ */
+
+#ifndef _PINS_4X8_H_
+#define _PINS_4X8_H_
+
+#define MATRIX_COLUMN_PINS(X)			\
+	X(0, B, 0)				\
+	X(1, B, 1)				\
+	X(2, B, 2)				\
+	X(3, B, 3)				\
+	X(4, B, 4)				\
+	X(5, B, 5)				\
+	X(6, B, 6)				\
+	X(7, B, 7)
+
+#define MATRIX_ROW_PINS(X)			\
+	X(0, F, 4)				\
+	X(1, F, 5)				\
+	X(2, F, 6)				\
+	X(3, F, 7)
+
+#endif /* _PINS_4X8_H_ */
@@ -0,0 +1,56 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * 6x14 matrix pin map for the host tests, the rows split over two
+ * ports and the columns spread over four.
+ */
+
+#ifndef _PINS_6X14_H_
+#define _PINS_6X14_H_
+
+#define MATRIX_COLUMN_PINS(X)			\
+	X(0, B, 0)				\
+	X(1, B, 1)				\
+	X(2, B, 2)				\
+	X(3, B, 3)				\
+	X(4, B, 4)				\
+	X(5, B, 5)				\
+	X(6, F, 0)				\
+	X(7, F, 1)				\
+	X(8, F, 4)				\
+	X(9, F, 5)				\
+	X(10, F, 6)				\
+	X(11, F, 7)				\
+	X(12, C, 6)				\
+	X(13, C, 7)
+
+#define MATRIX_ROW_PINS(X)			\
+	X(0, D, 4)				\
+	X(1, D, 5)				\
+	X(2, D, 6)				\
+	X(3, D, 7)				\
+	X(4, B, 6)				\
+	X(5, B, 7)
+
+#endif /* _PINS_6X14_H_ */
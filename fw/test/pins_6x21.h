@@ -0,0 +1,64 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * 6x21 matrix pin map for the host tests. The atmega32u4 has 23 free
+ * I/O pins, this map also uses PC0-PC3, which only exist in the host
+ * build, and only serves to measure the scan of a full-size matrix.
+ */
+
+#ifndef _PINS_6X21_H_
+#define _PINS_6X21_H_
+
+#define MATRIX_COLUMN_PINS(X)			\
+	X(0, B, 0)				\
+	X(1, B, 1)				\
+	X(2, B, 2)				\
+	X(3, B, 3)				\
+	X(4, B, 4)				\
+	X(5, B, 5)				\
+	X(6, B, 6)				\
+	X(7, B, 7)				\
+	X(8, F, 0)				\
+	X(9, F, 1)				\
+	X(10, F, 4)				\
+	X(11, F, 5)				\
+	X(12, F, 6)				\
+	X(13, F, 7)				\
+	X(14, C, 6)				\
+	X(15, C, 7)				\
+	X(16, E, 6)				\
+	X(17, C, 0)				\
+	X(18, C, 1)				\
+	X(19, C, 2)				\
+	X(20, C, 3)
+
+#define MATRIX_ROW_PINS(X)			\
+	X(0, D, 2)				\
+	X(1, D, 3)				\
+	X(2, D, 4)				\
+	X(3, D, 5)				\
+	X(4, D, 6)				\
+	X(5, D, 7)
+
+#endif /* _PINS_6X21_H_ */
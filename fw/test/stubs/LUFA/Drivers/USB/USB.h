@@ -0,0 +1,149 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/*
+ * The subset of the LUFA USB definitions used by the firmware
+ * headers and keyboard_tester.c. The driver calls are left to the
+ * tests that model the endpoints.
+ */
+
+#ifndef _HOST_LUFA_USB_H_
+#define _HOST_LUFA_USB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#define ATTR_PACKED __attribute__((packed))
+
+typedef struct {
+  uint8_t Modifier;
+  uint8_t Reserved;
+  uint8_t KeyCode[6];
+} ATTR_PACKED USB_KeyboardReport_Data_t;
+
+enum {
+  HID_KEYBOARD_SC_A = 4,
+};
+
+#define ENDPOINT_DIR_IN 0x80
+#define ENDPOINT_DIR_OUT 0x00
+
+#define FIXED_CONTROL_ENDPOINT_SIZE 64
+
+/* Descriptors are only laid out, the host build never sends them */
+typedef struct {
+  uint8_t Size;
+  uint8_t Type;
+} ATTR_PACKED USB_Descriptor_Header_t;
+
+typedef USB_Descriptor_Header_t USB_Descriptor_Configuration_Header_t;
+typedef USB_Descriptor_Header_t USB_Descriptor_Interface_t;
+typedef USB_Descriptor_Header_t USB_Descriptor_Endpoint_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalHeader_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalACM_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalUnion_t;
+typedef USB_Descriptor_Header_t USB_HID_Descriptor_HID_t;
+
+enum {
+  DEVICE_STATE_Unattached,
+  DEVICE_STATE_Powered,
+  DEVICE_STATE_Default,
+  DEVICE_STATE_Addressed,
+  DEVICE_STATE_Configured,
+  DEVICE_STATE_Suspended,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+#define USB_DEVICE_OPT_FULLSPEED 0
+#define USB_OPT_AUTO_PLL 0
+
+#define HID_REPORT_ITEM_In 0
+#define HID_REPORT_ITEM_Out 1
+
+#define CDC_CONTROL_LINE_OUT_DTR 1
+
+typedef struct {
+  uint8_t Address;
+  uint16_t Size;
+  uint8_t Type;
+  uint8_t Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct {
+  struct {
+    uint8_t ControlInterfaceNumber;
+    USB_Endpoint_Table_t DataINEndpoint;
+    USB_Endpoint_Table_t DataOUTEndpoint;
+    USB_Endpoint_Table_t NotificationEndpoint;
+  } Config;
+  struct {
+    struct {
+      uint16_t HostToDevice;
+      uint16_t DeviceToHost;
+    } ControlLineStates;
+  } State;
+} USB_ClassInfo_CDC_Device_t;
+
+typedef struct {
+  struct {
+    uint8_t InterfaceNumber;
+    USB_Endpoint_Table_t ReportINEndpoint;
+    void *PrevReportINBuffer;
+    uint8_t PrevReportINBufferSize;
+  } Config;
+  struct {
+    bool UsingReportProtocol;
+  } State;
+} USB_ClassInfo_HID_Device_t;
+
+void USB_Init(uint8_t options);
+void USB_USBTask(void);
+void USB_Device_EnableSOFEvents(void);
+
+void CDC_Device_CreateStream(USB_ClassInfo_CDC_Device_t *cdc, FILE *stream);
+void CDC_Device_USBTask(USB_ClassInfo_CDC_Device_t *cdc);
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *cdc);
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *cdc);
+
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t *hid);
+bool HID_Device_ConfigureEndpoints(USB_ClassInfo_HID_Device_t *hid);
+void HID_Device_ProcessControlRequest(USB_ClassInfo_HID_Device_t *hid);
+void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t *hid);
+
+void Endpoint_SelectEndpoint(uint8_t address);
+uint8_t Endpoint_GetCurrentEndpoint(void);
+uint8_t Endpoint_GetBusyBanks(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+bool Endpoint_IsReadWriteAllowed(void);
+bool Endpoint_IsOUTReceived(void);
+uint8_t Endpoint_Read_8(void);
+void Endpoint_ClearOUT(void);
+void Endpoint_ClearIN(void);
+uint8_t Endpoint_Write_Stream_LE(const void *buf, uint16_t len,
+				 uint16_t *done);
+
+#endif /* _HOST_LUFA_USB_H_ */
@@ -0,0 +1,77 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/*
+ * Host stand-ins for the atmega32u4 I/O registers used by the
+ * firmware, defined in host.c so that the tests can drive them.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#define HOST_REGS8(X)							\
+  X(PORTB) X(PORTC) X(PORTD) X(PORTE) X(PORTF)				\
+  X(DDRB) X(DDRC) X(DDRD) X(DDRE) X(DDRF)				\
+  X(MCUSR) X(PRR0) X(PRR1)						\
+  X(TCCR0A) X(TCCR0B) X(TIFR0) X(TIMSK0) X(OCR0A) X(TCNT0)		\
+  X(TCCR1A) X(TCCR1B) X(TIFR1) X(TIMSK1)				\
+  X(TCCR3A) X(TCCR3B) X(TIFR3) X(TIMSK3)				\
+  X(TWCR) X(TWSR) X(TWBR) X(TWDR) X(TWAR) X(UDFNUML)
+
+#define HOST_REGS16(X) X(OCR1A) X(OCR3A) X(TCNT1) X(TCNT3)
+
+#define HOST_REG8_DECLARE(reg) extern volatile uint8_t reg;
+#define HOST_REG16_DECLARE(reg) extern volatile uint16_t reg;
+HOST_REGS8(HOST_REG8_DECLARE)
+HOST_REGS16(HOST_REG16_DECLARE)
+
+/*
+ * Pin reads go through host_pin_read(), tests override it to model
+ * what is wired to the pins.
+ */
+enum { HOST_PORT_B, HOST_PORT_C, HOST_PORT_D, HOST_PORT_E, HOST_PORT_F };
+uint8_t host_pin_read(uint8_t port);
+#define PINB host_pin_read(HOST_PORT_B)
+#define PINC host_pin_read(HOST_PORT_C)
+#define PIND host_pin_read(HOST_PORT_D)
+#define PINE host_pin_read(HOST_PORT_E)
+#define PINF host_pin_read(HOST_PORT_F)
+
+enum { PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7 };
+enum { PC6 = 6, PC7 = 7 };
+enum { PD0, PD1, PD2, PD3, PD4, PD5, PD6, PD7 };
+enum { PE2 = 2, PE6 = 6 };
+enum { PF0, PF1, PF2, PF3, PF4, PF5, PF6, PF7 };
+enum { DDE2 = 2, DDF0 = 0, DDF1 = 1, DDF4 = 4 };
+enum { WDRF = 3, PRTIM1 = 3, PRTIM3 = 3, PRTIM0 = 5, PRTWI = 7 };
+enum { CS00, CS01, CS02 };
+enum { CS10, CS11, CS12 };
+enum { CS30, CS31, CS32 };
+enum { WGM01 = 1, WGM12 = 3, WGM13 = 4, WGM32 = 3, WGM33 = 4 };
+enum { OCF0A = 1, OCIE0A = 1, OCF1A = 1, OCIE1A = 1, OCF3A = 1, OCIE3A = 1 };
+enum { TWIE = 0, TWEN = 2, TWWC = 3, TWSTO = 4, TWSTA = 5, TWEA = 6,
+       TWINT = 7 };
+enum { TWPS0 = 0, TWPS1 = 1 };
+
+#endif /* _HOST_AVR_IO_H_ */
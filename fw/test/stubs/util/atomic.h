@@ -0,0 +1,57 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/*
+ * Atomic blocks mask the signals, which the tests use to simulate
+ * interrupts that preempt the main loop.
+ */
+
+#ifndef _HOST_UTIL_ATOMIC_H_
+#define _HOST_UTIL_ATOMIC_H_
+
+#include <signal.h>
+#include <stddef.h>
+
+static inline sigset_t
+host_atomic_enter(void)
+{
+  sigset_t all, old;
+
+  sigfillset(&all);
+  sigprocmask(SIG_BLOCK, &all, &old);
+  return old;
+}
+
+static inline void
+host_atomic_leave(sigset_t *old)
+{
+  sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+#define ATOMIC_BLOCK(type)						\
+  for (sigset_t __old __attribute__((cleanup(host_atomic_leave))) =	\
+	 host_atomic_enter(), *__once = &__old;				\
+       __once; __once = NULL)
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
+
+#endif /* _HOST_UTIL_ATOMIC_H_ */
@@ -0,0 +1,105 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Animation frame benchmark.
+ * Renders frames of every effect kernel on the simulated bus, which
+ * counts the traffic of each frame. The host time per frame only
+ * compares the kernels with each other; the bus time of the frame
+ * traffic, bytes on the wire with the address and register, bounds
+ * the frame rate on the target and must fit the frame period.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "animation.h"
+#include "backlight.h"
+#include "error.h"
+#include "host.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+/** Frames rendered for each effect */
+#define FRAMES 3000
+
+static struct Backlight board;
+
+static const char *const names[ANIMATION_EFFECTS] = {
+  [ANIMATION_RAINBOW] = "rainbow",
+  [ANIMATION_RIPPLE] = "ripple",
+  [ANIMATION_GRADIENT] = "gradient",
+};
+
+/**
+ * Render FRAMES frames of an effect and report the cost of a frame.
+ * The ripple effect is kept busy with a new ring every few frames.
+ */
+static void
+bench(enum animation_effect effect)
+{
+  struct backlight_led led;
+  double start, host_ns, bus_us, fps;
+  unsigned f;
+
+  animation_start(&board, effect);
+  /* The first frame paints every LED, leave it out */
+  animation_render();
+  twi_fake.txns = 0;
+  twi_fake.bits = 0;
+
+  start = now_ns();
+  for (f = 0; f < FRAMES; f++) {
+    if (effect == ANIMATION_RIPPLE && f % 8 == 0) {
+      backlight_led_get(f / 8 % BACKLIGHT_LEDS, &led);
+      animation_ripple(led.x, led.y);
+    }
+    CHECK(animation_tick(), "%s: no frame due", names[effect]);
+    animation_render();
+  }
+  host_ns = (now_ns() - start) / FRAMES;
+  animation_stop();
+
+  bus_us = (double)twi_fake.bits / FRAMES * 1e6 / TWI_SCL_HZ;
+  fps = (bus_us > 0) ? 1e6 / bus_us : 0;
+  printf("%-9s %7.0f ns %10.1f %11.1f %8.1f us %7.0f\n",
+	 names[effect], host_ns, (double)twi_fake.txns / FRAMES,
+	 (double)twi_fake.bits / TWI_FAKE_BYTE_BITS / FRAMES, bus_us, fps);
+  CHECK(bus_us * ANIMATION_FPS < 1e6,
+	"%s: frame traffic %.0f us does not fit %d fps", names[effect],
+	bus_us, ANIMATION_FPS);
+}
+
+int
+main(void)
+{
+  twi_fake.immediate = true;
+  backlight_board_init(&board);
+  backlight_board_brightness(&board, 255);
+
+  printf("effect    host/frame txns/frame bytes/frame  bus/frame max fps\n");
+  bench(ANIMATION_RAINBOW);
+  bench(ANIMATION_RIPPLE);
+  bench(ANIMATION_GRADIENT);
+  return host_report("animation");
+}
@@ -0,0 +1,318 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight test with two drivers on a simulated bus.
+ * The TWI engine is replaced by the simulated bus of twi_fake.c.
+ * Checks the SYNC roles, the interleaving of the frame flush across
+ * the chips, that a full queue loses no update and that the
+ * board-wide operations reach both chips. The bus cost of a full
+ * frame, of a single LED and of the test pattern is printed, with
+ * the host time to render a pixel into the PWM shadow.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backlight.h"
+#include "error.h"
+#include "host.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+_Static_assert(BACKLIGHT_DRIVERS == 2, "Build with two drivers");
+
+/** Pixels rendered by the pixel benchmark */
+#define PIXELS 2000000
+
+/** Order of the configuration register writes */
+static struct {
+  uint8_t chip;
+  uint8_t value;
+} conf[16];
+static unsigned confs;
+
+static struct Backlight board;
+
+static void
+record_conf(const struct twi_txn *txn, uint8_t chip)
+{
+  if (!(txn->flags & TWI_TXN_READ) && txn->page == CRP_FUNCTION &&
+      txn->offset == LFO_CONF && confs < 16) {
+    conf[confs].chip = chip;
+    conf[confs].value = twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF];
+    confs++;
+  }
+}
+
+/**
+ * Check that the PWM registers of the devices hold the shadow.
+ */
+static void
+check_pwm(const char *name)
+{
+  struct IS3733_State *state;
+  struct backlight_led led;
+  uint8_t chip, idx, ch;
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    state = &board.chip[chip];
+    for (idx = 0; idx < state->is_leds; idx++) {
+      backlight_led_get(state->is_first + idx, &led);
+      for (ch = 0; ch < 3; ch++)
+	CHECK(twi_fake.regs[chip][CRP_LED_PWM][led.pwm + ch * 0x10] ==
+	      state->is_pwm[ch][idx],
+	      "%s: chip %u LED %u channel %u is %u, not %u", name, chip,
+	      idx, ch, twi_fake.regs[chip][CRP_LED_PWM][led.pwm + ch * 0x10],
+	      state->is_pwm[ch][idx]);
+    }
+  }
+}
+
+/**
+ * The slaves are configured first, the master starts the SYNC
+ * clock last.
+ */
+static void
+test_reset(void)
+{
+  confs = 0;
+  backlight_board_reset(&board);
+  twi_fake_run();
+
+  CHECK(confs >= 2, "%u configuration writes", confs);
+  CHECK(conf[0].chip == 1 && (conf[0].value & LED_FN_CONF_SYNC_SLAVE),
+	"first configuration on chip %u: %02x", conf[0].chip, conf[0].value);
+  CHECK(conf[confs - 1].chip == 0 &&
+	(conf[confs - 1].value & LED_FN_CONF_SYNC_MASTER),
+	"last configuration on chip %u: %02x", conf[confs - 1].chip,
+	conf[confs - 1].value);
+}
+
+/**
+ * The PWM bursts of a frame alternate between the chips, so that
+ * both halves of the board update together.
+ */
+static void
+test_interleave(void)
+{
+  struct LedColor lc = {200, 100, 50};
+  uint8_t led, last = 0xFF, chip;
+  unsigned i, bursts[BACKLIGHT_DRIVERS] = {0}, few, switches = 0;
+
+  for (led = 0; led < BACKLIGHT_LEDS; led++)
+    backlight_led_set(&board, led, lc);
+  CHECK(backlight_board_flush(&board) == ERR_OK, "flush failed");
+
+  for (i = 0; i < twi_fake.queued; i++) {
+    if (twi_fake.queue[i].page != CRP_LED_PWM)
+      continue;
+    chip = twi_fake_chip(&twi_fake.queue[i]);
+    if (last != 0xFF && chip != last)
+      switches++;
+    bursts[chip]++;
+    last = chip;
+  }
+  /* Alternate until the chip with fewer bursts is done */
+  few = (bursts[0] < bursts[1]) ? bursts[0] : bursts[1];
+  CHECK(few > 0 && switches == 2 * few - (bursts[0] == bursts[1]),
+	"%u and %u PWM bursts, %u chip switches", bursts[0], bursts[1],
+	switches);
+  twi_fake_run();
+  check_pwm("interleave");
+}
+
+/**
+ * A flush that finds the queue full keeps the bytes it could not
+ * queue, the next flush writes them.
+ */
+static void
+test_busy(void)
+{
+  struct LedColor lc = {10, 20, 30};
+  uint8_t led;
+
+  for (led = 0; led < BACKLIGHT_LEDS; led++)
+    backlight_led_set(&board, led, lc);
+  twi_fake.cap = 3;
+  CHECK(backlight_board_flush(&board) == ERR_BUSY,
+	"flush fits a queue of %u", twi_fake.cap);
+  twi_fake_run();
+  twi_fake.cap = TWI_FAKE_QUEUE;
+  CHECK(backlight_board_flush(&board) == ERR_OK, "retry failed");
+  twi_fake_run();
+  check_pwm("busy");
+}
+
+/**
+ * The test pattern lights every LED of the board.
+ */
+static void
+test_pattern(void)
+{
+  struct IS3733_State *state;
+  uint8_t chip, idx;
+
+  backlight_board_reset(&board);
+  twi_fake_run();
+  confs = 0;
+  CHECK(backlight_set_pattern(&board) == ERR_OK, "pattern failed");
+  twi_fake_run();
+  check_pwm("pattern");
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    state = &board.chip[chip];
+    CHECK(twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF] ==
+	  (LED_FN_CONF_SSD | state->is_sync),
+	  "pattern: chip %u configuration %02x", chip,
+	  twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF]);
+    for (idx = 0; idx < state->is_leds; idx++)
+      CHECK(state->is_pwm[0][idx] | state->is_pwm[1][idx] |
+	    state->is_pwm[2][idx],
+	    "pattern: chip %u LED %u is dark", chip, idx);
+  }
+}
+
+/**
+ * Run the queued transactions and print their bus cost.
+ */
+static unsigned
+frame_cost(const char *name)
+{
+  unsigned txns;
+
+  twi_fake.txns = 0;
+  twi_fake.bytes = 0;
+  twi_fake_run();
+  txns = twi_fake.txns;
+  printf("%-16s %3u tx %4lu B\n", name, txns, twi_fake.bytes);
+  return txns;
+}
+
+/**
+ * Transactions and bytes of the frame updates, page selection and
+ * address bytes included.
+ */
+static void
+test_frame_cost(void)
+{
+  struct LedColor lc;
+  uint8_t led;
+  unsigned txns;
+
+  for (led = 0; led < BACKLIGHT_LEDS; led++) {
+    lc = (struct LedColor){led + 1, 2 * led + 1, 3 * led + 1};
+    backlight_led_set(&board, led, lc);
+  }
+  backlight_board_flush(&board);
+  frame_cost("full frame");
+  check_pwm("full frame");
+
+  backlight_led_set(&board, 0, bright_white);
+  backlight_board_flush(&board);
+  txns = frame_cost("single LED");
+  /* One burst for each channel at most, on an already selected page */
+  CHECK(txns <= 3, "single LED: %u transactions", txns);
+  check_pwm("single LED");
+
+  backlight_board_flush(&board);
+  txns = frame_cost("unchanged frame");
+  CHECK(txns == 0, "unchanged frame: %u transactions", txns);
+
+  backlight_set_pattern(&board);
+  frame_cost("test pattern");
+  check_pwm("test pattern");
+}
+
+/**
+ * Host time of a pixel through the colour pipeline, gamma and white
+ * balance lookups into the shadow, from RGB and from HSV. The host
+ * time only compares the paths with each other.
+ */
+static void
+test_pixel_cost(void)
+{
+  double start, rgb_ns, hsv_ns;
+  uint8_t led = 0;
+  unsigned i;
+
+  start = now_ns();
+  for (i = 0; i < PIXELS; i++) {
+    backlight_led_set(&board, led, (struct LedColor){i, i >> 8, i >> 16});
+    if (++led == BACKLIGHT_LEDS)
+      led = 0;
+  }
+  rgb_ns = (now_ns() - start) / PIXELS;
+
+  start = now_ns();
+  for (i = 0; i < PIXELS; i++) {
+    backlight_led_set(&board, led, backlight_hsv(i, i >> 8, 255));
+    if (++led == BACKLIGHT_LEDS)
+      led = 0;
+  }
+  hsv_ns = (now_ns() - start) / PIXELS;
+
+  printf("pixel %5.1f ns from RGB, %5.1f ns from HSV\n", rgb_ns, hsv_ns);
+  backlight_board_flush(&board);
+  twi_fake_run();
+  check_pwm("pixel");
+}
+
+/**
+ * Keys map to the LED under them on either chip.
+ */
+static void
+test_key_led(void)
+{
+  struct backlight_led led;
+  uint8_t key, idx;
+
+  for (key = 0; key < 6; key++) {
+    idx = backlight_key_led(key);
+    if (idx == BACKLIGHT_LEDS)
+      continue;
+    backlight_led_get(idx, &led);
+    CHECK(led.key == key, "key %u maps to the LED of key %u", key, led.key);
+  }
+  backlight_led_get(backlight_key_led(5), &led);
+  CHECK(led.chip == 1, "key 5 on chip %u", led.chip);
+}
+
+int
+main(void)
+{
+  twi_fake.hook = record_conf;
+  backlight_board_init(&board);
+  CHECK(board.chip[0].is_leds == 5 && board.chip[1].is_leds == 5,
+	"chips mirror %u and %u LEDs", board.chip[0].is_leds,
+	board.chip[1].is_leds);
+  test_reset();
+  test_interleave();
+  test_busy();
+  test_pattern();
+  test_frame_cost();
+  test_pixel_cost();
+  test_key_led();
+  return host_report("backlight");
+}
@@ -0,0 +1,144 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Switch bounce capture test.
+ * The sampler interrupt is run by hand against a modelled row state.
+ * Checks the frames streamed around a capture and that a new capture
+ * waits until the host has seen the end of the last one.
+ */
+
+#include <stdint.h>
+
+#include "capture.h"
+#include "error.h"
+#include "host.h"
+#include "matrix.h"
+
+void TIMER0_COMPA_vect(void);
+
+/** Row state seen by the sampler */
+static uint8_t rows;
+
+void
+matrixSelectColumn(uint8_t col)
+{
+}
+
+void
+matrixClearColumns()
+{
+}
+
+uint8_t
+matrixReadRows()
+{
+  return rows;
+}
+
+static uint8_t frame[64];
+
+/**
+ * Fetch the next frame and return its type, 0 if there is none.
+ */
+static uint8_t
+fetch(void)
+{
+  uint8_t size = captureFetchFrame(frame, sizeof(frame));
+
+  if (size == 0)
+    return 0;
+  CHECK(frame[0] == CAPTURE_SYNC0 && frame[1] == CAPTURE_SYNC1,
+	"frame without sync");
+  CHECK(size == CAPTURE_HEADER_SIZE + frame[3], "frame length %u of %u",
+	frame[3], size);
+  return frame[2];
+}
+
+/**
+ * Record a transition every other sample.
+ */
+static void
+toggle(unsigned transitions)
+{
+  while (transitions--) {
+    rows ^= 1;
+    TIMER0_COMPA_vect();
+    TIMER0_COMPA_vect();
+  }
+}
+
+/**
+ * A start while the records or the stop frame of the last capture
+ * are pending is refused, the host would lose them.
+ */
+static void
+test_restart(void)
+{
+  rows = 0;
+  CHECK(captureStart(0, 0x1) == ERR_OK, "first start refused");
+  CHECK(captureStart(1, 0x1) == ERR_CAPTURE, "start while running");
+  CHECK(fetch() == CAPTURE_FRAME_START, "no start frame");
+  toggle(4);
+  captureStop();
+
+  CHECK(captureStart(0, 0x1) == ERR_CAPTURE, "start with records pending");
+  CHECK(fetch() == CAPTURE_FRAME_DATA && frame[3] == 4 * CAPTURE_RECORD_SIZE,
+	"records lost, data frame of %u bytes", frame[3]);
+  CHECK(captureStart(0, 0x1) == ERR_CAPTURE, "start with the stop pending");
+  CHECK(fetch() == CAPTURE_FRAME_STOP && frame[4] == 0 && frame[5] == 0,
+	"no stop frame");
+  CHECK(fetch() == 0, "frames after the stop");
+
+  CHECK(captureStart(0, 0x1) == ERR_OK, "start after the stop refused");
+  CHECK(fetch() == CAPTURE_FRAME_START, "no start frame after restart");
+  captureStop();
+  CHECK(fetch() == CAPTURE_FRAME_STOP, "no stop frame after restart");
+}
+
+/**
+ * Transitions that find the ring full are counted in the stop frame.
+ */
+static void
+test_dropped(void)
+{
+  unsigned records = 0;
+
+  CHECK(captureStart(0, 0x1) == ERR_OK, "start refused");
+  fetch();
+  toggle(CAPTURE_RECORDS + 5);
+  captureStop();
+  while (fetch() == CAPTURE_FRAME_DATA)
+    records += frame[3] / CAPTURE_RECORD_SIZE;
+  CHECK(frame[2] == CAPTURE_FRAME_STOP && frame[4] == 5,
+	"stop frame type %u, %u dropped", frame[2], frame[4]);
+  CHECK(records == CAPTURE_RECORDS, "%u records", records);
+}
+
+int
+main(void)
+{
+  test_restart();
+  test_dropped();
+  return host_report("capture");
+}
@@ -0,0 +1,251 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Debounce test bench.
+ * Checks the (window + 1) switching threshold of each mode, then
+ * feeds synthetic bounce waveforms to every algorithm and reports the
+ * added latency and the false event rate.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "debounce.h"
+#include "host.h"
+#include "keyboard_tester.h"
+#include "matrix.h"
+
+/** Window used by the eager and deferred modes, as in debounce.c */
+#define DEFAULT_WINDOW							\
+  ((DEBOUNCE_WINDOW_MS / KEYBOARD_SCAN_INTERVAL_MS) > DEBOUNCE_WINDOW_MAX ? \
+   DEBOUNCE_WINDOW_MAX : (DEBOUNCE_WINDOW_MS / KEYBOARD_SCAN_INTERVAL_MS))
+
+/** Actuations in each waveform run */
+#define ACTUATIONS 2000
+
+/**
+ * Sample row 0 of column 0 and return its debounced state.
+ */
+static uint8_t
+sample(uint8_t level)
+{
+  return debounceColumn(0, level) & 1;
+}
+
+/**
+ * Check that a key held for window samples does not switch and that
+ * it switches on the next one, in both directions.
+ */
+static void
+check_threshold(const char *mode, uint8_t press, uint8_t release)
+{
+  uint8_t i;
+
+  for (i = 0; i < press; i++)
+    CHECK(sample(1) == 0, "%s: pressed after %u samples, window %u",
+	  mode, i + 1, press);
+  CHECK(sample(1) == 1, "%s: not pressed after %u samples", mode, press + 1);
+
+  /* A glitch back to the debounced state restarts the count */
+  for (i = 0; i < release; i++)
+    CHECK(sample(0) == 1, "%s: released after %u samples, window %u",
+	  mode, i + 1, release);
+  CHECK(sample(1) == 1, "%s: released by a glitch", mode);
+  for (i = 0; i < release; i++)
+    CHECK(sample(0) == 1, "%s: count not restarted by a glitch", mode);
+  CHECK(sample(0) == 0, "%s: not released after %u samples", mode,
+	release + 1);
+}
+
+static void
+test_thresholds(void)
+{
+  uint8_t w;
+  char name[32];
+
+  debounceReset();
+  debounceSetMode(DEBOUNCE_EAGER);
+  check_threshold("eager", 0, DEFAULT_WINDOW);
+
+  debounceReset();
+  debounceSetMode(DEBOUNCE_DEFERRED);
+  check_threshold("deferred", DEFAULT_WINDOW, DEFAULT_WINDOW);
+
+  for (w = 0; w <= DEBOUNCE_WINDOW_MAX; w++) {
+    snprintf(name, sizeof(name), "per-key %u/%u", w, DEBOUNCE_WINDOW_MAX - w);
+    debounceReset();
+    debounceSetWindow(0, 0, w, DEBOUNCE_WINDOW_MAX - w);
+    debounceSetMode(DEBOUNCE_PER_KEY);
+    check_threshold(name, w, DEBOUNCE_WINDOW_MAX - w);
+  }
+
+  /* Windows beyond the counter range are clamped */
+  debounceReset();
+  debounceSetWindow(0, 0, DEBOUNCE_WINDOW_MAX + 3, 0xff);
+  debounceSetMode(DEBOUNCE_PER_KEY);
+  check_threshold("per-key clamped", DEBOUNCE_WINDOW_MAX, DEBOUNCE_WINDOW_MAX);
+
+  /* The other keys of the column keep their own window */
+  debounceReset();
+  debounceSetWindow(0, 0, DEBOUNCE_WINDOW_MAX, DEBOUNCE_WINDOW_MAX);
+  debounceSetMode(DEBOUNCE_PER_KEY);
+  for (w = 0; w < DEFAULT_WINDOW; w++)
+    CHECK((debounceColumn(0, 0x3) & 0x2) == 0, "row 1: early press");
+  CHECK(debounceColumn(0, 0x3) == 0x2, "row 1: window shared with row 0");
+
+  /* A window set while the mode is selected applies right away */
+  debounceReset();
+  debounceSetMode(DEBOUNCE_PER_KEY);
+  debounceSetWindow(0, 0, 1, 2);
+  check_threshold("per-key live", 1, 2);
+}
+
+struct bench_stats {
+  unsigned actuations;
+  unsigned false_events;
+  unsigned missed;
+  unsigned long latency[2];
+  unsigned latency_max[2];
+};
+
+/**
+ * Feed one edge of an actuation: bounce runs of at most max_run
+ * samples, then a stable level for hold samples. Count the debounced
+ * edges seen from the first contact.
+ */
+static void
+bench_edge(struct bench_stats *stats, uint8_t level, uint8_t max_run,
+	   uint8_t hold)
+{
+  uint8_t state = !level;
+  uint8_t bounces = rnd(5);
+  unsigned t = 0, edges = 0, latency = 0;
+  uint8_t run, i, out;
+
+  while (true) {
+    run = rnd(max_run) + 1;
+    for (i = 0; i < run; i++, t++) {
+      out = sample(level);
+      if (out != state) {
+	if (edges++ == 0)
+	  latency = t;
+	state = out;
+      }
+    }
+    if (bounces-- == 0)
+      break;
+    run = rnd(max_run) + 1;
+    for (i = 0; i < run; i++, t++) {
+      out = sample(!level);
+      if (out != state) {
+	if (edges++ == 0)
+	  latency = t;
+	state = out;
+      }
+    }
+  }
+  for (i = 0; i < hold; i++, t++) {
+    out = sample(level);
+    if (out != state) {
+      if (edges++ == 0)
+	latency = t;
+      state = out;
+    }
+  }
+
+  if (edges == 0 || state != level)
+    stats->missed++;
+  else
+    stats->false_events += edges - 1;
+  stats->latency[level] += latency;
+  if (latency > stats->latency_max[level])
+    stats->latency_max[level] = latency;
+}
+
+/**
+ * Run ACTUATIONS press and release cycles with bounce runs of at
+ * most max_run samples.
+ */
+static struct bench_stats
+bench(const char *name, enum DebounceMode mode, uint8_t press,
+      uint8_t release, uint8_t max_run)
+{
+  struct bench_stats stats = {0};
+  uint8_t hold = (press > release ? press : release) + 2;
+  unsigned i;
+
+  rnd_seed(1);
+  debounceReset();
+  debounceSetWindow(0, 0, press, release);
+  debounceSetMode(mode);
+  for (i = 0; i < ACTUATIONS; i++) {
+    bench_edge(&stats, 1, max_run, hold + rnd(8));
+    bench_edge(&stats, 0, max_run, hold + rnd(8));
+    stats.actuations++;
+  }
+
+  printf("%-9s %u/%u     %u      %6.2f%%  %4u   "
+	 "%5.1f/%-3u ms   %5.1f/%-3u ms\n", name, press, release, max_run,
+	 100.0 * stats.false_events / (2 * stats.actuations), stats.missed,
+	 (double)stats.latency[1] * KEYBOARD_SCAN_INTERVAL_MS / stats.actuations,
+	 stats.latency_max[1] * KEYBOARD_SCAN_INTERVAL_MS,
+	 (double)stats.latency[0] * KEYBOARD_SCAN_INTERVAL_MS / stats.actuations,
+	 stats.latency_max[0] * KEYBOARD_SCAN_INTERVAL_MS);
+  return stats;
+}
+
+static void
+test_waveforms(void)
+{
+  struct bench_stats s;
+  uint8_t w = DEFAULT_WINDOW;
+  uint8_t k = 3;
+
+  printf("latency from the first contact, bounce runs in scans of %u ms\n"
+	 "mode      window  bounce  false    missed  press avg/max    "
+	 "release avg/max\n", KEYBOARD_SCAN_INTERVAL_MS);
+
+  /* Bounce runs that fit the window are always filtered */
+  s = bench("eager", DEBOUNCE_EAGER, 0, w, w);
+  CHECK(s.false_events == 0 && s.missed == 0, "eager: bounce not filtered");
+  CHECK(s.latency_max[1] == 0, "eager: press delayed");
+  s = bench("deferred", DEBOUNCE_DEFERRED, w, w, w);
+  CHECK(s.false_events == 0 && s.missed == 0, "deferred: bounce not filtered");
+  s = bench("per-key", DEBOUNCE_PER_KEY, k, k, k);
+  CHECK(s.false_events == 0 && s.missed == 0, "per-key: bounce not filtered");
+
+  /* Runs one sample longer than the window are seen as events */
+  s = bench("deferred", DEBOUNCE_DEFERRED, w, w, w + 1);
+  CHECK(s.false_events != 0, "deferred: runs of window + 1 filtered");
+  s = bench("per-key", DEBOUNCE_PER_KEY, k, k, k + 1);
+  CHECK(s.false_events != 0, "per-key: runs of window + 1 filtered");
+}
+
+int
+main(void)
+{
+  test_thresholds();
+  test_waveforms();
+  return host_report("debounce");
+}
@@ -0,0 +1,383 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight self-test on two drivers.
+ * Runs board checks on the simulated bus with the scheduler driven by
+ * hand, one ms at a time. The detection cycle of the devices is
+ * modelled on the write of the OSD bit, which loads the open and short
+ * bits injected by the test. Checks the fault records and the check
+ * duration of the report, that the global current and configuration
+ * of the drivers are restored, that the report waits for room, and
+ * that a driver whose readback fails is flagged while the other one
+ * is still reported. The time of a full board check is printed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backlight.h"
+#include "diag.h"
+#include "error.h"
+#include "host.h"
+#include "sched.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+_Static_assert(BACKLIGHT_DRIVERS == 2, "Build with two drivers");
+
+/** Longest check before the test gives up, in ms */
+#define CHECK_MS_MAX 1000
+
+static struct Backlight board;
+
+static uint32_t now;
+/** The diag timer, once armed */
+static struct sched_timer *armed;
+
+/** Open and short bits found by the next detection cycle of each chip */
+static uint8_t osd[BACKLIGHT_DRIVERS][LCO_END - LCO_OPEN];
+/** Global current of each chip during its detection cycle */
+static uint8_t osd_current[BACKLIGHT_DRIVERS];
+/** Chip whose readbacks fail, BACKLIGHT_DRIVERS for none */
+static uint8_t failing = BACKLIGHT_DRIVERS;
+
+/** Function registers of each chip before the check */
+static uint8_t conf[BACKLIGHT_DRIVERS];
+static uint8_t gcc[BACKLIGHT_DRIVERS];
+
+struct report {
+  uint16_t duration;
+  uint8_t tested;
+  uint8_t faulty;
+  uint8_t flags;
+  uint8_t records[DIAG_FAULTS_MAX][DIAG_RECORD_SIZE];
+};
+
+uint32_t
+sched_now(void)
+{
+  return now;
+}
+
+void
+sched_add(struct sched_timer *timer, uint16_t delay, uint16_t period)
+{
+  timer->expires = now + delay;
+  timer->period = period;
+  timer->state = SCHED_TIMER_ARMED;
+  armed = timer;
+}
+
+void
+sched_cancel(struct sched_timer *timer)
+{
+  timer->state = SCHED_TIMER_IDLE;
+  if (armed == timer)
+    armed = NULL;
+}
+
+/**
+ * Let a ms pass, run the timer if it is due and the queued
+ * transactions.
+ */
+static void
+tick(void)
+{
+  now++;
+  if (armed && armed->expires <= now) {
+    armed->expires += armed->period;
+    armed->callback(armed->arg);
+  }
+  twi_fake_run();
+}
+
+/**
+ * The devices run the detection cycle when the OSD bit is set, the
+ * readbacks of the failing chip do not complete.
+ */
+static void
+device(const struct twi_txn *txn, uint8_t chip)
+{
+  uint8_t *regs = twi_fake.regs[chip][CRP_LED_CTRL];
+  uint8_t status = 0, i;
+
+  if (!(txn->flags & TWI_TXN_READ) && txn->page == CRP_FUNCTION &&
+      txn->offset == LFO_CONF && (txn->value & LED_FN_CONF_OSD)) {
+    memcpy(&regs[LCO_OPEN], osd[chip], sizeof(osd[chip]));
+    for (i = 0; i < LCO_SHORT - LCO_OPEN; i++) {
+      if (regs[LCO_OPEN + i])
+	status |= BL_INTR_OPEN;
+      if (regs[LCO_SHORT + i])
+	status |= BL_INTR_SHORT;
+    }
+    twi_fake.regs[chip][TWI_FAKE_PAGE_NONE][BCR_INTR_STATUS] = status;
+    osd_current[chip] =
+      twi_fake.regs[chip][CRP_FUNCTION][LFO_GLOBAL_CURRENT_CTRL];
+  }
+  twi_fake.rc = (chip == failing && (txn->flags & TWI_TXN_READ) &&
+		 txn->page == CRP_LED_CTRL) ? ERR_I2C : ERR_OK;
+}
+
+/**
+ * Flag faults of a LED in the open and short registers, which have
+ * the layout of the on/off registers: two bytes for each SW line, one
+ * bit for each CS line.
+ */
+static void
+inject(uint8_t idx, uint8_t faults)
+{
+  struct backlight_led led;
+  uint8_t ch, sw, cs, byte;
+
+  backlight_led_get(idx, &led);
+  for (ch = 0; ch < 3; ch++) {
+    sw = led.pwm / 0x10 + ch;
+    cs = led.pwm % 0x10;
+    byte = sw * 2 + cs / 8;
+    if (faults & (BL_FAULT_OPEN_B << ch))
+      osd[led.chip][byte] |= 1 << (cs % 8);
+    if (faults & (BL_FAULT_SHORT_B << ch))
+      osd[led.chip][LCO_SHORT - LCO_OPEN + byte] |= 1 << (cs % 8);
+  }
+}
+
+/**
+ * Fetch and decode the report.
+ */
+static struct report
+fetch(const char *name)
+{
+  uint8_t buf[DIAG_FRAME_SIZE];
+  const uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  struct report r = {0};
+  uint8_t size;
+
+  size = diag_fetch_report(buf, sizeof(buf));
+  CHECK(size >= CAPTURE_HEADER_SIZE + DIAG_REPORT_HEADER_SIZE &&
+	buf[0] == CAPTURE_SYNC0 && buf[1] == CAPTURE_SYNC1 &&
+	buf[2] == DIAG_FRAME_REPORT && buf[3] == size - CAPTURE_HEADER_SIZE,
+	"%s: bad report of %u bytes", name, size);
+  if (size < CAPTURE_HEADER_SIZE + DIAG_REPORT_HEADER_SIZE)
+    return r;
+  r.duration = payload[0] | (payload[1] << 8);
+  r.tested = payload[2];
+  r.faulty = payload[3];
+  r.flags = payload[4];
+  CHECK(r.faulty <= DIAG_FAULTS_MAX && size == CAPTURE_HEADER_SIZE +
+	DIAG_REPORT_HEADER_SIZE + r.faulty * DIAG_RECORD_SIZE,
+	"%s: %u records in %u bytes", name, r.faulty, size);
+  if (r.faulty <= DIAG_FAULTS_MAX)
+    memcpy(r.records, &payload[DIAG_REPORT_HEADER_SIZE],
+	   r.faulty * DIAG_RECORD_SIZE);
+  return r;
+}
+
+/**
+ * Run a full board check.
+ *
+ * \return The time it took in ms.
+ */
+static unsigned
+run(const char *name)
+{
+  uint32_t start = now;
+  uint8_t chip;
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    conf[chip] = twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF];
+    gcc[chip] = twi_fake.regs[chip][CRP_FUNCTION][LFO_GLOBAL_CURRENT_CTRL];
+    osd_current[chip] = 0;
+  }
+  diag_start(0);
+  while (diag_busy() && now - start < CHECK_MS_MAX)
+    tick();
+  CHECK(!diag_busy(), "%s: check still running after %u ms", name,
+	CHECK_MS_MAX);
+  CHECK(armed == NULL, "%s: timer left armed", name);
+  return now - start;
+}
+
+/**
+ * The detection ran at the test current, the current and the
+ * configuration are back as they were before the check.
+ */
+static void
+check_restore(const char *name)
+{
+  uint8_t chip;
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    CHECK(osd_current[chip] == 0x01,
+	  "%s: chip %u detection at global current %02x", name, chip,
+	  osd_current[chip]);
+    CHECK(twi_fake.regs[chip][CRP_FUNCTION][LFO_GLOBAL_CURRENT_CTRL] ==
+	  gcc[chip], "%s: chip %u global current %02x, not %02x", name,
+	  chip, twi_fake.regs[chip][CRP_FUNCTION][LFO_GLOBAL_CURRENT_CTRL],
+	  gcc[chip]);
+    CHECK(twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF] == conf[chip],
+	  "%s: chip %u configuration %02x, not %02x", name, chip,
+	  twi_fake.regs[chip][CRP_FUNCTION][LFO_CONF], conf[chip]);
+    CHECK(twi_fake.regs[chip][TWI_FAKE_PAGE_NONE][BCR_INTR_MASK] ==
+	  (BL_INTR_OPEN | BL_INTR_SHORT),
+	  "%s: chip %u interrupt mask %02x", name, chip,
+	  twi_fake.regs[chip][TWI_FAKE_PAGE_NONE][BCR_INTR_MASK]);
+  }
+}
+
+static void
+check_record(const char *name, const struct report *r, uint8_t n,
+	     uint8_t idx, uint8_t faults)
+{
+  struct backlight_led led;
+
+  backlight_led_get(idx, &led);
+  CHECK(n < r->faulty && r->records[n][0] == idx &&
+	r->records[n][1] == led.key && r->records[n][2] == faults,
+	"%s: record %u is LED %u key %u faults %02x, not LED %u key %u "
+	"faults %02x", name, n, r->records[n][0], r->records[n][1],
+	r->records[n][2], idx, led.key, faults);
+}
+
+/**
+ * A board with no faults waits for the timeout on each driver.
+ */
+static unsigned
+test_clean(void)
+{
+  struct report r;
+  unsigned ms;
+
+  memset(osd, 0, sizeof(osd));
+  ms = run("clean");
+  r = fetch("clean");
+  CHECK(r.duration == ms, "clean: duration %u ms, took %u ms", r.duration,
+	ms);
+  CHECK(r.duration >= BACKLIGHT_DRIVERS * DIAG_DETECT_MS,
+	"clean: %u ms is shorter than the detection timeouts", r.duration);
+  CHECK(r.tested == BACKLIGHT_LEDS && r.faulty == 0 && r.flags == 0,
+	"clean: %u tested, %u faulty, flags %02x", r.tested, r.faulty,
+	r.flags);
+  check_restore("clean");
+  return ms;
+}
+
+/**
+ * Faults on both chips end the detection early, they are reported in
+ * LED order with the key under the LED.
+ */
+static unsigned
+test_faults(unsigned clean)
+{
+  struct report r;
+  unsigned ms;
+
+  memset(osd, 0, sizeof(osd));
+  inject(2, BL_FAULT_OPEN_R);
+  inject(4, BL_FAULT_OPEN_B | BL_FAULT_SHORT_R);
+  inject(8, BL_FAULT_SHORT_G | BL_FAULT_SHORT_B);
+  ms = run("faults");
+  r = fetch("faults");
+  CHECK(r.duration == ms, "faults: duration %u ms, took %u ms", r.duration,
+	ms);
+  CHECK(r.duration < clean, "faults: %u ms, no faults %u ms", r.duration,
+	clean);
+  CHECK(r.tested == BACKLIGHT_LEDS && r.faulty == 3 && r.flags == 0,
+	"faults: %u tested, %u faulty, flags %02x", r.tested, r.faulty,
+	r.flags);
+  check_record("faults", &r, 0, 2, BL_FAULT_OPEN_R);
+  check_record("faults", &r, 1, 4, BL_FAULT_OPEN_B | BL_FAULT_SHORT_R);
+  check_record("faults", &r, 2, 8, BL_FAULT_SHORT_G | BL_FAULT_SHORT_B);
+  check_restore("faults");
+  return ms;
+}
+
+/**
+ * The report is held back until the room fits all the records, and
+ * it is sent once.
+ */
+static void
+test_held_back(void)
+{
+  uint8_t buf[DIAG_FRAME_SIZE];
+  uint8_t need;
+
+  memset(osd, 0, sizeof(osd));
+  inject(0, BL_FAULT_OPEN_G);
+  inject(9, BL_FAULT_SHORT_R);
+  run("held back");
+  need = CAPTURE_HEADER_SIZE + DIAG_REPORT_HEADER_SIZE + 2 * DIAG_RECORD_SIZE;
+  CHECK(diag_fetch_report(buf, need - 1) == 0,
+	"held back: report sent in %u bytes", need - 1);
+  CHECK(diag_fetch_report(buf, need) == need,
+	"held back: report not sent in %u bytes", need);
+  CHECK(diag_fetch_report(buf, sizeof(buf)) == 0, "held back: sent twice");
+}
+
+/**
+ * The readbacks of a chip fail, the check goes on with the other chip
+ * and the current of the failing chip is restored all the same.
+ */
+static void
+test_bus_error(void)
+{
+  struct report r;
+
+  memset(osd, 0, sizeof(osd));
+  inject(3, BL_FAULT_OPEN_R);
+  inject(7, BL_FAULT_OPEN_R);
+  failing = 1;
+  run("bus error");
+  failing = BACKLIGHT_DRIVERS;
+  twi_fake.rc = ERR_OK;
+  r = fetch("bus error");
+  CHECK(r.flags == DIAG_REPORT_BUS_ERROR, "bus error: flags %02x", r.flags);
+  CHECK(r.tested == board.chip[0].is_leds && r.faulty == 1,
+	"bus error: %u tested, %u faulty", r.tested, r.faulty);
+  check_record("bus error", &r, 0, 3, BL_FAULT_OPEN_R);
+  check_restore("bus error");
+}
+
+int
+main(void)
+{
+  unsigned clean, faults;
+
+  twi_fake.hook = device;
+  backlight_board_init(&board);
+  backlight_board_reset(&board);
+  twi_fake_run();
+  backlight_board_brightness(&board, 0x80);
+  twi_fake_run();
+  diag_init(&board);
+
+  clean = test_clean();
+  faults = test_faults(clean);
+  test_held_back();
+  test_bus_error();
+
+  printf("board check of %u LEDs on %u drivers: %u ms, %u ms with faults\n",
+	 BACKLIGHT_LEDS, BACKLIGHT_DRIVERS, clean, faults);
+  return host_report("diag");
+}
@@ -0,0 +1,168 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Power governor sweep on two drivers.
+ * Streams white, random and black frames through the backlight layer
+ * and runs the queued transactions one at a time against the register
+ * files of the devices. The average LED current of the board, from
+ * the PWM and global current registers, must stay within the budget
+ * after every transaction, and the governor must bring the current
+ * back up to the budget once a bright frame is on the devices.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "backlight.h"
+#include "error.h"
+#include "host.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+_Static_assert(BACKLIGHT_DRIVERS == 2, "Build with two drivers");
+
+/** Frames of each sweep phase */
+#define WHITE_FRAMES 10
+#define RANDOM_FRAMES 30
+#define BLACK_FRAMES 10
+#define SWEEPS 8
+
+/** Frame period in ms */
+#define FRAME_MS 16
+
+static struct Backlight board;
+
+static uint32_t now;
+static unsigned txns;
+static double worst;
+
+uint32_t
+sched_now(void)
+{
+  return now;
+}
+
+/**
+ * Average LED current of the board in mA.
+ */
+static double
+current(void)
+{
+  double total = 0;
+  unsigned sum, i;
+  uint8_t chip;
+
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    for (sum = 0, i = 0; i < 192; i++)
+      sum += twi_fake.regs[chip][CRP_LED_PWM][i];
+    total += 840.0 / BACKLIGHT_REXT_KOHM *
+      twi_fake.regs[chip][CRP_FUNCTION][LFO_GLOBAL_CURRENT_CTRL] / 256 *
+      sum / 256 / BACKLIGHT_SCAN_LINES;
+  }
+  return total;
+}
+
+/**
+ * Check the current after each transaction.
+ */
+static void
+check_current(const struct twi_txn *txn, uint8_t chip)
+{
+  double ma = current();
+
+  txns++;
+  if (ma > worst)
+    worst = ma;
+  CHECK(ma <= BACKLIGHT_POWER_BUDGET_MA,
+	"%.1f mA after transaction %u at %u ms", ma, txns, now);
+}
+
+/**
+ * Send a frame and let the governor work for a frame period.
+ */
+static void
+frame(struct LedColor (*color)(void))
+{
+  uint8_t led, ms;
+
+  for (led = 0; led < BACKLIGHT_LEDS; led++)
+    backlight_led_set(&board, led, color());
+  backlight_board_flush(&board);
+  twi_fake_run();
+  for (ms = 0; ms < FRAME_MS; ms++) {
+    now++;
+    backlight_board_poll(&board);
+    twi_fake_run();
+  }
+}
+
+static struct LedColor
+white_led(void)
+{
+  return bright_white;
+}
+
+static struct LedColor
+random_led(void)
+{
+  return (struct LedColor){rnd(256), rnd(256), rnd(256)};
+}
+
+static struct LedColor
+black_led(void)
+{
+  return black;
+}
+
+int
+main(void)
+{
+  unsigned sweep, f;
+  double settled;
+
+  twi_fake.hook = check_current;
+  backlight_board_init(&board);
+  backlight_board_reset(&board);
+  twi_fake_run();
+  backlight_board_brightness(&board, 255);
+  twi_fake_run();
+
+  for (sweep = 0; sweep < SWEEPS; sweep++) {
+    for (f = 0; f < WHITE_FRAMES; f++)
+      frame(white_led);
+    /* Full white draws more than the budget, the governor ramps to it */
+    settled = current();
+    CHECK(settled > BACKLIGHT_POWER_BUDGET_MA * 0.9,
+	  "white frames settle at %.1f mA", settled);
+    for (f = 0; f < RANDOM_FRAMES; f++)
+      frame(random_led);
+    for (f = 0; f < BLACK_FRAMES; f++)
+      frame(black_led);
+    CHECK(current() == 0, "black frames draw %.1f mA", current());
+  }
+
+  printf("%u transactions, worst %.1f mA, budget %d mA\n", txns, worst,
+	 BACKLIGHT_POWER_BUDGET_MA);
+  return host_report("governor");
+}
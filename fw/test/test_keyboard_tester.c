@@ -0,0 +1,458 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Host frame streaming of keyboard_tester.c.
+ * The source is built in with its main loop renamed, so that the
+ * static frame helpers can be driven against a model of the CDC
+ * endpoints: the IN endpoint has CDC_TXRX_BANKS banks that the modelled
+ * host frees when it reads. Checks that the frames are packed in the
+ * room of the free banks without waiting for the host, that the
+ * self-test report is held back until it fits, and that the benchmark
+ * frames are whole packets that tools/cdc_bench.py decodes.
+ */
+
+#define main keyboard_tester_main
+#include "../keyboard_tester.c"
+#undef main
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "twi_fake.h"
+
+/** Benchmark duration in seconds */
+#define BENCH_SECONDS 2
+
+/** Timers the firmware may have armed at once */
+#define TIMERS 4
+
+_Static_assert(BACKLIGHT_LEDS <= DIAG_FAULTS_MAX,
+	       "The report of a faulty board is truncated");
+
+volatile uint8_t USB_DeviceState = DEVICE_STATE_Configured;
+
+static uint32_t now;
+static struct sched_timer *armed[TIMERS];
+
+/** CDC endpoints */
+static uint8_t selected;
+static struct {
+  /** Banks sent and not read by the host yet */
+  uint8_t busy;
+  /** Bytes in the bank being filled */
+  uint8_t fill;
+  /** Banks sent before they were full */
+  unsigned partial;
+} in;
+static struct {
+  uint8_t buf[CDC_TXRX_EPSIZE];
+  uint8_t len;
+  uint8_t pos;
+} out;
+
+/** Bytes sent on the IN endpoint, in order */
+static uint8_t stream[1 << 20];
+static unsigned streamed;
+
+uint32_t
+sched_now(void)
+{
+  return now;
+}
+
+void
+sched_add(struct sched_timer *timer, uint16_t delay, uint16_t period)
+{
+  uint8_t i, slot = TIMERS;
+
+  for (i = 0; i < TIMERS; i++) {
+    if (armed[i] == timer || (armed[i] == NULL && slot == TIMERS))
+      slot = i;
+  }
+  CHECK(slot < TIMERS, "more than %u timers", TIMERS);
+  if (slot == TIMERS)
+    return;
+  timer->expires = now + delay;
+  timer->period = period;
+  timer->state = SCHED_TIMER_ARMED;
+  armed[slot] = timer;
+}
+
+void
+sched_cancel(struct sched_timer *timer)
+{
+  uint8_t i;
+
+  timer->state = SCHED_TIMER_IDLE;
+  for (i = 0; i < TIMERS; i++)
+    if (armed[i] == timer)
+      armed[i] = NULL;
+}
+
+void
+sched_init(void)
+{
+}
+
+void
+sched_run(void)
+{
+}
+
+void USB_Init(uint8_t options) {}
+void USB_USBTask(void) {}
+void USB_Device_EnableSOFEvents(void) {}
+void CDC_Device_CreateStream(USB_ClassInfo_CDC_Device_t *cdc, FILE *stream) {}
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *cdc)
+{
+  return true;
+}
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *cdc) {}
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t *hid) {}
+bool HID_Device_ConfigureEndpoints(USB_ClassInfo_HID_Device_t *hid)
+{
+  return true;
+}
+void HID_Device_ProcessControlRequest(USB_ClassInfo_HID_Device_t *hid) {}
+void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t *hid) {}
+
+void
+Endpoint_SelectEndpoint(uint8_t address)
+{
+  selected = address;
+}
+
+uint8_t
+Endpoint_GetCurrentEndpoint(void)
+{
+  return selected;
+}
+
+uint8_t
+Endpoint_GetBusyBanks(void)
+{
+  CHECK(selected == CDC_TX_EPADDR, "busy banks of endpoint %02x", selected);
+  return in.busy;
+}
+
+uint16_t
+Endpoint_BytesInEndpoint(void)
+{
+  if (selected == CDC_RX_EPADDR)
+    return out.len - out.pos;
+  CHECK(selected == CDC_TX_EPADDR, "bytes in endpoint %02x", selected);
+  return in.fill;
+}
+
+bool
+Endpoint_IsReadWriteAllowed(void)
+{
+  CHECK(selected == CDC_TX_EPADDR, "write to endpoint %02x", selected);
+  return in.busy < CDC_TXRX_BANKS && in.fill < CDC_TXRX_EPSIZE;
+}
+
+bool
+Endpoint_IsOUTReceived(void)
+{
+  return selected == CDC_RX_EPADDR && out.len > 0;
+}
+
+uint8_t
+Endpoint_Read_8(void)
+{
+  CHECK(selected == CDC_RX_EPADDR && out.pos < out.len,
+	"read from endpoint %02x", selected);
+  return out.buf[out.pos++];
+}
+
+void
+Endpoint_ClearOUT(void)
+{
+  out.len = 0;
+  out.pos = 0;
+}
+
+/**
+ * Send the bank being filled.
+ */
+void
+Endpoint_ClearIN(void)
+{
+  CHECK(selected == CDC_TX_EPADDR, "send on endpoint %02x", selected);
+  CHECK(in.busy < CDC_TXRX_BANKS, "bank sent with all the banks busy");
+  if (in.fill < CDC_TXRX_EPSIZE)
+    in.partial++;
+  in.busy++;
+  in.fill = 0;
+}
+
+/**
+ * Write like LUFA, a full bank is sent before the next byte and the
+ * write waits for the host when all the banks are busy, which ends
+ * the test. Benchmark
+ * frames must fill the room of the free banks.
+ */
+uint8_t
+Endpoint_Write_Stream_LE(const void *buf, uint16_t len, uint16_t *done)
+{
+  const uint8_t *p = buf;
+  unsigned room = (CDC_TXRX_BANKS - in.busy) * CDC_TXRX_EPSIZE - in.fill;
+
+  if (room > HOST_FRAME_SIZE)
+    room = HOST_FRAME_SIZE;
+  CHECK(len < 3 || p[2] != HOST_FRAME_BENCH || len == room,
+	"benchmark frame of %u bytes in %u bytes of room", len, room);
+  while (len) {
+    if (!Endpoint_IsReadWriteAllowed()) {
+      if (in.busy < CDC_TXRX_BANKS)
+	Endpoint_ClearIN();
+      if (in.busy == CDC_TXRX_BANKS) {
+	/* The main loop would wait for the host */
+	CHECK(0, "write of %u bytes waits for the host", len);
+	exit(host_report("keyboard_tester"));
+      }
+      continue;
+    }
+    stream[streamed++] = *p++;
+    in.fill++;
+    len--;
+  }
+  return 0;
+}
+
+/**
+ * CDC_Device_USBTask flushes a partial bank.
+ */
+void
+CDC_Device_USBTask(USB_ClassInfo_CDC_Device_t *cdc)
+{
+  Endpoint_SelectEndpoint(CDC_TX_EPADDR);
+  if (in.fill > 0 && in.busy < CDC_TXRX_BANKS)
+    Endpoint_ClearIN();
+}
+
+/**
+ * The host reads all the banks sent.
+ */
+static void
+host_read(void)
+{
+  in.busy = 0;
+}
+
+/**
+ * The host sends a command.
+ */
+static void
+host_send(const uint8_t *buf, uint8_t len)
+{
+  memcpy(out.buf, buf, len);
+  out.len = len;
+  out.pos = 0;
+  processHostCommands();
+  CHECK(out.len == 0, "command bytes left in the OUT bank");
+}
+
+/**
+ * Let a ms pass, running the timers that are due and the queued
+ * transactions.
+ */
+static void
+tick(void)
+{
+  uint8_t i;
+
+  now++;
+  for (i = 0; i < TIMERS; i++) {
+    if (armed[i] && armed[i]->expires <= now) {
+      armed[i]->expires += armed[i]->period;
+      armed[i]->callback(armed[i]->arg);
+    }
+  }
+  twi_fake_run();
+}
+
+static void
+reset(void)
+{
+  memset(&in, 0, sizeof(in));
+  streamed = 0;
+  selected = 0;
+}
+
+/**
+ * Next frame of the stream from pos, 0 if the stream ends.
+ */
+static unsigned
+next_frame(unsigned pos, uint8_t *type, const uint8_t **payload,
+	   uint8_t *len)
+{
+  if (pos + CAPTURE_HEADER_SIZE > streamed)
+    return 0;
+  CHECK(stream[pos] == CAPTURE_SYNC0 && stream[pos + 1] == CAPTURE_SYNC1,
+	"no sync at %u", pos);
+  *type = stream[pos + 2];
+  *len = stream[pos + 3];
+  *payload = &stream[pos + CAPTURE_HEADER_SIZE];
+  return pos + CAPTURE_HEADER_SIZE + *len;
+}
+
+/**
+ * Stream the benchmark to a host that reads now and then, with
+ * statistics frames requested in between that leave odd room in the
+ * banks. The data frames must fill the room left, so that the banks
+ * are only ever sent full, and the pattern and summary must match the
+ * frames.
+ */
+static void
+test_bench(void)
+{
+  const uint8_t start[] = {HOST_CMD_BENCH, BENCH_SECONDS};
+  const uint8_t stats[] = {HOST_CMD_TRACE_STATS};
+  uint32_t elapsed, frames = 0, bytes = 0, summary[3];
+  const uint8_t *payload;
+  unsigned pos, next, ends = 0, ms;
+  uint8_t type, len, i;
+  uint16_t seq = 0;
+  FILE *fp;
+
+  reset();
+  host_send(start, sizeof(start));
+  /* The summary waits for room too */
+  for (ms = 0; bench.active && ms < BENCH_SECONDS * 2000; ms++) {
+    if (rnd(8) == 0)
+      host_send(stats, sizeof(stats));
+    sendHostFrames();
+    CHECK(!bench.active ||
+	  hostRoom() < CAPTURE_HEADER_SIZE + HOST_BENCH_END_SIZE,
+	  "bench: %u bytes of room left", hostRoom());
+    if (rnd(3) == 0)
+      host_read();
+    tick();
+  }
+  CHECK(!bench.active, "bench: still running");
+  CHECK(in.partial == 0, "bench: %u banks sent partial", in.partial);
+  CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
+
+  for (pos = 0; (next = next_frame(pos, &type, &payload, &len)) != 0;
+       pos = next) {
+    if (type == TRACE_FRAME_STATS)
+      continue;
+    if (type == HOST_FRAME_BENCH_END) {
+      CHECK(len == HOST_BENCH_END_SIZE, "bench: summary of %u bytes", len);
+      memset(summary, 0, sizeof(summary));
+      for (i = 0; i < HOST_BENCH_END_SIZE; i++)
+	summary[i / 4] |= (uint32_t)payload[i] << (8 * (i % 4));
+      ends++;
+      continue;
+    }
+    CHECK(type == HOST_FRAME_BENCH, "bench: frame type %02x", type);
+    CHECK(len > 2 && (payload[0] | (payload[1] << 8)) == seq,
+	  "bench: frame %u of %u bytes, sequence %u", seq, len,
+	  payload[0] | (payload[1] << 8));
+    for (i = 2; i < len; i++)
+      CHECK(payload[i] == (uint8_t)(seq + i), "bench: frame %u byte %u",
+	    seq, i);
+    frames++;
+    bytes += len;
+    seq++;
+  }
+  CHECK(pos == streamed, "bench: %u bytes after the last frame",
+	streamed - pos);
+  elapsed = summary[0];
+  CHECK(ends == 1 && elapsed >= BENCH_SECONDS * 1000 &&
+	summary[1] == frames && summary[2] == bytes,
+	"bench: %u summaries, %u ms, %u/%u frames, %u/%u bytes", ends,
+	elapsed, summary[1], frames, summary[2], bytes);
+
+  fp = fopen(CDC_BENCH_STREAM, "wb");
+  CHECK(fp != NULL, "bench: can not write %s", CDC_BENCH_STREAM);
+  if (fp == NULL)
+    return;
+  fwrite(stream, 1, streamed, fp);
+  fclose(fp);
+  CHECK(system("python3 " CDC_BENCH_TOOL " --input " CDC_BENCH_STREAM
+	       " > /dev/null") == 0, "bench: %s rejects the stream",
+	CDC_BENCH_TOOL);
+}
+
+/**
+ * A report with a fault on every LED does not fit the room left by
+ * the statistics frames, it waits until the host reads, then it is
+ * sent whole.
+ */
+static void
+test_held_back(void)
+{
+  const uint8_t diag[] = {HOST_CMD_DIAG, 0};
+  const uint8_t stats[] = {HOST_CMD_TRACE_STATS};
+  uint8_t report = CAPTURE_HEADER_SIZE + DIAG_REPORT_HEADER_SIZE +
+    BACKLIGHT_LEDS * DIAG_RECORD_SIZE;
+  const uint8_t *payload;
+  unsigned before;
+  uint8_t type, len, chip, i;
+
+  reset();
+  for (chip = 0; chip < BACKLIGHT_DRIVERS; chip++) {
+    memset(&twi_fake.regs[chip][CRP_LED_CTRL][LCO_OPEN], 0xff,
+	   LCO_SHORT - LCO_OPEN);
+    twi_fake.regs[chip][TWI_FAKE_PAGE_NONE][BCR_INTR_STATUS] = BL_INTR_OPEN;
+  }
+  for (i = 0; hostRoom() >= report && i < HOST_FRAME_SIZE; i++) {
+    host_send(stats, sizeof(stats));
+    sendHostFrames();
+  }
+  /* No trace records in the way */
+  debugConnected = false;
+  host_send(diag, sizeof(diag));
+  while (diag_busy())
+    tick();
+  debugConnected = true;
+
+  before = streamed;
+  sendHostFrames();
+  CHECK(streamed == before, "held back: %u bytes sent in %u bytes of room",
+	streamed - before, hostRoom());
+
+  host_read();
+  sendHostFrames();
+  CHECK(next_frame(before, &type, &payload, &len) == streamed &&
+	type == DIAG_FRAME_REPORT &&
+	len == report - CAPTURE_HEADER_SIZE && payload[3] == BACKLIGHT_LEDS,
+	"held back: frame %02x of %u bytes, %u faulty", type, len,
+	payload[3]);
+}
+
+int
+main(void)
+{
+  init_backlight();
+  debugConnected = true;
+
+  test_bench();
+  test_held_back();
+  return host_report("keyboard_tester");
+}
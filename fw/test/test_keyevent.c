@@ -0,0 +1,337 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Key event queue tap replay.
+ * Drives the matrix scan with modelled switch levels and replays
+ * rapid tap sequences, several of them between two HID polls, then
+ * checks that the host sees every press and release of every key.
+ * Every combination of keys is also held in turn, checking the boot
+ * and NKRO reports built for it; the test is also built with a larger
+ * pin map so that the boot report overflows.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "debounce.h"
+#include "host.h"
+#include "keyevent.h"
+#include "matrix.h"
+
+/** Raw switch levels, a packed row word for each column */
+static uint8_t raw[KEYBOARD_COLUMNS];
+
+/** Key state seen by the host */
+static uint8_t hostKeys[sizeof(KeystateBitset)];
+
+struct tally {
+  unsigned presses[KEYBOARD_KEYS];
+  unsigned releases[KEYBOARD_KEYS];
+};
+
+/** Transitions of the switches and transitions seen by the host */
+static struct tally sent, seen;
+static unsigned reports;
+
+/**
+ * Row pins read the switches of the columns that are driven high.
+ */
+uint8_t
+host_pin_read(uint8_t port)
+{
+  uint8_t ports[] = {PORTB, PORTC, PORTD, PORTE, PORTF};
+  uint8_t rows = 0, pins = 0;
+
+#define DRIVEN_COLUMN(idx, P, bit)					\
+  if (ports[HOST_PORT_##P] & (1 << (bit)))				\
+    rows |= raw[idx];
+#define ROW_PIN(idx, P, bit)						\
+  if (HOST_PORT_##P == port && (rows & (1 << (idx))))			\
+    pins |= 1 << (bit);
+
+  MATRIX_COLUMN_PINS(DRIVEN_COLUMN)
+  MATRIX_ROW_PINS(ROW_PIN)
+
+  return pins;
+}
+
+static bool
+key_get(const uint8_t *keys, uint8_t key)
+{
+  return keys[key / 8] & (1 << (key % 8));
+}
+
+/**
+ * Set the level of a switch, counting the transitions.
+ */
+static void
+key_set(uint8_t key, bool level)
+{
+  uint8_t col = IDX2C(key), bit = 1 << IDX2R(key);
+
+  if (!!(raw[col] & bit) == level)
+    return;
+  raw[col] ^= bit;
+  if (level)
+    sent.presses[key]++;
+  else
+    sent.releases[key]++;
+}
+
+/**
+ * HID poll of the report endpoint, with the host tracking the key
+ * transitions in the NKRO reports.
+ */
+static void
+poll(void)
+{
+  USB_NKROReport_Data_t report;
+  uint16_t size;
+  uint8_t key;
+  bool down;
+
+  if (!matrixFetchKeyboardReport(&report, &size, true, true))
+    return;
+  reports++;
+  for (key = 0; key < KEYBOARD_KEYS; key++) {
+    down = key_get(report.KeyBitmap, key);
+    if (down == key_get(hostKeys, key))
+      continue;
+    if (down)
+      seen.presses[key]++;
+    else
+      seen.releases[key]++;
+  }
+  memcpy(hostKeys, report.KeyBitmap, sizeof(hostKeys));
+}
+
+/**
+ * Poll until the queued events are all reported.
+ */
+static void
+drain(void)
+{
+  unsigned i;
+
+  for (i = 0; i < 2 * KEYEVENT_QUEUE_SIZE; i++)
+    poll();
+}
+
+static void
+reset(enum DebounceMode mode)
+{
+  uint8_t row, col;
+
+  matrixReset();
+  for (row = 0; row < KEYBOARD_ROWS; row++)
+    for (col = 0; col < KEYBOARD_COLUMNS; col++)
+      debounceSetWindow(row, col, 0, 0);
+  debounceSetMode(mode);
+  memset(raw, 0, sizeof(raw));
+  memset(hostKeys, 0, sizeof(hostKeys));
+  memset(&sent, 0, sizeof(sent));
+  memset(&seen, 0, sizeof(seen));
+  reports = 0;
+}
+
+static void
+check_tally(const char *name)
+{
+  uint8_t key;
+
+  for (key = 0; key < KEYBOARD_KEYS; key++) {
+    CHECK(seen.presses[key] == sent.presses[key] &&
+	  seen.releases[key] == sent.releases[key],
+	  "%s: key %u sent %u/%u transitions, host saw %u/%u", name, key,
+	  sent.presses[key], sent.releases[key], seen.presses[key],
+	  seen.releases[key]);
+  }
+}
+
+/**
+ * Bursts of taps on all the keys, one scan down and one scan up, with
+ * no poll in between, then polls on idle scans until the queue drains.
+ * Every event needs its own report.
+ */
+static void
+test_burst(void)
+{
+  unsigned round, i;
+  uint8_t key, taps = KEYEVENT_QUEUE_SIZE / KEYBOARD_KEYS / 2;
+
+  reset(DEBOUNCE_PER_KEY);
+  for (round = 0; round < 50; round++) {
+    for (i = 0; i < 2 * taps; i++) {
+      for (key = 0; key < KEYBOARD_KEYS; key++)
+	key_set(key, i % 2 == 0);
+      matrixScan();
+    }
+    for (i = 0; i < 2 * taps + 1; i++) {
+      poll();
+      matrixScan();
+    }
+  }
+  drain();
+  check_tally("burst");
+  CHECK(reports == 50 * 2 * taps, "burst: %u taps reported in %u reports",
+	50 * taps, reports);
+}
+
+/**
+ * Random taps, two keys change per scan on average, with a random
+ * number of polls between scans, at one poll per scan on average.
+ */
+static void
+test_random(void)
+{
+  unsigned i;
+  uint8_t key, p;
+
+  reset(DEBOUNCE_PER_KEY);
+  for (i = 0; i < 20000; i++) {
+    for (key = 0; key < KEYBOARD_KEYS; key++)
+      if (rnd(KEYBOARD_KEYS / 2) == 0)
+	key_set(key, !(raw[IDX2C(key)] & (1 << IDX2R(key))));
+    matrixScan();
+    for (p = rnd(3); p > 0; p--)
+      poll();
+  }
+  drain();
+  check_tally("random");
+}
+
+/**
+ * The shortest taps that pass the default eager debounce.
+ */
+static void
+test_eager(void)
+{
+  unsigned i;
+  uint8_t key, s;
+
+  reset(DEBOUNCE_EAGER);
+  for (i = 0; i < 100; i++) {
+    key = rnd(KEYBOARD_KEYS);
+    key_set(key, true);
+    matrixScan();
+    key_set(key, false);
+    /* Releases are deferred by the window */
+    for (s = 0; s < DEBOUNCE_WINDOW_MAX + 1; s++)
+      matrixScan();
+    poll();
+  }
+  drain();
+  check_tally("eager");
+}
+
+/**
+ * Without polls the queue overflows, the host must then resync with
+ * the current key state.
+ */
+static void
+test_overflow(void)
+{
+  unsigned i;
+  uint8_t key;
+
+  reset(DEBOUNCE_PER_KEY);
+  for (i = 0; i < KEYEVENT_QUEUE_SIZE + 1; i++) {
+    for (key = 0; key < KEYBOARD_KEYS; key++)
+      key_set(key, i % 2 == 0);
+    matrixScan();
+  }
+  drain();
+  for (key = 0; key < KEYBOARD_KEYS; key++)
+    CHECK(key_get(hostKeys, key) == !!(raw[IDX2C(key)] & (1 << IDX2R(key))),
+	  "overflow: key %u out of sync", key);
+}
+
+_Static_assert(KEYBOARD_KEYS <= 16, "Too many keys for every combination");
+
+/**
+ * Hold every combination of keys and check the report of the given
+ * protocol once the events are consumed through it. The boot report
+ * carries the first six keys in key index order, the NKRO report
+ * exactly the keys held.
+ */
+static void
+test_rollover(bool nkro)
+{
+  const char *name = nkro ? "rollover nkro" : "rollover boot";
+  union {
+    USB_KeyboardReport_Data_t boot;
+    USB_NKROReport_Data_t nkro;
+  } report;
+  uint8_t expect[sizeof(report.nkro.KeyBitmap)];
+  unsigned combo, i;
+  uint16_t size;
+  uint8_t key, n;
+
+  reset(DEBOUNCE_PER_KEY);
+  for (combo = 0; combo < (1U << KEYBOARD_KEYS); combo++) {
+    for (key = 0; key < KEYBOARD_KEYS; key++)
+      key_set(key, combo & (1U << key));
+    matrixScan();
+    for (i = 0; i < 2 * KEYEVENT_QUEUE_SIZE; i++)
+      matrixFetchKeyboardReport(&report, &size, nkro, true);
+    matrixFetchKeyboardReport(&report, &size, nkro, false);
+
+    if (nkro) {
+      memset(expect, 0, sizeof(expect));
+      for (key = 0; key < KEYBOARD_KEYS; key++)
+	if (combo & (1U << key))
+	  expect[key / 8] |= 1 << (key % 8);
+      CHECK(size == sizeof(report.nkro) &&
+	    memcmp(report.nkro.KeyBitmap, expect, sizeof(expect)) == 0,
+	    "%s: keys %04x reported as %02x%02x", name, combo,
+	    report.nkro.KeyBitmap[1], report.nkro.KeyBitmap[0]);
+      continue;
+    }
+    CHECK(size == sizeof(report.boot) && report.boot.Modifier == 0,
+	  "%s: keys %04x report size %u", name, combo, size);
+    for (key = 0, n = 0; key < KEYBOARD_KEYS && n < 6; key++) {
+      if (!(combo & (1U << key)))
+	continue;
+      CHECK(report.boot.KeyCode[n] == KEYBOARD_USAGE_BASE + key,
+	    "%s: keys %04x slot %u holds %02x, not key %u", name, combo,
+	    n, report.boot.KeyCode[n], key);
+      n++;
+    }
+    for (; n < 6; n++)
+      CHECK(report.boot.KeyCode[n] == 0, "%s: keys %04x slot %u holds %02x",
+	    name, combo, n, report.boot.KeyCode[n]);
+  }
+}
+
+int
+main(void)
+{
+  test_burst();
+  test_random();
+  test_eager();
+  test_overflow();
+  test_rollover(false);
+  test_rollover(true);
+  return host_report("keyevent");
+}
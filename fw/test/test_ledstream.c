@@ -0,0 +1,307 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Backlight frame stream loopback.
+ * Feeds encoded frames to the decoder the way the host command
+ * parser does, then checks the driver state against the frames and
+ * the statistics against the stream. The stream of tools/led_stream.py
+ * is replayed too. Malformed frames must be dropped whole, none of
+ * their bytes may reach the command parser.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backlight.h"
+#include "error.h"
+#include "host.h"
+#include "ledstream.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+/** Frames in the random loopback */
+#define FRAMES 500
+
+static struct Backlight board;
+/** Driver state expected from the frames */
+static struct Backlight expect;
+
+/** Bytes outside of a frame that are not the frame command */
+static unsigned strays;
+
+/** Encoder output */
+static uint8_t stream[1024];
+static unsigned used;
+
+static struct LedColor colors[BACKLIGHT_LEDS];
+
+/**
+ * Host command parser, as far as frames are concerned.
+ */
+static void
+feed(const uint8_t *buf, unsigned len)
+{
+  for (unsigned i = 0; i < len; i++) {
+    if (ledstream_active())
+      ledstream_feed(buf[i]);
+    else if (buf[i] == 'f')
+      ledstream_begin();
+    else
+      strays++;
+  }
+}
+
+static void
+put(uint8_t byte)
+{
+  stream[used++] = byte;
+}
+
+/**
+ * Start a frame, the body length is patched by frame_end.
+ */
+static void
+frame_begin(uint8_t seq, uint8_t type)
+{
+  used = 0;
+  put('f');
+  put(seq);
+  put(type);
+  put(0);
+  put(0);
+}
+
+static void
+frame_end(void)
+{
+  uint16_t length = used - 5;
+
+  stream[3] = length & 0xff;
+  stream[4] = length >> 8;
+}
+
+static void
+put_color(uint8_t led)
+{
+  put(colors[led].r);
+  put(colors[led].g);
+  put(colors[led].b);
+  backlight_led_set(&expect, led, colors[led]);
+}
+
+struct stats {
+  uint16_t frames;
+  uint16_t dropped;
+  uint16_t errors;
+};
+
+static struct stats
+fetch_stats(void)
+{
+  uint8_t buf[LEDSTREAM_STATS_SIZE];
+  const uint8_t *p = buf + CAPTURE_HEADER_SIZE;
+  struct stats st;
+
+  ledstream_request_stats();
+  CHECK(ledstream_fetch_stats(buf, sizeof(buf)) == sizeof(buf),
+	"no statistics");
+  st.frames = p[0] | (p[1] << 8);
+  st.dropped = p[2] | (p[3] << 8);
+  st.errors = p[4] | (p[5] << 8);
+  return st;
+}
+
+static void
+check_leds(const char *name)
+{
+  CHECK(memcmp(board.chip[0].is_pwm, expect.chip[0].is_pwm,
+	       sizeof(board.chip[0].is_pwm)) == 0,
+	"%s: driver state differs from the frames", name);
+}
+
+/**
+ * Random full and delta frames, every frame must land in the
+ * driver state.
+ */
+static void
+test_loopback(void)
+{
+  struct stats st;
+  uint8_t led, start, n, runs, *count;
+  unsigned f;
+
+  for (f = 0; f < FRAMES; f++) {
+    if (f % 10 == 0) {
+      frame_begin(f, LEDSTREAM_FULL);
+      put(BACKLIGHT_LEDS);
+      for (led = 0; led < BACKLIGHT_LEDS; led++) {
+	colors[led] = (struct LedColor){rnd(255), rnd(255), rnd(255)};
+	put_color(led);
+      }
+    } else {
+      frame_begin(f, LEDSTREAM_DELTA);
+      count = &stream[used];
+      put(0);
+      for (runs = 0, start = rnd(3); start < BACKLIGHT_LEDS;
+	   start += n + 1 + rnd(3), runs++) {
+	n = 1 + rnd(BACKLIGHT_LEDS - start);
+	put(start);
+	put(n);
+	for (led = start; led < start + n; led++) {
+	  colors[led].g = rnd(255);
+	  put_color(led);
+	}
+      }
+      *count = runs;
+    }
+    frame_end();
+    feed(stream, used);
+    check_leds("loopback");
+  }
+
+  st = fetch_stats();
+  CHECK(st.frames == FRAMES && st.dropped == 0 && st.errors == 0,
+	"loopback: %u frames, %u dropped, %u errors", st.frames,
+	st.dropped, st.errors);
+  CHECK(strays == 0, "loopback: %u stray bytes", strays);
+}
+
+/**
+ * Replay the stream encoded by tools/led_stream.py.
+ */
+static void
+test_tool(void)
+{
+  static uint8_t buf[65536];
+  struct stats st;
+  unsigned len, frames = 0;
+  FILE *fp;
+
+  fp = fopen(LEDSTREAM_TOOL_STREAM, "rb");
+  CHECK(fp != NULL, "tool: can not open %s", LEDSTREAM_TOOL_STREAM);
+  if (fp == NULL)
+    return;
+  len = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+
+  strays = 0;
+  for (unsigned i = 0; i < len; i++) {
+    if (!ledstream_active() && buf[i] == 'f')
+      frames++;
+    feed(&buf[i], 1);
+  }
+  st = fetch_stats();
+  CHECK(frames > 0 && st.frames == frames && st.errors == 0 &&
+	st.dropped == 0, "tool: %u frames sent, %u decoded, %u dropped,"
+	" %u errors", frames, st.frames, st.dropped, st.errors);
+  CHECK(strays == 0, "tool: %u stray bytes", strays);
+}
+
+/**
+ * Send a malformed frame whose body holds host command bytes, then
+ * a good frame that must still be decoded.
+ */
+static void
+check_malformed(const char *name)
+{
+  struct stats st;
+  uint8_t led;
+
+  frame_end();
+  feed(stream, used);
+
+  frame_begin(1, LEDSTREAM_FULL);
+  put(BACKLIGHT_LEDS);
+  for (led = 0; led < BACKLIGHT_LEDS; led++) {
+    colors[led] = (struct LedColor){led, 2 * led, 3 * led};
+    put_color(led);
+  }
+  frame_end();
+  feed(stream, used);
+
+  st = fetch_stats();
+  CHECK(st.frames == 1 && st.errors == 1, "%s: %u frames, %u errors",
+	name, st.frames, st.errors);
+  CHECK(strays == 0, "%s: %u stray bytes", name, strays);
+  check_leds(name);
+  strays = 0;
+}
+
+static void
+test_malformed(void)
+{
+  /* Run past the end of the LED table */
+  frame_begin(0, LEDSTREAM_DELTA);
+  put(2);
+  put(BACKLIGHT_LEDS - 1);
+  put(3);
+  put('c'); put('d'); put('b');
+  put('d'); put('c'); put('b');
+  put('b'); put('d'); put('c');
+  put(0);
+  put(1);
+  put('c'); put('d'); put('b');
+  check_malformed("overrun");
+
+  /* Unknown frame type */
+  frame_begin(0, 7);
+  put(2);
+  put('c'); put('d'); put('b');
+  check_malformed("type");
+
+  /* Full frame with more LEDs than the table */
+  frame_begin(0, LEDSTREAM_FULL);
+  put(BACKLIGHT_LEDS + 1);
+  for (uint8_t led = 0; led <= BACKLIGHT_LEDS; led++) {
+    put('c'); put('d'); put('b');
+  }
+  check_malformed("count");
+
+  /* Bytes after the end of the frame */
+  frame_begin(0, LEDSTREAM_DELTA);
+  put(0);
+  put('c'); put('d');
+  check_malformed("trailing");
+
+  /* Body shorter than the frame, the decoder stops at the length */
+  frame_begin(0, LEDSTREAM_FULL);
+  put(BACKLIGHT_LEDS);
+  put(1); put(2);
+  check_malformed("short");
+}
+
+int
+main(void)
+{
+  twi_fake.immediate = true;
+  backlight_board_init(&board);
+  backlight_board_init(&expect);
+  ledstream_init(&board);
+
+  test_loopback();
+  test_tool();
+  test_malformed();
+  return host_report("ledstream");
+}
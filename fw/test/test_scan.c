@@ -0,0 +1,173 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Matrix scan benchmark.
+ * Runs the scan on idle switches and on switches that all change on
+ * every scan, with the pin map of the build (see MATRIX_PINMAP). The
+ * row ports must be read once per column whatever the number of rows,
+ * an idle scan must not queue anything and after a busy one the host
+ * must see every key. The host time per scan only compares the pin
+ * maps and the two cases with each other; the cycles on the target
+ * need a simulator.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "debounce.h"
+#include "host.h"
+#include "keyevent.h"
+#include "matrix.h"
+
+/** Scans of each run, the best of RUNS runs is kept */
+#define SCANS 50000
+#define RUNS 5
+
+/**
+ * Level of every switch, all the keys are pressed or released
+ * together so that the pin model does not depend on the column.
+ */
+static bool level;
+
+/** Row port reads */
+static unsigned long reads;
+
+/**
+ * Row pins read the level of the switches.
+ */
+uint8_t
+host_pin_read(uint8_t port)
+{
+  static const uint8_t rows[] = {
+    MATRIX_ROW_MASK(B), MATRIX_ROW_MASK(C), MATRIX_ROW_MASK(D),
+    MATRIX_ROW_MASK(E), MATRIX_ROW_MASK(F),
+  };
+
+  reads++;
+  return level ? rows[port] : 0;
+}
+
+static void
+reset(void)
+{
+  uint8_t row, col;
+
+  matrixReset();
+  for (row = 0; row < KEYBOARD_ROWS; row++)
+    for (col = 0; col < KEYBOARD_COLUMNS; col++)
+      debounceSetWindow(row, col, 0, 0);
+  debounceSetMode(DEBOUNCE_PER_KEY);
+  level = false;
+  reads = 0;
+}
+
+/**
+ * Flip every switch if busy, then scan.
+ */
+static void
+scan(bool busy)
+{
+  if (busy)
+    level = !level;
+  matrixScan();
+}
+
+/**
+ * Check the port reads of a scan, and that the host sees the key
+ * state of the switches after a busy one. The key event queue is
+ * shorter than the larger matrices, the report path then resyncs
+ * with the key state of the scan.
+ */
+static void
+check_scan(bool busy, unsigned row_ports)
+{
+  const char *name = busy ? "busy" : "idle";
+  USB_NKROReport_Data_t report;
+  keyevent_t ev;
+  uint16_t size;
+  uint8_t key;
+  unsigned i, k;
+
+  reset();
+  for (i = 0; i < 100; i++) {
+    scan(busy);
+    if (!busy) {
+      CHECK(!keyeventPeek(&ev), "idle: key event queued");
+      continue;
+    }
+    for (k = 0; k < KEYEVENT_QUEUE_SIZE; k++)
+      matrixFetchKeyboardReport(&report, &size, true, true);
+    for (key = 0; key < KEYBOARD_KEYS; key++)
+      CHECK(!!(report.KeyBitmap[key / 8] & (1 << (key % 8))) == level,
+	    "busy: key %u out of sync after scan %u", key, i);
+  }
+  CHECK(reads == 100UL * KEYBOARD_COLUMNS * row_ports,
+	"%s: %.1f row port reads per scan, %u expected", name,
+	reads / 100.0, KEYBOARD_COLUMNS * row_ports);
+}
+
+/**
+ * Run SCANS scans, the key events are dropped after each scan as
+ * the report path would consume them.
+ *
+ * \return The host time per scan in ns.
+ */
+static double
+bench(bool busy)
+{
+  double start, ns, best = 0;
+  unsigned i, run;
+
+  for (run = 0; run < RUNS; run++) {
+    reset();
+    start = now_ns();
+    for (i = 0; i < SCANS; i++) {
+      scan(busy);
+      keyeventReset();
+    }
+    ns = (now_ns() - start) / SCANS;
+    if (run == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+int
+main(void)
+{
+  unsigned row_ports = !!MATRIX_ROW_MASK(B) + !!MATRIX_ROW_MASK(C) +
+    !!MATRIX_ROW_MASK(D) + !!MATRIX_ROW_MASK(E) + !!MATRIX_ROW_MASK(F);
+  double idle, busy;
+
+  check_scan(false, row_ports);
+  check_scan(true, row_ports);
+  idle = bench(false);
+  busy = bench(true);
+
+  printf("scan %ux%-2u %u row port%s %2u port reads, idle %5.1f ns, "
+	 "busy %6.1f ns with %3u keys changing\n", KEYBOARD_ROWS,
+	 KEYBOARD_COLUMNS, row_ports, (row_ports > 1) ? "s," : ", ",
+	 KEYBOARD_COLUMNS * row_ports, idle, busy, KEYBOARD_KEYS);
+  return host_report("scan");
+}
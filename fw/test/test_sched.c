@@ -0,0 +1,211 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Timer wheel test.
+ * TIMER 3 is modelled one tick at a time, the compare interrupt runs
+ * when the count reaches OCR3A and the main loop calls sched_run at
+ * a fixed interval. Checks that callbacks never run early, run in
+ * expiration order and late by at most one ms, and that periodic
+ * timers keep their phase after a late callback.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <avr/io.h>
+
+#include "host.h"
+#include "sched.h"
+
+void TIMER3_COMPA_vect(void);
+
+#define TIMERS 300
+
+/** Ticks between two sched_run calls */
+#define RUN_TICKS 50
+
+/** Ticks since sched_init, TCNT3 is the low 16 bits */
+static uint32_t ticks;
+
+static struct sched_timer timers[TIMERS];
+
+/** Expected state of each timer */
+static struct {
+  uint32_t due;
+  uint16_t period;
+  unsigned runs;
+  /** Runs after which the callback cancels the timer, 0 for never */
+  unsigned cancel;
+} model[TIMERS];
+
+/** Callbacks run, and the latest deadline seen so far */
+static unsigned runs;
+static uint32_t last_due;
+static int max_late;
+
+static uint32_t
+now_ms(void)
+{
+  return ticks / SCHED_TICKS_PER_MS;
+}
+
+/**
+ * Run the clock for the given number of ticks, with the main loop
+ * calling sched_run every run ticks, or never if run is 0.
+ */
+static void
+advance(uint32_t n, uint32_t run)
+{
+  while (n--) {
+    ticks++;
+    TCNT3 = ticks;
+    if ((TIMSK3 & (1 << OCIE3A)) && TCNT3 == OCR3A)
+      TIMER3_COMPA_vect();
+    if (run && ticks % run == 0)
+      sched_run();
+  }
+}
+
+static void
+expired(void *arg)
+{
+  int i = (int)(long)arg;
+  int late = now_ms() - model[i].due;
+
+  CHECK(late >= 0, "timer %d early by %d ms", i, -late);
+  CHECK(model[i].due >= last_due, "timer %d due %u after one due %u",
+	i, model[i].due, last_due);
+  if (late > max_late)
+    max_late = late;
+  last_due = model[i].due;
+  runs++;
+  model[i].runs++;
+  if (model[i].period)
+    model[i].due += model[i].period;
+  if (model[i].runs == model[i].cancel)
+    sched_cancel(&timers[i]);
+}
+
+static void
+reset(void)
+{
+  ticks = 0;
+  TCNT3 = 0;
+  runs = 0;
+  last_due = 0;
+  max_late = 0;
+  sched_init();
+}
+
+/**
+ * Random one-shot and periodic timers, some cancelled by their own
+ * callback, over a few revolutions of the wheel.
+ */
+static void
+test_wheel(void)
+{
+  uint16_t delay;
+  unsigned i, expected = 0;
+
+  reset();
+  for (i = 0; i < TIMERS; i++) {
+    timers[i] = (struct sched_timer)SCHED_TIMER_INIT(expired, (void *)(long)i);
+    delay = 1 + rnd(2000);
+    model[i].due = delay;
+    model[i].period = (i % 3 == 0) ? 1 + rnd(100) : 0;
+    model[i].runs = 0;
+    model[i].cancel = (i % 7 == 0) ? 3 : 0;
+    sched_add(&timers[i], delay, model[i].period);
+  }
+
+  advance(5000UL * SCHED_TICKS_PER_MS, RUN_TICKS);
+
+  for (i = 0; i < TIMERS; i++) {
+    if (model[i].period == 0)
+      CHECK(model[i].runs == 1, "one-shot %u ran %u times", i,
+	    model[i].runs);
+    else if (model[i].cancel)
+      CHECK(model[i].runs == model[i].cancel,
+	    "timer %u ran %u times after the cancel", i, model[i].runs);
+    else
+      expected += model[i].runs;
+  }
+  CHECK(max_late <= 1, "callbacks late by %d ms", max_late);
+  CHECK(expected > 0 && runs > TIMERS, "only %u callbacks", runs);
+
+  for (i = 0; i < TIMERS; i++)
+    sched_cancel(&timers[i]);
+}
+
+static void
+tick(void *arg)
+{
+}
+
+/**
+ * A periodic callback delayed past its next deadline by a busy main
+ * loop runs as soon as the main loop is back, then at the next
+ * deadline in phase, not a wheel revolution later. Other timers
+ * make the interrupt walk the wheel past the missed deadline.
+ */
+static void
+test_late(void)
+{
+  struct sched_timer *t = &timers[0];
+  unsigned i;
+
+  reset();
+  *t = (struct sched_timer)SCHED_TIMER_INIT(expired, (void *)0L);
+  model[0].due = 10;
+  model[0].period = 10;
+  model[0].runs = 0;
+  model[0].cancel = 0;
+  sched_add(t, 10, 10);
+  for (i = 1; i < 5; i++) {
+    timers[i] = (struct sched_timer)SCHED_TIMER_INIT(tick, NULL);
+    sched_add(&timers[i], 20 + i, 0);
+  }
+
+  /* The main loop is busy from 0 to 25 ms */
+  advance(25UL * SCHED_TICKS_PER_MS, 0);
+  CHECK(model[0].runs == 0, "callback ran with a busy main loop");
+  sched_run();
+  CHECK(model[0].runs == 1, "late callback ran %u times", model[0].runs);
+
+  /* The 20 ms deadline was missed, the next one is at 30 ms */
+  model[0].due = 30;
+  max_late = 0;
+  advance(10UL * SCHED_TICKS_PER_MS, RUN_TICKS);
+  CHECK(model[0].runs == 2, "%u runs by 35 ms, expected 2", model[0].runs);
+  CHECK(max_late <= 1, "callback late by %d ms", max_late);
+  sched_cancel(t);
+}
+
+int
+main(void)
+{
+  test_wheel();
+  test_late();
+  return host_report("sched");
+}
@@ -0,0 +1,277 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Trace ring flood.
+ * A timer signal plays the part of an interrupt that floods the ring
+ * while the main loop logs records too and drains the ring in chunks
+ * of random size, as the endpoint room allows, with pauses that let
+ * the ring overflow. The chunks are
+ * reassembled and every record is checked: records must arrive whole
+ * and in order, the first record offset of each chunk must match the
+ * record boundaries, and the records received plus the records
+ * dropped must add up to the records logged.
+ * The host time of a trace call is then compared with the time of the
+ * same message printed with fprintf, as the text debug build does.
+ */
+
+#define TRACE_FILE TRACE_FILE_MATRIX
+
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <util/atomic.h>
+
+#include "capture.h"
+#include "host.h"
+#include "keyboard_tester.h"
+#include "trace.h"
+
+/** Interrupts to simulate */
+#define ISR_CALLS 5000
+
+/** Interrupts in each period the host does not read the trace */
+#define STALL_CALLS 250
+
+/** Records logged by each interrupt */
+#define ISR_RECORDS 3
+
+/** Calls of the trace and fprintf benchmark */
+#define BENCH_CALLS 1000000
+
+/** Calls between two drains of the ring, their records fit in it */
+#define BENCH_BATCH 4
+
+/** Tokens of the two writers */
+#define TOKEN_ISR TRACE_TOKEN(TRACE_FILE_KEYBOARD_TESTER, 1)
+#define TOKEN_MAIN TRACE_TOKEN(TRACE_FILE_MATRIX, 2)
+
+static volatile uint32_t isr_calls;
+static volatile uint32_t isr_seq;
+static uint32_t main_seq;
+
+/** Reassembly of the chunk payloads */
+static struct {
+  uint8_t rec[TRACE_RECORD_HEADER + TRACE_ARGS_MAX];
+  uint8_t have;
+  uint32_t isr_next;
+  uint32_t main_next;
+  uint32_t isr_seen;
+  uint32_t main_seen;
+  uint32_t chunks;
+} rx;
+
+/**
+ * Arguments of a record, the sequence number and check bytes.
+ */
+static uint8_t
+pack(uint8_t *args, uint32_t seq)
+{
+  uint8_t len = (seq % 2) ? 6 : 4;
+
+  memcpy(args, &seq, 4);
+  args[4] = seq ^ 0x5A;
+  args[5] = ~seq;
+  return len;
+}
+
+static void
+isr(int sig)
+{
+  uint8_t args[6], len;
+
+  for (int i = 0; i < ISR_RECORDS; i++) {
+    len = pack(args, isr_seq);
+    isr_seq++;
+    trace_log(TOKEN_ISR, args, len);
+  }
+  isr_calls++;
+}
+
+static void
+check_record(const uint8_t *rec)
+{
+  uint16_t token = rec[1] | (rec[2] << 8);
+  uint8_t len = rec[0] - TRACE_RECORD_HEADER, expect[6];
+  uint32_t seq;
+
+  memcpy(&seq, &rec[TRACE_RECORD_HEADER], 4);
+  CHECK(len == pack(expect, seq) &&
+	memcmp(expect, &rec[TRACE_RECORD_HEADER], len) == 0,
+	"record %u of %04x torn", seq, token);
+
+  if (token == TOKEN_ISR) {
+    CHECK(seq >= rx.isr_next, "interrupt record %u after %u", seq,
+	  rx.isr_next);
+    rx.isr_next = seq + 1;
+    rx.isr_seen++;
+  } else if (token == TOKEN_MAIN) {
+    CHECK(seq >= rx.main_next, "main record %u after %u", seq,
+	  rx.main_next);
+    rx.main_next = seq + 1;
+    rx.main_seen++;
+  } else {
+    CHECK(0, "unknown token %04x", token);
+  }
+}
+
+/**
+ * Reassemble the records of a chunk.
+ */
+static void
+receive(const uint8_t *buf, uint8_t size)
+{
+  const uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint8_t len = buf[3], first = 0xFF;
+
+  CHECK(buf[0] == CAPTURE_SYNC0 && buf[1] == CAPTURE_SYNC1 &&
+	buf[2] == TRACE_FRAME && size == CAPTURE_HEADER_SIZE + len,
+	"bad chunk header");
+  rx.chunks++;
+
+  for (uint8_t i = 1; i < len; i++) {
+    if (rx.have == 0 && first == 0xFF)
+      first = i - 1;
+    rx.rec[rx.have++] = payload[i];
+    if (rx.have == 1 && (rx.rec[0] <= TRACE_RECORD_HEADER ||
+			 rx.rec[0] > sizeof(rx.rec))) {
+      CHECK(0, "record length %u", rx.rec[0]);
+      rx.have = 0;
+    }
+    if (rx.have > 0 && rx.have == rx.rec[0]) {
+      check_record(rx.rec);
+      rx.have = 0;
+    }
+  }
+  CHECK(payload[0] == first, "chunk %u first %u, record at %u", rx.chunks,
+	payload[0], first);
+}
+
+static uint16_t
+dropped(void)
+{
+  uint8_t buf[TRACE_STATS_SIZE];
+
+  trace_request_stats();
+  CHECK(trace_fetch_stats(buf, sizeof(buf)) == sizeof(buf), "no stats");
+  return buf[CAPTURE_HEADER_SIZE] | (buf[CAPTURE_HEADER_SIZE + 1] << 8);
+}
+
+/**
+ * Host time of a trace call with the arguments of the backlight_set
+ * message, and of the same message printed to /dev/null. The ring is
+ * drained between batches of calls, the drain is part of the cost of
+ * the records as it is on the target. The atomic block of
+ * the host masks the signals with two system calls, a cli and a sei on
+ * the target, its cost is measured apart and taken out.
+ */
+static void
+bench(void)
+{
+  uint8_t buf[TRACE_RING_SIZE];
+  double start, trace_ns, atomic_ns, text_ns;
+  volatile uint8_t row = 3, col = 7, pwm = 200;
+  uint16_t lost = dropped();
+  unsigned i, j;
+  FILE *fp;
+
+  debugConnected = true;
+  start = now_ns();
+  for (i = 0; i < BENCH_CALLS; i += BENCH_BATCH) {
+    for (j = 0; j < BENCH_BATCH; j++)
+      TRACE("[%s] row %hhu col %hhu pwm %hhu\r\n", __func__, row, col, pwm);
+    while (trace_fetch_frame(buf, sizeof(buf)) != 0)
+      ;
+  }
+  trace_ns = (now_ns() - start) / BENCH_CALLS;
+  CHECK(dropped() == lost, "bench: records dropped");
+
+  start = now_ns();
+  for (i = 0; i < BENCH_CALLS; i++) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      row++;
+    }
+  }
+  atomic_ns = (now_ns() - start) / BENCH_CALLS;
+
+  fp = fopen("/dev/null", "w");
+  CHECK(fp != NULL, "bench: can not open /dev/null");
+  if (fp == NULL)
+    return;
+  start = now_ns();
+  for (i = 0; i < BENCH_CALLS; i++)
+    fprintf(fp, "[%s] row %hhu col %hhu pwm %hhu\r\n", __func__, row, col,
+	    pwm);
+  text_ns = (now_ns() - start) / BENCH_CALLS;
+  fclose(fp);
+
+  printf("trace call and drain %.1f ns, %.1f ns without the host atomic block, "
+	 "fprintf %.1f ns\n", trace_ns, trace_ns - atomic_ns, text_ns);
+}
+
+int
+main(void)
+{
+  struct itimerval it = {{0, 50}, {0, 50}};
+  uint8_t buf[32], args[6], len, size;
+  uint32_t logged;
+  uint16_t lost;
+
+  signal(SIGALRM, isr);
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  while (isr_calls < ISR_CALLS) {
+    /* The host stops reading now and then, the ring overflows */
+    if (isr_calls / STALL_CALLS % 4 == 3)
+      continue;
+    if (rnd(4) == 0) {
+      len = pack(args, main_seq);
+      main_seq++;
+      trace_log(TOKEN_MAIN, args, len);
+    }
+    /* Room left in a 16 byte bank */
+    size = trace_fetch_frame(buf, TRACE_CHUNK_MIN + rnd(11));
+    if (size)
+      receive(buf, size);
+  }
+
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_REAL, &it, NULL);
+  while ((size = trace_fetch_frame(buf, 16)) != 0)
+    receive(buf, size);
+
+  lost = dropped();
+  logged = isr_seq + main_seq;
+  printf("%u records logged, %u received in %u chunks, %u dropped\n",
+	 logged, rx.isr_seen + rx.main_seen, rx.chunks, lost);
+  CHECK(rx.have == 0, "partial record left");
+  CHECK(lost < 0xffff && rx.isr_seen + rx.main_seen + lost == logged,
+	"%u + %u received, %u dropped, %u logged", rx.isr_seen,
+	rx.main_seen, lost, logged);
+  CHECK(rx.isr_seen > 0 && rx.main_seen > 0, "a writer is missing");
+
+  bench();
+  return host_report("trace");
+}
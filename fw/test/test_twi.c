@@ -0,0 +1,512 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * TWI engine test against a simulated bus.
+ * The bus model acts on the TWCR values written by the engine, like
+ * the TWI hardware, and raises the TWI interrupt. The devices on the
+ * bus have paged registers behind a page lock, like the backlight
+ * drivers. The scheduler is replaced by a single timer that the tests
+ * fire by hand to run the watchdog.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <util/twi.h>
+
+#include "error.h"
+#include "host.h"
+#include "sched.h"
+#include "twi.h"
+
+void TWI_vect(void);
+
+#define DEVICES 2
+#define PAGES 4
+
+/** Address of a device that does not acknowledge */
+#define ABSENT_ADDR 0xA8
+
+struct sim_device {
+  uint8_t addr;
+  uint8_t regs[PAGES][256];
+  uint8_t page;
+  bool unlocked;
+  /** Page register writes without the unlock */
+  unsigned violations;
+};
+
+static struct sim_device sim[DEVICES] = {
+  {.addr = 0xA0},
+  {.addr = 0xA6},
+};
+
+/** Bus state */
+static struct {
+  bool master;
+  bool address;
+  bool read;
+  struct sim_device *dev;
+  uint8_t ptr;
+  uint8_t count;
+  unsigned starts;
+  unsigned stops;
+  unsigned interrupts;
+  /** A device holds SCL low, the TWI never raises the interrupt */
+  bool stuck;
+  /** Misplaced start or stop after this many data bytes, 0 for none */
+  unsigned error_at;
+  unsigned bytes;
+} bus;
+
+/** The watchdog timer armed by the engine */
+static struct sched_timer *armed;
+
+void
+sched_add(struct sched_timer *timer, uint16_t delay, uint16_t period)
+{
+  CHECK(delay == TWI_TIMEOUT_MS && period == TWI_TIMEOUT_MS,
+	"watchdog armed for %u ms every %u ms", delay, period);
+  timer->state = SCHED_TIMER_ARMED;
+  armed = timer;
+}
+
+void
+sched_cancel(struct sched_timer *timer)
+{
+  timer->state = SCHED_TIMER_IDLE;
+  armed = NULL;
+}
+
+bool
+sched_pending(struct sched_timer *timer)
+{
+  return timer->state != SCHED_TIMER_IDLE;
+}
+
+/**
+ * Let TWI_TIMEOUT_MS pass, running the watchdog if it is armed.
+ */
+static void
+watchdog_tick(void)
+{
+  if (armed)
+    armed->callback(armed->arg);
+}
+
+static void
+bus_interrupt(uint8_t status)
+{
+  TWSR = status;
+  TWCR |= (1 << TWINT);
+  bus.interrupts++;
+  if (TWCR & (1 << TWIE))
+    TWI_vect();
+}
+
+static void
+bus_write(uint8_t byte)
+{
+  struct sim_device *dev = bus.dev;
+
+  if (bus.count++ == 0) {
+    bus.ptr = byte;
+    return;
+  }
+  if (bus.ptr == TWI_PAGE_LOCK_REG) {
+    dev->unlocked = (byte == TWI_PAGE_UNLOCK_MAGIC);
+  }
+  else if (bus.ptr == TWI_PAGE_REG) {
+    if (dev->unlocked)
+      dev->page = byte % PAGES;
+    else
+      dev->violations++;
+    dev->unlocked = false;
+  }
+  else {
+    dev->regs[dev->page][bus.ptr++] = byte;
+  }
+}
+
+/**
+ * Run the bus until it is idle, acting on the TWCR value written by
+ * the engine. A stop condition stays on the bus until the next call.
+ */
+static void
+bus_run(void)
+{
+  uint8_t twcr, i;
+
+  if (bus.stuck)
+    return;
+  /* The stop left on the bus is over, unless a new action is pending */
+  if (!(TWCR & (1 << TWINT)))
+    TWCR &= ~(1 << TWSTO);
+  while ((twcr = TWCR) & (1 << TWINT)) {
+    TWCR = twcr & ~(1 << TWINT);
+    if (twcr & (1 << TWSTO)) {
+      if (bus.master)
+	bus.stops++;
+      bus.master = false;
+      if (!(twcr & (1 << TWSTA)))
+	return;
+      TWCR &= ~(1 << TWSTO);
+    }
+    if (twcr & (1 << TWSTA)) {
+      bus.starts++;
+      bus.address = true;
+      bus_interrupt(bus.master ? TW_REP_START : TW_START);
+      bus.master = true;
+      continue;
+    }
+    CHECK(bus.master, "bus action without a start");
+    if (bus.error_at && ++bus.bytes == bus.error_at) {
+      bus.master = false;
+      bus_interrupt(TW_BUS_ERROR);
+      continue;
+    }
+    if (bus.address) {
+      bus.address = false;
+      bus.read = TWDR & TW_READ;
+      bus.dev = NULL;
+      for (i = 0; i < DEVICES; i++)
+	if (sim[i].addr == (TWDR & ~TW_READ))
+	  bus.dev = &sim[i];
+      if (bus.dev == NULL) {
+	bus_interrupt(bus.read ? TW_MR_SLA_NACK : TW_MT_SLA_NACK);
+	continue;
+      }
+      bus.count = 0;
+      bus_interrupt(bus.read ? TW_MR_SLA_ACK : TW_MT_SLA_ACK);
+      continue;
+    }
+    if (bus.read) {
+      TWDR = bus.dev->regs[bus.dev->page][bus.ptr++];
+      bus_interrupt((twcr & (1 << TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+    }
+    else {
+      bus_write(TWDR);
+      bus_interrupt(TW_MT_DATA_ACK);
+    }
+  }
+}
+
+static struct twi_device devs[DEVICES];
+static struct twi_device absent;
+
+/** Completion record */
+static struct {
+  uint8_t order[64];
+  int rc[64];
+  uint8_t mismatch[64];
+  unsigned count;
+} done;
+
+static void
+record_done(const struct twi_txn *txn, int rc)
+{
+  done.order[done.count] = (uintptr_t)txn->arg;
+  done.rc[done.count] = rc;
+  done.mismatch[done.count] = txn->mismatch;
+  done.count++;
+}
+
+static void
+reset(void)
+{
+  uint8_t i;
+
+  memset(&bus, 0, sizeof(bus));
+  memset(&done, 0, sizeof(done));
+  /* Drop the state left by the last test */
+  if (armed)
+    sched_cancel(armed);
+  TWCR = 0;
+  twi_init();
+  for (i = 0; i < DEVICES; i++) {
+    twi_device_init(&devs[i], sim[i].addr);
+    memset(sim[i].regs, 0, sizeof(sim[i].regs));
+    sim[i].page = 0;
+    sim[i].unlocked = false;
+    sim[i].violations = 0;
+  }
+  twi_device_init(&absent, ABSENT_ADDR);
+}
+
+static int
+submit(struct twi_device *dev, uint8_t page, uint8_t offset, uint8_t flags,
+       uint8_t *buf, uint8_t len, uintptr_t id)
+{
+  struct twi_txn txn = {
+    .dev = dev, .page = page, .offset = offset, .flags = flags,
+    .buf = buf, .len = len, .done = record_done, .arg = (void *)id,
+  };
+
+  if (flags & TWI_TXN_INLINE)
+    txn.value = buf[0];
+  return twi_submit(&txn);
+}
+
+/**
+ * Paged writes and reads, with the page cache skipping the unlock
+ * and page select when the page is already selected.
+ */
+static void
+test_paged(void)
+{
+  uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t back[8] = {0};
+  uint8_t value = 0x5a;
+
+  reset();
+  submit(&devs[0], 1, 0x10, 0, data, sizeof(data), 0);
+  submit(&devs[0], 1, 0x30, TWI_TXN_INLINE, &value, 1, 1);
+  submit(&devs[0], 1, 0x10, TWI_TXN_READ, back, sizeof(back), 2);
+  submit(&devs[0], 2, 0x00, TWI_TXN_INLINE, &value, 1, 3);
+  bus_run();
+
+  CHECK(done.count == 4, "paged: %u transactions completed", done.count);
+  CHECK(memcmp(sim[0].regs[1] + 0x10, data, sizeof(data)) == 0,
+	"paged: data not written to page 1");
+  CHECK(sim[0].regs[1][0x30] == value, "paged: inline value not written");
+  CHECK(memcmp(back, data, sizeof(data)) == 0, "paged: read back differs");
+  CHECK(sim[0].regs[2][0x00] == value, "paged: page 2 not selected");
+  CHECK(sim[0].violations == 0, "paged: page written while locked");
+  CHECK(devs[0].avoided == 4, "paged: %u transfers avoided, expected 4",
+	devs[0].avoided);
+  /* Unlock and page select twice, the data transfers and the read offset */
+  CHECK(devs[0].tx == 2 * 2 + 4, "paged: %u transfers counted", devs[0].tx);
+  CHECK(bus.starts == devs[0].tx + 1, "paged: %u starts on the bus",
+	bus.starts);
+  CHECK(twi_idle(), "paged: engine not idle");
+}
+
+/**
+ * Verify reads count the differences instead of storing the bytes.
+ */
+static void
+test_verify(void)
+{
+  uint8_t data[16], expect[16];
+  uint8_t i;
+
+  reset();
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = expect[i] = i * 3;
+  submit(&devs[1], 0, 0x00, 0, data, sizeof(data), 0);
+  bus_run();
+  expect[2] ^= 1;
+  expect[15] ^= 0x80;
+  submit(&devs[1], 0, 0x00, TWI_TXN_READ | TWI_TXN_VERIFY, expect,
+	 sizeof(expect), 1);
+  bus_run();
+  CHECK(done.count == 2 && done.mismatch[1] == 2,
+	"verify: %u mismatches, expected 2", done.mismatch[1]);
+  CHECK(expect[2] == (data[2] ^ 1), "verify: buffer overwritten");
+}
+
+/**
+ * Transactions complete in order, the queue rejects submissions
+ * when full and transactions to both devices interleave.
+ */
+static void
+test_queue(void)
+{
+  uint8_t value[TWI_QUEUE_SIZE + 1];
+  unsigned i;
+
+  reset();
+  for (i = 0; i <= TWI_QUEUE_SIZE; i++) {
+    value[i] = i;
+    CHECK(submit(&devs[i % DEVICES], i % PAGES, i, TWI_TXN_INLINE,
+		 &value[i], 1, i) == (i < TWI_QUEUE_SIZE ? ERR_OK : ERR_BUSY),
+	  "queue: submission %u", i);
+  }
+  CHECK(twi_queue_free() == 0, "queue: %u free slots", twi_queue_free());
+  bus_run();
+  CHECK(done.count == TWI_QUEUE_SIZE, "queue: %u completed", done.count);
+  for (i = 0; i < done.count; i++) {
+    CHECK(done.order[i] == i && done.rc[i] == ERR_OK,
+	  "queue: completion %u out of order", i);
+    CHECK(sim[i % DEVICES].regs[i % PAGES][i] == i,
+	  "queue: write %u lost", i);
+  }
+  CHECK(twi_queue_free() == TWI_QUEUE_SIZE, "queue: slots not released");
+}
+
+/**
+ * A device that does not acknowledge fails its transaction, the
+ * following transactions still run.
+ */
+static void
+test_nack(void)
+{
+  uint8_t value = 7;
+
+  reset();
+  submit(&absent, 1, 0x00, TWI_TXN_INLINE, &value, 1, 0);
+  submit(&devs[0], 1, 0x00, TWI_TXN_INLINE, &value, 1, 1);
+  bus_run();
+  CHECK(done.count == 2 && done.rc[0] == ERR_I2C && done.rc[1] == ERR_OK,
+	"nack: completions %d %d", done.rc[0], done.rc[1]);
+  CHECK(absent.errors == 1 && absent.page == TWI_PAGE_NONE,
+	"nack: device state not reset");
+  CHECK(sim[0].regs[1][0] == value, "nack: next transaction lost");
+}
+
+/**
+ * Reads of no bytes are rejected instead of overrunning the buffer.
+ */
+static void
+test_empty_read(void)
+{
+  uint8_t guard[2] = {0xaa, 0xaa};
+
+  reset();
+  CHECK(submit(&devs[0], 0, 0x00, TWI_TXN_READ, guard, 0, 0) == ERR_I2C,
+	"empty read: accepted");
+  CHECK(twi_idle(), "empty read: queued");
+  bus_run();
+  CHECK(guard[0] == 0xaa && guard[1] == 0xaa, "empty read: buffer written");
+}
+
+/**
+ * A submission while the last stop condition is still on the bus
+ * must not wait for it, the start follows the stop.
+ */
+static void
+test_pending_stop(void)
+{
+  uint8_t value = 3;
+
+  reset();
+  submit(&devs[0], 0, 0x00, TWI_TXN_INLINE, &value, 1, 0);
+  bus_run();
+  CHECK(TWCR & (1 << TWSTO), "pending stop: no stop left on the bus");
+  CHECK(submit(&devs[0], 0, 0x01, TWI_TXN_INLINE, &value, 1, 1) == ERR_OK,
+	"pending stop: submission failed");
+  bus_run();
+  CHECK(done.count == 2 && sim[0].regs[0][1] == value,
+	"pending stop: transaction lost");
+  CHECK(bus.stops == bus.starts, "pending stop: %u starts %u stops",
+	bus.starts, bus.stops);
+}
+
+/**
+ * Writes stop at the end of the caller's buffer, the sanitizer
+ * catches a read of the byte after it.
+ */
+static void
+test_write_bounds(void)
+{
+  uint8_t *data = malloc(3);
+
+  reset();
+  data[0] = 0x11;
+  data[1] = 0x22;
+  data[2] = 0x33;
+  submit(&devs[0], 0, 0x40, 0, data, 3, 0);
+  bus_run();
+  CHECK(done.count == 1 && sim[0].regs[0][0x42] == 0x33 &&
+	sim[0].regs[0][0x43] == 0, "bounds: write length wrong");
+  free(data);
+}
+
+/**
+ * A bus error fails the transaction in flight, the next one runs.
+ */
+static void
+test_bus_error(void)
+{
+  uint8_t data[4] = {1, 2, 3, 4};
+
+  reset();
+  bus.error_at = 2;
+  submit(&devs[0], 0, 0x00, 0, data, sizeof(data), 0);
+  submit(&devs[1], 0, 0x00, 0, data, sizeof(data), 1);
+  bus_run();
+  CHECK(done.count == 2 && done.rc[0] == ERR_I2C && done.rc[1] == ERR_OK,
+	"bus error: completions %d %d", done.rc[0], done.rc[1]);
+  CHECK(devs[0].errors == 1 && devs[0].page == TWI_PAGE_NONE,
+	"bus error: device state not reset");
+  CHECK(memcmp(sim[1].regs[0], data, sizeof(data)) == 0,
+	"bus error: next transaction lost");
+}
+
+/**
+ * A bus that stops moving fails the transaction in flight after a
+ * watchdog period without interrupts, the queue keeps draining
+ * and the watchdog stops once the engine is idle.
+ */
+static void
+test_stuck(void)
+{
+  uint8_t value = 9;
+  unsigned i;
+
+  reset();
+  bus.stuck = true;
+  for (i = 0; i < 3; i++)
+    submit(&devs[0], 0, i, TWI_TXN_INLINE, &value, 1, i);
+  CHECK(armed != NULL, "stuck: watchdog not armed");
+  bus_run();
+  watchdog_tick();
+  CHECK(done.count == 1 && done.rc[0] == ERR_I2C,
+	"stuck: %u completions", done.count);
+  CHECK(devs[0].errors == 1, "stuck: error not counted");
+  CHECK(TWCR & (1 << TWEN), "stuck: TWI left disabled");
+  /* The bus recovers, the rest of the queue runs */
+  bus.stuck = false;
+  bus_run();
+  watchdog_tick();
+  CHECK(done.count == 3 && done.rc[1] == ERR_OK && done.rc[2] == ERR_OK,
+	"stuck: %u completions after recovery", done.count);
+  CHECK(sim[0].regs[0][1] == value && sim[0].regs[0][2] == value,
+	"stuck: writes lost after recovery");
+  /* A transaction that moves is left alone */
+  submit(&devs[0], 0, 3, TWI_TXN_INLINE, &value, 1, 3);
+  bus_run();
+  watchdog_tick();
+  CHECK(done.count == 4 && done.rc[3] == ERR_OK,
+	"stuck: moving transaction failed");
+  watchdog_tick();
+  CHECK(armed == NULL, "stuck: watchdog left running while idle");
+}
+
+int
+main(void)
+{
+  test_paged();
+  test_verify();
+  test_queue();
+  test_nack();
+  test_empty_read();
+  test_pending_stop();
+  test_write_bounds();
+  test_bus_error();
+  test_stuck();
+  return host_report("twi");
+}
@@ -0,0 +1,175 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backlight.h"
+#include "error.h"
+#include "twi.h"
+#include "twi_fake.h"
+
+struct twi_fake twi_fake = {
+  .cap = TWI_FAKE_QUEUE,
+};
+
+void
+twi_fake_reset()
+{
+  memset(&twi_fake, 0, sizeof(twi_fake));
+  twi_fake.cap = TWI_FAKE_QUEUE;
+}
+
+uint8_t
+twi_fake_chip(const struct twi_txn *txn)
+{
+  return (txn->dev->addr - I2C_BACKLIGHT_BUSADDR) / 2;
+}
+
+/**
+ * Account the bus time of a transaction and keep the device
+ * statistics like the engine.
+ */
+static void
+account(const struct twi_txn *txn)
+{
+  struct twi_device *dev = txn->dev;
+  uint8_t data = (txn->flags & TWI_TXN_INLINE) ? 1 : txn->len;
+
+  if (txn->page != TWI_PAGE_NONE && txn->page != dev->page) {
+    /* Start, address, register, value and stop for each write */
+    twi_fake.txns += 2;
+    twi_fake.bits += 2 * (3 * TWI_FAKE_BYTE_BITS + 2);
+    twi_fake.bytes += 2 * 3;
+    dev->tx += 2;
+    dev->page = txn->page;
+  }
+  else if (txn->page != TWI_PAGE_NONE) {
+    dev->avoided += 2;
+  }
+  twi_fake.txns++;
+  dev->tx++;
+  if (txn->flags & TWI_TXN_READ) {
+    /* Offset write, repeated start and the second address */
+    twi_fake.bits += (3 + data) * TWI_FAKE_BYTE_BITS + 3;
+    twi_fake.bytes += 3 + data;
+  }
+  else {
+    twi_fake.bits += (2 + data) * TWI_FAKE_BYTE_BITS + 2;
+    twi_fake.bytes += 2 + data;
+  }
+}
+
+static void
+run_txn(struct twi_txn *txn)
+{
+  uint8_t chip = twi_fake_chip(txn);
+  uint8_t *r = &twi_fake.regs[chip][txn->page % TWI_FAKE_PAGES][txn->offset];
+  unsigned k;
+
+  account(txn);
+  if (txn->flags & TWI_TXN_READ) {
+    txn->mismatch = 0;
+    for (k = 0; k < txn->len; k++) {
+      if (txn->flags & TWI_TXN_VERIFY)
+	txn->mismatch += (txn->buf[k] != r[k]);
+      else
+	txn->buf[k] = r[k];
+    }
+    /* Reading the reset register restores the defaults */
+    if (txn->page == CRP_FUNCTION && txn->offset == LFO_RESET)
+      memset(twi_fake.regs[chip], 0, sizeof(twi_fake.regs[chip]));
+  }
+  else if (txn->flags & TWI_TXN_INLINE) {
+    *r = txn->value;
+  }
+  else {
+    memcpy(r, txn->buf, txn->len);
+  }
+  if (twi_fake.hook)
+    twi_fake.hook(txn, chip);
+  if (twi_fake.rc != ERR_OK) {
+    txn->dev->page = TWI_PAGE_NONE;
+    txn->dev->errors++;
+  }
+  if (txn->done)
+    txn->done(txn, twi_fake.rc);
+}
+
+void
+twi_fake_run()
+{
+  unsigned i;
+
+  /* Completion callbacks may queue more transactions */
+  for (i = 0; i < twi_fake.queued; i++)
+    run_txn(&twi_fake.queue[i]);
+  twi_fake.queued = 0;
+}
+
+void
+twi_init()
+{
+}
+
+void
+twi_device_init(struct twi_device *dev, uint8_t addr)
+{
+  memset(dev, 0, sizeof(*dev));
+  dev->addr = addr;
+  dev->page = TWI_PAGE_NONE;
+}
+
+int
+twi_submit(const struct twi_txn *txn)
+{
+  struct twi_txn t;
+
+  if ((txn->flags & TWI_TXN_READ) && txn->len == 0)
+    return ERR_I2C;
+  if (twi_fake.immediate) {
+    t = *txn;
+    run_txn(&t);
+    return ERR_OK;
+  }
+  if (twi_fake.queued >= twi_fake.cap)
+    return ERR_BUSY;
+  twi_fake.queue[twi_fake.queued++] = *txn;
+  return ERR_OK;
+}
+
+uint8_t
+twi_queue_free()
+{
+  unsigned free = twi_fake.cap - twi_fake.queued;
+
+  if (twi_fake.immediate)
+    free = twi_fake.cap;
+  return (free > 255) ? 255 : free;
+}
+
+bool
+twi_idle()
+{
+  return twi_fake.immediate || twi_fake.queued == 0;
+}
@@ -0,0 +1,100 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Simulated backlight bus for the host tests.
+ * Replaces the TWI engine with a queue of transactions that the test
+ * runs against the register files of the backlight drivers, or that
+ * run as soon as they are submitted. The bus time of each transaction
+ * is accounted as the engine would issue it, with the unlock and page
+ * writes when the device has another page selected.
+ */
+
+#ifndef _TWI_FAKE_H_
+#define _TWI_FAKE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backlight.h"
+#include "twi.h"
+
+/** Register pages of each device */
+#define TWI_FAKE_PAGES 4
+
+/** Transactions the queue can hold */
+#define TWI_FAKE_QUEUE 256
+
+/** SCL periods to move a byte with its acknowledge */
+#define TWI_FAKE_BYTE_BITS 9
+
+/** Page of the registers outside the pages, like the interrupt status */
+#define TWI_FAKE_PAGE_NONE (TWI_PAGE_NONE % TWI_FAKE_PAGES)
+
+/**
+ * Transaction hook, called once the transaction reached the device
+ * and before its completion callback. The hook may set twi_fake.rc to
+ * fail the transaction.
+ */
+typedef void (*twi_fake_hook_t)(const struct twi_txn *txn, uint8_t chip);
+
+struct twi_fake {
+  /** Register files of the devices, by chip */
+  uint8_t regs[BACKLIGHT_DRIVERS][TWI_FAKE_PAGES][256];
+  /** Queued transactions */
+  struct twi_txn queue[TWI_FAKE_QUEUE];
+  unsigned queued;
+  /** Queue size seen by the firmware, up to TWI_FAKE_QUEUE */
+  unsigned cap;
+  /** Run the transactions when they are submitted */
+  bool immediate;
+  /** Completion status of the transactions */
+  int rc;
+  /** Bus transactions, page selection included */
+  unsigned txns;
+  /** Bus time in SCL periods */
+  unsigned long bits;
+  /** Bytes on the bus, the address bytes included */
+  unsigned long bytes;
+  /** May be NULL */
+  twi_fake_hook_t hook;
+};
+
+extern struct twi_fake twi_fake;
+
+/**
+ * Clear the devices, the queue and the statistics.
+ */
+void twi_fake_reset(void);
+
+/**
+ * Run the queued transactions in order.
+ */
+void twi_fake_run(void);
+
+/**
+ * Chip addressed by a transaction.
+ */
+uint8_t twi_fake_chip(const struct twi_txn *txn);
+
+#endif /* _TWI_FAKE_H_ */
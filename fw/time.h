@@ -54,6 +54,3 @@ struct time {
 #define PRESCALER_256(N) (1 << CS##N##2)
 #define PRESCALER_1024(N) ((1 << CS##N##2) | (1 << CS##N##0))
 #define PRESCALER_MASK(N) ((1 << CS##N##2) | (1 << CS##N##1) | (1 << CS##N##0))
-
-uint8_t get_timer3_clocksource(uint32_t nano);
-uint16_t get_timer3_ticks(uint8_t clksrc, uint32_t nano);
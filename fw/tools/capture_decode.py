@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+"""
+Decode the switch bounce capture stream (see fw/capture.h) and print
+bounce statistics for each actuation of the captured switches.
+
+An actuation is a burst of transitions on one row, separated from the
+next burst by at least --settle milliseconds of stable signal.
+
+Capture from the device serial port:
+    capture_decode.py --port /dev/ttyACM0 --column 0 --rows 0x3
+
+Decode a raw dump of the stream:
+    capture_decode.py --input dump.bin
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+SYNC = b"\xa5\x5a"
+FRAME_START = 0x01
+FRAME_DATA = 0x02
+FRAME_STOP = 0x03
+RECORD = struct.Struct("<HB")
+START = struct.Struct("<HBBB")
+STOP = struct.Struct("<H")
+
+
+def read_frames(data):
+    """Yield (type, payload) for each frame, skipping the text output."""
+    pos = 0
+    while True:
+        pos = data.find(SYNC, pos)
+        if pos < 0 or pos + 4 > len(data):
+            return
+        ftype, length = data[pos + 2], data[pos + 3]
+        end = pos + 4 + length
+        if ftype not in (FRAME_START, FRAME_DATA, FRAME_STOP) or end > len(data):
+            pos += 1
+            continue
+        yield ftype, data[pos + 4:end]
+        pos = end
+
+
+class Actuation:
+    def __init__(self, row, start, state):
+        self.row = row
+        self.start = start
+        self.last = start
+        self.transitions = 1
+        self.state = state
+
+    def add(self, sample, state):
+        self.last = sample
+        self.transitions += 1
+        self.state = state
+
+
+class Decoder:
+    def __init__(self, settle_ms):
+        self.settle_ms = settle_ms
+        self.sample_hz = None
+        self.actuations = []
+        self.dropped = 0
+
+    def start(self, payload):
+        self.sample_hz, self.column, self.mask, self.rows = START.unpack(payload)
+        self.settle = max(1, self.settle_ms * self.sample_hz // 1000)
+        self.sample = 0
+        self.open = {}
+
+    def data(self, payload):
+        if self.sample_hz is None:
+            return
+        for elapsed, rows in RECORD.iter_unpack(payload):
+            self.sample += elapsed
+            self.close_settled()
+            changed = (rows ^ self.rows) & self.mask
+            for row in range(8):
+                if not changed & (1 << row):
+                    continue
+                state = bool(rows & (1 << row))
+                act = self.open.get(row)
+                if act is None:
+                    self.open[row] = Actuation(row, self.sample, state)
+                else:
+                    act.add(self.sample, state)
+            self.rows = rows
+
+    def close_settled(self):
+        for row, act in list(self.open.items()):
+            if self.sample - act.last >= self.settle:
+                self.actuations.append(act)
+                del self.open[row]
+
+    def stop(self, payload):
+        (dropped,) = STOP.unpack(payload)
+        self.dropped += dropped
+        if self.sample_hz is not None:
+            self.actuations.extend(self.open.values())
+            self.open = {}
+
+    def feed(self, data):
+        for ftype, payload in read_frames(data):
+            if ftype == FRAME_START:
+                self.start(payload)
+            elif ftype == FRAME_DATA:
+                self.data(payload)
+            else:
+                self.stop(payload)
+
+    def report(self, out=sys.stdout):
+        if self.sample_hz is None:
+            print("No capture found in the stream", file=out)
+            return
+        us = 1e6 / self.sample_hz
+        print("column {} sampled at {} Hz, {} transitions dropped".format(
+            self.column, self.sample_hz, self.dropped), file=out)
+        print("{:>4} {:>12} {:>8} {:>12} {:>8}".format(
+            "row", "time (ms)", "action", "bounce (us)", "chatter"), file=out)
+        for act in sorted(self.actuations, key=lambda a: a.start):
+            print("{:>4} {:>12.3f} {:>8} {:>12.1f} {:>8}".format(
+                act.row, act.start * us / 1000,
+                "press" if act.state else "release",
+                (act.last - act.start) * us, act.transitions - 1), file=out)
+        for row in range(8):
+            acts = [a for a in self.actuations if a.row == row]
+            if not acts:
+                continue
+            bounce = [(a.last - a.start) * us for a in acts]
+            print("row {}: {} actuations, bounce min {:.1f} avg {:.1f} "
+                  "max {:.1f} us, {} chattering".format(
+                      row, len(acts), min(bounce), sum(bounce) / len(bounce),
+                      max(bounce), sum(1 for a in acts if a.transitions > 1)),
+                  file=out)
+
+
+def capture(args):
+    import serial
+
+    with serial.Serial(args.port, timeout=0.1) as port:
+        port.write(bytes([ord("c"), args.column, args.rows]))
+        data = bytearray()
+        end = time.monotonic() + args.duration
+        try:
+            while time.monotonic() < end:
+                data += port.read(4096)
+        except KeyboardInterrupt:
+            pass
+        port.write(b"s")
+        # Drain the remaining records and the stop frame
+        while True:
+            chunk = port.read(4096)
+            if not chunk:
+                break
+            data += chunk
+    if args.output:
+        with open(args.output, "wb") as dump:
+            dump.write(data)
+    return bytes(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", help="Device CDC serial port")
+    parser.add_argument("--column", type=int, default=0, help="Column to capture")
+    parser.add_argument("--rows", type=lambda v: int(v, 0), default=0xff,
+                        help="Mask of the rows to capture")
+    parser.add_argument("--duration", type=float, default=10.0,
+                        help="Capture duration in seconds")
+    parser.add_argument("--output", help="Save the raw stream to this file")
+    parser.add_argument("--input", help="Decode a raw stream dump")
+    parser.add_argument("--settle", type=int, default=5,
+                        help="Stable time in ms that ends an actuation")
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input, "rb") as dump:
+            data = dump.read()
+    elif args.port:
+        data = capture(args)
+    else:
+        parser.error("one of --port or --input is required")
+
+    decoder = Decoder(args.settle)
+    decoder.feed(data)
+    decoder.report()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+
+"""
+Measure the throughput of the device CDC IN endpoint.
+
+The device streams a known pattern (see HOST_CMD_BENCH in
+fw/keyboard_tester.c) for the given number of seconds, the pattern
+is checked as it is received and the rate is reported in KB/s:
+    cdc_bench.py --port /dev/ttyACM0 --seconds 10
+A stream recorded from the device is checked with:
+    cdc_bench.py --input stream.bin
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+SYNC = b"\xa5\x5a"
+FRAME_BENCH = 0x14
+FRAME_BENCH_END = 0x15
+SUMMARY = struct.Struct("<III")
+
+
+def read_frames(data):
+    """Yield the frame types and payloads, return the position of the
+    first byte not consumed. Frames of other types are skipped whole,
+    so that the pattern is never mistaken for a sync."""
+    pos = 0
+    while True:
+        pos = data.find(SYNC, pos)
+        if pos < 0:
+            return len(data) - 1 if data.endswith(SYNC[:1]) else len(data)
+        if pos + 4 > len(data):
+            return pos
+        end = pos + 4 + data[pos + 3]
+        if end > len(data):
+            return pos
+        yield data[pos + 2], data[pos + 4:end]
+        pos = end
+
+
+class Bench:
+    def __init__(self, out=sys.stdout):
+        self.out = out
+        self.frames = 0
+        self.bytes = 0
+        self.lost = 0
+        self.corrupt = 0
+        self.seq = None
+        self.first = None
+        self.last = None
+        self.summary = None
+
+    def frame(self, payload):
+        now = time.monotonic()
+        if self.first is None:
+            self.first = now
+        self.last = now
+        seq = payload[0] | (payload[1] << 8)
+        if self.seq is not None:
+            self.lost += (seq - self.seq - 1) & 0xffff
+        self.seq = seq
+        expect = bytes((seq + i) & 0xff for i in range(2, len(payload)))
+        if payload[2:] != expect:
+            self.corrupt += 1
+        self.frames += 1
+        self.bytes += len(payload)
+
+    def feed(self, data):
+        """Consume the complete frames, return the bytes left over."""
+        frames = read_frames(data)
+        while True:
+            try:
+                ftype, payload = next(frames)
+            except StopIteration as stop:
+                return data[stop.value:]
+            if ftype == FRAME_BENCH:
+                self.frame(payload)
+            elif ftype == FRAME_BENCH_END:
+                self.summary = SUMMARY.unpack(payload)
+
+    def report(self):
+        if self.summary is None:
+            print("no benchmark summary received", file=self.out)
+            return 1
+        elapsed, frames, size = self.summary
+        print("device: {} frames, {} bytes in {} ms, {:.1f} KB/s".format(
+            frames, size, elapsed, size / max(elapsed, 1) * 1000 / 1024),
+              file=self.out)
+        host = (self.last - self.first) if self.frames > 1 else 0
+        print("host: {} frames, {} bytes in {:.0f} ms, {:.1f} KB/s".format(
+            self.frames, self.bytes, host * 1000,
+            self.bytes / host / 1024 if host else 0), file=self.out)
+        if self.lost or self.corrupt or self.frames != frames:
+            print("error: {} frames lost, {} corrupt".format(
+                max(self.lost, frames - self.frames), self.corrupt),
+                  file=self.out)
+            return 1
+        return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--port", help="Device CDC serial port")
+    source.add_argument("--input", help="Stream recorded from the device")
+    parser.add_argument("--seconds", type=int, default=5,
+                        help="Benchmark duration, 1 to 255 seconds")
+    args = parser.parse_args()
+    if not 1 <= args.seconds <= 255:
+        parser.error("--seconds must be between 1 and 255")
+
+    bench = Bench()
+    if args.input:
+        with open(args.input, "rb") as stream:
+            bench.feed(stream.read())
+        sys.exit(bench.report())
+
+    import serial
+
+    with serial.Serial(args.port, timeout=0.1) as port:
+        port.reset_input_buffer()
+        port.write(bytes([ord("b"), args.seconds]))
+        end = time.monotonic() + args.seconds + 2
+        data = b""
+        try:
+            while bench.summary is None and time.monotonic() < end:
+                data = bench.feed(data + port.read(16384))
+        except KeyboardInterrupt:
+            port.write(b"b\x00")
+            for _ in range(10):
+                data = bench.feed(data + port.read(16384))
+    sys.exit(bench.report())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+"""
+Run the backlight LED self-test (see fw/diag.h) and print the faults
+found by each board check.
+
+Run a single check:
+    diag_report.py --port /dev/ttyACM0
+
+Check every 10 seconds until interrupted:
+    diag_report.py --port /dev/ttyACM0 --period 10
+"""
+
+import argparse
+import struct
+import sys
+
+SYNC = b"\xa5\x5a"
+FRAME_REPORT = 0x10
+HEADER = struct.Struct("<HBBB")
+RECORD = struct.Struct("<BBB")
+NO_KEY = 0xff
+TRUNCATED = 0x01
+BUS_ERROR = 0x02
+CHANNELS = "BGR"
+
+
+def read_reports(data):
+    """Yield the payload of each complete report, skipping the text output."""
+    pos = 0
+    while True:
+        pos = data.find(SYNC, pos)
+        if pos < 0 or pos + 4 > len(data):
+            break
+        ftype, length = data[pos + 2], data[pos + 3]
+        end = pos + 4 + length
+        if ftype != FRAME_REPORT or length < HEADER.size:
+            pos += 1
+            continue
+        if end > len(data):
+            break
+        yield data[pos + 4:end]
+        pos = end
+
+
+def faults_str(faults):
+    names = []
+    for ch, colour in enumerate(CHANNELS):
+        if faults & (1 << ch):
+            names.append("open " + colour)
+        if faults & (8 << ch):
+            names.append("short " + colour)
+    return ", ".join(names)
+
+
+def print_report(payload, out=sys.stdout):
+    duration, leds, faulty, flags = HEADER.unpack_from(payload)
+    print("{} LEDs checked in {} ms, {} faulty{}{}".format(
+        leds, duration, faulty,
+        ", bus error" if flags & BUS_ERROR else "",
+        ", report truncated" if flags & TRUNCATED else ""), file=out)
+    for led, key, faults in RECORD.iter_unpack(payload[HEADER.size:]):
+        print("  LED {:>3} key {:>4}: {}".format(
+            led, "-" if key == NO_KEY else key, faults_str(faults)), file=out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", required=True, help="Device CDC serial port")
+    parser.add_argument("--period", type=int, default=0,
+                        help="Seconds between checks, 0 to check once")
+    args = parser.parse_args()
+    if not 0 <= args.period <= 255:
+        parser.error("--period must be in 0-255")
+
+    import serial
+
+    with serial.Serial(args.port, timeout=0.1) as port:
+        port.write(bytes([ord("d"), args.period]))
+        data = bytearray()
+        try:
+            while True:
+                data += port.read(4096)
+                done = 0
+                for payload in read_reports(bytes(data)):
+                    print_report(payload)
+                    done += 1
+                if done:
+                    data.clear()
+                    if not args.period:
+                        break
+        except KeyboardInterrupt:
+            pass
+        if args.period:
+            # A last single check ends the periodic ones
+            port.write(bytes([ord("d"), 0]))
+
+
+if __name__ == "__main__":
+    main()
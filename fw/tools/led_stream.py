@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+"""
+Stream backlight frames to the device (see fw/ledstream.h) and report
+the sustained frame rate and the frames dropped by the device.
+
+Frames are sent as deltas of the changed LEDs when that is shorter
+than the full frame. The LED positions are read from fw/ledmap.h.
+
+Stream a rainbow at 60 FPS for 10 seconds:
+    led_stream.py --port /dev/ttyACM0 --fps 60 --duration 10
+
+Save the encoded stream instead of sending it:
+    led_stream.py --output frames.bin --duration 1
+"""
+
+import argparse
+import colorsys
+import os
+import re
+import struct
+import sys
+import time
+
+SYNC = b"\xa5\x5a"
+CMD_FRAME = b"f"
+CMD_STATS = b"q"
+FULL = 0
+DELTA = 1
+FRAME_STATS = 0x11
+STATS = struct.Struct("<HHHHI")
+LEDMAP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "ledmap.h")
+
+
+def read_ledmap(path):
+    """Return the (x, y) position of each LED in the LED table order."""
+    entry = re.compile(r"X\(\s*\w+\s*,\s*\w+\s*,\s*\d+\s*,\s*\d+\s*,"
+                       r"\s*(\d+)\s*,\s*(\d+)\s*\)")
+    with open(path) as ledmap:
+        return [(int(x), int(y)) for x, y in entry.findall(ledmap.read())]
+
+
+def rainbow(positions, t):
+    """Hue wheel scrolling along the x axis, one turn every 2 seconds."""
+    frame = []
+    for x, _ in positions:
+        r, g, b = colorsys.hsv_to_rgb((x / 256 + t / 2) % 1.0, 1.0, 1.0)
+        frame.append((int(r * 255), int(g * 255), int(b * 255)))
+    return frame
+
+
+def encode_frame(seq, kind, body):
+    """Frame header with the length of the body, then the body."""
+    return CMD_FRAME + struct.pack("<BBH", seq, kind, len(body)) + body
+
+
+def encode_full(seq, frame):
+    body = bytearray([len(frame)])
+    for color in frame:
+        body += bytes(color)
+    return encode_frame(seq, FULL, body)
+
+
+def encode_delta(seq, frame, prev):
+    """Runs of changed LEDs, a run header is cheaper than a colour."""
+    runs = []
+    i = 0
+    while i < len(frame):
+        if frame[i] == prev[i]:
+            i += 1
+            continue
+        start = i
+        while i < len(frame) and frame[i] != prev[i] and i - start < 255:
+            i += 1
+        runs.append((start, frame[start:i]))
+    body = bytearray([len(runs)])
+    for start, colors in runs:
+        body += bytes([start, len(colors)])
+        for color in colors:
+            body += bytes(color)
+    return encode_frame(seq, DELTA, body)
+
+
+def encode(seq, frame, prev):
+    full = encode_full(seq, frame)
+    if prev is None:
+        return full
+    delta = encode_delta(seq, frame, prev)
+    return delta if len(delta) < len(full) else full
+
+
+def read_stats(port, timeout=1.0):
+    data = bytearray()
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        data += port.read(256)
+        pos = data.find(SYNC)
+        while pos >= 0:
+            if (len(data) >= pos + 4 + STATS.size and data[pos + 2] == FRAME_STATS
+                    and data[pos + 3] == STATS.size):
+                return STATS.unpack_from(data, pos + 4)
+            pos = data.find(SYNC, pos + 1)
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", help="Device CDC serial port")
+    parser.add_argument("--output", help="Save the encoded stream to this file")
+    parser.add_argument("--fps", type=float, default=60.0, help="Frames per second")
+    parser.add_argument("--duration", type=float, default=10.0,
+                        help="Stream duration in seconds")
+    parser.add_argument("--ledmap", default=LEDMAP, help="LED table header")
+    args = parser.parse_args()
+    if not args.port and not args.output:
+        parser.error("one of --port or --output is required")
+
+    positions = read_ledmap(args.ledmap)
+    count = int(args.fps * args.duration)
+    period = 1.0 / args.fps
+
+    if args.output:
+        prev = None
+        with open(args.output, "wb") as out:
+            for n in range(count):
+                frame = rainbow(positions, n * period)
+                out.write(encode(n & 0xff, frame, prev))
+                prev = frame
+        return
+
+    import serial
+
+    with serial.Serial(args.port, timeout=0.01) as port:
+        # Reset the device statistics
+        port.write(CMD_STATS)
+        read_stats(port)
+
+        prev = None
+        sent = 0
+        late = 0
+        start = time.monotonic()
+        try:
+            for n in range(count):
+                due = start + n * period
+                wait = due - time.monotonic()
+                if wait > 0:
+                    time.sleep(wait)
+                elif wait < -period:
+                    late += 1
+                frame = rainbow(positions, n * period)
+                data = encode(n & 0xff, frame, prev)
+                port.write(data)
+                # The debug output is not needed while streaming
+                port.reset_input_buffer()
+                sent += len(data)
+                prev = frame
+        except KeyboardInterrupt:
+            count = n
+        elapsed = time.monotonic() - start
+
+        port.write(CMD_STATS)
+        stats = read_stats(port)
+
+    print("host: {} frames, {} bytes in {:.2f} s, {:.1f} FPS, {:.1f} KB/s, "
+          "{} late".format(count, sent, elapsed, count / elapsed,
+                           sent / elapsed / 1024, late))
+    if stats is None:
+        print("device: no statistics received", file=sys.stderr)
+        sys.exit(1)
+    frames, dropped, errors, deferred, ms = stats
+    fps = (frames - 1) * 1000 / ms if ms else 0.0
+    print("device: {} frames, {:.1f} FPS, {} dropped ({} not decoded), "
+          "{} malformed, {} flushes deferred".format(
+              frames, fps, dropped, count - frames, errors, deferred))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,310 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+"""
+Generate the backlight LED map header (see fw/ledmap.h) from the
+board design.
+
+The matrix row and column of each key switch are traced from the key
+matrix schematic, through the switch diode, to the row_N and col_N
+hierarchical labels. Key positions come from the switch footprints
+of the board layout.
+
+The LED driver wiring is not traced, the wiring file lists one LED
+per line with the driver chip, the key row (SW1-3, SW4-6...) and the
+CS column, 0-based:
+
+    # switch  chip  row  col  [x  y]
+    SW2       0     0    3
+    -         0     0    0    159  0
+
+The first field is the reference of the switch on top of the LED in
+the schematic, or - for LEDs that are not under a scanned key. The
+optional x y fields give the position directly in board units (0-255),
+they are required for LEDs without a switch. Footprint positions are
+scaled to fill the 0-255 board range.
+
+Regenerate the prototype map:
+    ledmap_gen.py --schematic ../pcb/cherry_proto_circuit/key_matrix.sch \\
+        --pcb ../pcb/panel/panel.kicad_pcb \\
+        --wiring tools/ledmap_proto.txt --output ledmap.h
+"""
+
+import argparse
+import re
+import sys
+
+# Pin offsets of the schematic symbols, in symbol coordinates
+SYMBOL_PINS = {
+    "SW_Push": [(-200, 0), (200, 0)],
+    "D": [(-150, 0), (150, 0)],
+}
+
+LICENSE = open(__file__).read().split("\n\n")[0]
+
+
+class Nets:
+    """Union-find of the schematic connection points."""
+
+    def __init__(self):
+        self.parent = {}
+
+    def find(self, p):
+        self.parent.setdefault(p, p)
+        while self.parent[p] != p:
+            self.parent[p] = self.parent[self.parent[p]]
+            p = self.parent[p]
+        return p
+
+    def union(self, a, b):
+        self.parent[self.find(a)] = self.find(b)
+
+
+def on_segment(p, a, b):
+    """Check whether point p lies on the axis aligned segment a-b."""
+    (x, y), (x0, y0), (x1, y1) = p, a, b
+    if x0 == x1 == x:
+        return min(y0, y1) <= y <= max(y0, y1)
+    if y0 == y1 == y:
+        return min(x0, x1) <= x <= max(x0, x1)
+    return False
+
+
+def parse_schematic(path):
+    """
+    Parse a legacy eeschema sheet.
+    Return the components as {ref: (symbol, [pin points])}, the labels
+    as {point: name} and the list of wire segments.
+    """
+    comps, labels, wires = {}, {}, []
+    lines = open(path).read().splitlines()
+    i = 0
+    while i < len(lines):
+        line = lines[i]
+        if line.startswith("$Comp"):
+            symbol = ref = pos = None
+            i += 1
+            while not lines[i].startswith("$EndComp"):
+                fields = lines[i].split()
+                if fields[0] == "L":
+                    symbol, ref = fields[1].split(":")[-1], fields[2]
+                elif fields[0] == "P":
+                    pos = (int(fields[1]), int(fields[2]))
+                i += 1
+            # The last line before $EndComp is the orientation matrix
+            a, b, c, d = (int(v) for v in lines[i - 1].split())
+            pins = [(pos[0] + a * x + b * -y, pos[1] + c * x + d * -y)
+                    for x, y in SYMBOL_PINS.get(symbol, [])]
+            comps[ref] = (symbol, pins)
+        elif line.startswith("Text ") and "Label" in line.split()[1]:
+            fields = line.split()
+            labels[(int(fields[2]), int(fields[3]))] = lines[i + 1].strip()
+            i += 1
+        elif line.startswith("Wire Wire Line"):
+            x0, y0, x1, y1 = (int(v) for v in lines[i + 1].split())
+            wires.append(((x0, y0), (x1, y1)))
+            i += 1
+        i += 1
+    return comps, labels, wires
+
+
+def trace_matrix(path):
+    """Return {switch ref: (row, col)} and the number of columns."""
+    comps, labels, wires = parse_schematic(path)
+    nets = Nets()
+    points = set(labels)
+    for _, pins in comps.values():
+        points.update(pins)
+    for a, b in wires:
+        points.update((a, b))
+    for a, b in wires:
+        nets.union(a, b)
+        for p in points:
+            if on_segment(p, a, b):
+                nets.union(p, a)
+
+    def label_of(point, prefix):
+        net = nets.find(point)
+        for lpos, name in labels.items():
+            m = re.match(prefix + r"_(\d+)$", name)
+            if m and nets.find(lpos) == net:
+                return int(m.group(1)) - 1
+        return None
+
+    diodes = [pins for sym, pins in comps.values() if sym == "D"]
+    columns = len([n for n in labels.values() if re.match(r"col_\d+$", n)])
+    keys = {}
+    for ref, (sym, pins) in comps.items():
+        if sym != "SW_Push":
+            continue
+        row = col = None
+        for pin in pins:
+            col = label_of(pin, "col") if col is None else col
+            row = label_of(pin, "row") if row is None else row
+            # Follow the diode from the switch to the row line
+            for dpins in diodes:
+                if row is None and nets.find(pin) in map(nets.find, dpins):
+                    for dpin in dpins:
+                        if nets.find(dpin) != nets.find(pin):
+                            row = label_of(dpin, "row")
+        if row is None or col is None:
+            sys.exit("{}: can not trace {} to the matrix".format(path, ref))
+        keys[ref] = (row, col)
+    return keys, columns
+
+
+def parse_pcb(path):
+    """Return {reference: (x, y)} of the footprints of a layout."""
+    text = open(path).read()
+    pos = {}
+    for m in re.finditer(r"\((?:module|footprint) \S+.*?\n  \)", text, re.S):
+        at = re.search(r"\(at ([-\d.]+) ([-\d.]+)", m.group(0))
+        ref = re.search(r"fp_text reference (\S+)", m.group(0))
+        if at and ref:
+            pos[ref.group(1)] = (float(at.group(1)), float(at.group(2)))
+    return pos
+
+
+def parse_wiring(path):
+    """Yield (switch, chip, row, col, position or None) for each LED."""
+    for num, line in enumerate(open(path), 1):
+        fields = line.split("#")[0].split()
+        if not fields:
+            continue
+        if len(fields) not in (4, 6):
+            sys.exit("{}:{}: malformed line".format(path, num))
+        switch = None if fields[0] == "-" else fields[0]
+        chip, row, col = (int(v) for v in fields[1:4])
+        xy = tuple(int(v) for v in fields[4:]) or None
+        if not (0 <= row < 4 and 0 <= col < 16 and 0 <= chip < 4):
+            sys.exit("{}:{}: LED out of the driver matrix".format(path, num))
+        if switch is None and xy is None:
+            sys.exit("{}:{}: LED without a switch needs x y".format(path, num))
+        yield switch, chip, row, col, xy
+
+
+def scale(positions):
+    """Scale footprint positions to the 0-255 board range."""
+    if not positions:
+        return {}
+    xs = [p[0] for p in positions.values()]
+    ys = [p[1] for p in positions.values()]
+    w = (max(xs) - min(xs)) or 1
+    h = (max(ys) - min(ys)) or 1
+    return {ref: (round((x - min(xs)) * 255 / w), round((y - min(ys)) * 255 / h))
+            for ref, (x, y) in positions.items()}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--schematic", required=True,
+                        help="key matrix schematic sheet")
+    parser.add_argument("--pcb", required=True, help="board layout")
+    parser.add_argument("--wiring", required=True, help="LED driver wiring")
+    parser.add_argument("--output", default="-", help="header to write")
+    args = parser.parse_args()
+
+    keys, columns = trace_matrix(args.schematic)
+    footprints = parse_pcb(args.pcb)
+    leds = list(parse_wiring(args.wiring))
+
+    placed = {sw: footprints[sw] for sw, _, _, _, xy in leds
+              if sw is not None and xy is None and sw in footprints}
+    placed = scale(placed)
+    entries = []
+    seen = set()
+    for switch, chip, row, col, xy in leds:
+        if (chip, row, col) in seen:
+            sys.exit("LED {} {} {} listed twice".format(chip, row, col))
+        seen.add((chip, row, col))
+        if switch is not None and switch not in keys:
+            sys.exit("{} is not in the key matrix".format(switch))
+        if xy is None:
+            if switch not in placed:
+                sys.exit("{} has no footprint in the layout".format(switch))
+            xy = placed[switch]
+        key = None
+        if switch is not None:
+            krow, kcol = keys[switch]
+            key = krow * columns + kcol
+        entries.append((chip, row, col, key, xy, switch))
+    # Group by chip, neighbouring LEDs share bus bursts
+    entries.sort()
+
+    nkeys = (max(r for r, _ in keys.values()) + 1) * columns
+    key_leds = ["BACKLIGHT_LEDS"] * nkeys
+    for idx, (_, _, _, key, _, _) in enumerate(entries):
+        if key is not None:
+            key_leds[key] = str(idx)
+
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    out.write("/*\n")
+    for line in LICENSE.splitlines()[2:]:
+        out.write(("  " + line[2:]).rstrip() + "\n")
+    out.write("*/\n")
+    out.write(HEADER.format(sch=args.schematic, pcb=args.pcb,
+                            wiring=args.wiring))
+    out.write("#define BACKLIGHT_LED_MAP(X)" + "\t" * 5 + "\\\n")
+    for n, (chip, row, col, key, (x, y), switch) in enumerate(entries):
+        k = "BACKLIGHT_NO_KEY" if key is None else str(key)
+        item = "X({}, {}, {}, {}, {}, {})".format(chip, k, row, col, x, y)
+        if n < len(entries) - 1:
+            # Align the continuations with tabs, as in the other headers
+            width = 8 + len(item)
+            item += "\t" * ((63 - width) // 8 + 1) + "\\"
+        out.write("\t" + item + "\n")
+    out.write("\n/**\n * LED map index of each matrix key, BACKLIGHT_LEDS for keys\n"
+              " * without a LED.\n */\n")
+    out.write("#define BACKLIGHT_KEY_MAP {{ {} }}\n".format(", ".join(key_leds)))
+    out.write("\n#endif /* _LEDMAP_H_ */\n")
+
+
+HEADER = """
+/**
+ * @file
+ * Backlight LED map of the board, one X(chip, key, row, col, x, y)
+ * entry for each populated RGB LED:
+ * - chip: driver on the bus, index in struct Backlight
+ * - key: matrix key index on top of the LED, or BACKLIGHT_NO_KEY
+ * - row, col: key row (SW1-3, SW4-6...) and CS column of the driver
+ * - x, y: position on the board, the board spans 0-255
+ *
+ * The driver state only mirrors the LEDs listed here. Entries are
+ * grouped by chip and sorted by row and column, so that neighbouring
+ * LEDs share a bus burst.
+ *
+ * Generated by tools/ledmap_gen.py, do not edit. Sources:
+ * - {sch}
+ * - {pcb}
+ * - {wiring}
+ */
+
+#ifndef _LEDMAP_H_
+#define _LEDMAP_H_
+
+"""
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+"""
+Decode the binary trace records (see fw/trace.h) streamed by the
+device, using the dictionary built by tools/trace_dict.py.
+
+Follow the device serial port, the trace statistics are printed on
+exit:
+    trace_decode.py --dict trace_dict.json --port /dev/ttyACM0
+
+Decode a raw dump of the stream:
+    trace_decode.py --dict trace_dict.json --input dump.bin
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+SYNC = b"\xa5\x5a"
+FRAME_TRACE = 0x12
+FRAME_STATS = 0x13
+NO_RECORD = 0xff
+RECORD = struct.Struct("<BHH")
+STATS = struct.Struct("<HBB")
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l)?([diouxXcsp%])")
+
+
+def read_frames(data):
+    """Yield the trace frame types and payloads, return the position
+    of the first byte not consumed."""
+    pos = 0
+    while True:
+        pos = data.find(SYNC, pos)
+        if pos < 0:
+            return len(data) - 1 if data.endswith(SYNC[:1]) else len(data)
+        if pos + 4 > len(data):
+            return pos
+        ftype, length = data[pos + 2], data[pos + 3]
+        if ftype not in (FRAME_TRACE, FRAME_STATS):
+            pos += 1
+            continue
+        end = pos + 4 + length
+        if end > len(data):
+            return pos
+        yield ftype, data[pos + 4:end]
+        pos = end
+
+
+def render(entry, args):
+    """printf the entry format with the raw argument bytes."""
+    values = []
+    pos = 0
+    for t in entry["args"]:
+        raw = args[pos:pos + t["size"]]
+        pos += t["size"]
+        if len(raw) < t["size"]:
+            return "<truncated record> " + entry["format"]
+        values.append(t.get("value") or int.from_bytes(raw, "little", signed=t["signed"]))
+
+    def convert(m):
+        flags, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        value = values.pop(0)
+        if conv == "s":
+            return ("%" + flags + "s") % (value if isinstance(value, str) else "0x%04x" % value)
+        if conv == "p":
+            return "0x%04x" % value
+        if length == "hh":
+            value &= 0xff
+            if conv in "di" and value >= 0x80:
+                value -= 0x100
+        elif conv not in "di":
+            value &= 0xffffffff if length in ("l", "ll") else 0xffff
+        if conv == "c":
+            return chr(value & 0xff)
+        return ("%" + flags + ("d" if conv in "diu" else conv)) % value
+
+    return CONVERSION.sub(convert, entry["format"])
+
+
+class Decoder:
+    def __init__(self, entries, out=sys.stdout):
+        self.entries = entries
+        self.out = out
+        self.epoch = 0
+        self.last = None
+        # Record bytes carried over from the previous chunk, None
+        # until a chunk with a record start is seen
+        self.pending = None
+
+    def timestamp(self, ms):
+        """Unwrap the 16 bit device time."""
+        if self.last is not None and ms < self.last:
+            self.epoch += 0x10000
+        self.last = ms
+        return self.epoch + ms
+
+    def chunk(self, payload):
+        """Records may span chunks, resynchronize on the first record
+        start after a gap."""
+        first = payload[0]
+        if self.pending is None:
+            if first == NO_RECORD:
+                return
+            self.pending = payload[1 + first:]
+        else:
+            self.pending += payload[1:]
+
+        data = self.pending
+        pos = 0
+        while pos < len(data):
+            size = data[pos]
+            if size < RECORD.size:
+                # Out of sync, wait for the next record start
+                self.pending = None
+                return
+            if pos + size > len(data):
+                break
+            _, token, ms = RECORD.unpack_from(data, pos)
+            args = data[pos + RECORD.size:pos + size]
+            pos += size
+            self.record(token, ms, args)
+        self.pending = data[pos:]
+
+    def record(self, token, ms, args):
+        t = self.timestamp(ms) / 1000
+        entry = self.entries.get(str(token))
+        if entry is None:
+            print("{:10.3f} <unknown token {:#06x}> {}".format(
+                t, token, args.hex()), file=self.out)
+            return
+        print("{:10.3f} {}:{}: {}".format(
+            t, entry["file"], entry["line"], render(entry, args).rstrip()),
+            file=self.out)
+
+    def stats(self, payload):
+        dropped, high_water, ring = STATS.unpack(payload)
+        print("trace: {} records dropped, ring high-water {}/{} bytes".format(
+            dropped, high_water, ring), file=self.out)
+
+    def feed(self, data):
+        """Decode the complete frames, return the bytes left over."""
+        frames = read_frames(data)
+        while True:
+            try:
+                ftype, payload = next(frames)
+            except StopIteration as stop:
+                return data[stop.value:]
+            if ftype == FRAME_TRACE:
+                self.chunk(payload)
+            else:
+                self.stats(payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--dict", required=True, help="Trace dictionary")
+    parser.add_argument("--port", help="Device CDC serial port")
+    parser.add_argument("--input", help="Decode a raw stream dump")
+    args = parser.parse_args()
+
+    with open(args.dict) as f:
+        decoder = Decoder(json.load(f))
+
+    if args.input:
+        with open(args.input, "rb") as dump:
+            decoder.feed(dump.read())
+    elif args.port:
+        import serial
+
+        with serial.Serial(args.port, timeout=0.1) as port:
+            data = b""
+            try:
+                while True:
+                    data = decoder.feed(data + port.read(4096))
+                    sys.stdout.flush()
+            except KeyboardInterrupt:
+                pass
+            port.write(b"l")
+            for _ in range(10):
+                data = decoder.feed(data + port.read(4096))
+    else:
+        parser.error("one of --port or --input is required")
+
+
+if __name__ == "__main__":
+    main()
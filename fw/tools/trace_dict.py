@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019  Alfredo Mazzinghi
+#
+# Permission to use, copy, modify, distribute, and sell this
+# software and its documentation for any purpose is hereby granted
+# without fee, provided that the above copyright notice appear in
+# all copies and that both that the copyright notice and this
+# permission notice and warranty disclaimer appear in supporting
+# documentation, and that the name of the author not be used in
+# advertising or publicity pertaining to distribution of the
+# software without specific, written prior permission.
+#
+# The author disclaims all warranties with regard to this
+# software, including all implied warranties of merchantability
+# and fitness.  In no event shall the author be liable for any
+# special, indirect or consequential damages or any damages
+# whatsoever resulting from loss of use, data or profits, whether
+# in an action of contract, negligence or other tortious action,
+# arising out of or in connection with the use or performance of
+# this software.
+
+
+"""
+Build the dictionary of the trace tokens (see fw/trace.h) from the
+firmware sources, for tools/trace_decode.py.
+
+Each DEBUG() or TRACE() call is keyed by its token, the file id of
+the source and the line of the call. Calls spanning several lines
+get a token for each line, since compilers differ on the line they
+report for a macro call. __func__ arguments are resolved to the name
+of the enclosing function.
+
+    trace_dict.py --output trace_dict.json *.c
+"""
+
+import argparse
+import json
+import os
+import re
+import sys
+
+CALL = re.compile(r"\b(?:DEBUG|TRACE)\s*\(")
+FILE_ID = re.compile(r"^#define\s+TRACE_FILE\s+(\w+)", re.M)
+ENUM_ID = re.compile(r"^\s*(TRACE_FILE_\w+)\s*=\s*(\d+)\s*,", re.M)
+FUNCTION = re.compile(r"^([A-Za-z_]\w*)\s*\(", re.M)
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l)?([diouxXcsp%])")
+ESCAPES = {"n": "\n", "r": "\r", "t": "\t", "\\": "\\", '"': '"', "'": "'",
+           "0": "\0"}
+
+
+class ParseError(Exception):
+    pass
+
+
+def parse_call(text, pos):
+    """Split the arguments of the call opening at pos, return them
+    and the position after the closing parenthesis."""
+    args = []
+    depth = 0
+    start = pos
+    i = pos
+    while i < len(text):
+        c = text[i]
+        if c in "\"'":
+            end = i + 1
+            while text[end] != c:
+                end += 2 if text[end] == "\\" else 1
+            i = end + 1
+            continue
+        if c in "([{":
+            depth += 1
+        elif c in ")]}":
+            if depth == 0:
+                args.append(text[start:i].strip())
+                return args, i + 1
+            depth -= 1
+        elif c == "," and depth == 0:
+            args.append(text[start:i].strip())
+            start = i + 1
+        i += 1
+    raise ParseError("unterminated call")
+
+
+def parse_string(literal):
+    """Concatenate adjacent C string literals."""
+    out = []
+    for part in re.findall(r'"((?:[^"\\]|\\.)*)"', literal):
+        i = 0
+        while i < len(part):
+            if part[i] == "\\":
+                out.append(ESCAPES.get(part[i + 1], part[i + 1]))
+                i += 2
+            else:
+                out.append(part[i])
+                i += 1
+    return "".join(out)
+
+
+def arg_types(fmt):
+    """Size and signedness of each argument, as promoted on the AVR."""
+    types = []
+    for _, length, conv in CONVERSION.findall(fmt):
+        if conv == "%":
+            continue
+        size = 4 if length in ("l", "ll") else 2
+        types.append({"size": size, "signed": conv in "di"})
+    return types
+
+
+def strip_comments(text):
+    """Blank the comments, keeping the line numbers."""
+    return re.sub(r"/\*.*?\*/|//[^\n]*",
+                  lambda m: re.sub(r"[^\n]", " ", m.group(0)), text, flags=re.S)
+
+
+def file_ids(sources):
+    ids = {}
+    for path in sources:
+        header = os.path.join(os.path.dirname(path), "trace.h")
+        if os.path.exists(header):
+            with open(header) as f:
+                ids.update((k, int(v)) for k, v in ENUM_ID.findall(f.read()))
+            break
+    return ids
+
+
+def scan(path, file_id, entries):
+    with open(path) as f:
+        text = strip_comments(f.read())
+    functions = [(m.start(), m.group(1)) for m in FUNCTION.finditer(text)]
+    name = os.path.basename(path)
+    for m in CALL.finditer(text):
+        line_start = text.rfind("\n", 0, m.start()) + 1
+        if text[line_start:m.start()].lstrip().startswith("#"):
+            continue
+        args, end = parse_call(text, m.end())
+        fmt = parse_string(args[0])
+        types = arg_types(fmt)
+        if len(types) != len(args) - 1:
+            raise ParseError("{}:{}: {} conversions for {} arguments".format(
+                name, text.count("\n", 0, m.start()) + 1, len(types), len(args) - 1))
+        func = None
+        for pos, fname in functions:
+            if pos > m.start():
+                break
+            func = fname
+        for arg, t in zip(args[1:], types):
+            if arg == "__func__":
+                t["value"] = func
+        first = text.count("\n", 0, m.start()) + 1
+        last = text.count("\n", 0, end) + 1
+        for line in range(first, last + 1):
+            token = (file_id << 11) | line
+            if token in entries:
+                raise ParseError("{}:{}: two trace calls on one line".format(name, line))
+            entries[token] = {"file": name, "line": first, "format": fmt,
+                              "args": types}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("sources", nargs="+", help="Firmware sources")
+    parser.add_argument("--output", required=True, help="Dictionary to write")
+    args = parser.parse_args()
+
+    ids = file_ids(args.sources)
+    entries = {}
+    try:
+        for path in args.sources:
+            with open(path) as f:
+                m = FILE_ID.search(f.read())
+            if m is None:
+                continue
+            if m.group(1) not in ids:
+                raise ParseError("{}: unknown file id {}".format(path, m.group(1)))
+            scan(path, ids[m.group(1)], entries)
+    except ParseError as e:
+        print("trace_dict: {}".format(e), file=sys.stderr)
+        sys.exit(1)
+
+    with open(args.output, "w") as out:
+        json.dump({str(k): v for k, v in sorted(entries.items())}, out, indent=1)
+
+
+if __name__ == "__main__":
+    main()
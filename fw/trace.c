@@ -0,0 +1,147 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <util/atomic.h>
+
+#include "capture.h"
+#include "sched.h"
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+_Static_assert((TRACE_RING_SIZE & TRACE_RING_MASK) == 0 &&
+	       TRACE_RING_SIZE <= 128, "Invalid trace ring size");
+
+/** Offset of a chunk with no record start */
+#define TRACE_NO_RECORD 0xFF
+
+static volatile uint8_t ring[TRACE_RING_SIZE];
+/** Free running reservation and read positions */
+static volatile uint8_t head;
+static volatile uint8_t tail;
+/** End of the record being streamed */
+static uint8_t record_end;
+static volatile uint16_t dropped;
+static volatile uint8_t high_water;
+static bool stats_pending;
+
+void
+trace_log(uint16_t token, const uint8_t *args, uint8_t len)
+{
+  uint16_t now = sched_now();
+  uint8_t size = TRACE_RECORD_HEADER + len;
+  uint8_t start, used, pos;
+
+  /* Reserve the space, the length byte stays 0 until the commit */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    used = head - tail;
+    if ((uint8_t)(TRACE_RING_SIZE - used) < size) {
+      if (dropped != 0xffff)
+	dropped++;
+      return;
+    }
+    start = head;
+    ring[start & TRACE_RING_MASK] = 0;
+    head = start + size;
+    if (used + size > high_water)
+      high_water = used + size;
+  }
+
+  pos = start + 1;
+  ring[pos++ & TRACE_RING_MASK] = token & 0xff;
+  ring[pos++ & TRACE_RING_MASK] = token >> 8;
+  ring[pos++ & TRACE_RING_MASK] = now & 0xff;
+  ring[pos++ & TRACE_RING_MASK] = now >> 8;
+  while (len--)
+    ring[pos++ & TRACE_RING_MASK] = *args++;
+  /* Commit */
+  ring[start & TRACE_RING_MASK] = size;
+}
+
+uint8_t
+trace_fetch_frame(uint8_t *buf, uint8_t size)
+{
+  uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint8_t len = 1;
+  uint8_t t = tail;
+
+  if (size < TRACE_CHUNK_MIN)
+    return 0;
+
+  payload[0] = TRACE_NO_RECORD;
+  while (CAPTURE_HEADER_SIZE + len < size) {
+    if (t == record_end) {
+      /* Stop at the first record not committed yet */
+      if (t == head || ring[t & TRACE_RING_MASK] == 0)
+	break;
+      record_end = t + ring[t & TRACE_RING_MASK];
+      if (payload[0] == TRACE_NO_RECORD)
+	payload[0] = len - 1;
+    }
+    payload[len++] = ring[t++ & TRACE_RING_MASK];
+  }
+  if (len == 1)
+    return 0;
+
+  buf[0] = CAPTURE_SYNC0;
+  buf[1] = CAPTURE_SYNC1;
+  buf[2] = TRACE_FRAME;
+  buf[3] = len;
+  /* Release the space to the writers */
+  tail = t;
+
+  return CAPTURE_HEADER_SIZE + len;
+}
+
+void
+trace_request_stats()
+{
+  stats_pending = true;
+}
+
+uint8_t
+trace_fetch_stats(uint8_t *buf, uint8_t size)
+{
+  uint8_t *payload = buf + CAPTURE_HEADER_SIZE;
+  uint16_t count;
+
+  if (!stats_pending || size < TRACE_STATS_SIZE)
+    return 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = dropped;
+  }
+  buf[0] = CAPTURE_SYNC0;
+  buf[1] = CAPTURE_SYNC1;
+  buf[2] = TRACE_FRAME_STATS;
+  buf[3] = TRACE_STATS_SIZE - CAPTURE_HEADER_SIZE;
+  payload[0] = count & 0xff;
+  payload[1] = count >> 8;
+  payload[2] = high_water;
+  payload[3] = TRACE_RING_SIZE;
+  stats_pending = false;
+
+  return TRACE_STATS_SIZE;
+}
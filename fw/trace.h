@@ -0,0 +1,186 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Tokenized binary trace.
+ * Trace calls do not format anything on the device, they store a
+ * token, a timestamp and the raw arguments in a ring buffer. Each
+ * record is:
+ *
+ * | length | token (u16) | time in ms (u16) | arguments |
+ *
+ * Records can be written from any context. Interrupts are only
+ * masked while the space of a record is reserved, the record is
+ * copied afterwards and committed by writing its length last.
+ * Records that do not fit in the ring are dropped and counted.
+ * The main loop streams the committed records to the host in the
+ * capture framing, in chunks sized to fit the room left in the
+ * endpoint so that draining never waits for the host:
+ *
+ * | 0xA5 | 0x5A | TRACE_FRAME | payload length | first | records |
+ *
+ * Records may span chunks, first is the offset in the chunk of the
+ * first record that starts in it, 0xFF if none does.
+ *
+ * The statistics are sent on request:
+ *
+ * | 0xA5 | 0x5A | TRACE_FRAME_STATS | payload length | payload |
+ *
+ * Payload: records dropped (u16), ring high-water mark in bytes (u8),
+ * ring size (u8).
+ *
+ * The token is the file id in the top 5 bits and the source line of
+ * the call in the low 11 bits. The format strings never reach the
+ * firmware image, tools/trace_dict.py builds the dictionary from the
+ * token to the format string from the sources and
+ * tools/trace_decode.py uses it to print the log.
+ * Arguments are stored in the size they are passed to printf, ints
+ * and pointers take 2 bytes and longs 4 bytes. Multi-byte values are
+ * little endian.
+ *
+ * Sources using the trace define TRACE_FILE to their id in
+ * enum trace_file before the first include.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Size of the trace ring buffer, must be a power of 2 up to 128.
+ */
+#define TRACE_RING_SIZE 128
+
+/**
+ * Size of the record header.
+ */
+#define TRACE_RECORD_HEADER 5
+
+/**
+ * Maximum size of the arguments of a record, 6 longs or pointers.
+ */
+#define TRACE_ARGS_MAX 24
+
+/**
+ * Frame types of the trace records and statistics, after the
+ * capture frame types.
+ */
+#define TRACE_FRAME 0x12
+#define TRACE_FRAME_STATS 0x13
+
+/**
+ * Smallest chunk worth sending, the header and first offset with
+ * one byte of records.
+ */
+#define TRACE_CHUNK_MIN 6
+
+/**
+ * Size of the statistics frame.
+ */
+#define TRACE_STATS_SIZE 8
+
+/**
+ * File ids of the sources using the trace, the values are part of
+ * the tokens and must not change.
+ */
+enum trace_file {
+  TRACE_FILE_KEYBOARD_TESTER = 1,
+  TRACE_FILE_BACKLIGHT = 2,
+  TRACE_FILE_CAPTURE = 3,
+  TRACE_FILE_DEBOUNCE = 4,
+  TRACE_FILE_DIAG = 5,
+  TRACE_FILE_MATRIX = 6,
+};
+
+#define TRACE_TOKEN(file, line) ((uint16_t)(((file) << 11) | (line)))
+
+/*
+ * Apply a macro to each trace argument, up to 6.
+ */
+#define TRACE_NARGS(...) TRACE_NARGS_(_, ## __VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define TRACE_NARGS_(z, a, b, c, d, e, f, n, ...) n
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+#define TRACE_CAT_(a, b) a ## b
+#define TRACE_EACH(m, ...)						\
+  TRACE_CAT(TRACE_EACH_, TRACE_NARGS(__VA_ARGS__))(m, ## __VA_ARGS__)
+#define TRACE_EACH_0(m)
+#define TRACE_EACH_1(m, a) m(a)
+#define TRACE_EACH_2(m, a, ...) m(a) TRACE_EACH_1(m, __VA_ARGS__)
+#define TRACE_EACH_3(m, a, ...) m(a) TRACE_EACH_2(m, __VA_ARGS__)
+#define TRACE_EACH_4(m, a, ...) m(a) TRACE_EACH_3(m, __VA_ARGS__)
+#define TRACE_EACH_5(m, a, ...) m(a) TRACE_EACH_4(m, __VA_ARGS__)
+#define TRACE_EACH_6(m, a, ...) m(a) TRACE_EACH_5(m, __VA_ARGS__)
+
+/**
+ * Store an argument with the default argument promotions of printf.
+ */
+#define TRACE_PACK(arg) {						\
+    __typeof__((arg) + 0) _trace_v = (arg);				\
+    memcpy(&_trace_args[_trace_len], &_trace_v, sizeof(_trace_v));	\
+    _trace_len += sizeof(_trace_v);					\
+  }
+
+/**
+ * Trace a message, the format string is only used by the host.
+ */
+#define TRACE(fmt, ...) do {						\
+    _Static_assert(__LINE__ < 2048, "Source too long for trace tokens"); \
+    if (debugConnected) {						\
+      uint8_t _trace_args[TRACE_ARGS_MAX];				\
+      uint8_t _trace_len = 0;						\
+      TRACE_EACH(TRACE_PACK, ## __VA_ARGS__)				\
+      /* Nothing to read without arguments */			\
+      trace_log(TRACE_TOKEN(TRACE_FILE, __LINE__),			\
+		_trace_len ? _trace_args : NULL, _trace_len);		\
+    }									\
+  } while (0)
+
+/**
+ * Append a record to the ring, it is dropped if the ring is full.
+ * Safe from interrupt handlers.
+ */
+void trace_log(uint16_t token, const uint8_t *args, uint8_t len);
+
+/**
+ * Fill buf with a chunk of the committed trace records, up to size
+ * bytes.
+ *
+ * \return The frame size, 0 if there is nothing to send.
+ */
+uint8_t trace_fetch_frame(uint8_t *buf, uint8_t size);
+
+/**
+ * Ask for the statistics to be sent to the host.
+ */
+void trace_request_stats(void);
+
+/**
+ * Fill buf with the requested statistics frame, once.
+ *
+ * \return The frame size, 0 if there is nothing to send.
+ */
+uint8_t trace_fetch_stats(uint8_t *buf, uint8_t size);
+
+#endif /* _TRACE_H_ */
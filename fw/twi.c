@@ -0,0 +1,342 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <util/twi.h>
+
+#include "error.h"
+#include "sched.h"
+#include "twi.h"
+
+#define TWI_QUEUE_MASK (TWI_QUEUE_SIZE - 1)
+
+/* TWCR values for each bus action, the interrupt is always enabled */
+#define TWCR_START ((1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE))
+#define TWCR_STOP ((1 << TWINT) | (1 << TWSTO) | (1 << TWEN))
+#define TWCR_STOP_START (TWCR_START | (1 << TWSTO))
+#define TWCR_NEXT ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+#define TWCR_ACK (TWCR_NEXT | (1 << TWEA))
+
+/**
+ * Phases of a transaction, each phase is a separate bus transfer
+ * except for the offset selection of a read, which is followed by
+ * a repeated start.
+ */
+enum twi_stage {
+  /** Write the magic value to the page lock register */
+  TWI_STAGE_UNLOCK,
+  /** Write the page register */
+  TWI_STAGE_PAGE,
+  /** Write the offset and the data */
+  TWI_STAGE_WRITE,
+  /** Write the offset for a read */
+  TWI_STAGE_OFFSET,
+  /** Read the data */
+  TWI_STAGE_READ,
+};
+
+static struct twi_txn queue[TWI_QUEUE_SIZE];
+/* Free running indexes, producers serialize with interrupts disabled */
+static volatile uint8_t head;
+/* Free running indexes, only the TWI interrupt advances the tail */
+static volatile uint8_t tail;
+
+/* Progress of the transaction at the queue tail */
+static uint8_t stage;
+/* Bytes transferred in the current stage */
+static uint8_t cursor;
+
+/* Bus interrupts taken, the watchdog checks that it moves */
+static volatile uint8_t progress;
+/* Value of progress at the last watchdog check */
+static uint8_t seen;
+
+static void twi_begin(uint8_t twcr);
+static void twi_watchdog(void *arg);
+
+static struct sched_timer watchdog = SCHED_TIMER_INIT(twi_watchdog, NULL);
+
+void
+twi_init()
+{
+  /* enable clock to the TWI */
+  PRR0 &= ~(1 << PRTWI);
+
+  head = 0;
+  tail = 0;
+  /* Prescaler 1 */
+  TWSR = 0;
+  TWBR = ((F_CPU / TWI_SCL_HZ) - 16) / 2;
+  TWCR = (1 << TWEN);
+}
+
+void
+twi_device_init(struct twi_device *dev, uint8_t addr)
+{
+  dev->addr = addr;
+  dev->page = TWI_PAGE_NONE;
+  dev->tx = 0;
+  dev->avoided = 0;
+  dev->errors = 0;
+}
+
+int
+twi_submit(const struct twi_txn *txn)
+{
+  int rc = ERR_BUSY;
+  uint8_t h;
+
+  /* The last byte of a read is never acknowledged, there must be one */
+  if ((txn->flags & TWI_TXN_READ) && txn->len == 0)
+    return ERR_I2C;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    h = head;
+    if ((uint8_t)(h - tail) != TWI_QUEUE_SIZE) {
+      queue[h & TWI_QUEUE_MASK] = *txn;
+      head = h + 1;
+      /*
+       * Kick the engine if the bus was idle. The stop condition of
+       * the last transaction may still be on the bus, the hardware
+       * sends the start after it instead of us waiting for it.
+       */
+      if (h == tail) {
+	twi_begin(TWCR_STOP_START);
+	if (!sched_pending(&watchdog)) {
+	  seen = progress;
+	  sched_add(&watchdog, TWI_TIMEOUT_MS, TWI_TIMEOUT_MS);
+	}
+      }
+      rc = ERR_OK;
+    }
+  }
+  return rc;
+}
+
+uint8_t
+twi_queue_free()
+{
+  return TWI_QUEUE_SIZE - (uint8_t)(head - tail);
+}
+
+bool
+twi_idle()
+{
+  return head == tail;
+}
+
+/**
+ * Start the transaction at the tail of the queue.
+ * Must be called with the TWI interrupt masked.
+ */
+static void
+twi_begin(uint8_t twcr)
+{
+  struct twi_txn *txn = &queue[tail & TWI_QUEUE_MASK];
+  struct twi_device *dev = txn->dev;
+
+  if (txn->page == TWI_PAGE_NONE || txn->page == dev->page) {
+    if (txn->page != TWI_PAGE_NONE)
+      /* Saved unlock and page select */
+      dev->avoided += 2;
+    stage = (txn->flags & TWI_TXN_READ) ? TWI_STAGE_OFFSET : TWI_STAGE_WRITE;
+  }
+  else {
+    stage = TWI_STAGE_UNLOCK;
+  }
+  cursor = 0;
+  txn->mismatch = 0;
+  dev->tx++;
+  TWCR = twcr;
+}
+
+/**
+ * Complete the transaction at the tail of the queue and start
+ * the next one, if any.
+ */
+static void
+twi_complete(int rc)
+{
+  struct twi_txn *txn = &queue[tail & TWI_QUEUE_MASK];
+
+  if (rc != ERR_OK) {
+    /* The device state is unknown */
+    txn->dev->page = TWI_PAGE_NONE;
+    txn->dev->errors++;
+  }
+  if (txn->done)
+    txn->done(txn, rc);
+
+  tail++;
+  if (head != tail)
+    twi_begin(TWCR_STOP_START);
+  else
+    TWCR = TWCR_STOP;
+}
+
+/**
+ * Fetch the next byte to write in the current stage.
+ *
+ * \return false if the stage has no more bytes.
+ */
+static inline bool
+twi_next_byte(struct twi_txn *txn, uint8_t *byte)
+{
+  uint8_t idx = cursor++;
+
+  switch (stage) {
+  case TWI_STAGE_UNLOCK:
+    *byte = (idx == 0) ? TWI_PAGE_LOCK_REG : TWI_PAGE_UNLOCK_MAGIC;
+    return idx < 2;
+  case TWI_STAGE_PAGE:
+    *byte = (idx == 0) ? TWI_PAGE_REG : txn->page;
+    return idx < 2;
+  case TWI_STAGE_OFFSET:
+    *byte = txn->offset;
+    return idx < 1;
+  case TWI_STAGE_WRITE:
+    if (idx > txn->len)
+      return false;
+    if (idx == 0)
+      *byte = txn->offset;
+    else if (txn->flags & TWI_TXN_INLINE)
+      *byte = txn->value;
+    else
+      *byte = txn->buf[idx - 1];
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Store or verify the next byte read in the current transaction.
+ */
+static inline void
+twi_store_byte(struct twi_txn *txn, uint8_t byte)
+{
+  if (txn->flags & TWI_TXN_VERIFY) {
+    if (txn->buf[cursor] != byte)
+      txn->mismatch++;
+  }
+  else {
+    txn->buf[cursor] = byte;
+  }
+  cursor++;
+}
+
+/**
+ * Check that the bus moved since the last run while a transaction is
+ * in flight. A device holding SCL or SDA low leaves the TWI waiting
+ * for a condition that never comes, the peripheral is reset to
+ * release the lines and the transaction fails, so that the queue
+ * keeps draining.
+ */
+static void
+twi_watchdog(void *arg)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (head == tail) {
+      sched_cancel(&watchdog);
+    }
+    else if (progress == seen) {
+      TWCR = 0;
+      twi_complete(ERR_I2C);
+    }
+    seen = progress;
+  }
+}
+
+ISR(TWI_vect)
+{
+  struct twi_txn *txn = &queue[tail & TWI_QUEUE_MASK];
+  uint8_t byte;
+
+  progress++;
+  switch (TW_STATUS) {
+  case TW_START:
+  case TW_REP_START:
+    TWDR = txn->dev->addr |
+      ((stage == TWI_STAGE_READ) ? TW_READ : TW_WRITE);
+    TWCR = TWCR_NEXT;
+    break;
+
+  case TW_MT_SLA_ACK:
+  case TW_MT_DATA_ACK:
+    if (twi_next_byte(txn, &byte)) {
+      TWDR = byte;
+      TWCR = TWCR_NEXT;
+      break;
+    }
+    /* End of the stage */
+    cursor = 0;
+    switch (stage) {
+    case TWI_STAGE_UNLOCK:
+      stage = TWI_STAGE_PAGE;
+      txn->dev->tx++;
+      TWCR = TWCR_STOP_START;
+      break;
+    case TWI_STAGE_PAGE:
+      txn->dev->page = txn->page;
+      stage = (txn->flags & TWI_TXN_READ) ?
+	TWI_STAGE_OFFSET : TWI_STAGE_WRITE;
+      txn->dev->tx++;
+      TWCR = TWCR_STOP_START;
+      break;
+    case TWI_STAGE_OFFSET:
+      stage = TWI_STAGE_READ;
+      TWCR = TWCR_START;
+      break;
+    default:
+      twi_complete(ERR_OK);
+    }
+    break;
+
+  case TW_MR_SLA_ACK:
+    /* Acknowledge all but the last byte */
+    TWCR = (txn->len > 1) ? TWCR_ACK : TWCR_NEXT;
+    break;
+
+  case TW_MR_DATA_ACK:
+    twi_store_byte(txn, TWDR);
+    TWCR = (cursor < txn->len - 1) ? TWCR_ACK : TWCR_NEXT;
+    break;
+
+  case TW_MR_DATA_NACK:
+    twi_store_byte(txn, TWDR);
+    twi_complete(ERR_OK);
+    break;
+
+  default:
+    /*
+     * Missing acknowledge, arbitration lost or bus error. The stop
+     * written by twi_complete releases the lines after a bus error,
+     * after an arbitration loss the TWI is no longer master and the
+     * stop only resets it.
+     */
+    twi_complete(ERR_I2C);
+  }
+}
@@ -0,0 +1,168 @@
+/*
+  Copyright 2019  Alfredo Mazzinghi
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/**
+ * @file
+ * Interrupt driven TWI (I2C) master.
+ * Transactions are described by a twi_txn descriptor that is copied
+ * in a fixed size queue, the TWI interrupt walks the queue and
+ * invokes the completion callback of each transaction, nobody waits
+ * for the bus.
+ *
+ * A watchdog timer fails the transaction in flight when the bus
+ * stops moving, the TWI needs the scheduler to be running.
+ *
+ * The backlight drivers have paged register files, a page register
+ * protected by a write lock. A transaction may ask for a page, the
+ * engine unlocks and selects it before the data transfer unless the
+ * device already has the page selected.
+ */
+
+#ifndef _TWI_H_
+#define _TWI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Number of transactions that can be queued, must be a power of 2.
+ */
+#define TWI_QUEUE_SIZE 16
+
+/**
+ * Bus clock frequency.
+ */
+#define TWI_SCL_HZ 500000UL
+
+/**
+ * Time without bus activity after which the transaction in flight
+ * fails and the TWI is reset, in ms. A byte takes 18us on the bus.
+ */
+#define TWI_TIMEOUT_MS 5
+
+/**
+ * Paged device registers.
+ * Writing TWI_PAGE_UNLOCK_MAGIC to the lock register enables the
+ * next write to the page register.
+ */
+#define TWI_PAGE_REG 0xFD
+#define TWI_PAGE_LOCK_REG 0xFE
+#define TWI_PAGE_UNLOCK_MAGIC 0xC5
+
+/**
+ * Page value for transactions that do not need a page, also used
+ * when the page selected on the device is not known.
+ */
+#define TWI_PAGE_NONE 0xFF
+
+/**
+ * State of a device on the bus, shared by all the transactions
+ * addressed to it.
+ */
+struct twi_device {
+  /** Bus address (write) */
+  uint8_t addr;
+  /** Page currently selected on the device, updated by the engine */
+  volatile uint8_t page;
+  /** Bus transactions issued */
+  volatile uint16_t tx;
+  /** Bus transactions saved by the page cache */
+  volatile uint16_t avoided;
+  /** Failed transactions */
+  volatile uint16_t errors;
+};
+
+struct twi_txn;
+
+/**
+ * Transaction completion callback, runs in interrupt context.
+ */
+typedef void (*twi_callback_t)(const struct twi_txn *txn, int rc);
+
+enum twi_txn_flags {
+  /** Read len bytes into buf instead of writing them */
+  TWI_TXN_READ = 1,
+  /** Write the single byte in value instead of buf */
+  TWI_TXN_INLINE = (1 << 1),
+  /**
+   * With TWI_TXN_READ, compare the bytes read with buf instead of
+   * storing them, the differences are counted in mismatch.
+   */
+  TWI_TXN_VERIFY = (1 << 2),
+};
+
+/**
+ * Transaction descriptor.
+ */
+struct twi_txn {
+  /** Target device */
+  struct twi_device *dev;
+  /** Page to select before the transfer or TWI_PAGE_NONE */
+  uint8_t page;
+  /** Register offset in the page */
+  uint8_t offset;
+  /** Combination of twi_txn_flags */
+  uint8_t flags;
+  /** Bytes to transfer */
+  uint8_t len;
+  /** Source or destination of the transfer */
+  uint8_t *buf;
+  /** Byte to write for TWI_TXN_INLINE transactions */
+  uint8_t value;
+  /** Bytes that differ from buf for TWI_TXN_VERIFY transactions */
+  uint8_t mismatch;
+  /** Completion callback, may be NULL */
+  twi_callback_t done;
+  /** Opaque argument for the callback */
+  void *arg;
+};
+
+/**
+ * Initialize the TWI peripheral and the transaction queue.
+ */
+void twi_init(void);
+
+/**
+ * Initialize the state of a device at the given bus address.
+ */
+void twi_device_init(struct twi_device *dev, uint8_t addr);
+
+/**
+ * Queue a transaction, the descriptor is copied and the
+ * caller can reuse it.
+ *
+ * \return ERR_OK, ERR_BUSY if the queue is full or ERR_I2C for
+ * a read of no bytes.
+ */
+int twi_submit(const struct twi_txn *txn);
+
+/**
+ * Number of free slots in the transaction queue.
+ */
+uint8_t twi_queue_free(void);
+
+/**
+ * Check whether all queued transactions completed.
+ */
+bool twi_idle(void);
+
+#endif /* _TWI_H_ */